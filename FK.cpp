@@ -9,6 +9,9 @@
 #include <iostream>
 #include <fstream>
 #include <functional>
+#include <sstream>
+#include <algorithm>
+#include <cfloat>
 #if defined(_WIN32) || defined(WIN32)
   #ifndef _USE_MATH_DEFINES
     #define _USE_MATH_DEFINES
@@ -17,46 +20,8 @@
 #include <math.h>
 using namespace std;
 
-namespace
-{
-
-inline double deg2rad(double deg) { return deg * M_PI / 180.0; }
-
-// Convert Euler angles (in degrees) in the given RotateOrder, to the row-major 3x3 rotation.
-void euler2Rotation(const double angle[3], double R[9], RotateOrder order)
-{
-  Mat3d RX = getElementRotationMatrix(0, deg2rad(angle[0]));
-  Mat3d RY = getElementRotationMatrix(1, deg2rad(angle[1]));
-  Mat3d RZ = getElementRotationMatrix(2, deg2rad(angle[2]));
-
-  Mat3d & RMat = asMat3d(R);
-  switch(order)
-  {
-  case XYZ:
-    RMat = RZ * RY * RX;
-    return;
-  case YZX:
-    RMat = RX * RZ * RY;
-    return;
-  case ZXY:
-    RMat = RY * RX * RZ;
-    return;
-  case XZY:
-    RMat = RY * RZ * RX;
-    return;
-  case YXZ:
-    RMat = RZ * RX * RY;
-    return;
-  case ZYX:
-    RMat = RX * RY * RZ;
-    return;
-  }
-  assert(0);
-}
-
-} // anonymous namespace
-
-FK::FK(const std::string & jointParentsFilename, const std::string & skeletonConfigFilename)
+FKSkeleton::FKSkeleton(const std::string & jointParentsFilename, const std::string & skeletonConfigFilename,
+    const std::string & jointLimitsFilename)
 {
   const int listOffset = 0;
   const bool sortListAfterLoad = false;
@@ -90,8 +55,6 @@ FK::FK(const std::string & jointParentsFilename, const std::string & skeletonCon
   assert(fin.fail() == false);
   fin >> ws;
 
-  jointEulerAngles = jointRestEulerAngles;
-
   jointRotateOrders.resize(numJoints, getDefaultRotateOrder());
   if (fin.eof() == false) // load rotateOrder
   {
@@ -123,6 +86,16 @@ FK::FK(const std::string & jointParentsFilename, const std::string & skeletonCon
   }
   fin.close();
 
+  // Joint orientations never change, so convert them to rotations once.
+  // Likewise, resolve the rotate order of each joint to its closed-form kernel once.
+  jointOrientRotations.resize(numJoints);
+  jointEuler2RotationFunctions.resize(numJoints);
+  for(int i = 0; i < numJoints; i++)
+  {
+    euler2Rotation<XYZ>(jointOrientations[i].data(), jointOrientRotations[i].data());
+    jointEuler2RotationFunctions[i] = getEuler2RotationFunction<double>(jointRotateOrders[i]);
+  }
+
   vector<bool> jointVisited(numJoints, false);
   // Use recursion to create an order to update joint transforms, 
   // so that one joint's parent always gets updated before the joint.
@@ -146,27 +119,49 @@ FK::FK(const std::string & jointParentsFilename, const std::string & skeletonCon
   for(int i = 0; i < numJoints; i++)
     assert(jointParents[i] < 0 || jointUpdateOrder[jointParents[i]] < jointUpdateOrder[i]);
 
-  // Call computeLocalAndGlobalTransforms to compute jointRestGlobalTransforms given restTranslations/EulerAngles/JointOrientations.
-  // jointInvRestGlobalTransforms here is just a place-holder.
-  vector<RigidTransform4d> jointRestGlobalTransforms(numJoints);
-  computeLocalAndGlobalTransforms(jointRestTranslations, jointRestEulerAngles, jointOrientations, jointRotateOrders, 
-      jointParents, jointUpdateOrder,
-      jointInvRestGlobalTransforms/*not used*/, jointRestGlobalTransforms);
+  vector<Mat3<double>> restGlobalRotations(numJoints);
+  vector<Vec3<double>> restGlobalTranslations(numJoints);
+
+  // Call computeLocalAndGlobalTransforms on the rest Euler angles to compute the rest global transforms.
+  computeLocalAndGlobalTransforms<double>(jointRestEulerAngles[0].data(), jointEuler2RotationFunctions.data(),
+      nullptr, restGlobalRotations.data(), restGlobalTranslations.data());
 
   for (int i = 0; i < numJoints; i++)
   {
-    jointInvRestGlobalTransforms[i] = inv(jointRestGlobalTransforms[i]);
+    RigidTransform4d jointRestGlobalTransform(Mat3d(restGlobalRotations[i].data()), Vec3d(restGlobalTranslations[i].data()));
+    jointInvRestGlobalTransforms[i] = inv(jointRestGlobalTransform);
   }
 
   buildJointChildren();
 
-  jointLocalTransforms.resize(numJoints);
-  jointGlobalTransforms.resize(numJoints);
-  jointSkinTransforms.resize(numJoints);
-  computeJointTransforms();
+  jointLowerLimits.assign(numJoints, Vec3d(-DBL_MAX));
+  jointUpperLimits.assign(numJoints, Vec3d(DBL_MAX));
+  if (jointLimitsFilename.size() > 0)
+  {
+    ifstream limitsFin(jointLimitsFilename.c_str());
+    assert(limitsFin);
+    // jointLimits file format: one line per limited joint, '#' starts a comment line
+    // <jointID> <min X> <max X> <min Y> <max Y> <min Z> <max Z>
+    string line;
+    while(getline(limitsFin, line))
+    {
+      istringstream lineStream(line);
+      int jointID = -1;
+      if ((lineStream >> ws).peek() == '#' || !(lineStream >> jointID))
+        continue;
+      assert(jointID >= 0 && jointID < numJoints);
+      for(int d = 0; d < 3; d++)
+        lineStream >> jointLowerLimits[jointID][d] >> jointUpperLimits[jointID][d];
+      assert(lineStream.fail() == false);
+      for(int d = 0; d < 3; d++)
+        assert(jointLowerLimits[jointID][d] <= jointUpperLimits[jointID][d]);
+    }
+    jointLimitsLoaded = true;
+    cout << "Loaded joint limits from " << jointLimitsFilename << endl;
+  }
 }
 
-void FK::buildJointChildren()
+void FKSkeleton::buildJointChildren()
 {
   jointChildren.assign(numJoints, {});
   for(int jointID = 0; jointID < numJoints; jointID++)
@@ -178,7 +173,7 @@ void FK::buildJointChildren()
   }
 }
 
-vector<int> FK::getJointDescendents(int jointID) const
+vector<int> FKSkeleton::getJointDescendents(int jointID) const
 {
   vector<int> ret = jointChildren[jointID];
   doBFSOnDirectedTree(convertArrayToFunction(jointChildren), ret);
@@ -186,73 +181,55 @@ vector<int> FK::getJointDescendents(int jointID) const
   return ret;
 }
 
-void printRotMat(double mat[9]) {
-  for(int i = 0; i < 3; i++)
-  {
-    for(int j = 0; j < 3; j++)
-      cout << mat[i*3+j] << " ";
-    cout << endl;
-  }
-  cout << endl;
+template<typename T>
+static size_t getVectorMemoryUsage(const vector<T> & v)
+{
+  return v.capacity() * sizeof(T);
 }
 
-// This is the main function that performs forward kinematics.
-// Each joint has its local transformation relative to the parent joint. 
-// globalTransform of a joint is the transformation that converts a point expressed in the joint's local frame of reference, to the world coordinate frame.
-// localTransform is the transformation that converts a point expressed in the joint's local frame of reference, to the coordinate frame of its parent joint. 
-// Specifically, if xLocal is the homogeneous coordinate of a point expressed in the joint's local frame, and xParent is the homogeneous coordinate of the 
-// same point expressed in the frame of the joint's parent, we have:
-// xParent = localTransform * xLocal , and
-// globalTransform = parentGlobalTransform * localTransform .
-// Note that the globalTransform of the root joint equals its localTransform.
-//
-// Input: translations of each joint relative to its parent (in parent's coordinate system), 
-// current Euler angles, joint orientations, joint rotation order, joint parents, joint update order.
-// All arrays are assumed to have the same length (= #joints).
-// Joint orientations are always given in XYZ order (Maya convention).
-// Output: localTransforms and globalTransforms.
-void FK::computeLocalAndGlobalTransforms(
-    const vector<Vec3d> & translations, const vector<Vec3d> & eulerAngles, 
-    const vector<Vec3d> & jointOrientationEulerAngles, const vector<RotateOrder> & rotateOrders,
-    const std::vector<int> jointParents, const vector<int> & jointUpdateOrder,
-    vector<RigidTransform4d> & localTransforms, vector<RigidTransform4d> & globalTransforms)
+size_t FKSkeleton::getMemoryUsage() const
 {
-  // Students should implement this.
-  // First, compute the localTransform for each joint, using eulerAngles and jointOrientationEulerAngles,
-  // and the "euler2Rotation" function.
+  size_t memoryUsage = getVectorMemoryUsage(jointParents) + getVectorMemoryUsage(jointChildren) + getVectorMemoryUsage(jointUpdateOrder) +
+    getVectorMemoryUsage(jointRestTranslations) + getVectorMemoryUsage(jointRestEulerAngles) + getVectorMemoryUsage(jointOrientations) +
+    getVectorMemoryUsage(jointRotateOrders) + getVectorMemoryUsage(jointOrientRotations) + getVectorMemoryUsage(jointEuler2RotationFunctions) +
+    getVectorMemoryUsage(jointLowerLimits) + getVectorMemoryUsage(jointUpperLimits) + getVectorMemoryUsage(jointInvRestGlobalTransforms);
+  for(const vector<int> & children : jointChildren)
+    memoryUsage += getVectorMemoryUsage(children);
+  return memoryUsage;
+}
 
-  Mat3d currLocalRotMat;
-  double currRotArr[9], currJointRotArr[9];
-  // printRotMat(currJointRotMat);
-  for(int i=0; i<localTransforms.size(); i++)
-  {
-    // convert rotation "offset" - joint orientation Euler angles to matrix
-    euler2Rotation(jointOrientationEulerAngles[i], currJointRotArr, XYZ);
-    // convert rotation Euler angles to matrix
-    euler2Rotation(eulerAngles[i], currRotArr, rotateOrders[i]);
+FK::FK(const std::string & jointParentsFilename, const std::string & skeletonConfigFilename, const std::string & jointLimitsFilename) :
+  FK(make_shared<const FKSkeleton>(jointParentsFilename, skeletonConfigFilename, jointLimitsFilename))
+{
+}
 
-    // calculate complete 3x3 rotation matrix inside currrent local transformation
-    // convert to mat3d for calculation
-    currLocalRotMat = Mat3d(currJointRotArr) * Mat3d(currRotArr);
+FK::FK(shared_ptr<const FKSkeleton> skeleton_) : skeleton(move(skeleton_))
+{
+  numJoints = skeleton->numJoints;
+  jointLocalRotations.resize(numJoints);
+  jointGlobalRotations.resize(numJoints);
+  jointGlobalTranslations.resize(numJoints);
+  jointLocalTransforms.resize(numJoints);
+  jointGlobalTransforms.resize(numJoints);
+  jointSkinTransforms.resize(numJoints);
+  resetToRestPose();
+}
 
-    // set current localTransform (4x4) with rotation and translation
-    localTransforms[i] = RigidTransform4d(currLocalRotMat, translations[i]);
-  }
+size_t FK::getPoseMemoryUsage() const
+{
+  return getVectorMemoryUsage(jointEulerAngles) + getVectorMemoryUsage(jointLocalTransforms) + getVectorMemoryUsage(jointGlobalTransforms) +
+    getVectorMemoryUsage(jointSkinTransforms) + getVectorMemoryUsage(jointLocalRotations) + getVectorMemoryUsage(jointGlobalRotations) +
+    getVectorMemoryUsage(jointGlobalTranslations);
+}
 
-  // Then, recursively compute the globalTransforms, from the root to the leaves of the hierarchy.
-  // Use the jointParents and jointUpdateOrder arrays to do so.
-  // Also useful are the Mat3d and RigidTransform4d classes defined in the Vega folder.
-  for(int i=0; i<localTransforms.size(); i++)
+void printRotMat(double mat[9]) {
+  for(int i = 0; i < 3; i++)
   {
-    // get current joint
-    int currJoint = jointUpdateOrder[i];
-    // recursively compute global transformation for each joint
-    jointParents[currJoint] == -1 
-      // M(g)root = M(l)root b/c root has no parent
-      ? globalTransforms[currJoint] = localTransforms[currJoint]
-      // M(g)currJoint = M(g)currJoint'sParent * M(l)currJoint
-      : globalTransforms[currJoint] = globalTransforms[jointParents[currJoint]] * localTransforms[currJoint];
+    for(int j = 0; j < 3; j++)
+      cout << mat[i*3+j] << " ";
+    cout << endl;
   }
+  cout << endl;
 }
 
 // Compute skinning transformations for all the joints, using the formula:
@@ -271,15 +248,71 @@ void FK::computeSkinningTransforms(
 
 void FK::computeJointTransforms()
 {
-  computeLocalAndGlobalTransforms(jointRestTranslations, jointEulerAngles, jointOrientations, jointRotateOrders, 
-      jointParents, jointUpdateOrder,
-      jointLocalTransforms, jointGlobalTransforms);
-  computeSkinningTransforms(jointGlobalTransforms, jointInvRestGlobalTransforms, jointSkinTransforms);
+  // The FK kernel is shared with IK; see computeLocalAndGlobalTransforms in FK.h.
+  skeleton->computeLocalAndGlobalTransforms(jointEulerAngles[0].data(), skeleton->jointEuler2RotationFunctions.data(),
+      jointLocalRotations.data(), jointGlobalRotations.data(), jointGlobalTranslations.data());
+  for(int i = 0; i < numJoints; i++)
+  {
+    jointLocalTransforms[i] = RigidTransform4d(Mat3d(jointLocalRotations[i].data()), skeleton->jointRestTranslations[i]);
+    jointGlobalTransforms[i] = RigidTransform4d(Mat3d(jointGlobalRotations[i].data()), Vec3d(jointGlobalTranslations[i].data()));
+  }
+  computeSkinningTransforms(jointGlobalTransforms, skeleton->jointInvRestGlobalTransforms, jointSkinTransforms);
+}
+
+void FK::clampToJointLimits(Vec3d * eulerAngles) const
+{
+  if (skeleton->jointLimitsLoaded == false)
+    return;
+  for(int i = 0; i < numJoints; i++)
+    for(int d = 0; d < 3; d++)
+      eulerAngles[i][d] = min(max(eulerAngles[i][d], skeleton->jointLowerLimits[i][d]), skeleton->jointUpperLimits[i][d]);
 }
 
 void FK::resetToRestPose()
 {
-  jointEulerAngles = jointRestEulerAngles;
+  jointEulerAngles = skeleton->jointRestEulerAngles;
   computeJointTransforms();
 }
 
+int FK::getChangedJoints(const Vec3d * referenceEulerAngles, char * changedJoints) const
+{
+  int numChangedJoints = 0;
+  for(int k = 0; k < numJoints; k++) // parents before children
+  {
+    int jointID = skeleton->jointUpdateOrder[k];
+    int parentID = skeleton->jointParents[jointID];
+    changedJoints[jointID] = (jointEulerAngles[jointID] != referenceEulerAngles[jointID]) || ((parentID >= 0) && changedJoints[parentID]);
+    numChangedJoints += changedJoints[jointID];
+  }
+  return numChangedJoints;
+}
+
+void rotation2Euler(RotateOrder order, const double R[9], double angle[3])
+{
+  // R = Rk(c) * Rj(b) * Ri(a), where i, j, k are the axes in the order they are applied (see getRotateOrderAxes in IK.cpp)
+  static const int orderAxes[6][3] = { {0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {1, 0, 2}, {2, 1, 0} };
+  int i = orderAxes[order][0], j = orderAxes[order][1], k = orderAxes[order][2];
+  // sign of the permutation (i, j, k): +1 for XYZ, YZX, ZXY; -1 for the others
+  double sign = (order <= ZXY) ? 1.0 : -1.0;
+  const double rad2deg = 180.0 / M_PI;
+  const Mat3d M(R);
+
+  double sb = -sign * M[k][i];
+  sb = (sb > 1.0) ? 1.0 : ((sb < -1.0) ? -1.0 : sb);
+  double a, b = asin(sb), c;
+  if (fabs(sb) < 1.0 - 1e-12)
+  {
+    a = atan2(sign * M[k][j], M[k][k]);
+    c = atan2(sign * M[j][i], M[i][i]);
+  }
+  else
+  {
+    // gimbal lock: only a combination of a and c is determined; choose c = 0, so that Rj(b)^T R = Ri(a)
+    c = 0.0;
+    Mat3d A = trans(getElementRotationMatrix(j, b)) * M;
+    a = atan2(A[(i + 2) % 3][(i + 1) % 3], A[(i + 1) % 3][(i + 1) % 3]);
+  }
+  angle[i] = a * rad2deg;
+  angle[j] = b * rad2deg;
+  angle[k] = c * rad2deg;
+}
@@ -3,8 +3,17 @@
 
 #include <memory.h>
 #include <vector>
+#include <memory>
+#include <string>
+#if defined(_WIN32) || defined(WIN32)
+  #ifndef _USE_MATH_DEFINES
+    #define _USE_MATH_DEFINES
+  #endif
+#endif
+#include <math.h>
 #include "vec3d.h"
 #include "transform4d.h"
+#include "minivectorTemplate.h"
 
 // CSCI 520 Computer Animation and Simulation
 // Jernej Barbic and Yijing Li
@@ -46,9 +55,231 @@ enum RotateOrder
 };
 inline RotateOrder getDefaultRotateOrder() { return XYZ; }
 
+// Closed-form Euler-to-rotation kernels, one per RotateOrder.
+// Each kernel writes the row-major 3x3 matrix R of the product of the elemental rotations given above,
+// expanded symbolically, so that sin/cos are evaluated only once per axis and no 3x3 products are formed.
+// The kernels are templated on the scalar type, so that they can be used both with double and with
+// traced types such as adouble in Adol-C.
+template<RotateOrder order>
+struct EulerRotationKernel;
+
+template<> struct EulerRotationKernel<XYZ> // R = RZ * RY * RX
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = cy * cz;
+    R[1] = cz * sx * sy - cx * sz;
+    R[2] = cx * cz * sy + sx * sz;
+    R[3] = cy * sz;
+    R[4] = sx * sy * sz + cx * cz;
+    R[5] = cx * sy * sz - cz * sx;
+    R[6] = -sy;
+    R[7] = cy * sx;
+    R[8] = cx * cy;
+  }
+};
+
+template<> struct EulerRotationKernel<YZX> // R = RX * RZ * RY
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = cy * cz;
+    R[1] = -sz;
+    R[2] = cz * sy;
+    R[3] = cx * cy * sz + sx * sy;
+    R[4] = cx * cz;
+    R[5] = cx * sy * sz - cy * sx;
+    R[6] = cy * sx * sz - cx * sy;
+    R[7] = cz * sx;
+    R[8] = sx * sy * sz + cx * cy;
+  }
+};
+
+template<> struct EulerRotationKernel<ZXY> // R = RY * RX * RZ
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = sx * sy * sz + cy * cz;
+    R[1] = cz * sx * sy - cy * sz;
+    R[2] = cx * sy;
+    R[3] = cx * sz;
+    R[4] = cx * cz;
+    R[5] = -sx;
+    R[6] = cy * sx * sz - cz * sy;
+    R[7] = cy * cz * sx + sy * sz;
+    R[8] = cx * cy;
+  }
+};
+
+template<> struct EulerRotationKernel<XZY> // R = RY * RZ * RX
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = cy * cz;
+    R[1] = -cx * cy * sz + sx * sy;
+    R[2] = cy * sx * sz + cx * sy;
+    R[3] = sz;
+    R[4] = cx * cz;
+    R[5] = -cz * sx;
+    R[6] = -cz * sy;
+    R[7] = cx * sy * sz + cy * sx;
+    R[8] = -sx * sy * sz + cx * cy;
+  }
+};
+
+template<> struct EulerRotationKernel<YXZ> // R = RZ * RX * RY
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = -sx * sy * sz + cy * cz;
+    R[1] = -cx * sz;
+    R[2] = cy * sx * sz + cz * sy;
+    R[3] = cz * sx * sy + cy * sz;
+    R[4] = cx * cz;
+    R[5] = -cy * cz * sx + sy * sz;
+    R[6] = -cx * sy;
+    R[7] = sx;
+    R[8] = cx * cy;
+  }
+};
+
+template<> struct EulerRotationKernel<ZYX> // R = RX * RY * RZ
+{
+  template<typename real>
+  static void build(const real & cx, const real & sx, const real & cy, const real & sy, const real & cz, const real & sz, real R[9])
+  {
+    R[0] = cy * cz;
+    R[1] = -cy * sz;
+    R[2] = sy;
+    R[3] = cz * sx * sy + cx * sz;
+    R[4] = -sx * sy * sz + cx * cz;
+    R[5] = -cy * sx;
+    R[6] = -cx * cz * sy + sx * sz;
+    R[7] = cx * sy * sz + cz * sx;
+    R[8] = cx * cy;
+  }
+};
+
+// Convert Euler angles (in degrees) in the compile-time RotateOrder "order", to the row-major 3x3 rotation.
+template<RotateOrder order, typename real>
+inline void euler2Rotation(const real angle[3], real R[9])
+{
+  const double deg2rad = M_PI / 180.0;
+  real cx = cos(angle[0] * deg2rad), sx = sin(angle[0] * deg2rad);
+  real cy = cos(angle[1] * deg2rad), sy = sin(angle[1] * deg2rad);
+  real cz = cos(angle[2] * deg2rad), sz = sin(angle[2] * deg2rad);
+  EulerRotationKernel<order>::build(cx, sx, cy, sy, cz, sz, R);
+}
+
+// A pointer to one of the euler2Rotation<order, real> kernels.
+template<typename real>
+using Euler2RotationFunction = void (*)(const real angle[3], real R[9]);
+
+// Resolve a run-time RotateOrder to its kernel. Call this once per joint and store the result,
+// instead of switching on the rotate order every time a rotation is computed.
+template<typename real>
+inline Euler2RotationFunction<real> getEuler2RotationFunction(RotateOrder order)
+{
+  switch(order)
+  {
+  case XYZ:
+    return &euler2Rotation<XYZ, real>;
+  case YZX:
+    return &euler2Rotation<YZX, real>;
+  case ZXY:
+    return &euler2Rotation<ZXY, real>;
+  case XZY:
+    return &euler2Rotation<XZY, real>;
+  case YXZ:
+    return &euler2Rotation<YXZ, real>;
+  case ZYX:
+    return &euler2Rotation<ZYX, real>;
+  }
+  return nullptr;
+}
+
+// The inverse of euler2Rotation: convert the row-major 3x3 rotation R to Euler angles (in degrees) in RotateOrder "order".
+// The middle angle is in [-90, 90]; the other two are in [-180, 180]. At gimbal lock (middle angle = +-90),
+// the last angle is set to zero.
+void rotation2Euler(RotateOrder order, const double R[9], double angle[3]);
+
+// The joint hierarchy and rest configuration of a rig: the part of forward kinematics that does not depend on the pose.
+// A skeleton is loaded once and is not modified afterwards. FK instances refer to it through a std::shared_ptr<const FKSkeleton>,
+// so that all the instances of a rig (e.g., the characters of a crowd) share one skeleton and store only their own poses.
+class FKSkeleton
+{
+public:
+  // Loads the files described at the FK constructor.
+  FKSkeleton(const std::string & jointHierarchyFilename, const std::string & skeletonConfigFilename,
+      const std::string & jointLimitsFilename = "");
+
+  // Joint hierarchy accessor functions (see FK):
+  int getNumJoints() const { return numJoints; }
+  int getJointParent(int jointID) const { return jointParents[jointID]; }
+  const std::vector<int> & getJointChildren(int jointID) const { return jointChildren[jointID]; }
+  std::vector<int> getJointDescendents(int jointID) const;
+  int getJointUpdateOrder(int index) const { return jointUpdateOrder[index]; }
+
+  // Rest configuration and joint limits (see FK):
+  const Vec3d & getJointRestTranslation(int jointID) const { return jointRestTranslations[jointID]; }
+  const Vec3d & getJointRestEulerAngles(int jointID) const { return jointRestEulerAngles[jointID]; }
+  const Vec3d & getJointOrient(int jointID) const { return jointOrientations[jointID]; }
+  const Mat3d & getJointOrientRotation(int jointID) const { return jointOrientRotations[jointID]; }
+  RotateOrder getJointRotateOrder(int jointID) const { return jointRotateOrders[jointID]; }
+  const RigidTransform4d & getJointInvRestGlobalTransform(int jointID) const { return jointInvRestGlobalTransforms[jointID]; }
+  bool hasJointLimits() const { return jointLimitsLoaded; }
+  const Vec3d & getJointLowerLimit(int jointID) const { return jointLowerLimits[jointID]; }
+  const Vec3d & getJointUpperLimit(int jointID) const { return jointUpperLimits[jointID]; }
+
+  // The forward kinematics kernel, and the euler2Rotation kernels of the joints; see FK.
+  template<typename real>
+  void computeLocalAndGlobalTransforms(const real * eulerAngles, const Euler2RotationFunction<real> * euler2RotationFunctions,
+      Mat3<real> * localRotations, Mat3<real> * globalRotations, Vec3<real> * globalTranslations) const;
+  template<typename real>
+  std::vector<Euler2RotationFunction<real>> getJointEuler2RotationFunctions() const;
+
+  size_t getMemoryUsage() const; // bytes used by the arrays
+
+protected:
+  friend class FK;
+  void buildJointChildren();
+
+  int numJoints = 0;
+  std::vector<int> jointParents; // the parent of the root is -1
+  std::vector<std::vector<int>> jointChildren; // They are sorted; ascending order.
+  // jointUpdateOrder: an array of length numJoints
+  // Stores an ordering from root -> leaves, so that a joint's parent is always before the joint in this order.
+  std::vector<int> jointUpdateOrder;
+
+  // Translation, Euler angles, and orientation of the joints in the rest configuration.
+  std::vector<Vec3d> jointRestTranslations, jointRestEulerAngles, jointOrientations;
+  // Rotate orders of the joints. Different joints may have different rotation orders.
+  std::vector<RotateOrder> jointRotateOrders;
+  // Cached rotation matrices of jointOrientations (always in XYZ order), and the euler2Rotation kernel
+  // of each joint's rotate order. Both are set in the constructor, as they do not change with the pose.
+  std::vector<Mat3d> jointOrientRotations;
+  std::vector<Euler2RotationFunction<double>> jointEuler2RotationFunctions;
+  // Euler angle limits (degrees)
+  bool jointLimitsLoaded = false;
+  std::vector<Vec3d> jointLowerLimits, jointUpperLimits;
+
+  // jointInvRestGlobalTransforms are the inverse of restGlobalTransforms.
+  // restGlobalTransforms are 4x4 row-major transforms. Same convention as in Maya (worldMatrix attribute).
+  // JointInvRestGlobalTransform is the global matrix that transfers the coordinate of a point expressed in 
+  // a local joint coordinate frame, to the world coordinate frame; when the joint hierarchy is in the rest pose.
+  std::vector<RigidTransform4d> jointInvRestGlobalTransforms;
+};
+
 // Forward kinematics of a joint hierarchy.
 // This class follows the implementation conventions used in Autodesk Maya.
 // For the provided examples, the hierarchy was exported from a Maya joint system.
+// The hierarchy and rest configuration are in an FKSkeleton, shared by the copies of an FK and by the FKs constructed
+// from getSkeleton(); an FK itself stores only the current pose and its joint transforms.
 class FK
 {
 public:
@@ -57,8 +288,18 @@ public:
   // jointHierarchyFilename: ASCII file giving a list of indices a[i]; the parent of the i-th joint is the a[i]-th joint; the parent of the root is "-1"
   // skeletonConfigFilename: ASCII file storing the rest configuration of each joint (translate, rotate, jointOrient and rotateOrder attributes)
   //                         Each line in the file gives the values for a single attribute for all the joints.
-  // This constructor sets jointRestTranslations, jointRestEulerAngles, jointOrientations, jointRotateOrders.
-  FK(const std::string & jointHierarchyFilename, const std::string & skeletonConfigFilename);
+  // jointLimitsFilename (optional): ASCII file with the Euler angle limits (in degrees) of some joints; one joint per line:
+  //                         jointID minX maxX minY maxY minZ maxZ
+  //                         Lines starting with '#' are comments. Joints that are not listed have no limits.
+  // This constructor loads a new FKSkeleton (jointRestTranslations, jointRestEulerAngles, jointOrientations, jointRotateOrders,
+  // and the joint limits), and sets the pose to the rest pose.
+  FK(const std::string & jointHierarchyFilename, const std::string & skeletonConfigFilename,
+      const std::string & jointLimitsFilename = "");
+  // Another instance of a loaded skeleton (e.g., fk.getSkeleton()), in the rest pose.
+  explicit FK(std::shared_ptr<const FKSkeleton> skeleton);
+
+  const std::shared_ptr<const FKSkeleton> & getSkeleton() const { return skeleton; }
+  size_t getPoseMemoryUsage() const; // bytes used by the per-instance arrays (the skeleton is not included)
 
   // Based on the current euler angles (jointEulerAngles) of all joints, compute current 
   // values (jointLocalTransforms, jointGlobalTransforms, jointSkinTransforms) of all the joints.
@@ -72,69 +313,143 @@ public:
   Vec3d & jointEulerAngle(int jointID) { return jointEulerAngles[jointID]; } 
   // Resets all joint angles to their rest pose values:
   void resetToRestPose();
+  // Finds the joints whose global (and skin) transforms differ between the current Euler angles and referenceEulerAngles
+  // (e.g., the angles of the last skinned pose): the joints whose angles, or whose ancestors' angles, differ.
+  // Sets changedJoints[jointID] to 1 for these joints and to 0 for the others (length: numJoints); returns the number of changed joints.
+  int getChangedJoints(const Vec3d * referenceEulerAngles, char * changedJoints) const;
 
   // Joint hierarchy accessor functions:
   int getNumJoints() const { return numJoints; }
-  int getJointParent(int jointID) const { return jointParents[jointID]; } // parent of the root is -1, by definition
+  int getJointParent(int jointID) const { return skeleton->jointParents[jointID]; } // parent of the root is -1, by definition
   // The returned children are sorted (ascending order).
-  const std::vector<int> & getJointChildren(int jointID) const { return jointChildren[jointID]; }
+  const std::vector<int> & getJointChildren(int jointID) const { return skeleton->jointChildren[jointID]; }
   // The returned joints are sorted (ascending order).
-  std::vector<int> getJointDescendents(int jointID) const;
+  std::vector<int> getJointDescendents(int jointID) const { return skeleton->getJointDescendents(jointID); }
   // Get the joint that appears at position "index" in a linear joint update order. This order is established
   // in the constructor. When one traverses the hierarchy in this order, children are guaranteed to appear after
   // the parents. So, when performing forward kinematics, you can use this order to guarantee that
   // the transformations of parents are computed before the transformations of the children.
-  int getJointUpdateOrder(int index) const { return jointUpdateOrder[index]; }
+  int getJointUpdateOrder(int index) const { return skeleton->jointUpdateOrder[index]; }
   
   // Get joint values in the rest pose:
-  const Vec3d & getJointRestTranslation(int jointID) const { return jointRestTranslations[jointID]; }
-  const Vec3d & getJointRestEulerAngles(int jointID) const { return jointRestEulerAngles[jointID]; }
-  const Vec3d & getJointOrient(int jointID) const { return jointOrientations[jointID]; }
-  RotateOrder getJointRotateOrder(int jointID) const { return jointRotateOrders[jointID]; }
+  const Vec3d & getJointRestTranslation(int jointID) const { return skeleton->jointRestTranslations[jointID]; }
+  const Vec3d & getJointRestEulerAngles(int jointID) const { return skeleton->jointRestEulerAngles[jointID]; }
+  const Vec3d & getJointOrient(int jointID) const { return skeleton->jointOrientations[jointID]; }
+  // The rotation matrix of getJointOrient(jointID); it is constant and computed once in the constructor.
+  const Mat3d & getJointOrientRotation(int jointID) const { return skeleton->jointOrientRotations[jointID]; }
+  RotateOrder getJointRotateOrder(int jointID) const { return skeleton->jointRotateOrders[jointID]; }
+
+  // Joint limits: the allowed range of each Euler angle, [lower, upper]. Without limits, the range is [-DBL_MAX, DBL_MAX].
+  bool hasJointLimits() const { return skeleton->jointLimitsLoaded; }
+  const Vec3d & getJointLowerLimit(int jointID) const { return skeleton->jointLowerLimits[jointID]; }
+  const Vec3d & getJointUpperLimit(int jointID) const { return skeleton->jointUpperLimits[jointID]; }
+  // Clamp the Euler angles (of all joints; e.g., getJointEulerAngles()) to the joint limits.
+  void clampToJointLimits(Vec3d * eulerAngles) const;
 
   // Get joint values in the current pose:
   Vec3d getJointGlobalPosition(int jointID) const { return jointGlobalTransforms[jointID].getTranslation(); }
   const RigidTransform4d & getJointGlobalTransform(int jointID) const { return jointGlobalTransforms[jointID]; }
   const RigidTransform4d * getJointSkinTransforms() const { return jointSkinTransforms.data(); } // the transforms are used for skinning
 
-protected:
-  void buildJointChildren();
+  // The forward kinematics kernel, templated on the scalar type.
+  // It is used by computeJointTransforms() with real = double, and by IK with real = adouble (Adol-C taping);
+  // other scalar types (e.g., float, or dual numbers) work as long as they support the usual arithmetic and sin/cos.
+  // See the comment in the implementation below.
+  template<typename real>
+  void computeLocalAndGlobalTransforms(const real * eulerAngles, const Euler2RotationFunction<real> * euler2RotationFunctions,
+      Mat3<real> * localRotations, Mat3<real> * globalRotations, Vec3<real> * globalTranslations) const
+  {
+    skeleton->computeLocalAndGlobalTransforms(eulerAngles, euler2RotationFunctions, localRotations, globalRotations, globalTranslations);
+  }
 
-  // See comment in the implementation file.
-  static void computeLocalAndGlobalTransforms(
-    const std::vector<Vec3d> & translations, const std::vector<Vec3d> & eulerAngles,
-    const std::vector<Vec3d> & jointOrientationEulerAngles, const std::vector<RotateOrder> & rotateOrders,
-    const std::vector<int> jointParents, const std::vector<int> & jointUpdateOrder,
-    std::vector<RigidTransform4d> & localTransforms, std::vector<RigidTransform4d> & globalTransforms);
+  // Returns the euler2Rotation kernel of each joint's rotate order, for the given scalar type.
+  // Resolve these once, and pass them to computeLocalAndGlobalTransforms.
+  template<typename real>
+  std::vector<Euler2RotationFunction<real>> getJointEuler2RotationFunctions() const { return skeleton->getJointEuler2RotationFunctions<real>(); }
 
+protected:
   // See comment in the implementation file.
   static void computeSkinningTransforms(
     const std::vector<RigidTransform4d> & globalTransforms, 
     const std::vector<RigidTransform4d> & invRestGlobalTransforms,
     std::vector<RigidTransform4d> & skinTransforms);
 
+  std::shared_ptr<const FKSkeleton> skeleton;
   int numJoints = 0;
-  std::vector<int> jointParents; // the parent of the root is -1
-  std::vector<std::vector<int>> jointChildren; // They are sorted; ascending order.
-  // jointUpdateOrder: an array of length numJoints
-  // Stores an ordering from root -> leaves, so that a joint's parent is always before the joint in this order.
-  std::vector<int> jointUpdateOrder;
-
-  // Translation, Euler angles, and orientation of the joints in the rest configuration.
-  std::vector<Vec3d> jointRestTranslations, jointRestEulerAngles, jointOrientations;
-  // Rotate orders of the joints. Different joints may have different rotation orders.
-  std::vector<RotateOrder> jointRotateOrders;
 
   // Current values of various joint quantities:
   std::vector<Vec3d> jointEulerAngles; 
   std::vector<RigidTransform4d> jointLocalTransforms, jointGlobalTransforms, jointSkinTransforms;
-
-  // jointInvRestGlobalTransforms are the inverse of restGlobalTransforms.
-  // restGlobalTransforms are 4x4 row-major transforms. Same convention as in Maya (worldMatrix attribute).
-  // JointInvRestGlobalTransform is the global matrix that transfers the coordinate of a point expressed in 
-  // a local joint coordinate frame, to the world coordinate frame; when the joint hierarchy is in the rest pose.
-  std::vector<RigidTransform4d> jointInvRestGlobalTransforms;
+  // Output buffers of computeLocalAndGlobalTransforms<double>, converted into the transforms above.
+  std::vector<Mat3<double>> jointLocalRotations, jointGlobalRotations;
+  std::vector<Vec3<double>> jointGlobalTranslations;
 };
 
+// =============== IMPLEMENTATION ===============
+
+// This is the main function that performs forward kinematics.
+// Each joint has its local transformation relative to the parent joint. 
+// globalTransform of a joint is the transformation that converts a point expressed in the joint's local frame of reference, to the world coordinate frame.
+// localTransform is the transformation that converts a point expressed in the joint's local frame of reference, to the coordinate frame of its parent joint. 
+// Specifically, if xLocal is the homogeneous coordinate of a point expressed in the joint's local frame, and xParent is the homogeneous coordinate of the 
+// same point expressed in the frame of the joint's parent, we have:
+// xParent = localTransform * xLocal , and
+// globalTransform = parentGlobalTransform * localTransform .
+// Note that the globalTransform of the root joint equals its localTransform.
+//
+// Input: current Euler angles of all joints (an array of length 3 * #joints), and the euler2Rotation kernel of each joint.
+// The rest translations, joint orientation rotations, joint parents and joint update order are taken from the skeleton.
+// These are constants, so they are never converted to "real"; they enter the computation as plain doubles.
+// Output: the rotational part of the localTransforms (optional; pass nullptr if not needed), and
+// the rotational and translational parts of the globalTransforms. All output arrays have length #joints.
+// The translational part of each localTransform is the joint's rest translation.
+template<typename real>
+void FKSkeleton::computeLocalAndGlobalTransforms(const real * eulerAngles, const Euler2RotationFunction<real> * euler2RotationFunctions,
+    Mat3<real> * localRotations, Mat3<real> * globalRotations, Vec3<real> * globalTranslations) const
+{
+  Mat3<real> eulerRotation, localRotation;
+  for(int i = 0; i < numJoints; i++)
+  {
+    // traverse from the root to the leaves, so that the parent's globalTransform is always ready
+    int jointID = jointUpdateOrder[i];
+    int parentID = jointParents[jointID];
+
+    // local rotation = joint orientation rotation * rotation from the Euler angles
+    euler2RotationFunctions[jointID](&eulerAngles[3 * jointID], eulerRotation.data());
+    const Mat3d & O = jointOrientRotations[jointID];
+    for(int r = 0; r < 3; r++)
+      for(int c = 0; c < 3; c++)
+        localRotation[r][c] = O[r][0] * eulerRotation[0][c] + O[r][1] * eulerRotation[1][c] + O[r][2] * eulerRotation[2][c];
+    if (localRotations)
+      localRotations[jointID] = localRotation;
+
+    const Vec3d & t = jointRestTranslations[jointID];
+    if (parentID < 0)
+    {
+      // M(g)root = M(l)root b/c root has no parent
+      globalRotations[jointID] = localRotation;
+      globalTranslations[jointID] = Vec3<real>(real(t[0]), real(t[1]), real(t[2]));
+    }
+    else
+    {
+      // M(g)joint = M(g)parent * M(l)joint, i.e., Rg = Rg_parent * Rl, tg = Rg_parent * tl + tg_parent
+      const Mat3<real> & parentRotation = globalRotations[parentID];
+      globalRotations[jointID] = parentRotation * localRotation;
+      for(int r = 0; r < 3; r++)
+        globalTranslations[jointID][r] = parentRotation[r][0] * t[0] + parentRotation[r][1] * t[1] + parentRotation[r][2] * t[2]
+          + globalTranslations[parentID][r];
+    }
+  }
+}
+
+template<typename real>
+std::vector<Euler2RotationFunction<real>> FKSkeleton::getJointEuler2RotationFunctions() const
+{
+  std::vector<Euler2RotationFunction<real>> functions(numJoints);
+  for(int i = 0; i < numJoints; i++)
+    functions[i] = getEuler2RotationFunction<real>(jointRotateOrders[i]);
+  return functions;
+}
+
 #endif
 
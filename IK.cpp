@@ -1,7 +1,10 @@
 #include "IK.h"
 #include "FK.h"
 #include "minivectorTemplate.h"
+#include "dualNumber.h"
+#include "workerPool.h"
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 #include <adolc/adolc.h>
 #include <cassert>
 #if defined(_WIN32) || defined(WIN32)
@@ -10,6 +13,11 @@
   #endif
 #endif
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
 using namespace std;
 using namespace Eigen;
 
@@ -19,34 +27,9 @@ using namespace Eigen;
 namespace
 {
 
-// Converts degrees to radians.
-template<typename real>
-inline real deg2rad(real deg) { return deg * M_PI / 180.0; }
-
-template<typename real>
-Mat3<real> Euler2Rotation(const real angle[3], RotateOrder order)
-{
-  Mat3<real> RX = Mat3<real>::getElementRotationMatrix(0, deg2rad(angle[0]));
-  Mat3<real> RY = Mat3<real>::getElementRotationMatrix(1, deg2rad(angle[1]));
-  Mat3<real> RZ = Mat3<real>::getElementRotationMatrix(2, deg2rad(angle[2]));
-
-  switch(order)
-  {
-    case RotateOrder::XYZ:
-      return RZ * RY * RX;
-    case RotateOrder::YZX:
-      return RX * RZ * RY;
-    case RotateOrder::ZXY:
-      return RY * RX * RZ;
-    case RotateOrder::XZY:
-      return RY * RZ * RX;
-    case RotateOrder::YXZ:
-      return RZ * RX * RY;
-    case RotateOrder::ZYX:
-      return RX * RY * RZ;
-  }
-  assert(0);
-}
+// Adol-C keeps its tapes and work buffers in global variables, so at most one thread may be inside Adol-C at a time.
+mutex adolcMutex;
+atomic<int> nextUniqueAdolcTagID(16384);
 
 // Performs forward kinematics, using the provided "fk" class.
 // This is the function whose Jacobian matrix will be computed using adolc.
@@ -54,97 +37,402 @@ Mat3<real> Euler2Rotation(const real angle[3], RotateOrder order)
 //   IKJointIDs is an array of integers of length "numIKJoints"
 // Input: numIKJoints, IKJointIDs, fk, eulerAngles (of all joints)
 // Output: handlePositions (world-coordinate positions of all the IK joints; length is 3 * numIKJoints)
+// The FK algorithm itself is FK::computeLocalAndGlobalTransforms, which is templated on the scalar type
+// and shared with the FK class.
 template<typename real>
 void forwardKinematicsFunction(
     int numIKJoints, const int * IKJointIDs, const FK & fk,
     const std::vector<real> & eulerAngles, std::vector<real> & handlePositions)
 {
-  // Students should implement this.
-  // The implementation of this function is very similar to function computeLocalAndGlobalTransforms in the FK class.
-  // The recommended approach is to first implement FK::computeLocalAndGlobalTransforms.
-  // Then, implement the same algorithm into this function. To do so,
-  // you can use fk.getJointUpdateOrder(), fk.getJointRestTranslation(), and fk.getJointRotateOrder() functions.
-  // Also useful is the multiplyAffineTransform4ds function in minivectorTemplate.h .
-  // It would be in principle possible to unify this "forwardKinematicsFunction" and FK::computeLocalAndGlobalTransforms(),
-  // so that code is only written once. We considered this; but it is actually not easily doable.
-  // If you find a good approach, feel free to document it in the README file, for extra credit.
-
   int numJoints = fk.getNumJoints();
- 
-  Mat3<adouble> currEulerMat3, currJtMat3,                                 // store temp conversion result
-                localRotations[numJoints], globalRotations[numJoints];     // store rotations
-  Vec3<adouble> localTranslation[numJoints], globalTranslation[numJoints]; // store translations
-
-  // calculate local rotation and translation
-  for(int i=0; i<numJoints; i++)
-  {
-    // get joint orientation and euler angle as adouble for adol-c to track
-    // as input
-    adouble adolcJointAngle[3] = {fk.getJointOrient(i)[0], 
-                                  fk.getJointOrient(i)[1], 
-                                  fk.getJointOrient(i)[2]};
-    adouble adolcEulerAngle[3] = {eulerAngles[3 * i + 0],
-                                  eulerAngles[3 * i + 1],
-                                  eulerAngles[3 * i + 2]};
-
-    // calculate local 3x3 rotation matrix and store for later use
-    currJtMat3 = Euler2Rotation(adolcJointAngle, XYZ);
-    currEulerMat3 = Euler2Rotation(adolcEulerAngle, fk.getJointRotateOrder(i));
-    localRotations[i] = currJtMat3 * currEulerMat3;
-
-    // get local translation 3-vector for later use
-    localTranslation[i] = {fk.getJointRestTranslation(i)[0],
-                           fk.getJointRestTranslation(i)[1],
-                           fk.getJointRestTranslation(i)[2]};
-  }
-  
-  // calculate handle positions
-  for(int i=0; i<numJoints; i++)
-  {
-    // get current joint
-    int currJoint = fk.getJointUpdateOrder(i);
-
-    // recursively compute global transformation for calculating handle positions
-    // here we want rotations and translations to be seprated for updating IK
-    // joint positions, so we will use multiplyAffineTransform4ds to do so, which
-    // is equivalent to multiplying two 4x4 transformation matrices
-    if (fk.getJointParent(currJoint) == -1) {
-      // M(g)root = M(l)root b/c root has no parent
-      globalRotations[currJoint] = localRotations[currJoint];
-      globalTranslation[currJoint] = localTranslation[currJoint];
-    } else {
-      // M(g)currJoint = M(g)currJoint'sParent * M(l)currJoint
-      multiplyAffineTransform4ds(globalRotations[fk.getJointParent(currJoint)],   // R1
-                                 globalTranslation[fk.getJointParent(currJoint)], // t1
-                                 localRotations[currJoint],                       // R2
-                                 localTranslation[currJoint],                     // t2
-                                 globalRotations[currJoint],                      // Rout
-                                 globalTranslation[currJoint]);                   // tout
-    }
-  }
+
+  std::vector<Euler2RotationFunction<real>> euler2RotationFunctions = fk.getJointEuler2RotationFunctions<real>();
+  std::vector<Mat3<real>> globalRotations(numJoints);
+  std::vector<Vec3<real>> globalTranslations(numJoints);
+  fk.computeLocalAndGlobalTransforms<real>(eulerAngles.data(), euler2RotationFunctions.data(),
+      nullptr, globalRotations.data(), globalTranslations.data());
 
   // set IK joint positions in world coord
   for(int i=0; i<numIKJoints; i++)
   {
-      handlePositions[3 * i + 0] = globalTranslation[IKJointIDs[i]][0];
-      handlePositions[3 * i + 1] = globalTranslation[IKJointIDs[i]][1];
-      handlePositions[3 * i + 2] = globalTranslation[IKJointIDs[i]][2];
+      handlePositions[3 * i + 0] = globalTranslations[IKJointIDs[i]][0];
+      handlePositions[3 * i + 1] = globalTranslations[IKJointIDs[i]][1];
+      handlePositions[3 * i + 2] = globalTranslations[IKJointIDs[i]][2];
+  }
+}
+
+// The axes of the three elemental rotations of "order", in the order they are applied to a point.
+// For example, for XYZ, R = RZ * RY * RX, so the axes are {0, 1, 2}: X first, Z last.
+void getRotateOrderAxes(RotateOrder order, int axes[3])
+{
+  static const int orderAxes[6][3] = { {0, 1, 2}, {1, 2, 0}, {2, 0, 1}, {0, 2, 1}, {1, 0, 2}, {2, 1, 0} };
+  for(int i = 0; i < 3; i++)
+    axes[i] = orderAxes[order][i];
+}
+
+// The rotation with the smallest angle that turns the direction of "from" into the direction of "to".
+Mat3d rotationBetween(const Vec3d & from, const Vec3d & to)
+{
+  double lengths = len(from) * len(to);
+  if (lengths == 0.0)
+    return Mat3d(1.0);
+  Vec3d axis = cross(from, to);
+  double sinAngle = len(axis) / lengths, cosAngle = dot(from, to) / lengths;
+  if (sinAngle < 1e-12)
+  {
+    if (cosAngle > 0)
+      return Mat3d(1.0);
+    // opposite directions: rotate by 180 degrees around any axis perpendicular to "from"
+    axis = cross(from, Vec3d(1, 0, 0));
+    if (len2(axis) < 1e-12 * len2(from))
+      axis = cross(from, Vec3d(0, 1, 0));
+    sinAngle = 0.0;
+    cosAngle = -1.0;
+  }
+  // Rodrigues' formula
+  Mat3d K = skewSymmetricMatrix(norm(axis));
+  return Mat3d(1.0) + sinAngle * K + (1.0 - cosAngle) * (K * K);
+}
+
+// Rotates chain joint c by R around its position: the chain joints below it (and the handle, at positions[numChainJoints])
+// move with it. positions has numChainJoints + 1 entries, globalRotations has numChainJoints entries.
+void rotateChainJoint(int c, const Mat3d & R, int numChainJoints, Vec3d * positions, Mat3d * globalRotations)
+{
+  for(int d = c; d < numChainJoints; d++)
+    globalRotations[d] = R * globalRotations[d];
+  for(int d = c + 1; d <= numChainJoints; d++)
+    positions[d] = positions[c] + R * (positions[d] - positions[c]);
+}
+
+// Cyclic coordinate descent: sweeps from the handle's parent to the chain base, rotating each joint so that the
+// direction from the joint to the handle points at the target.
+void solveChainCCD(int numChainJoints, Vec3d * positions, Mat3d * globalRotations, const Vec3d & target, int numIterations)
+{
+  double chainLength = 0.0;
+  for(int c = 0; c < numChainJoints; c++)
+    chainLength += len(positions[c + 1] - positions[c]);
+  double tolerance = 1e-6 * chainLength;
+
+  for(int iter = 0; iter < numIterations; iter++)
+  {
+    for(int c = numChainJoints - 1; c >= 0; c--)
+      rotateChainJoint(c, rotationBetween(positions[numChainJoints] - positions[c], target - positions[c]),
+          numChainJoints, positions, globalRotations);
+    if (len(positions[numChainJoints] - target) <= tolerance)
+      break;
+  }
+}
+
+// FABRIK: alternately fixes the handle at the target and the chain base at its position, moving the joints in between
+// along the bones while keeping the bone lengths. Then the chain joints are rotated, from the base, onto the new bones.
+void solveChainFABRIK(int numChainJoints, Vec3d * positions, Mat3d * globalRotations, const Vec3d & target, int numIterations)
+{
+  int n = numChainJoints;
+  vector<double> boneLengths(n);
+  double chainLength = 0.0;
+  for(int c = 0; c < n; c++)
+  {
+    boneLengths[c] = len(positions[c + 1] - positions[c]);
+    chainLength += boneLengths[c];
+  }
+  double tolerance = 1e-6 * chainLength;
+
+  // moves "p" to distance "length" from "anchor", along the direction from "anchor" to "p"
+  auto placeAt = [](const Vec3d & anchor, const Vec3d & p, double length) -> Vec3d
+  {
+    double distance = len(p - anchor);
+    return (distance > 0.0) ? anchor + (length / distance) * (p - anchor) : p;
+  };
+
+  vector<Vec3d> P(positions, positions + n + 1);
+  const Vec3d base = positions[0];
+  if (len(target - base) >= chainLength)
+  {
+    // unreachable: stretch the chain towards the target
+    for(int c = 0; c < n; c++)
+      P[c + 1] = P[c] + boneLengths[c] * norm(target - base);
+  }
+  else
+  {
+    for(int iter = 0; iter < numIterations; iter++)
+    {
+      P[n] = target;
+      for(int c = n - 1; c >= 0; c--)
+        P[c] = placeAt(P[c + 1], P[c], boneLengths[c]);
+      P[0] = base;
+      for(int c = 0; c < n; c++)
+        P[c + 1] = placeAt(P[c], P[c + 1], boneLengths[c]);
+      if (len(P[n] - target) <= tolerance)
+        break;
+    }
+  }
+
+  // project the new positions back to rotations
+  for(int c = 0; c < n; c++)
+    rotateChainJoint(c, rotationBetween(positions[c + 1] - positions[c], P[c + 1] - positions[c]), n, positions, globalRotations);
+}
+
+// Solves the damped least squares problem restricted to "rows" and the columns of the Euler angles
+// of "joints": delta = (J^T J + alpha I)^-1 J^T r, where J is the submatrix of the row-major "jacobian" (with
+// "numColumns" columns), and r is the matching part of "residual". Output: delta, of length 3 * joints.size().
+// The smaller of the equivalent systems (J^T J + alpha I) and (J J^T + alpha I) is factored.
+// If lowerLimits and upperLimits (indexed like the columns) are not nullptr, the new angles x + delta are kept in
+// [lowerLimits, upperLimits] with an active set: DOFs that would leave their range are clamped to the limit, their
+// (fixed) change is moved to the right-hand side, and they are dropped from the system, which is then re-solved for
+// the remaining DOFs, until no DOF leaves its range.
+void solveDampedLeastSquaresBlock(int numColumns, const double * jacobian, const double * residual,
+    const vector<int> & rows, const vector<int> & joints, double alpha, double * delta,
+    const double * x = nullptr, const double * lowerLimits = nullptr, const double * upperLimits = nullptr)
+{
+  int m = rows.size(), numDOFs = 3 * joints.size();
+  vector<int> columns(numDOFs);
+  for(int b = 0; b < numDOFs; b++)
+    columns[b] = 3 * joints[b / 3] + b % 3;
+  VectorXd r(m);
+  for(int a = 0; a < m; a++)
+    r[a] = residual[rows[a]];
+  auto jacobianEntry = [&](int a, int b) { return jacobian[rows[a] * numColumns + columns[b]]; };
+
+  vector<int> freeDOFs(numDOFs);
+  for(int b = 0; b < numDOFs; b++)
+    freeDOFs[b] = b;
+  while(freeDOFs.size() > 0)
+  {
+    int n = freeDOFs.size();
+    MatrixXd J(m, n);
+    for(int a = 0; a < m; a++)
+      for(int k = 0; k < n; k++)
+        J(a, k) = jacobianEntry(a, freeDOFs[k]);
+    VectorXd solution;
+    if (n <= m)
+      solution = (J.transpose() * J + alpha * MatrixXd::Identity(n, n)).ldlt().solve(J.transpose() * r);
+    else
+      solution = J.transpose() * (J * J.transpose() + alpha * MatrixXd::Identity(m, m)).ldlt().solve(r);
+
+    vector<int> stillFreeDOFs;
+    for(int k = 0; k < n; k++)
+    {
+      int b = freeDOFs[k];
+      delta[b] = solution[k];
+      if (lowerLimits == nullptr)
+        continue;
+      double angle = x[columns[b]] + delta[b];
+      double clampedAngle = min(max(angle, lowerLimits[columns[b]]), upperLimits[columns[b]]);
+      if (clampedAngle == angle)
+      {
+        stillFreeDOFs.push_back(b);
+        continue;
+      }
+      // clamp, and move the DOF to the right-hand side
+      delta[b] = clampedAngle - x[columns[b]];
+      for(int a = 0; a < m; a++)
+        r[a] -= jacobianEntry(a, b) * delta[b];
+    }
+    if ((int)stillFreeDOFs.size() == n || lowerLimits == nullptr)
+      break;
+    freeDOFs.swap(stillFreeDOFs);
+  }
+}
+
+// The world-space rotation axes of the three Euler angles of jointID, given the global rotations of all joints.
+// Joint j rotates as R = Rc * Rb * Ra (Ra is applied first), after its parent's global rotation P
+// and its joint orientation O. With A = P * O, the world-space rotation axes are
+// A e_c, A Rc e_b and A Rc Rb e_a. worldAxes[k] is the axis of Euler angle axes[k] (see getRotateOrderAxes).
+void computeJointWorldAxes(const FK & fk, int jointID, const Mat3<double> * globalRotations, const double * eulerAngles,
+    int axes[3], Vec3d worldAxes[3])
+{
+  const double deg2rad = M_PI / 180.0;
+  int parentID = fk.getJointParent(jointID);
+  Mat3d A = fk.getJointOrientRotation(jointID);
+  if (parentID >= 0)
+    A = Mat3d(globalRotations[parentID].data()) * A;
+
+  getRotateOrderAxes(fk.getJointRotateOrder(jointID), axes);
+  for(int k = 2; k >= 0; k--)
+  {
+    worldAxes[k] = A.col(axes[k]);
+    A = A * getElementRotationMatrix(axes[k], eulerAngles[3 * jointID + axes[k]] * deg2rad);
   }
 }
 
+// The rotation vector (axis * angle, angle in radians, in [0, pi]) of the rotation R; the inverse of Rodrigues' formula.
+Vec3d rotationVector(const Mat3d & R)
+{
+  double cosAngle = 0.5 * (R[0][0] + R[1][1] + R[2][2] - 1.0);
+  cosAngle = std::min(std::max(cosAngle, -1.0), 1.0);
+  double angle = acos(cosAngle);
+  Vec3d w(R[2][1] - R[1][2], R[0][2] - R[2][0], R[1][0] - R[0][1]); // 2 sin(angle) * axis
+  if (angle < 1e-6)
+    return 0.5 * w; // sin(angle) ~ angle
+  if (M_PI - angle > 1e-6)
+    return (angle / (2.0 * sin(angle))) * w;
+  // angle ~ pi: R ~ 2 axis axis^T - I; take the largest column of R + I
+  int c = 0;
+  for(int i = 1; i < 3; i++)
+    if (R[i][i] > R[c][c])
+      c = i;
+  Vec3d axis = norm(R.col(c) + Vec3d(c == 0, c == 1, c == 2));
+  if (dot(axis, w) < 0)
+    axis = -axis;
+  return angle * axis;
+}
+
 } // end anonymous namespaces
 
-IK::IK(int numIKJoints, const int * IKJointIDs, FK * inputFK, int adolc_tagID)
+struct IK::LevenbergMarquardtState
+{
+  double damping = -1.0; // relative to diag(J^T J); < 0 means it has not been initialized yet
+  double dampingGrowth = 2.0; // factor to increase the damping after a rejected step
+  // A = J^T J + damping * diag(J^T J), restricted to the Euler angles of handle ancestors (the only nonzero
+  // columns of J). Its sparsity pattern (lower triangle) only depends on which handles each joint moves,
+  // so it is built, and analyzed by the Cholesky solver, once.
+  SparseMatrix<double> A;
+  SimplicialLDLT<SparseMatrix<double>> cholesky;
+  bool patternAnalyzed = false;
+};
+
+struct IK::ResidualFKBuffers
+{
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions;
+  vector<Mat3<double>> globalRotations;
+  vector<Vec3<double>> globalTranslations;
+};
+
+IK::IK(int numIKJoints, const int * IKJointIDs, FK * inputFK, int adolc_tagID, JacobianBackend jacobianBackend)
 {
   this->numIKJoints = numIKJoints;
   this->IKJointIDs = IKJointIDs;
   this->fk = inputFK;
-  this->adolc_tagID = adolc_tagID;
+  this->adolc_tagID = (adolc_tagID >= 0) ? adolc_tagID : getUniqueAdolcTagID();
 
   FKInputDim = fk->getNumJoints() * 3;
   FKOutputDim = numIKJoints * 3;
 
-  train_adolc();
+  handleOrientationIndices.assign(numIKJoints, -1);
+  buildHandleStructure();
+
+  setJacobianBackend(jacobianBackend);
+  levenbergMarquardtState.reset(new LevenbergMarquardtState);
+  residualFKBuffers.reset(new ResidualFKBuffers);
+  residualFKBuffers->euler2RotationFunctions = fk->getJointEuler2RotationFunctions<double>();
+  residualFKBuffers->globalRotations.resize(fk->getNumJoints());
+  residualFKBuffers->globalTranslations.resize(fk->getNumJoints());
+}
+
+IK::~IK()
+{
+}
+
+void IK::buildHandleStructure()
+{
+  // find the strict ancestors of each handle; only the Euler angles of these joints move the handle
+  // (an oriented handle is also rotated by its own Euler angles)
+  int numJoints = fk->getNumJoints();
+  handleAncestors.assign(numIKJoints, vector<bool>(numJoints, false));
+  vector<bool> isHandleAncestor(numJoints, false);
+  auto firstChainJoint = [&](int i) { return (handleOrientationIndices[i] >= 0) ? IKJointIDs[i] : fk->getJointParent(IKJointIDs[i]); };
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    for(int jointID = firstChainJoint(i); jointID >= 0; jointID = fk->getJointParent(jointID))
+    {
+      handleAncestors[i][jointID] = true;
+      isHandleAncestor[jointID] = true;
+    }
+  }
+  handleAncestorJoints.clear();
+  for(int i = 0; i < numJoints; i++)
+  {
+    int jointID = fk->getJointUpdateOrder(i);
+    if (isHandleAncestor[jointID])
+      handleAncestorJoints.push_back(jointID);
+  }
+
+  // the chain of each handle: its ancestors (and itself, if oriented), up to the first one that also moves another handle
+  handleChains.assign(numIKJoints, vector<int>());
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    for(int jointID = firstChainJoint(i); jointID >= 0; jointID = fk->getJointParent(jointID))
+    {
+      bool movesOtherHandle = false;
+      for(int k = 0; k < numIKJoints && movesOtherHandle == false; k++)
+        movesOtherHandle = (k != i) && handleAncestors[k][jointID];
+      if (movesOtherHandle)
+        break;
+      handleChains[i].push_back(jointID);
+    }
+    reverse(handleChains[i].begin(), handleChains[i].end());
+  }
+
+  // DISJOINT_BLOCKS: connected components of the handles, where two handles are connected if they share an ancestor
+  blockHandles.clear();
+  blockJoints.clear();
+  vector<int> jointBlock(numJoints, -1);
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    // merge the blocks that already own an ancestor of this handle into a new block
+    vector<int> handles(1, i), joints;
+    for(int jointID : handleAncestorJoints)
+    {
+      if (handleAncestors[i][jointID] == false)
+        continue;
+      int block = jointBlock[jointID];
+      if ((block >= 0) && (blockHandles[block].size() > 0))
+      {
+        handles.insert(handles.end(), blockHandles[block].begin(), blockHandles[block].end());
+        joints.insert(joints.end(), blockJoints[block].begin(), blockJoints[block].end());
+        blockHandles[block].clear();
+        blockJoints[block].clear();
+      }
+      if (block < 0)
+        joints.push_back(jointID);
+    }
+    for(int jointID : joints)
+      jointBlock[jointID] = blockHandles.size();
+    blockHandles.push_back(handles);
+    blockJoints.push_back(joints);
+  }
+  for(int block = blockHandles.size() - 1; block >= 0; block--)
+  {
+    if (blockJoints[block].size() == 0) // merged into another block, or the handle is the root
+    {
+      blockHandles.erase(blockHandles.begin() + block);
+      blockJoints.erase(blockJoints.begin() + block);
+    }
+  }
+
+  // SHARED_THEN_CHAINS: the handle ancestors that are in no chain
+  vector<bool> isChainJoint(numJoints, false);
+  for(int i = 0; i < numIKJoints; i++)
+    for(int jointID : handleChains[i])
+      isChainJoint[jointID] = true;
+  sharedJoints.clear();
+  for(int jointID : handleAncestorJoints)
+    if (isChainJoint[jointID] == false)
+      sharedJoints.push_back(jointID);
+}
+
+void IK::setOrientedHandles(int numOrientedHandles, const int * orientedHandles)
+{
+  this->orientedHandles.assign(orientedHandles, orientedHandles + numOrientedHandles);
+  handleOrientationIndices.assign(numIKJoints, -1);
+  for(int k = 0; k < numOrientedHandles; k++)
+    handleOrientationIndices[orientedHandles[k]] = k;
+  buildHandleStructure();
+  // the sparsity pattern of LEVENBERG_MARQUARDT depends on the handle ancestors
+  levenbergMarquardtState.reset(new LevenbergMarquardtState);
+}
+
+int IK::getUniqueAdolcTagID()
+{
+  return nextUniqueAdolcTagID++;
+}
+
+void IK::setJacobianBackend(JacobianBackend jacobianBackend)
+{
+  this->jacobianBackend = jacobianBackend;
+  // only the Adol-C backend needs a tape; record it the first time it is needed
+  if (jacobianBackend == ADOLC_TAPE && adolcTrained == false)
+    train_adolc();
 }
 
 void IK::train_adolc()
@@ -161,6 +449,7 @@ void IK::train_adolc()
   int n = FKInputDim;  // input dimension = # euler angles = numJoints *3(angles)
   int m = FKOutputDim; // output dimension = # IK joints * 3(positions)
 
+  lock_guard<mutex> lock(adolcMutex);
   // tell adolc to trace below computations
   trace_on(adolc_tagID);
     // setup input and output
@@ -177,25 +466,278 @@ void IK::train_adolc()
     for(int i = 0; i < m; i++)
       y[i] >>= output[i];
   trace_off();
+
+  adolcTrained = true;
+}
+
+void IK::computeFKAndJacobian(const double * eulerAngles, double * handlePositions, double * jacobian)
+{
+  switch(jacobianBackend)
+  {
+    case ADOLC_TAPE:
+      computeFKAndJacobianADOLC(eulerAngles, handlePositions, jacobian);
+      return;
+    case FORWARD_DUAL:
+      computeFKAndJacobianForwardDual(eulerAngles, handlePositions, jacobian);
+      return;
+    case ANALYTIC:
+      computeFKAndJacobianAnalytic(eulerAngles, handlePositions, jacobian);
+      return;
+  }
+  assert(0);
+}
+
+void IK::computeFK(const double * eulerAngles, double * handlePositions)
+{
+  if (jacobianBackend == ADOLC_TAPE)
+  {
+    lock_guard<mutex> lock(adolcMutex);
+    ::function(adolc_tagID, FKOutputDim, FKInputDim, const_cast<double*>(eulerAngles), handlePositions);
+    return;
+  }
+
+  int numJoints = fk->getNumJoints();
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions = fk->getJointEuler2RotationFunctions<double>();
+  vector<Mat3<double>> globalRotations(numJoints);
+  vector<Vec3<double>> globalTranslations(numJoints);
+  fk->computeLocalAndGlobalTransforms<double>(eulerAngles, euler2RotationFunctions.data(),
+      nullptr, globalRotations.data(), globalTranslations.data());
+  for(int i = 0; i < numIKJoints; i++)
+    globalTranslations[IKJointIDs[i]].convertToArray(&handlePositions[3 * i]);
+}
+
+int IK::getNumResidualRows(const Mat3d * targetHandleRotations) const
+{
+  return FKOutputDim + ((targetHandleRotations != nullptr) ? 3 * orientedHandles.size() : 0);
+}
+
+void IK::computeResidual(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    const double * eulerAngles, double * residual)
+{
+  // one FK pass gives both the handle positions and rotations
+  ResidualFKBuffers & buffers = *residualFKBuffers;
+  fk->computeLocalAndGlobalTransforms<double>(eulerAngles, buffers.euler2RotationFunctions.data(),
+      nullptr, buffers.globalRotations.data(), buffers.globalTranslations.data());
+  for(int i = 0; i < numIKJoints; i++)
+    for(int d = 0; d < 3; d++)
+      residual[3 * i + d] = targetHandlePositions[i][d] - buffers.globalTranslations[IKJointIDs[i]][d];
+  if ((targetHandleRotations == nullptr) || (orientedHandles.size() == 0))
+    return;
+
+  for(size_t k = 0; k < orientedHandles.size(); k++)
+  {
+    Mat3d R(buffers.globalRotations[IKJointIDs[orientedHandles[k]]].data());
+    Vec3d w = orientationWeight * rotationVector(targetHandleRotations[k] * trans(R));
+    w.convertToArray(&residual[FKOutputDim + 3 * k]);
+  }
+}
+
+int IK::computeResidualAndJacobian(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    const double * eulerAngles, double * residual, double * jacobian)
+{
+  computeFKAndJacobian(eulerAngles, residual, jacobian);
+  for(int i = 0; i < numIKJoints; i++)
+    for(int d = 0; d < 3; d++)
+      residual[3 * i + d] = targetHandlePositions[i][d] - residual[3 * i + d];
+  int numRows = getNumResidualRows(targetHandleRotations);
+  if (numRows == FKOutputDim)
+    return numRows;
+
+  int numJoints = fk->getNumJoints();
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions = fk->getJointEuler2RotationFunctions<double>();
+  vector<Mat3<double>> globalRotations(numJoints);
+  vector<Vec3<double>> globalTranslations(numJoints);
+  fk->computeLocalAndGlobalTransforms<double>(eulerAngles, euler2RotationFunctions.data(),
+      nullptr, globalRotations.data(), globalTranslations.data());
+  for(size_t k = 0; k < orientedHandles.size(); k++)
+  {
+    Mat3d R(globalRotations[IKJointIDs[orientedHandles[k]]].data());
+    Vec3d w = orientationWeight * rotationVector(targetHandleRotations[k] * trans(R));
+    w.convertToArray(&residual[FKOutputDim + 3 * k]);
+  }
+
+  // Rotating by d(theta) around a world-space axis changes the handle's rotation vector by axis * d(theta).
+  const double deg2rad = M_PI / 180.0;
+  double * orientationJacobian = &jacobian[FKOutputDim * FKInputDim];
+  memset(orientationJacobian, 0, sizeof(double) * (numRows - FKOutputDim) * FKInputDim);
+  for(int jointID : handleAncestorJoints)
+  {
+    int axes[3];
+    Vec3d worldAxes[3];
+    computeJointWorldAxes(*fk, jointID, globalRotations.data(), eulerAngles, axes, worldAxes);
+    for(size_t k = 0; k < orientedHandles.size(); k++)
+    {
+      if (handleAncestors[orientedHandles[k]][jointID] == false)
+        continue;
+      for(int c = 0; c < 3; c++)
+        for(int d = 0; d < 3; d++)
+          orientationJacobian[(3 * k + d) * FKInputDim + 3 * jointID + axes[c]] = orientationWeight * deg2rad * worldAxes[c][d];
+    }
+  }
+  return numRows;
+}
+
+void IK::computeFKAndJacobianADOLC(const double * eulerAngles, double * handlePositions, double * jacobian)
+{
+  lock_guard<mutex> lock(adolcMutex);
+  // let adol-c evaluate forwardKinematicsFunction for different joint euler angles
+  ::function(adolc_tagID, FKOutputDim, FKInputDim, const_cast<double*>(eulerAngles), handlePositions);
+
+  // create pointer array where each pointer points to one row of the jacobian matrix
+  vector<double*> jacobianEachRow(FKOutputDim);
+  for(int i = 0; i < FKOutputDim; i++)
+    jacobianEachRow[i] = &jacobian[i * FKInputDim];
+  // each row is the gradient of one output component of the function
+  ::jacobian(adolc_tagID, FKOutputDim, FKInputDim, eulerAngles, jacobianEachRow.data());
+}
+
+void IK::computeFKAndJacobianForwardDual(const double * eulerAngles, double * handlePositions, double * jacobian)
+{
+  // Each forward sweep computes laneWidth columns of the Jacobian.
+  // Only the Euler angles of handle ancestors are seeded; all other columns are zero.
+  const int laneWidth = 8;
+  typedef DualNumber<laneWidth> Dual;
+
+  int numJoints = fk->getNumJoints();
+  vector<Euler2RotationFunction<Dual>> euler2RotationFunctions = fk->getJointEuler2RotationFunctions<Dual>();
+  vector<Dual> x(FKInputDim);
+  vector<Mat3<Dual>> globalRotations(numJoints);
+  vector<Vec3<Dual>> globalTranslations(numJoints);
+
+  memset(jacobian, 0, sizeof(double) * FKOutputDim * FKInputDim);
+  int numSeededDOFs = 3 * handleAncestorJoints.size();
+  for(int firstDOF = 0; firstDOF < numSeededDOFs || firstDOF == 0; firstDOF += laneWidth)
+  {
+    for(int i = 0; i < FKInputDim; i++)
+      x[i] = Dual(eulerAngles[i]);
+    int numLanes = std::min(laneWidth, numSeededDOFs - firstDOF);
+    vector<int> laneColumns(numLanes);
+    for(int lane = 0; lane < numLanes; lane++)
+    {
+      int dof = firstDOF + lane;
+      laneColumns[lane] = 3 * handleAncestorJoints[dof / 3] + dof % 3;
+      x[laneColumns[lane]] = Dual(eulerAngles[laneColumns[lane]], lane);
+    }
+
+    fk->computeLocalAndGlobalTransforms<Dual>(x.data(), euler2RotationFunctions.data(),
+        nullptr, globalRotations.data(), globalTranslations.data());
+
+    for(int i = 0; i < numIKJoints; i++)
+      for(int d = 0; d < 3; d++)
+      {
+        const Dual & p = globalTranslations[IKJointIDs[i]][d];
+        handlePositions[3 * i + d] = p.value();
+        for(int lane = 0; lane < numLanes; lane++)
+          jacobian[(3 * i + d) * FKInputDim + laneColumns[lane]] = p.derivative(lane);
+      }
+  }
+}
+
+void IK::computeFKAndJacobianAnalytic(const double * eulerAngles, double * handlePositions, double * jacobian)
+{
+  int numJoints = fk->getNumJoints();
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions = fk->getJointEuler2RotationFunctions<double>();
+  vector<Mat3<double>> globalRotations(numJoints);
+  vector<Vec3<double>> globalTranslations(numJoints);
+  fk->computeLocalAndGlobalTransforms<double>(eulerAngles, euler2RotationFunctions.data(),
+      nullptr, globalRotations.data(), globalTranslations.data());
+
+  for(int i = 0; i < numIKJoints; i++)
+    globalTranslations[IKJointIDs[i]].convertToArray(&handlePositions[3 * i]);
+
+  // Rotating by d(theta) around a world-space axis through the joint position (see computeJointWorldAxes)
+  // moves a descendant handle at p by axis x (p - jointPosition) * d(theta).
+  const double deg2rad = M_PI / 180.0;
+  memset(jacobian, 0, sizeof(double) * FKOutputDim * FKInputDim);
+  for(int jointID : handleAncestorJoints)
+  {
+    int axes[3];
+    Vec3d worldAxes[3];
+    computeJointWorldAxes(*fk, jointID, globalRotations.data(), eulerAngles, axes, worldAxes);
+
+    Vec3d jointPosition(globalTranslations[jointID].data());
+    for(int i = 0; i < numIKJoints; i++)
+    {
+      if (handleAncestors[i][jointID] == false)
+        continue;
+      Vec3d r = Vec3d(&handlePositions[3 * i]) - jointPosition;
+      for(int k = 0; k < 3; k++)
+      {
+        Vec3d column = deg2rad * cross(worldAxes[k], r);
+        for(int d = 0; d < 3; d++)
+          jacobian[(3 * i + d) * FKInputDim + 3 * jointID + axes[k]] = column[d];
+      }
+    }
+  }
+}
+
+const IK::MethodEntry IK::methodRegistry[IK::NUM_METHODS] =
+{
+  { "dampedLeastSquares", &IK::doIKDampedLeastSquares },
+  { "levenbergMarquardt", &IK::doIKLevenbergMarquardt },
+  { "pseudoInverse", &IK::doIKPseudoInverse },
+  { "jacobianTranspose", &IK::doIKJacobianTranspose },
+  { "cyclicCoordinateDescent", &IK::doIKCyclicCoordinateDescent },
+  { "fabrik", &IK::doIKFABRIK },
+};
+
+const char * IK::getMethodName(Method method)
+{
+  assert(method >= 0 && method < NUM_METHODS);
+  return methodRegistry[method].name;
+}
+
+int IK::getMethodFromName(const char * name, Method * method)
+{
+  for(int i = 0; i < NUM_METHODS; i++)
+  {
+    if (strcmp(name, methodRegistry[i].name) == 0)
+    {
+      *method = (Method)i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
+{
+  doIK(targetHandlePositions, nullptr, jointEulerAngles);
+}
+
+void IK::doIK(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * jointEulerAngles)
+{
+  assert(method >= 0 && method < NUM_METHODS);
+  if (orientedHandles.size() == 0)
+    targetHandleRotations = nullptr;
+  (this->*methodRegistry[method].solver)(targetHandlePositions, targetHandleRotations, jointEulerAngles);
+  // DAMPED_LEAST_SQUARES already stays within the limits; the other methods are projected onto them
+  if (usesJointLimits())
+    fk->clampToJointLimits(jointEulerAngles);
 }
 
 /**********************************************************************************/
 /*                      Damped Least Squares Implementation                       */
 /**********************************************************************************/
-void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
+void IK::doIKDampedLeastSquares(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
 {
-  // Students should implement this.
-  // Use adolc to evalute the forwardKinematicsFunction and its gradient (Jacobian). It was trained in train_adolc().
-  // Specifically, use ::function, and ::jacobian .
-  // See ADOLCExample.cpp .
-  //
-  // Use it implement the Tikhonov IK method (or the pseudoinverse method for extra credit).
+  // Use the Jacobian backend to evaluate the forwardKinematicsFunction and its gradient (Jacobian).
+  // Use it to implement the Tikhonov IK method.
   // Note that at entry, "jointEulerAngles" contains the input Euler angles. 
   // Upon exit, jointEulerAngles should contain the new Euler angles.
 
-  // prepare input and output arrays for adol-c
+  // With joint limits, the DOFs at their limits are dropped from the system, and oriented handles add rows;
+  // both need the (exact) block solver.
+  if (decomposition != NO_DECOMPOSITION || usesJointLimits() || targetHandleRotations != nullptr)
+  {
+    doIKDampedLeastSquaresDecomposed(targetHandlePositions, targetHandleRotations, jointEulerAngles);
+    return;
+  }
+
+  // prepare input and output arrays
   int numJoints = fk->getNumJoints();
-  double input_x_values[FKInputDim], output_y_values[FKOutputDim];
+  vector<double> input_x_values(FKInputDim), output_y_values(FKOutputDim);
   // for the first pass, use the input jointEulerAngles
   for(int i = 0; i < numJoints; i++)
   {
@@ -204,20 +746,11 @@ void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
     input_x_values[3 * i + 2] = jointEulerAngles[i][2];
   }
 
-  // let adol-c evaluate forwardKinematicsFunction for different joint euler angles
-  ::function(adolc_tagID, FKOutputDim, FKInputDim, input_x_values, output_y_values);
-
-  // let adol-c evaluate Jacobian
-  double jacobianMatrix[FKInputDim * FKOutputDim];
-  // create pointer array where each pointer points to one row of the jacobian matrix
-  double * jacobianMatrixEachRow[FKOutputDim];
-  for(int i = 0; i < FKOutputDim; i++) {
-    jacobianMatrixEachRow[i] = & jacobianMatrix[i * FKInputDim];
-  }
-  // each row is the gradient of one output component of the function
-  ::jacobian(adolc_tagID, FKOutputDim, FKInputDim, input_x_values, jacobianMatrixEachRow);
+  // evaluate forwardKinematicsFunction and its Jacobian, with the selected backend
+  vector<double> jacobianMatrix(FKInputDim * FKOutputDim);
+  computeFKAndJacobian(input_x_values.data(), output_y_values.data(), jacobianMatrix.data());
 
-  // get Jacobian matrix (adol-c stores matrix in row-major order)
+  // get Jacobian matrix (stored in row-major order)
   MatrixXd J(FKOutputDim, FKInputDim);
   for(int m = 0; m < FKOutputDim; m++)
     for(int n = 0; n < FKInputDim; n++)
@@ -233,7 +766,7 @@ void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
 
   // set "punish" param alpha, it avoids theta change to become unreasonabally
   // large
-  double alpha = 0.01;
+  double alpha = dampedLeastSquaresAlpha;
 
   // now we get matrix A, goal is to solve Ax=b
   // A is square since J is mxn, J^T is nxm -> J^T * J is nxn, also, I is nxn
@@ -266,88 +799,403 @@ void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
   }
 }
 
-// below is the extra implementation for doIK with pseudo inverse method
-// uncomment it and comment out above doIk() if you'd like to test it
+bool IK::usesJointLimits() const
+{
+  return jointLimitsEnabled && fk->hasJointLimits();
+}
+
+void IK::setDecomposition(Decomposition decomposition, WorkerPool * workerPool)
+{
+  this->decomposition = decomposition;
+  decompositionWorkerPool = workerPool;
+}
+
+int IK::getNumIndependentSystems() const
+{
+  switch(decomposition)
+  {
+    case NO_DECOMPOSITION:
+      return 1;
+    case DISJOINT_BLOCKS:
+      return blockHandles.size();
+    case SHARED_THEN_CHAINS:
+    {
+      int numChains = 0;
+      for(int i = 0; i < numIKJoints; i++)
+        numChains += (handleChains[i].size() > 0);
+      return numChains;
+    }
+  }
+  return 1;
+}
+
+void IK::doIKDampedLeastSquaresDecomposed(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  int numJoints = fk->getNumJoints();
+  int numRows = getNumResidualRows(targetHandleRotations);
+  vector<double> x(FKInputDim), r(numRows), jacobianMatrix(numRows * FKInputDim);
+  for(int i = 0; i < numJoints; i++)
+    jointEulerAngles[i].convertToArray(&x[3 * i]);
+  computeResidualAndJacobian(targetHandlePositions, targetHandleRotations, x.data(), r.data(), jacobianMatrix.data());
+  // the rows of the handles: 3 position rows, and 3 orientation rows if oriented
+  auto getHandleRows = [&](const vector<int> & handles)
+  {
+    vector<int> rows;
+    for(int i : handles)
+    {
+      for(int d = 0; d < 3; d++)
+        rows.push_back(3 * i + d);
+      if (numRows > FKOutputDim && handleOrientationIndices[i] >= 0)
+        for(int d = 0; d < 3; d++)
+          rows.push_back(FKOutputDim + 3 * handleOrientationIndices[i] + d);
+    }
+    return rows;
+  };
+
+  const double * lowerLimits = nullptr, * upperLimits = nullptr;
+  if (usesJointLimits())
+  {
+    lowerLimits = fk->getJointLowerLimit(0).data();
+    upperLimits = fk->getJointUpperLimit(0).data();
+  }
+
+  // solves the blocks in parallel; they write the Euler angles of disjoint sets of joints
+  auto solveBlocks = [&](int numBlocks, const std::function<void(int)> & solveBlock)
+  {
+    if (decompositionWorkerPool)
+      decompositionWorkerPool->parallelFor(numBlocks, solveBlock);
+    else
+      for(int block = 0; block < numBlocks; block++)
+        solveBlock(block);
+  };
+  auto applyDelta = [&](const vector<int> & joints, const double * delta)
+  {
+    for(size_t j = 0; j < joints.size(); j++)
+      jointEulerAngles[joints[j]] += Vec3d(&delta[3 * j]);
+  };
+
+  if (decomposition != SHARED_THEN_CHAINS)
+  {
+    solveBlocks(blockHandles.size(), [&](int block)
+    {
+      vector<double> delta(3 * blockJoints[block].size());
+      solveDampedLeastSquaresBlock(FKInputDim, jacobianMatrix.data(), r.data(), getHandleRows(blockHandles[block]), blockJoints[block],
+          dampedLeastSquaresAlpha, delta.data(), x.data(), lowerLimits, upperLimits);
+      applyDelta(blockJoints[block], delta.data());
+    });
+    return;
+  }
+
+  // SHARED_THEN_CHAINS: the shared joints, with all handles ...
+  if (sharedJoints.size() > 0)
+  {
+    vector<int> allHandles(numIKJoints);
+    for(int i = 0; i < numIKJoints; i++)
+      allHandles[i] = i;
+    vector<double> delta(3 * sharedJoints.size());
+    solveDampedLeastSquaresBlock(FKInputDim, jacobianMatrix.data(), r.data(), getHandleRows(allHandles), sharedJoints,
+        dampedLeastSquaresAlpha, delta.data(), x.data(), lowerLimits, upperLimits);
+    applyDelta(sharedJoints, delta.data());
+    // ... then the chains, for the residual predicted by the linearization: r -= J_shared delta
+    for(int m = 0; m < numRows; m++)
+      for(size_t b = 0; b < delta.size(); b++)
+        r[m] -= jacobianMatrix[m * FKInputDim + 3 * sharedJoints[b / 3] + b % 3] * delta[b];
+  }
+  solveBlocks(numIKJoints, [&](int i)
+  {
+    if (handleChains[i].size() == 0)
+      return;
+    vector<double> delta(3 * handleChains[i].size());
+    solveDampedLeastSquaresBlock(FKInputDim, jacobianMatrix.data(), r.data(), getHandleRows(vector<int>(1, i)), handleChains[i],
+        dampedLeastSquaresAlpha, delta.data(), x.data(), lowerLimits, upperLimits);
+    applyDelta(handleChains[i], delta.data());
+  });
+}
+
+/**********************************************************************************/
+/*                      Levenberg-Marquardt Implementation                        */
+/**********************************************************************************/
+double IK::getLevenbergMarquardtDamping() const
+{
+  return levenbergMarquardtState->damping;
+}
+
+void IK::resetLevenbergMarquardtDamping()
+{
+  levenbergMarquardtState->damping = -1.0;
+  levenbergMarquardtState->dampingGrowth = 2.0;
+}
+
+void IK::doIKLevenbergMarquardt(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  LevenbergMarquardtState & state = *levenbergMarquardtState;
+  const double initialDamping = 1e-3;
+  const int maxNumAttempts = 10;
+
+  // reduced DOFs: the Euler angles of the handle ancestors
+  int numDOFs = 3 * handleAncestorJoints.size();
+  if (numDOFs == 0)
+    return;
+  vector<int> DOFColumns(numDOFs);
+  for(int a = 0; a < numDOFs; a++)
+    DOFColumns[a] = 3 * handleAncestorJoints[a / 3] + a % 3;
+
+  if (state.patternAnalyzed == false)
+  {
+    vector<Triplet<double>> entries;
+    for(int b = 0; b < numDOFs; b++)
+      for(int a = b; a < numDOFs; a++)
+      {
+        bool coupled = (a == b);
+        for(int i = 0; i < numIKJoints && coupled == false; i++)
+          coupled = handleAncestors[i][DOFColumns[a] / 3] && handleAncestors[i][DOFColumns[b] / 3];
+        if (coupled)
+          entries.push_back(Triplet<double>(a, b, 1.0));
+      }
+    state.A.resize(numDOFs, numDOFs);
+    state.A.setFromTriplets(entries.begin(), entries.end());
+    state.cholesky.analyzePattern(state.A);
+    state.patternAnalyzed = true;
+  }
+
+  // evaluate the residual and the Jacobian (once per call)
+  int numJoints = fk->getNumJoints();
+  int numRows = getNumResidualRows(targetHandleRotations);
+  vector<double> x(FKInputDim), residual(numRows), jacobianMatrix(numRows * FKInputDim);
+  for(int i = 0; i < numJoints; i++)
+    jointEulerAngles[i].convertToArray(&x[3 * i]);
+  computeResidualAndJacobian(targetHandlePositions, targetHandleRotations, x.data(), residual.data(), jacobianMatrix.data());
+
+  MatrixXd J(numRows, numDOFs);
+  for(int m = 0; m < numRows; m++)
+    for(int a = 0; a < numDOFs; a++)
+      J(m, a) = jacobianMatrix[m * FKInputDim + DOFColumns[a]];
+  VectorXd r = Map<VectorXd>(residual.data(), numRows); // residual = target - current
+
+  MatrixXd JTJ = J.transpose() * J;
+  VectorXd g = J.transpose() * r;
+  if (g.squaredNorm() == 0.0)
+    return; // at a stationary point (e.g., the targets are reached)
+
+  // Marquardt scaling: damp each DOF relative to its own curvature
+  VectorXd D = JTJ.diagonal();
+  double minD = 1e-12 * D.maxCoeff();
+  for(int a = 0; a < numDOFs; a++)
+    D[a] = std::max(D[a], minD);
+
+  if (state.damping < 0)
+    state.damping = initialDamping;
+
+  double F = 0.5 * r.squaredNorm();
+  vector<double> xNew(x), rNew(numRows);
+  for(int attempt = 0; attempt < maxNumAttempts; attempt++)
+  {
+    // A = J^T J + damping * D, on the fixed pattern
+    for(int b = 0; b < state.A.outerSize(); b++)
+      for(SparseMatrix<double>::InnerIterator it(state.A, b); it; ++it)
+        it.valueRef() = JTJ(it.row(), it.col()) + ((it.row() == it.col()) ? state.damping * D[b] : 0.0);
+    state.cholesky.factorize(state.A);
+    VectorXd delta = state.cholesky.solve(g);
+
+    for(int a = 0; a < numDOFs; a++)
+      xNew[DOFColumns[a]] = x[DOFColumns[a]] + delta[a];
+    computeResidual(targetHandlePositions, targetHandleRotations, xNew.data(), rNew.data());
+    double FNew = 0.0;
+    for(int m = 0; m < numRows; m++)
+      FNew += 0.5 * rNew[m] * rNew[m];
+
+    // gain ratio: actual reduction / reduction predicted by the linear model
+    double predictedReduction = 0.5 * delta.dot(state.damping * D.cwiseProduct(delta) + g);
+    double rho = (predictedReduction > 0) ? (F - FNew) / predictedReduction : -1.0;
+    if (rho > 0)
+    {
+      // accept the step, and decrease the damping the better the model predicted the reduction
+      double t = 2.0 * rho - 1.0;
+      state.damping *= std::max(1.0 / 3.0, 1.0 - t * t * t);
+      state.dampingGrowth = 2.0;
+      for(int i = 0; i < numJoints; i++)
+        jointEulerAngles[i] = Vec3d(&xNew[3 * i]);
+      return;
+    }
+
+    // reject the step; retry with more damping, using the same Jacobian
+    state.damping *= state.dampingGrowth;
+    state.dampingGrowth *= 2.0;
+  }
+}
 
 /**********************************************************************************/
 /*                    Pseudo-inverse Method Implementation                        */
 /**********************************************************************************/
-// void IK::doIK(const Vec3d * targetHandlePositions, Vec3d * jointEulerAngles)
-// {
-//   // Students should implement this.
-//   // Use adolc to evalute the forwardKinematicsFunction and its gradient (Jacobian). It was trained in train_adolc().
-//   // Specifically, use ::function, and ::jacobian .
-//   // See ADOLCExample.cpp .
-//   //
-//   // Use it implement the Tikhonov IK method (or the pseudoinverse method for extra credit).
-//   // Note that at entry, "jointEulerAngles" contains the input Euler angles. 
-//   // Upon exit, jointEulerAngles should contain the new Euler angles.
-
-//   // prepare input and output arrays for adol-c
-//   int numJoints = fk->getNumJoints();
-//   double input_x_values[FKInputDim], output_y_values[FKOutputDim];
-//   // for the first pass, use the input jointEulerAngles
-//   for(int i = 0; i < numJoints; i++)
-//   {
-//     input_x_values[3 * i + 0] = jointEulerAngles[i][0];
-//     input_x_values[3 * i + 1] = jointEulerAngles[i][1];
-//     input_x_values[3 * i + 2] = jointEulerAngles[i][2];
-//   }
-
-//   // let adol-c evaluate forwardKinematicsFunction for different joint euler angles
-//   ::function(adolc_tagID, FKOutputDim, FKInputDim, input_x_values, output_y_values);
-
-//   // let adol-c evaluate Jacobian
-//   double jacobianMatrix[FKInputDim * FKOutputDim];
-//   // create pointer array where each pointer points to one row of the jacobian matrix
-//   double * jacobianMatrixEachRow[FKOutputDim];
-//   for(int i = 0; i < FKOutputDim; i++) {
-//     jacobianMatrixEachRow[i] = & jacobianMatrix[i * FKInputDim];
-//   }
-//   // each row is the gradient of one output component of the function
-//   ::jacobian(adolc_tagID, FKOutputDim, FKInputDim, input_x_values, jacobianMatrixEachRow);
-
-//   // get Jacobian matrix (adol-c stores matrix in row-major order)
-//   MatrixXd J(FKOutputDim, FKInputDim);
-//   for(int m = 0; m < FKOutputDim; m++)
-//     for(int n = 0; n < FKInputDim; n++)
-//     {
-//       J(m, n) = jacobianMatrix[m * FKInputDim + n];
-//     }
-//   // get J^T
-//   MatrixXd J_transpose(FKInputDim, FKOutputDim);
-//   J_transpose = J.transpose();
-
-//   // calculate J_dagger with pseudo inverse in process, it has the same dimension with J
-//   MatrixXd J_dagger(FKInputDim, FKOutputDim);
-//   J_dagger = J_transpose * (J * J_transpose).inverse();
-
-//   // creata an nxn identity matrix as A, since lfh only has delta theta
-//   MatrixXd A(FKInputDim, FKInputDim);
-//   A = MatrixXd::Identity(FKInputDim, FKInputDim);
-
-//   // now define the b, rhs
-//   // make a posChanges vector to store IK handle positions changes
-//   // since FKOutputDim = 3 * numIKJoints, we can fill in posChanges as below
-//   VectorXd posChanges(FKOutputDim);
-//   for(int i = 0; i < numIKJoints; i++)
-//   {
-//     // get position change, posChange = targetHandlePos - currentPos
-//     posChanges[3 * i + 0] = targetHandlePositions[i][0] - output_y_values[3 * i + 0];
-//     posChanges[3 * i + 1] = targetHandlePositions[i][1] - output_y_values[3 * i + 1];
-//     posChanges[3 * i + 2] = targetHandlePositions[i][2] - output_y_values[3 * i + 2];
-//   }
-
-//   // make a b with length FKOutputDim and calculate rhs
-//   VectorXd b(FKOutputDim);
-//   b = J_dagger * posChanges;
-
-//   // now solve the linear system for Euler angles change
-//   VectorXd x = A.ldlt().solve(b);
-
-//   // finally, update jointEulerAngles with solution x (Euler angles change) for next pass
-//   for(int i = 0; i < numJoints; i++)
-//   {
-//     jointEulerAngles[i] += Vec3d(x[3 * i + 0], x[3 * i + 1], x[3 * i + 2]);
-//   }
-// }
\ No newline at end of file
+void IK::doIKPseudoInverse(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  // reduced DOFs: the Euler angles of the handle ancestors (the other columns of J are zero)
+  int numDOFs = 3 * handleAncestorJoints.size();
+  if (numDOFs == 0)
+    return;
+
+  int numJoints = fk->getNumJoints();
+  int numRows = getNumResidualRows(targetHandleRotations);
+  vector<double> x(FKInputDim), residual(numRows), jacobianMatrix(numRows * FKInputDim);
+  for(int i = 0; i < numJoints; i++)
+    jointEulerAngles[i].convertToArray(&x[3 * i]);
+  computeResidualAndJacobian(targetHandlePositions, targetHandleRotations, x.data(), residual.data(), jacobianMatrix.data());
+
+  MatrixXd J(numRows, numDOFs);
+  for(int m = 0; m < numRows; m++)
+    for(int a = 0; a < numDOFs; a++)
+      J(m, a) = jacobianMatrix[m * FKInputDim + 3 * handleAncestorJoints[a / 3] + a % 3];
+  VectorXd r = Map<VectorXd>(residual.data(), numRows); // residual = target - current
+
+  // The SVD reveals the rank of J, so a rank-deficient J (e.g., a fully stretched limb, or more handle
+  // coordinates than DOFs) gives the minimum-norm least squares step instead of dividing by ~0.
+  JacobiSVD<MatrixXd> svd(J, ComputeThinU | ComputeThinV);
+  svd.setThreshold(pseudoInverseThreshold);
+  VectorXd delta = svd.solve(r);
+
+  // the linearization only holds near x: scale the step down to at most pseudoInverseMaxStep degrees per angle
+  double maxAngleStep = delta.lpNorm<Infinity>();
+  if ((pseudoInverseMaxStep > 0.0) && (maxAngleStep > pseudoInverseMaxStep))
+    delta *= pseudoInverseMaxStep / maxAngleStep;
+
+  for(int a = 0; a < numDOFs; a++)
+    jointEulerAngles[handleAncestorJoints[a / 3]][a % 3] += delta[a];
+}
+
+/**********************************************************************************/
+/*                    Jacobian Transpose Method Implementation                    */
+/**********************************************************************************/
+void IK::doIKJacobianTranspose(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  int numJoints = fk->getNumJoints();
+  int numRows = getNumResidualRows(targetHandleRotations);
+  vector<double> x(FKInputDim), r(numRows), jacobianMatrix(numRows * FKInputDim);
+  for(int i = 0; i < numJoints; i++)
+    jointEulerAngles[i].convertToArray(&x[3 * i]);
+  computeResidualAndJacobian(targetHandlePositions, targetHandleRotations, x.data(), r.data(), jacobianMatrix.data());
+
+  // g = J^T r is the steepest descent direction of 0.5 |r|^2; only the handle ancestor columns are nonzero
+  vector<double> g(FKInputDim, 0.0);
+  for(int m = 0; m < numRows; m++)
+    for(int jointID : handleAncestorJoints)
+      for(int d = 0; d < 3; d++)
+        g[3 * jointID + d] += jacobianMatrix[m * FKInputDim + 3 * jointID + d] * r[m];
+
+  // alpha = <r, J g> / <J g, J g> minimizes |r - alpha J g|^2
+  double rJg = 0.0, JgJg = 0.0;
+  for(int m = 0; m < numRows; m++)
+  {
+    double Jg = 0.0;
+    for(int jointID : handleAncestorJoints)
+      for(int d = 0; d < 3; d++)
+        Jg += jacobianMatrix[m * FKInputDim + 3 * jointID + d] * g[3 * jointID + d];
+    rJg += r[m] * Jg;
+    JgJg += Jg * Jg;
+  }
+  if (JgJg == 0.0)
+    return; // at a stationary point
+  double alpha = rJg / JgJg;
+
+  for(int jointID : handleAncestorJoints)
+    jointEulerAngles[jointID] += alpha * Vec3d(&g[3 * jointID]);
+}
+
+/**********************************************************************************/
+/*                 Geometric (CCD and FABRIK) Methods Implementation              */
+/**********************************************************************************/
+void IK::doIKCyclicCoordinateDescent(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  doIKPerChain(targetHandlePositions, targetHandleRotations, jointEulerAngles, &solveChainCCD);
+}
+
+void IK::doIKFABRIK(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+    Vec3d * jointEulerAngles)
+{
+  doIKPerChain(targetHandlePositions, targetHandleRotations, jointEulerAngles, &solveChainFABRIK);
+}
+
+void IK::doIKPerChain(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * jointEulerAngles,
+    ChainSolver chainSolver)
+{
+  int numJoints = fk->getNumJoints();
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions = fk->getJointEuler2RotationFunctions<double>();
+  vector<Mat3<double>> globalRotations(numJoints);
+  vector<Vec3<double>> globalTranslations(numJoints);
+  fk->computeLocalAndGlobalTransforms<double>(jointEulerAngles[0].data(), euler2RotationFunctions.data(),
+      nullptr, globalRotations.data(), globalTranslations.data());
+
+  vector<Vec3d> positions;
+  vector<Mat3d> chainRotations;
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    const vector<int> & chain = handleChains[i];
+    int n = chain.size();
+    if (n == 0)
+      continue;
+
+    positions.resize(n + 1);
+    chainRotations.resize(n);
+    for(int c = 0; c < n; c++)
+    {
+      positions[c] = Vec3d(globalTranslations[chain[c]].data());
+      chainRotations[c] = Mat3d(globalRotations[chain[c]].data());
+    }
+    positions[n] = Vec3d(globalTranslations[IKJointIDs[i]].data());
+
+    chainSolver(n, positions.data(), chainRotations.data(), targetHandlePositions[i], geometricNumIterations);
+    // an oriented handle is the last joint of its chain; its position does not depend on its own rotation
+    if ((targetHandleRotations != nullptr) && (handleOrientationIndices[i] >= 0))
+      chainRotations[n - 1] = targetHandleRotations[handleOrientationIndices[i]];
+
+    // local rotation = parent global rotation^T * global rotation = joint orientation rotation * Euler rotation
+    int baseParent = fk->getJointParent(chain[0]);
+    Mat3d parentRotation = (baseParent >= 0) ? Mat3d(globalRotations[baseParent].data()) : Mat3d(1.0);
+    for(int c = 0; c < n; c++)
+    {
+      int jointID = chain[c];
+      Mat3d eulerRotation = trans(fk->getJointOrientRotation(jointID)) * trans(parentRotation) * chainRotations[c];
+      Vec3d & angles = jointEulerAngles[jointID];
+      double newAngles[2][3];
+      rotation2Euler(fk->getJointRotateOrder(jointID), eulerRotation.data(), newAngles[0]);
+      // the other Euler angle solution of the same rotation: (a + 180, 180 - b, c + 180), in the order of application
+      int axes[3];
+      getRotateOrderAxes(fk->getJointRotateOrder(jointID), axes);
+      newAngles[1][axes[0]] = newAngles[0][axes[0]] + 180.0;
+      newAngles[1][axes[1]] = 180.0 - newAngles[0][axes[1]];
+      newAngles[1][axes[2]] = newAngles[0][axes[2]] + 180.0;
+      // keep the solution, and the multiple of 360 degrees, closest to the current angles, so the pose changes continuously
+      double minDistance = DBL_MAX;
+      Vec3d closestAngles;
+      for(int s = 0; s < 2; s++)
+      {
+        Vec3d candidate;
+        for(int d = 0; d < 3; d++)
+          candidate[d] = newAngles[s][d] + 360.0 * floor((angles[d] - newAngles[s][d]) / 360.0 + 0.5);
+        double distance = len2(candidate - angles);
+        if (distance < minDistance)
+        {
+          minDistance = distance;
+          closestAngles = candidate;
+        }
+      }
+      angles = closestAngles;
+      parentRotation = chainRotations[c];
+    }
+  }
+}
+
+void IK::doIKBatch(int numCharacters, IK * const * IKs, const Vec3d * const * targetHandlePositions,
+    Vec3d * const * eulerAngles, WorkerPool * workerPool)
+{
+  for(int c = 0; c < numCharacters; c++)
+    assert(IKs[c]->getMethod() != LEVENBERG_MARQUARDT);
+  workerPool->parallelFor(numCharacters, [&](int c)
+  {
+    IKs[c]->doIK(targetHandlePositions[c], eulerAngles[c]);
+  });
+}
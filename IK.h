@@ -8,23 +8,176 @@
 // Jernej Barbic and Yijing Li
 
 #include <cfloat>
+#include <vector>
+#include <memory>
 
 class FK;
 class Vec3d;
+class Mat3d;
+class WorkerPool;
 
 class IK
 {
 public:
+  // How the forward kinematics function and its Jacobian matrix are evaluated.
+  // ADOLC_TAPE: record the FK function on an Adol-C tape once, then use ::function and ::jacobian (reverse sweeps).
+  // FORWARD_DUAL: forward-mode sweeps with DualNumber (see dualNumber.h), seeded only on the Euler angles
+  //   of the joints that are ancestors of some IK handle; the other Jacobian columns are zero.
+  // ANALYTIC: closed-form Jacobian; the derivative of a handle position p with respect to an Euler angle of an
+  //   ancestor joint j is (rotation axis in world coordinates) x (p - position of j).
+  // All backends produce the same Jacobian matrix (up to round-off). Use IKBenchmark to pick the fastest for a rig.
+  enum JacobianBackend
+  {
+    ADOLC_TAPE = 0,
+    FORWARD_DUAL,
+    ANALYTIC
+  };
+
+  // How doIK computes the new joint angles. Each doIK call evaluates the Jacobian matrix once.
+  // DAMPED_LEAST_SQUARES: a Tikhonov-regularized step with a fixed damping (see setDampedLeastSquaresAlpha).
+  // LEVENBERG_MARQUARDT: a Levenberg-Marquardt step, with damping scaled by diag(J^T J), so it does not depend on the rig units.
+  //   The damping adapts to the ratio of the actual to the predicted residual reduction; a rejected step is retried
+  //   with more damping, reusing the Jacobian (only FK is re-evaluated). The damping and the symbolic Cholesky
+  //   factorization are kept for the next doIK call (the next frame), so an IK instance in this mode
+  //   must not be used from several threads at once.
+  // PSEUDO_INVERSE: the minimum-norm least squares step J^+ r, with J^+ computed by a singular value decomposition;
+  //   singular values below a relative threshold are treated as zero (see setPseudoInverseThreshold).
+  // JACOBIAN_TRANSPOSE: the step alpha J^T r, with alpha minimizing the linearized residual along J^T r.
+  //   No linear system is solved, so each step is very cheap, but more steps are needed.
+  // CYCLIC_COORDINATE_DESCENT, FABRIK: geometric solvers that need no Jacobian matrix. Each handle is solved on its own
+  //   chain (see getHandleChain): cyclic coordinate descent rotates one chain joint at a time to point the handle at
+  //   its target; FABRIK moves the chain joint positions by forward and backward reaching passes, and then rotates
+  //   each chain joint onto its new bone direction. The new rotations are converted back to Euler angles in each joint's
+  //   RotateOrder. Each doIK call runs up to getGeometricNumIterations sweeps; joints outside all chains do not move.
+  // Each method has a name (see getMethodName), so it can be selected from a config file.
+  enum Method
+  {
+    DAMPED_LEAST_SQUARES = 0,
+    LEVENBERG_MARQUARDT,
+    PSEUDO_INVERSE,
+    JACOBIAN_TRANSPOSE,
+    CYCLIC_COORDINATE_DESCENT,
+    FABRIK,
+    NUM_METHODS
+  };
+
+  // How DAMPED_LEAST_SQUARES splits its linear system into smaller independent systems.
+  // NO_DECOMPOSITION: one system over the Euler angles of all joints.
+  // DISJOINT_BLOCKS: the handles are grouped so that no joint moves handles of two different groups; each group is
+  //   solved over the Euler angles of its handles' ancestors only. The systems do not interact, so the step is the same
+  //   as with NO_DECOMPOSITION (up to round-off). For rigs where all handles share an ancestor (e.g., the root),
+  //   there is only one group.
+  // SHARED_THEN_CHAINS: first, the joints that move several handles (e.g., the wrist of the hand) are solved, with all
+  //   handles; then each handle's chain (see getHandleChain) is solved for the remaining residual, independently.
+  //   This is one block Gauss-Seidel sweep over the coupled system: an approximation, unless no joint is shared.
+  enum Decomposition
+  {
+    NO_DECOMPOSITION = 0,
+    DISJOINT_BLOCKS,
+    SHARED_THEN_CHAINS
+  };
+
   // IK constructor.
   // numIKJoints, IKJointIDs: the number of IK handle joints, and their indices (using the joint numbering as defined in the FK class).
   // FK: pointer to an already initialized forward kinematics class.
   // adolc_tagID: an ID used in adol-c to represent a particular function for evaluation. Different functions should have different tagIDs.
-  IK(int numIKJoints, const int * IKJointIDs, FK * fk, int adolc_tagID = 1);
+  //   If adolc_tagID < 0, a tagID not used by any other IK instance is assigned (see getUniqueAdolcTagID).
+  // jacobianBackend: see JacobianBackend above.
+  // Thread safety: different IK instances can be used from different threads at the same time,
+  // and so can one IK instance, on different eulerAngles arrays, unless its method is LEVENBERG_MARQUARDT
+  // (its damping is shared by all doIK calls of the instance). The fk is only read.
+  // Adol-C keeps global state that is not thread-safe, so all Adol-C calls are serialized internally;
+  // for many concurrent solves, use the FORWARD_DUAL or ANALYTIC backends, which have no global state.
+  IK(int numIKJoints, const int * IKJointIDs, FK * fk, int adolc_tagID = -1, JacobianBackend jacobianBackend = ADOLC_TAPE);
+  ~IK();
 
   // input: an array of numIKJoints Vec3d's giving the positions of the IK handles, current joint Euler angles
   // output: the computed joint Euler angles; same meaning as in the FK class
   // Note: eulerAngles is both input and output
   void doIK(const Vec3d * targetHandlePositions, Vec3d * eulerAngles);
+  // The same, with orientation targets for the oriented handles (see setOrientedHandles):
+  // targetHandleRotations[k] is the target global rotation of the k-th oriented handle.
+  // If targetHandleRotations is nullptr, the orientations are not constrained.
+  void doIK(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+
+  // Evaluate the forward kinematics function and its Jacobian matrix, using the current backend.
+  // input: eulerAngles (length FKInputDim)
+  // output: handlePositions (length FKOutputDim), jacobian (FKOutputDim x FKInputDim, row-major)
+  void computeFKAndJacobian(const double * eulerAngles, double * handlePositions, double * jacobian);
+  // Evaluate only the forward kinematics function (much cheaper than the Jacobian).
+  void computeFK(const double * eulerAngles, double * handlePositions);
+
+  // Solve one IK step for each of numCharacters independent characters, in parallel on the threads of workerPool.
+  // Character c uses IKs[c], with targetHandlePositions[c] and eulerAngles[c] as in doIK.
+  // The same IK may appear several times, as long as the eulerAngles arrays are different.
+  // The IKs must not use LEVENBERG_MARQUARDT (asserted), since it keeps state between doIK calls.
+  static void doIKBatch(int numCharacters, IK * const * IKs, const Vec3d * const * targetHandlePositions,
+      Vec3d * const * eulerAngles, WorkerPool * workerPool);
+
+  // Returns an adol-c tagID that has not been returned before. These IDs start at 16384,
+  // so they do not collide with small tagIDs chosen by hand.
+  static int getUniqueAdolcTagID();
+
+  JacobianBackend getJacobianBackend() const { return jacobianBackend; }
+  void setJacobianBackend(JacobianBackend jacobianBackend);
+
+  Method getMethod() const { return method; }
+  void setMethod(Method method) { this->method = method; }
+  // The name of a method: "dampedLeastSquares", "levenbergMarquardt", "pseudoInverse", "jacobianTranspose",
+  // "cyclicCoordinateDescent" or "fabrik".
+  static const char * getMethodName(Method method);
+  // Finds the method with the given name. Returns 0 on success, and 1 if there is no such method.
+  static int getMethodFromName(const char * name, Method * method);
+
+  // The fixed damping of DAMPED_LEAST_SQUARES (default: 0.01).
+  double getDampedLeastSquaresAlpha() const { return dampedLeastSquaresAlpha; }
+  void setDampedLeastSquaresAlpha(double alpha) { dampedLeastSquaresAlpha = alpha; }
+  // The current (relative) damping of LEVENBERG_MARQUARDT; it carries over from one doIK call to the next.
+  double getLevenbergMarquardtDamping() const;
+  // Forget the damping of LEVENBERG_MARQUARDT, e.g., after the targets jump.
+  void resetLevenbergMarquardtDamping();
+  // Singular values of J below threshold * (largest singular value) are ignored by PSEUDO_INVERSE (default: 1e-4).
+  double getPseudoInverseThreshold() const { return pseudoInverseThreshold; }
+  void setPseudoInverseThreshold(double threshold) { pseudoInverseThreshold = threshold; }
+  // PSEUDO_INVERSE is undamped, so far from the targets (e.g., with oriented handles, whose rotation rows are only
+  // linear for small angles) its step can overshoot and diverge. A step that changes some Euler angle by more than
+  // maxStep degrees is scaled down to maxStep (default: 10; 0: no limit).
+  double getPseudoInverseMaxStep() const { return pseudoInverseMaxStep; }
+  void setPseudoInverseMaxStep(double maxStep) { pseudoInverseMaxStep = maxStep; }
+  // Select the decomposition of DAMPED_LEAST_SQUARES (default: NO_DECOMPOSITION). If workerPool is not nullptr,
+  // the independent systems are solved in parallel on it; this workerPool must then not be the one that runs
+  // this doIK call (e.g., in doIKBatch), because WorkerPool::parallelFor cannot be nested.
+  void setDecomposition(Decomposition decomposition, WorkerPool * workerPool = nullptr);
+  Decomposition getDecomposition() const { return decomposition; }
+  // The number of independent systems that DAMPED_LEAST_SQUARES solves per doIK call, in parallel if possible.
+  int getNumIndependentSystems() const;
+
+  // Joint limits (see the FK constructor). If enabled (default) and the FK has joint limits, doIK keeps the Euler angles
+  // within them. DAMPED_LEAST_SQUARES respects them natively: the DOFs that would leave their range are clamped and
+  // dropped from the linear system (an active set), and the others are re-solved. The other methods clamp their result.
+  void setJointLimitsEnabled(bool enabled) { jointLimitsEnabled = enabled; }
+  bool getJointLimitsEnabled() const { return jointLimitsEnabled; }
+
+  // Oriented (6-DOF) handles: orientedHandles[k] (an index into IKJointIDs) also gets an orientation target in doIK.
+  // Its orientation residual is the rotation vector of (target rotation * current rotation^T), which adds 3 rows
+  // to the IK system per oriented handle. The rows of the rotation vector are multiplied by orientationWeight
+  // (default: 1.0; radians are traded against the rig length units). The Jacobian of these rows is always
+  // computed analytically (world-space rotation axes), whatever the JacobianBackend. Oriented handles make their
+  // own joint's Euler angles part of the system (and of their chain). CYCLIC_COORDINATE_DESCENT and FABRIK solve
+  // the positions, and then set the handle's rotation to the target.
+  void setOrientedHandles(int numOrientedHandles, const int * orientedHandles);
+  int getNumOrientedHandles() const { return orientedHandles.size(); }
+  double getOrientationWeight() const { return orientationWeight; }
+  void setOrientationWeight(double weight) { orientationWeight = weight; }
+
+  // The maximum number of sweeps over a chain per doIK call, for CYCLIC_COORDINATE_DESCENT and FABRIK (default: 10).
+  int getGeometricNumIterations() const { return geometricNumIterations; }
+  void setGeometricNumIterations(int numIterations) { geometricNumIterations = numIterations; }
+
+  // The chain of the i-th IK handle: its ancestor joints, ordered from the chain base to the handle's parent
+  // (or to the handle itself, if it is oriented), that move no other handle. The chains of different handles are disjoint, so they can be solved independently.
+  // A chain is empty if the handle's parent also moves another handle.
+  const std::vector<int> & getHandleChain(int i) const { return handleChains[i]; }
 
   // IK parameters
   int getFKInputDim() const { return FKInputDim; }
@@ -37,10 +190,76 @@ protected:
   const int * IKJointIDs = nullptr;
   FK * fk = nullptr;
   int adolc_tagID = 0; // tagID
-  int FKInputDim = 0; // forward dynamics input dimension 
+  int FKInputDim = 0; // forward dynamics input dimension
   int FKOutputDim = 0; // forward dynamics output dimension
 
+  JacobianBackend jacobianBackend = ADOLC_TAPE;
+  bool adolcTrained = false;
+  Method method = DAMPED_LEAST_SQUARES;
+  double dampedLeastSquaresAlpha = 0.01;
+  double pseudoInverseThreshold = 1e-4;
+  double pseudoInverseMaxStep = 10.0;
+  int geometricNumIterations = 10;
+  std::vector<int> orientedHandles;
+  std::vector<int> handleOrientationIndices; // for each handle, its index in orientedHandles, or -1
+  double orientationWeight = 1.0;
+  Decomposition decomposition = NO_DECOMPOSITION;
+  bool jointLimitsEnabled = true;
+  WorkerPool * decompositionWorkerPool = nullptr;
+  // DISJOINT_BLOCKS: the handles of each group, and the joints whose Euler angles move them
+  std::vector<std::vector<int>> blockHandles, blockJoints;
+  // SHARED_THEN_CHAINS: the joints that move more than one handle, in FK update order
+  std::vector<int> sharedJoints;
+  // State of LEVENBERG_MARQUARDT kept across doIK calls; defined in IK.cpp.
+  struct LevenbergMarquardtState;
+  std::unique_ptr<LevenbergMarquardtState> levenbergMarquardtState;
+  // The FK buffers of computeResidual, allocated once; defined in IK.cpp.
+  struct ResidualFKBuffers;
+  std::unique_ptr<ResidualFKBuffers> residualFKBuffers;
+  // Joints that are (strict) ancestors of at least one IK handle, in the FK update order (root first), and the
+  // oriented handles themselves. Only their Euler angles move (or rotate) the handles.
+  std::vector<int> handleAncestorJoints;
+  // handleAncestors[i][jointID] is true if jointID is a strict ancestor of the i-th IK handle,
+  // or the i-th handle itself, if it is oriented.
+  std::vector<std::vector<bool>> handleAncestors;
+  std::vector<std::vector<int>> handleChains;
+
+  // The IK methods, indexed by Method; doIK calls the solver of the current method.
+  struct MethodEntry
+  {
+    const char * name;
+    void (IK::*solver)(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  };
+  static const MethodEntry methodRegistry[NUM_METHODS];
+
+  bool usesJointLimits() const;
+  // Computes handleAncestors, handleAncestorJoints, handleChains, and the decomposition blocks.
+  void buildHandleStructure();
+  // The number of rows of the IK system: 3 per handle, and 3 per oriented handle if targetHandleRotations is not nullptr.
+  int getNumResidualRows(const Mat3d * targetHandleRotations) const;
+  // residual = (target - current handle positions, weighted rotation vectors of the oriented handles), and its
+  // Jacobian matrix (getNumResidualRows x FKInputDim, row-major) with respect to the Euler angles.
+  // Returns the number of rows.
+  int computeResidualAndJacobian(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+      const double * eulerAngles, double * residual, double * jacobian);
+  // The same, without the Jacobian (much cheaper).
+  void computeResidual(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations,
+      const double * eulerAngles, double * residual);
   void train_adolc();
+  void doIKDampedLeastSquares(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKDampedLeastSquaresDecomposed(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKLevenbergMarquardt(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKPseudoInverse(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKJacobianTranspose(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKCyclicCoordinateDescent(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  void doIKFABRIK(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles);
+  // Solves each handle's chain with chainSolver (see IK.cpp), and converts the new chain rotations to Euler angles.
+  typedef void (*ChainSolver)(int numChainJoints, Vec3d * positions, Mat3d * globalRotations, const Vec3d & target, int numIterations);
+  void doIKPerChain(const Vec3d * targetHandlePositions, const Mat3d * targetHandleRotations, Vec3d * eulerAngles,
+      ChainSolver chainSolver);
+  void computeFKAndJacobianADOLC(const double * eulerAngles, double * handlePositions, double * jacobian);
+  void computeFKAndJacobianForwardDual(const double * eulerAngles, double * handlePositions, double * jacobian);
+  void computeFKAndJacobianAnalytic(const double * eulerAngles, double * handlePositions, double * jacobian);
 };
 
 #endif
@@ -0,0 +1,1349 @@
+// Benchmarks the IK Jacobian backends (Adol-C tape, forward dual numbers, analytic) and the IK methods on a rig,
+// for a single character and for many characters solved in parallel (IK::doIKBatch), and the skinning, mesh and
+// animation features. Each benchmark is a function, run in turn by main.
+// Usage: run from a rig folder (e.g., armadillo, hand, dragon), like the driver:
+//   ../IKBenchmark skin.config [numIterations]
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "FK.h"
+#include "IK.h"
+#include "workerPool.h"
+#include "poseCache.h"
+#include "animationClip.h"
+#include "vertexCache.h"
+#include "framePipeline.h"
+#include "fixedRateScheduler.h"
+#include "characterScene.h"
+#include "skinning.h"
+#include "objMesh.h"
+#include "objMeshTopology.h"
+#include "configFile.h"
+#include "performanceCounter.h"
+#include <vector>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+using namespace std;
+
+static string meshFilename;
+static string jointHierarchyFilename;
+static string jointRestTransformsFilename;
+static string jointWeightsFilename;
+static string jointLimitsFilename;
+static vector<int> IKJointIDs;
+
+#define ADD_CONFIG(v) configFile.addOptionOptional(#v, &v, v)
+static void initConfigurations(const char * configFilename)
+{
+  ConfigFile configFile;
+  ADD_CONFIG(meshFilename);
+  ADD_CONFIG(jointHierarchyFilename);
+  ADD_CONFIG(jointRestTransformsFilename);
+  ADD_CONFIG(jointWeightsFilename);
+  ADD_CONFIG(jointLimitsFilename);
+  ADD_CONFIG(IKJointIDs);
+
+  if (configFile.parseOptions(configFilename, 0) != 0)
+  {
+    printf("Error parsing options.\n");
+    exit(1);
+  }
+}
+
+// The rig, shared by the benchmarks; each benchmark leaves the FK in the rest pose.
+static int numJoints = 0, numIKJoints = 0;
+static double skeletonRadius = 0.0;
+static vector<double> eulerAngles; // a pose away from the rest pose, to compare the Jacobians
+static vector<Vec3d> targetHandlePositions; // IK targets: each handle moved by a fixed fraction of the skeleton size
+static const int numIKSteps = 30;
+static const char * backendNames[3] = { "adolc tape", "forward dual", "analytic" };
+static const IK::JacobianBackend backends[3] = { IK::ADOLC_TAPE, IK::FORWARD_DUAL, IK::ANALYTIC };
+
+static void initRig(const FK & fk)
+{
+  numJoints = fk.getNumJoints();
+  numIKJoints = IKJointIDs.size();
+
+  eulerAngles.resize(3 * numJoints);
+  srand(0);
+  for(int i = 0; i < numJoints; i++)
+    for(int d = 0; d < 3; d++)
+      eulerAngles[3 * i + d] = fk.getJointRestEulerAngles(i)[d] + (rand() % 40 - 20);
+
+  skeletonRadius = 0.0;
+  for(int i = 0; i < numJoints; i++)
+    skeletonRadius = max(skeletonRadius, len(fk.getJointGlobalPosition(i) - fk.getJointGlobalPosition(0)));
+  targetHandlePositions.resize(numIKJoints);
+  for(int i = 0; i < numIKJoints; i++)
+    targetHandlePositions[i] = fk.getJointGlobalPosition(IKJointIDs[i]) + 0.05 * skeletonRadius * Vec3d(1.0, (i % 2) ? 1.0 : -1.0, 0.5);
+}
+
+// the benchmarks of skinning need the rig's weights (e.g., dragon has none)
+static bool hasSkinningWeights()
+{
+  return (bool)ifstream(jointWeightsFilename.c_str());
+}
+
+static vector<double> getRestPositions(const ObjMesh & mesh)
+{
+  int numVertices = mesh.getNumVertices();
+  vector<double> restPositions(3 * numVertices);
+  for(int v = 0; v < numVertices; v++)
+    for(int d = 0; d < 3; d++)
+      restPositions[3 * v + d] = mesh.getPosition(v)[d];
+  return restPositions;
+}
+
+// sets fk to the pose eulerAngles, and computes its joint transforms
+static void setPose(FK & fk)
+{
+  for(int i = 0; i < numJoints; i++)
+    fk.getJointEulerAngles()[i] = Vec3d(eulerAngles[3 * i + 0], eulerAngles[3 * i + 1], eulerAngles[3 * i + 2]);
+  fk.computeJointTransforms();
+}
+
+// the total distance of the handles of the current pose of fk to the targets (one per handle)
+static double computeIKError(FK & fk, const Vec3d * targets)
+{
+  fk.computeJointTransforms();
+  double IKError = 0.0;
+  for(int i = 0; i < numIKJoints; i++)
+    IKError += len(fk.getJointGlobalPosition(IKJointIDs[i]) - targets[i]);
+  return IKError;
+}
+
+// The Jacobian backends: the time of a Jacobian, the difference to the Adol-C Jacobian, and the IK steps.
+static void benchmarkJacobianBackends(FK & fk, int numIterations)
+{
+  vector<double> referenceJacobian;
+
+  printf("#joints: %d, #IK handles: %d, Jacobian: %d x %d, #iterations: %d\n",
+      numJoints, numIKJoints, 3 * numIKJoints, 3 * numJoints, numIterations);
+  printf("%-14s %16s %16s %16s %16s\n", "backend", "Jacobian (us)", "IK step (us)", "max |J - J_ad|", "IK error");
+  for(int b = 0; b < 3; b++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, 1 + b, backends[b]);
+
+    vector<double> handlePositions(ik.getFKOutputDim());
+    vector<double> jacobian(ik.getFKOutputDim() * ik.getFKInputDim());
+    ik.computeFKAndJacobian(eulerAngles.data(), handlePositions.data(), jacobian.data());
+    if (b == 0)
+      referenceJacobian = jacobian;
+    double maxJacobianError = 0.0;
+    for(size_t i = 0; i < jacobian.size(); i++)
+      maxJacobianError = max(maxJacobianError, fabs(jacobian[i] - referenceJacobian[i]));
+
+    PerformanceCounter jacobianCounter;
+    for(int iter = 0; iter < numIterations; iter++)
+      ik.computeFKAndJacobian(eulerAngles.data(), handlePositions.data(), jacobian.data());
+    jacobianCounter.StopCounter();
+
+    fk.resetToRestPose();
+    PerformanceCounter IKCounter;
+    for(int iter = 0; iter < numIKSteps; iter++)
+      ik.doIK(targetHandlePositions.data(), fk.getJointEulerAngles());
+    IKCounter.StopCounter();
+    double IKError = computeIKError(fk, targetHandlePositions.data());
+
+    printf("%-14s %16.3f %16.3f %16.3g %16.6g\n", backendNames[b],
+        1e6 * jacobianCounter.GetElapsedTime() / numIterations, 1e6 * IKCounter.GetElapsedTime() / numIKSteps,
+        maxJacobianError, IKError);
+  }
+  fk.resetToRestPose();
+}
+
+// Compare the IK methods: the number of doIK calls (= Jacobian evaluations, except for the geometric methods) to reach the targets,
+// or, if they are not reachable, until the error has not decreased for maxNumStalledCalls calls
+static void benchmarkIKMethods(FK & fk)
+{
+  const int maxNumIKCalls = 500;
+  const int maxNumStalledCalls = 10;
+  const double tolerance = 1e-3 * skeletonRadius;
+  const double stallTolerance = 1e-6 * skeletonRadius;
+  printf("\nIK methods, until the total handle error < %g or stalls (at most %d calls):\n", tolerance, maxNumIKCalls);
+  printf("%-24s %12s %16s %16s %16s\n", "method", "#doIK calls", "per call (us)", "total (ms)", "IK error");
+  for(int m = 0; m < IK::NUM_METHODS; m++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+    ik.setMethod((IK::Method)m);
+    fk.resetToRestPose();
+    int numIKCalls = 0;
+    double IKError = 0.0, minIKError = DBL_MAX;
+    int numStalledCalls = 0;
+    PerformanceCounter methodCounter;
+    for(numIKCalls = 0; numIKCalls < maxNumIKCalls; numIKCalls++)
+    {
+      IKError = computeIKError(fk, targetHandlePositions.data());
+      if (IKError < tolerance)
+        break;
+      if (IKError < minIKError - stallTolerance)
+      {
+        minIKError = IKError;
+        numStalledCalls = 0;
+      }
+      else if (++numStalledCalls == maxNumStalledCalls)
+        break;
+      ik.doIK(targetHandlePositions.data(), fk.getJointEulerAngles());
+    }
+    methodCounter.StopCounter();
+    double time = methodCounter.GetElapsedTime();
+    printf("%-24s %12d %16.3f %16.3f %16.6g\n", IK::getMethodName((IK::Method)m), numIKCalls,
+        1e6 * time / max(numIKCalls, 1), 1e3 * time, IKError);
+  }
+  fk.resetToRestPose();
+}
+
+// Oriented (6-DOF) handles: every handle also gets a target rotation, its rest rotation turned by 20 degrees.
+static void benchmarkOrientedHandles(FK & fk)
+{
+  vector<int> orientedHandles(numIKJoints);
+  vector<Mat3d> targetHandleRotations(numIKJoints);
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    orientedHandles[i] = i;
+    targetHandleRotations[i] = getElementRotationMatrix(i % 3, 20.0 * M_PI / 180.0) * fk.getJointGlobalTransform(IKJointIDs[i]).getRotation();
+  }
+  printf("\nOriented handles, %d doIK calls, %d rows (%d without orientations):\n", numIKSteps, 6 * numIKJoints, 3 * numIKJoints);
+  printf("%-24s %16s %16s %16s\n", "method", "per call (us)", "position error", "max angle (deg)");
+  for(int m = 0; m < IK::NUM_METHODS; m++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+    ik.setMethod((IK::Method)m);
+    ik.setOrientedHandles(numIKJoints, orientedHandles.data());
+    fk.resetToRestPose();
+    PerformanceCounter orientationCounter;
+    for(int iter = 0; iter < numIKSteps; iter++)
+      ik.doIK(targetHandlePositions.data(), targetHandleRotations.data(), fk.getJointEulerAngles());
+    orientationCounter.StopCounter();
+
+    fk.computeJointTransforms();
+    double IKError = 0.0, maxAngle = 0.0;
+    for(int i = 0; i < numIKJoints; i++)
+    {
+      IKError += len(fk.getJointGlobalPosition(IKJointIDs[i]) - targetHandlePositions[i]);
+      Mat3d R = targetHandleRotations[i] * trans(fk.getJointGlobalTransform(IKJointIDs[i]).getRotation());
+      double cosAngle = min(max(0.5 * (R[0][0] + R[1][1] + R[2][2] - 1.0), -1.0), 1.0);
+      maxAngle = max(maxAngle, acos(cosAngle) * 180.0 / M_PI);
+    }
+    printf("%-24s %16.3f %16.6g %16.6g\n", IK::getMethodName((IK::Method)m),
+        1e6 * orientationCounter.GetElapsedTime() / numIKSteps, IKError, maxAngle);
+  }
+  fk.resetToRestPose();
+}
+
+// Split the DLS system into independent systems, solved in parallel.
+static void benchmarkDecompositions(FK & fk)
+{
+  const char * decompositionNames[3] = { "none", "disjoint blocks", "shared+chains" };
+  WorkerPool decompositionWorkerPool;
+  printf("\nDLS decompositions, %d doIK calls, on %d threads:\n", numIKSteps, decompositionWorkerPool.getNumThreads());
+  printf("%-16s %12s %16s %16s %16s\n", "decomposition", "#systems", "per call (us)", "max |dAngle|", "IK error");
+  vector<Vec3d> referenceAngles;
+  for(int decomposition = 0; decomposition < 3; decomposition++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+    ik.setDecomposition((IK::Decomposition)decomposition, &decompositionWorkerPool);
+    fk.resetToRestPose();
+    PerformanceCounter decompositionCounter;
+    for(int iter = 0; iter < numIKSteps; iter++)
+      ik.doIK(targetHandlePositions.data(), fk.getJointEulerAngles());
+    decompositionCounter.StopCounter();
+
+    // difference of the Euler angles to those without decomposition
+    vector<Vec3d> angles(fk.getJointEulerAngles(), fk.getJointEulerAngles() + numJoints);
+    if (decomposition == 0)
+      referenceAngles = angles;
+    double maxAngleDifference = 0.0;
+    for(int i = 0; i < numJoints; i++)
+      for(int d = 0; d < 3; d++)
+        maxAngleDifference = max(maxAngleDifference, fabs(angles[i][d] - referenceAngles[i][d]));
+    double IKError = computeIKError(fk, targetHandlePositions.data());
+    printf("%-16s %12d %16.3f %16.3g %16.6g\n", decompositionNames[decomposition], ik.getNumIndependentSystems(),
+        1e6 * decompositionCounter.GetElapsedTime() / numIKSteps, maxAngleDifference, IKError);
+  }
+  fk.resetToRestPose();
+}
+
+// With joint limits: DLS that drops the DOFs at their limits, vs. unconstrained DLS.
+// Each handle is pulled halfway towards the root, so that the limbs have to bend and some joints reach their limits.
+static void benchmarkJointLimits(FK & fk)
+{
+  if (fk.hasJointLimits() == false)
+    return;
+
+  vector<Vec3d> bentTargetHandlePositions(numIKJoints);
+  for(int i = 0; i < numIKJoints; i++)
+    bentTargetHandlePositions[i] = 0.5 * (fk.getJointGlobalPosition(IKJointIDs[i]) + fk.getJointGlobalPosition(0));
+  printf("\nJoint limits, DLS, %d doIK calls:\n", numIKSteps);
+  printf("%-16s %16s %16s %16s %16s\n", "limits", "per call (us)", "#DOFs at limit", "max violation", "IK error");
+  for(int enabled = 0; enabled < 2; enabled++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+    ik.setJointLimitsEnabled(enabled);
+    fk.resetToRestPose();
+    PerformanceCounter limitsCounter;
+    for(int iter = 0; iter < numIKSteps; iter++)
+      ik.doIK(bentTargetHandlePositions.data(), fk.getJointEulerAngles());
+    limitsCounter.StopCounter();
+
+    int numDOFsAtLimit = 0;
+    double maxViolation = 0.0;
+    for(int i = 0; i < numJoints; i++)
+      for(int d = 0; d < 3; d++)
+      {
+        double angle = fk.getJointEulerAngles()[i][d];
+        double violation = max(fk.getJointLowerLimit(i)[d] - angle, angle - fk.getJointUpperLimit(i)[d]);
+        maxViolation = max(maxViolation, violation);
+        numDOFsAtLimit += (violation >= 0.0);
+      }
+    double IKError = computeIKError(fk, bentTargetHandlePositions.data());
+    printf("%-16s %16.3f %16d %16.3g %16.6g\n", enabled ? "active set" : "ignored",
+        1e6 * limitsCounter.GetElapsedTime() / numIKSteps, numDOFsAtLimit, maxViolation, IKError);
+  }
+  fk.resetToRestPose();
+}
+
+// Replay a recorded take several times, each time from the rest pose, as when a recorded input is played back in a loop.
+// The take moves the handles to the targets and back; one doIK call per frame.
+// With the pose cache, every replay after the first one hits the cache.
+static void benchmarkPoseCache(FK & fk)
+{
+  const int numFrames = 60, numReplays = 4;
+  vector<Vec3d> takeTargets(numFrames * numIKJoints);
+  for(int frame = 0; frame < numFrames; frame++)
+  {
+    double t = sin(M_PI * frame / (numFrames - 1));
+    for(int i = 0; i < numIKJoints; i++)
+      takeTargets[frame * numIKJoints + i] = (1.0 - t) * fk.getJointGlobalPosition(IKJointIDs[i]) + t * targetHandlePositions[i];
+  }
+
+  printf("\nPose cache, %d replays of a %d-frame take:\n", numReplays, numFrames);
+  printf("%-10s %16s %16s %16s %16s\n", "cache", "per frame (us)", "hit rate", "memory (KB)", "max difference");
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+  PoseCache poseCache(numIKJoints, numJoints, 0, 16 << 20, 1e-5 * skeletonRadius);
+  vector<Vec3d> seedEulerAngles(numJoints), uncachedEulerAngles(numJoints);
+  double maxAngleDifference = 0.0;
+  for(int cached = 0; cached < 2; cached++)
+  {
+    PerformanceCounter cacheCounter;
+    for(int replay = 0; replay < numReplays; replay++)
+    {
+      fk.resetToRestPose();
+      Vec3d * angles = fk.getJointEulerAngles();
+      for(int frame = 0; frame < numFrames; frame++)
+      {
+        const Vec3d * targets = &takeTargets[frame * numIKJoints];
+        if (cached == 0)
+        {
+          ik.doIK(targets, angles);
+          continue;
+        }
+        if (poseCache.find(targets, angles, angles))
+          continue;
+        seedEulerAngles.assign(angles, angles + numJoints);
+        ik.doIK(targets, angles);
+        poseCache.insert(targets, seedEulerAngles.data(), angles);
+      }
+    }
+    cacheCounter.StopCounter();
+
+    if (cached == 0)
+      uncachedEulerAngles.assign(fk.getJointEulerAngles(), fk.getJointEulerAngles() + numJoints);
+    else
+      for(int i = 0; i < numJoints; i++)
+        maxAngleDifference = max(maxAngleDifference, len(fk.getJointEulerAngles()[i] - uncachedEulerAngles[i]));
+    printf("%-10s %16.3f %16.3f %16.1f %16.3g\n", cached ? "LRU" : "none", 1e6 * cacheCounter.GetElapsedTime() / (numReplays * numFrames),
+        poseCache.getHitRate(), poseCache.getMemoryUsage() / 1024.0, maxAngleDifference);
+  }
+  fk.resetToRestPose();
+}
+
+// Keyframe animation: record a clip of IK poses (the handles circle around their rest positions), save it, memory-map it,
+// and play it with many players at different phases. Compares the sampled keyframes with the recorded poses.
+static void benchmarkAnimationClip(FK & fk, WorkerPool & workerPool)
+{
+  const int numKeyframes = 128, numPlayers = 4096, numFrames = 100;
+  const double frameTime = 1.0 / 60;
+  const char * clipFilename = "IKBenchmark.clip";
+  vector<double> keyframeTimes(numKeyframes);
+  vector<Vec3d> keyframes(numKeyframes * numJoints);
+  vector<Vec3d> restHandlePositions(numIKJoints), circleTargets(numIKJoints);
+  for(int i = 0; i < numIKJoints; i++)
+    restHandlePositions[i] = fk.getJointGlobalPosition(IKJointIDs[i]);
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+  fk.resetToRestPose();
+  for(int k = 0; k < numKeyframes; k++)
+  {
+    double phase = 2.0 * M_PI * k / numKeyframes;
+    for(int i = 0; i < numIKJoints; i++)
+      circleTargets[i] = restHandlePositions[i] + 0.05 * skeletonRadius * Vec3d(cos(phase), sin(phase), 0.0);
+    for(int iter = 0; iter < 3; iter++)
+      ik.doIK(circleTargets.data(), fk.getJointEulerAngles());
+    keyframeTimes[k] = k * 0.1;
+    copy(fk.getJointEulerAngles(), fk.getJointEulerAngles() + numJoints, &keyframes[k * numJoints]);
+  }
+  fk.resetToRestPose();
+
+  if (AnimationClip::save(clipFilename, fk, numKeyframes, keyframeTimes.data(), keyframes.data()) != 0)
+  {
+    printf("Error: cannot save %s.\n", clipFilename);
+    exit(1);
+  }
+  AnimationClip clip(clipFilename);
+  if (clip.isLoaded() == false)
+    exit(1);
+
+  // accuracy: the largest difference between a recorded and a sampled joint rotation (Frobenius norm of the rotation matrices)
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions(numJoints);
+  for(int i = 0; i < numJoints; i++)
+    euler2RotationFunctions[i] = getEuler2RotationFunction<double>(fk.getJointRotateOrder(i));
+  AnimationClipPlayer checkPlayer(&clip);
+  checkPlayer.setLooping(false); // when looping, the end time wraps to the start time
+  vector<Vec3d> sampledPose(numJoints);
+  double maxRotationError = 0.0;
+  for(int k = 0; k < numKeyframes; k++)
+  {
+    checkPlayer.setTime(keyframeTimes[k]);
+    checkPlayer.samplePose(sampledPose.data());
+    for(int i = 0; i < numJoints; i++)
+    {
+      double R0[9], R1[9], error2 = 0.0;
+      euler2RotationFunctions[i](keyframes[k * numJoints + i].data(), R0);
+      euler2RotationFunctions[i](sampledPose[i].data(), R1);
+      for(int j = 0; j < 9; j++)
+        error2 += (R0[j] - R1[j]) * (R0[j] - R1[j]);
+      maxRotationError = max(maxRotationError, sqrt(error2));
+    }
+  }
+
+  printf("\nAnimation clip, %d keyframes (%.1f KB), %d players, %d frames, on %d threads; keyframe rotation error %.3g:\n",
+      numKeyframes, (double)clip.getNumBlocks() * clip.getKeyframesPerBlock() * numJoints * 8 / 1024, numPlayers, numFrames,
+      workerPool.getNumThreads(), maxRotationError);
+  printf("%-8s %16s %16s %16s\n", "interp", "batch (ms/frame)", "serial (ms/frame)", "blocks decoded");
+  vector<vector<Vec3d>> playerPoses(numPlayers, vector<Vec3d>(numJoints));
+  vector<Vec3d*> playerPosePtrs(numPlayers);
+  for(int p = 0; p < numPlayers; p++)
+    playerPosePtrs[p] = playerPoses[p].data();
+  const char * interpolationNames[2] = { "slerp", "nlerp" };
+  for(int interpolation = 0; interpolation < 2; interpolation++)
+  {
+    double times[2];
+    int numDecodedBlocks = 0;
+    for(int serial = 0; serial < 2; serial++)
+    {
+      vector<AnimationClipPlayer> players(numPlayers, AnimationClipPlayer(&clip, (AnimationClipPlayer::Interpolation)interpolation));
+      vector<AnimationClipPlayer*> playerPtrs(numPlayers);
+      for(int p = 0; p < numPlayers; p++)
+      {
+        players[p].setTime(clip.getEndTime() * p / numPlayers);
+        playerPtrs[p] = &players[p];
+      }
+      PerformanceCounter clipCounter;
+      for(int frame = 0; frame < numFrames; frame++)
+      {
+        AnimationClipPlayer::samplePoseBatch(numPlayers, playerPtrs.data(), playerPosePtrs.data(), serial ? nullptr : &workerPool);
+        for(int p = 0; p < numPlayers; p++)
+          players[p].advance(frameTime);
+      }
+      clipCounter.StopCounter();
+      times[serial] = 1e3 * clipCounter.GetElapsedTime() / numFrames;
+      numDecodedBlocks = 0;
+      for(int p = 0; p < numPlayers; p++)
+        numDecodedBlocks += players[p].getNumDecodedBlocks();
+    }
+    printf("%-8s %16.3f %16.3f %16d\n", interpolationNames[interpolation], times[0], times[1], numDecodedBlocks);
+  }
+  remove(clipFilename);
+}
+
+// Closest-vertex queries and ray casting (as for picking), by exhaustive search and with the vertex and triangle BVHs.
+static void benchmarkSpatialQueries()
+{
+  const int numQueries = 10000;
+  ObjMesh mesh(meshFilename);
+  Vec3d bmin, bmax;
+  mesh.getBoundingBox(1.0, &bmin, &bmax);
+  vector<Vec3d> queries(numQueries);
+  for(int q = 0; q < numQueries; q++)
+    for(int d = 0; d < 3; d++)
+      queries[q][d] = bmin[d] + (bmax[d] - bmin[d]) * rand() / RAND_MAX;
+
+  vector<unsigned int> closest(numQueries);
+  PerformanceCounter exhaustiveCounter;
+  for(int q = 0; q < numQueries; q++)
+    closest[q] = mesh.getClosestVertex(queries[q]);
+  exhaustiveCounter.StopCounter();
+
+  PerformanceCounter buildCounter;
+  mesh.buildVertexBVH();
+  buildCounter.StopCounter();
+  PerformanceCounter refitCounter;
+  mesh.refitVertexBVH();
+  refitCounter.StopCounter();
+  int numMismatches = 0;
+  PerformanceCounter BVHCounter;
+  for(int q = 0; q < numQueries; q++)
+  {
+    double distance;
+    unsigned int vertex = mesh.getClosestVertex(queries[q], &distance);
+    // ties may resolve to a different vertex at the same distance
+    numMismatches += (vertex != closest[q]) && (fabs(distance - len(mesh.getPosition(closest[q]) - queries[q])) > 0.0);
+  }
+  BVHCounter.StopCounter();
+  printf("\nClosest vertex, %d vertices, %d queries: exhaustive %.3f us/query, BVH %.3f us/query (build %.3f ms, refit %.3f ms), %d mismatches\n",
+      (int)mesh.getNumVertices(), numQueries, 1e6 * exhaustiveCounter.GetElapsedTime() / numQueries, 1e6 * BVHCounter.GetElapsedTime() / numQueries,
+      1e3 * buildCounter.GetElapsedTime(), 1e3 * refitCounter.GetElapsedTime(), numMismatches);
+
+  // Ray casting (as for picking): rays from random points on a sphere around the mesh towards random points inside its box.
+  const int numRays = 1000; // exhaustive ray casting is slow on large meshes
+  Vec3d center = 0.5 * (bmin + bmax);
+  double radius = len(bmax - bmin);
+  vector<Vec3d> rayOrigins(numRays), rayDirections(numRays);
+  for(int q = 0; q < numRays; q++)
+  {
+    Vec3d dir(0.0);
+    while ((len2(dir) < 1e-6) || (len2(dir) > 1.0))
+      dir = Vec3d(2.0 * rand() / RAND_MAX - 1.0, 2.0 * rand() / RAND_MAX - 1.0, 2.0 * rand() / RAND_MAX - 1.0);
+    rayOrigins[q] = center + radius * norm(dir);
+    rayDirections[q] = queries[q] - rayOrigins[q];
+  }
+  vector<Vec3d> hitPositions(numRays);
+  vector<bool> hits(numRays);
+  PerformanceCounter exhaustiveRayCounter;
+  for(int q = 0; q < numRays; q++)
+    hits[q] = mesh.intersectRay(rayOrigins[q], rayDirections[q], &hitPositions[q]);
+  exhaustiveRayCounter.StopCounter();
+
+  PerformanceCounter triangleBuildCounter;
+  mesh.buildTriangleBVH();
+  triangleBuildCounter.StopCounter();
+  PerformanceCounter triangleRefitCounter;
+  mesh.refitTriangleBVH();
+  triangleRefitCounter.StopCounter();
+  int numHits = 0;
+  numMismatches = 0;
+  PerformanceCounter BVHRayCounter;
+  for(int q = 0; q < numRays; q++)
+  {
+    Vec3d hitPosition;
+    bool hit = mesh.intersectRay(rayOrigins[q], rayDirections[q], &hitPosition);
+    numHits += hit;
+    numMismatches += (hit != hits[q]) || (hit && (len(hitPosition - hitPositions[q]) > 1e-9 * radius));
+  }
+  BVHRayCounter.StopCounter();
+  printf("Ray casting, %d faces, %d rays (%d hits): exhaustive %.3f us/ray, BVH %.3f us/ray (build %.3f ms, refit %.3f ms), %d mismatches\n",
+      mesh.getNumFaces(), numRays, numHits, 1e6 * exhaustiveRayCounter.GetElapsedTime() / numRays, 1e6 * BVHRayCounter.GetElapsedTime() / numRays,
+      1e3 * triangleBuildCounter.GetElapsedTime(), 1e3 * triangleRefitCounter.GetElapsedTime(), numMismatches);
+}
+
+// Mesh topology: loading, per-frame normals, and a traversal of all the faces (summing the face centroids),
+// through the ObjMesh Face objects and through the flat ObjMeshTopology arrays.
+static void benchmarkMeshTopology()
+{
+  const int numRepetitions = 20;
+  PerformanceCounter loadCounter;
+  ObjMesh mesh(meshFilename);
+  loadCounter.StopCounter();
+  PerformanceCounter normalsCounter;
+  for(int rep = 0; rep < numRepetitions; rep++)
+  {
+    mesh.buildFaceNormals();
+    mesh.buildVertexNormals(85.0);
+  }
+  normalsCounter.StopCounter();
+
+  PerformanceCounter topologyBuildCounter;
+  ObjMeshTopology topology(mesh);
+  topologyBuildCounter.StopCounter();
+
+  Vec3d faceSum(0.0);
+  PerformanceCounter faceCounter;
+  for(int rep = 0; rep < numRepetitions; rep++)
+    for(size_t i = 0; i < mesh.getNumGroups(); i++)
+    {
+      const ObjMesh::Group & group = mesh.getGroup(i);
+      for(size_t iFace = 0; iFace < group.getNumFaces(); iFace++)
+      {
+        const ObjMesh::Face & face = group.getFace(iFace);
+        Vec3d centroid(0.0);
+        for(size_t j = 0; j < face.getNumVertices(); j++)
+          centroid += mesh.getPosition(face.getVertexPositionIndex(j));
+        faceSum += centroid / face.getNumVertices();
+      }
+    }
+  faceCounter.StopCounter();
+
+  Vec3d viewSum(0.0);
+  PerformanceCounter viewCounter;
+  for(int rep = 0; rep < numRepetitions; rep++)
+    for(int iFace = 0; iFace < topology.getNumFaces(); iFace++)
+    {
+      ObjMeshTopology::FaceView face = topology.getFace(iFace);
+      Vec3d centroid(0.0);
+      for(int j = 0; j < face.getNumVertices(); j++)
+        centroid += mesh.getPosition(face.getVertexPositionIndex(j));
+      viewSum += centroid / face.getNumVertices();
+    }
+  viewCounter.StopCounter();
+
+  printf("\nMesh topology, %d faces (%s), %d repetitions: load %.1f ms, normals %.3f ms\n", topology.getNumFaces(),
+      topology.isTriangleMesh() ? "all triangles" : "polygons", numRepetitions, 1e3 * loadCounter.GetElapsedTime(),
+      1e3 * normalsCounter.GetElapsedTime() / numRepetitions);
+  printf("  faces: %.1f KB, traversal %.3f ms; flat topology: %.1f KB (build %.3f ms), traversal %.3f ms",
+      sizeof(ObjMesh::Face) * topology.getNumFaces() / 1024.0, 1e3 * faceCounter.GetElapsedTime() / numRepetitions,
+      topology.getMemoryUsage() / 1024.0, 1e3 * topologyBuildCounter.GetElapsedTime(), 1e3 * viewCounter.GetElapsedTime() / numRepetitions);
+  double difference = len(viewSum - faceSum);
+  if (topology.isTriangleMesh())
+  {
+    // triangle fast path: the corner array is the triangle index array
+    Vec3d triangleSum(0.0);
+    PerformanceCounter triangleCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+    {
+      const int * triangles = topology.getTriangles();
+      for(int iFace = 0; iFace < topology.getNumFaces(); iFace++)
+        triangleSum += (mesh.getPosition(triangles[3 * iFace + 0]) + mesh.getPosition(triangles[3 * iFace + 1]) +
+            mesh.getPosition(triangles[3 * iFace + 2])) / 3.0;
+    }
+    triangleCounter.StopCounter();
+    printf(", triangles %.3f ms", 1e3 * triangleCounter.GetElapsedTime() / numRepetitions);
+    difference = max(difference, len(triangleSum - faceSum));
+  }
+  printf("; difference %.3g\n", difference);
+}
+
+// Mesh order: skinning, normals and a render traversal (positions and normals of every face corner, as in immediate-mode rendering),
+// with the mesh as loaded and after reordering the faces for the vertex cache and renumbering the vertices in first-use order.
+// Rigs without skinning weights (e.g., dragon) get synthetic weights: the four closest joints, by inverse distance.
+static void benchmarkMeshOrder(FK & fk)
+{
+  const int numRepetitions = 10;
+  string weightsFilename = jointWeightsFilename;
+  const char * syntheticWeightsFilename = "IKBenchmark.weights";
+  ObjMesh meshes[2] = { ObjMesh(meshFilename), ObjMesh(meshFilename) };
+  int numVertices = meshes[0].getNumVertices();
+  fk.resetToRestPose();
+  if (!ifstream(weightsFilename.c_str()))
+  {
+    const int numInfluences = min(4, numJoints);
+    weightsFilename = syntheticWeightsFilename;
+    ofstream fout(weightsFilename.c_str());
+    fout << numVertices << " " << numJoints << endl;
+    vector<pair<double, int>> jointDistances(numJoints);
+    for(int v = 0; v < numVertices; v++)
+    {
+      for(int i = 0; i < numJoints; i++)
+        jointDistances[i] = make_pair(len(meshes[0].getPosition(v) - fk.getJointGlobalPosition(i)) + 1e-6 * skeletonRadius, i);
+      partial_sort(jointDistances.begin(), jointDistances.begin() + numInfluences, jointDistances.end());
+      double weightSum = 0.0;
+      for(int j = 0; j < numInfluences; j++)
+        weightSum += 1.0 / jointDistances[j].first;
+      for(int j = 0; j < numInfluences; j++)
+        fout << v << " " << jointDistances[j].second << " " << 1.0 / jointDistances[j].first / weightSum << endl;
+    }
+  }
+
+  double ACMR[2];
+  ACMR[0] = meshes[0].computeAverageCacheMissRatio();
+  PerformanceCounter reorderCounter;
+  vector<int> permutation;
+  meshes[1].reorderFacesForVertexCache();
+  meshes[1].computeFirstUseVertexOrder(permutation);
+  meshes[1].renumberVertices(permutation);
+  reorderCounter.StopCounter();
+  ACMR[1] = meshes[1].computeAverageCacheMissRatio();
+
+  setPose(fk);
+
+  double skinTime[2], normalsTime[2], renderTime[2];
+  vector<double> restPositions[2], skinnedPositions[2];
+  for(int m = 0; m < 2; m++)
+  {
+    restPositions[m] = getRestPositions(meshes[m]);
+    Skinning skinning(numVertices, restPositions[m].data(), weightsFilename);
+    if (m == 1)
+      skinning.renumberVertices(permutation);
+    skinnedPositions[m].resize(3 * numVertices);
+    PerformanceCounter skinCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      skinning.applySkinning(fk.getJointSkinTransforms(), skinnedPositions[m].data());
+    skinCounter.StopCounter();
+    skinTime[m] = skinCounter.GetElapsedTime() / numRepetitions;
+
+    for(int v = 0; v < numVertices; v++)
+      meshes[m].setPosition(v, Vec3d(&skinnedPositions[m][3 * v]));
+    PerformanceCounter normalsCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+    {
+      meshes[m].buildFaceNormals();
+      meshes[m].buildVertexNormals(85.0);
+    }
+    normalsCounter.StopCounter();
+    normalsTime[m] = normalsCounter.GetElapsedTime() / numRepetitions;
+
+    Vec3d renderSum(0.0);
+    PerformanceCounter renderCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      for(size_t i = 0; i < meshes[m].getNumGroups(); i++)
+      {
+        const ObjMesh::Group & group = meshes[m].getGroup(i);
+        for(size_t iFace = 0; iFace < group.getNumFaces(); iFace++)
+        {
+          const ObjMesh::Face & face = group.getFace(iFace);
+          for(size_t j = 0; j < face.getNumVertices(); j++)
+            renderSum += meshes[m].getPosition(face.getVertex(j)) + meshes[m].getNormal(face.getVertex(j));
+        }
+      }
+    renderCounter.StopCounter();
+    renderTime[m] = renderCounter.GetElapsedTime() / numRepetitions;
+  }
+  fk.resetToRestPose();
+  remove(syntheticWeightsFilename);
+
+  double maxDifference = 0.0;
+  for(int v = 0; v < numVertices; v++)
+    for(int d = 0; d < 3; d++)
+      maxDifference = max(maxDifference, fabs(skinnedPositions[1][3 * permutation[v] + d] - skinnedPositions[0][3 * v + d]));
+  printf("\nMesh order, %d vertices, %d faces%s (reordering %.1f ms), max skinning difference %.3g:\n", numVertices, meshes[0].getNumFaces(),
+      (weightsFilename == syntheticWeightsFilename) ? ", synthetic weights" : "", 1e3 * reorderCounter.GetElapsedTime(), maxDifference);
+  printf("%-12s %12s %16s %16s %16s\n", "order", "ACMR (32)", "skin (ms)", "normals (ms)", "render (ms)");
+  const char * orderNames[2] = { "as loaded", "reordered" };
+  for(int m = 0; m < 2; m++)
+    printf("%-12s %12.3f %16.3f %16.3f %16.3f\n", orderNames[m], ACMR[m], 1e3 * skinTime[m], 1e3 * normalsTime[m], 1e3 * renderTime[m]);
+}
+
+// Influence clusters: skinning with the joint transforms blended once per vertex (no clustering), once per set of identical
+// influences (exact), and once per set of influences with quantized weights. Errors are relative to no clustering.
+static void benchmarkInfluenceClusters(FK & fk)
+{
+  const int numRepetitions = 20;
+  ObjMesh mesh(meshFilename);
+  int numVertices = mesh.getNumVertices();
+  vector<double> restPositions = getRestPositions(mesh);
+  Skinning skinning(numVertices, restPositions.data(), jointWeightsFilename);
+  double meshRadius = mesh.getDiameter() / 2;
+  setPose(fk);
+
+  printf("\nInfluence clusters, %d vertices, %d repetitions:\n", numVertices, numRepetitions);
+  printf("%-14s %12s %20s %16s %16s\n", "weight quantum", "#clusters", "#clustered vertices", "skin (ms)", "max error / r");
+  const double weightQuanta[5] = { -1.0, 0.0, 1e-3, 1e-2, 5e-2 };
+  vector<double> referencePositions(3 * numVertices), skinnedPositions(3 * numVertices);
+  for(int q = 0; q < 5; q++)
+  {
+    skinning.setWeightQuantum(weightQuanta[q]);
+    PerformanceCounter skinCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      skinning.applySkinning(fk.getJointSkinTransforms(), skinnedPositions.data());
+    skinCounter.StopCounter();
+    if (q == 0)
+      referencePositions = skinnedPositions;
+    double maxError = 0.0;
+    for(int j = 0; j < 3 * numVertices; j++)
+      maxError = max(maxError, fabs(skinnedPositions[j] - referencePositions[j]));
+    char quantumName[32];
+    if (weightQuanta[q] < 0.0)
+      sprintf(quantumName, "none");
+    else
+      sprintf(quantumName, "%g", weightQuanta[q]);
+    printf("%-14s %12d %20d %16.3f %16.3g\n", quantumName, skinning.getNumClusters(), skinning.getNumClusteredVertices(),
+        1e3 * skinCounter.GetElapsedTime() / numRepetitions, maxError / meshRadius);
+  }
+  fk.resetToRestPose();
+}
+
+// Partial skinning: move one joint (the parent of each IK handle, e.g., a finger), and re-skin only the vertices that
+// the joint and its descendants influence, compared with skinning all the vertices. Then update the mesh (positions,
+// bounding volume hierarchies and normals) only around the dirty vertices, compared with updating all of it.
+static void benchmarkPartialSkinning(FK & fk)
+{
+  const int numRepetitions = 20;
+  const double normalAngle = 85.0; // the default of SceneObject::BuildNormals
+  ObjMesh partialMesh(meshFilename), fullMesh(meshFilename);
+  int numVertices = partialMesh.getNumVertices();
+  vector<double> restPositions = getRestPositions(partialMesh);
+  Skinning skinning(numVertices, restPositions.data(), jointWeightsFilename);
+  for(ObjMesh * mesh : { &partialMesh, &fullMesh })
+  {
+    mesh->buildVertexFaceNeighbors();
+    mesh->buildVertexBVH();
+    mesh->buildTriangleBVH();
+  }
+
+  // the mesh update of the driver: positions, bounding volume hierarchies, normals
+  auto updateMesh = [&](ObjMesh & mesh, const double * positions, const vector<int> * movedVertices)
+  {
+    if (movedVertices)
+    {
+      for(int i : *movedVertices)
+        mesh.setPosition(i, Vec3d(&positions[3 * i]));
+      mesh.refitVertexBVH(*movedVertices);
+      mesh.refitTriangleBVH(*movedVertices);
+      mesh.updateNormals(*movedVertices, normalAngle);
+    }
+    else
+    {
+      for(int i = 0; i < numVertices; i++)
+        mesh.setPosition(i, Vec3d(&positions[3 * i]));
+      mesh.refitVertexBVH();
+      mesh.refitTriangleBVH();
+      mesh.buildFaceNormals();
+      mesh.buildVertexNormals(normalAngle);
+    }
+  };
+
+  printf("\nPartial skinning, %d vertices, %d faces, one joint moved; mesh update: positions, BVHs and normals:\n", numVertices,
+      partialMesh.getNumFaces());
+  printf("%-8s %16s %16s %16s %16s %16s %16s %16s %12s\n", "joint", "#changed joints", "#dirty vertices", "#dirty faces",
+      "partial (ms)", "full (ms)", "mesh partial (ms)", "mesh full (ms)", "max error");
+  vector<double> previousPositions(3 * numVertices), partialPositions(3 * numVertices), fullPositions(3 * numVertices);
+  vector<char> changedJoints(numJoints);
+  vector<int> dirtyVertices, dirtyFaces;
+  for(int i = 0; i < numIKJoints; i++)
+  {
+    int jointID = max(fk.getJointParent(IKJointIDs[i]), 0);
+    fk.resetToRestPose();
+    skinning.applySkinning(fk.getJointSkinTransforms(), previousPositions.data());
+    updateMesh(partialMesh, previousPositions.data(), nullptr);
+    vector<Vec3d> previousEulerAngles(fk.getJointEulerAngles(), fk.getJointEulerAngles() + numJoints);
+    fk.jointEulerAngle(jointID) += Vec3d(10.0, -5.0, 15.0);
+    fk.computeJointTransforms();
+    int numChangedJoints = fk.getChangedJoints(previousEulerAngles.data(), changedJoints.data());
+
+    int numDirtyVertices = 0;
+    PerformanceCounter partialCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+    {
+      partialPositions = previousPositions;
+      numDirtyVertices = skinning.applySkinning(fk.getJointSkinTransforms(), changedJoints.data(), partialPositions.data(), &dirtyVertices);
+    }
+    partialCounter.StopCounter();
+    PerformanceCounter copyCounter; // the copy of the previous positions is not part of partial skinning
+    for(int rep = 0; rep < numRepetitions; rep++)
+      fullPositions = previousPositions;
+    copyCounter.StopCounter();
+    PerformanceCounter fullCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      skinning.applySkinning(fk.getJointSkinTransforms(), fullPositions.data());
+    fullCounter.StopCounter();
+
+    // repeating the update with the same positions gives the same result
+    PerformanceCounter partialMeshCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      updateMesh(partialMesh, partialPositions.data(), &dirtyVertices);
+    partialMeshCounter.StopCounter();
+    PerformanceCounter fullMeshCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      updateMesh(fullMesh, fullPositions.data(), nullptr);
+    fullMeshCounter.StopCounter();
+
+    // the error of the positions, and of the normals (if the hard edges changed, the normals were rebuilt, with the same count)
+    double maxError = 0.0;
+    for(int j = 0; j < 3 * numVertices; j++)
+      maxError = max(maxError, fabs(partialPositions[j] - fullPositions[j]));
+    if (partialMesh.getNumNormals() == fullMesh.getNumNormals())
+      for(size_t j = 0; j < partialMesh.getNumNormals(); j++)
+        maxError = max(maxError, len(partialMesh.getNormal(j) - fullMesh.getNormal(j)));
+    else
+      maxError = 1e300;
+    partialMesh.getFacesOfVertices(dirtyVertices, dirtyFaces);
+    printf("%-8d %16d %16d %16d %16.4f %16.4f %16.4f %16.4f %12.3g\n", jointID, numChangedJoints, numDirtyVertices, (int)dirtyFaces.size(),
+        1e3 * max(partialCounter.GetElapsedTime() - copyCounter.GetElapsedTime(), 0.0) / numRepetitions,
+        1e3 * fullCounter.GetElapsedTime() / numRepetitions, 1e3 * partialMeshCounter.GetElapsedTime() / numRepetitions,
+        1e3 * fullMeshCounter.GetElapsedTime() / numRepetitions, maxError);
+  }
+  fk.resetToRestPose();
+}
+
+// Bake skinned meshes to a vertex cache: IK and skinning for every frame, with the frames written by the background thread.
+// Then read the frames back in random order and compare them with the skinned positions.
+static void benchmarkVertexCache(FK & fk)
+{
+  const int numFrames = 60;
+  const char * cacheFilename = "IKBenchmark.vcache";
+  ObjMesh mesh(meshFilename);
+  int numVertices = mesh.getNumVertices();
+  vector<double> restPositions = getRestPositions(mesh);
+  Skinning skinning(numVertices, restPositions.data(), jointWeightsFilename);
+  double meshRadius = mesh.getDiameter() / 2;
+
+  // the skinned frames: the handles circle around their rest positions
+  vector<double> frames(3 * numVertices * numFrames);
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+  vector<Vec3d> circleTargets(numIKJoints);
+  fk.resetToRestPose();
+  for(int frame = 0; frame < numFrames; frame++)
+  {
+    double phase = 2.0 * M_PI * frame / numFrames;
+    for(int i = 0; i < numIKJoints; i++)
+      circleTargets[i] = fk.getJointGlobalPosition(IKJointIDs[i]) + 0.01 * skeletonRadius * Vec3d(cos(phase), sin(phase), 0.0);
+    ik.doIK(circleTargets.data(), fk.getJointEulerAngles());
+    fk.computeJointTransforms();
+    skinning.applySkinning(fk.getJointSkinTransforms(), &frames[3 * numVertices * frame]);
+  }
+  fk.resetToRestPose();
+
+  printf("\nVertex cache, %d frames of %d vertices (%.1f MB as doubles):\n", numFrames, numVertices, 24.0 * numVertices * numFrames / (1 << 20));
+  printf("%-12s %16s %16s %16s %16s %16s\n", "encoding", "write (ms/frame)", "stall (ms)", "file (MB)", "read (ms/frame)", "max error / r");
+  const char * encodingNames[NUM_VERTEX_CACHE_ENCODINGS] = { "float64", "float32", "quantized16", "delta16" };
+  vector<double> readPositions(3 * numVertices);
+  for(int encoding = 0; encoding < NUM_VERTEX_CACHE_ENCODINGS; encoding++)
+  {
+    PerformanceCounter writeCounter;
+    VertexCacheWriter writer(cacheFilename, numVertices, 30.0, (VertexCacheEncoding)encoding, restPositions.data());
+    for(int frame = 0; frame < numFrames; frame++)
+      writer.writeFrame(&frames[3 * numVertices * frame]);
+    double stallTime = writer.getStallTime();
+    if (writer.close() != 0)
+    {
+      printf("Error: cannot write %s.\n", cacheFilename);
+      exit(1);
+    }
+    writeCounter.StopCounter();
+
+    VertexCacheReader reader(cacheFilename);
+    if ((reader.isLoaded() == false) || (reader.getNumFrames() != numFrames))
+      exit(1);
+    PerformanceCounter readCounter;
+    for(int i = 0; i < numFrames; i++)
+      reader.readFrame((i * 37) % numFrames, readPositions.data()); // random access
+    readCounter.StopCounter();
+    double maxError = 0.0;
+    for(int frame = 0; frame < numFrames; frame++)
+    {
+      reader.readFrame(frame, readPositions.data());
+      for(int j = 0; j < 3 * numVertices; j++)
+        maxError = max(maxError, fabs(readPositions[j] - frames[3 * numVertices * frame + j]));
+    }
+    printf("%-12s %16.3f %16.3f %16.2f %16.3f %16.3g\n", encodingNames[encoding], 1e3 * writeCounter.GetElapsedTime() / numFrames,
+        1e3 * stallTime, (double)reader.getFileSize() / (1 << 20), 1e3 * readCounter.GetElapsedTime() / numFrames, maxError / meshRadius);
+  }
+  remove(cacheFilename);
+}
+
+// Simulation/render pipelining: every frame, one IK step (the handles circle around their rest positions), FK, skinning and
+// normals are simulated, and the frame is "rendered": a traversal of the face corners, then a wait with an idle CPU, as for the GPU.
+// Sequentially, or with the next frame simulated on a background thread (FramePipeline) during the rendering.
+// Latency: from the start of the simulation of a frame until the end of its rendering.
+static void benchmarkPipelining(FK & fk)
+{
+  const int numFrames = 100;
+  const double renderWaitTime = 2e-3;
+  ObjMesh meshes[3] = { ObjMesh(meshFilename), ObjMesh(meshFilename), ObjMesh(meshFilename) };
+  int numVertices = meshes[0].getNumVertices();
+  vector<double> restPositions = getRestPositions(meshes[0]), skinnedPositions(3 * numVertices);
+  for(int m = 0; m < 3; m++)
+    meshes[m].buildVertexNormals(85.0);
+  Skinning skinning(numVertices, restPositions.data(), jointWeightsFilename);
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+  fk.resetToRestPose();
+  vector<Vec3d> restHandlePositions(numIKJoints), circleTargets(numIKJoints);
+  for(int i = 0; i < numIKJoints; i++)
+    restHandlePositions[i] = fk.getJointGlobalPosition(IKJointIDs[i]);
+
+  int numSimulatedFrames = 0;
+  auto simulate = [&](int buffer)
+  {
+    double phase = 2.0 * M_PI * numSimulatedFrames++ / 60;
+    for(int i = 0; i < numIKJoints; i++)
+      circleTargets[i] = restHandlePositions[i] + 0.01 * skeletonRadius * Vec3d(cos(phase), sin(phase), 0.0);
+    ik.doIK(circleTargets.data(), fk.getJointEulerAngles());
+    fk.computeJointTransforms();
+    skinning.applySkinning(fk.getJointSkinTransforms(), skinnedPositions.data());
+    for(int v = 0; v < numVertices; v++)
+      meshes[buffer].setPosition(v, Vec3d(&skinnedPositions[3 * v]));
+    meshes[buffer].buildFaceNormals();
+    meshes[buffer].buildVertexNormals(85.0);
+  };
+  Vec3d renderSum(0.0);
+  auto render = [&](const ObjMesh & mesh)
+  {
+    for(size_t i = 0; i < mesh.getNumGroups(); i++)
+    {
+      const ObjMesh::Group & group = mesh.getGroup(i);
+      for(size_t iFace = 0; iFace < group.getNumFaces(); iFace++)
+      {
+        const ObjMesh::Face & face = group.getFace(iFace);
+        for(size_t j = 0; j < face.getNumVertices(); j++)
+          renderSum += mesh.getPosition(face.getVertex(j)) + mesh.getNormal(face.getVertex(j));
+      }
+    }
+    this_thread::sleep_for(chrono::microseconds((int)(1e6 * renderWaitTime)));
+  };
+
+  printf("\nPipelining, %d frames of %d vertices, render wait %.1f ms, %d hardware threads:\n", numFrames, numVertices,
+      1e3 * renderWaitTime, (int)thread::hardware_concurrency());
+  printf("%-12s %16s %16s %16s %16s\n", "mode", "frames/s", "simulate (ms)", "latency (ms)", "dropped");
+
+  // sequential: simulate, then render
+  double simulateTime = 0.0;
+  PerformanceCounter sequentialCounter;
+  for(int frame = 0; frame < numFrames; frame++)
+  {
+    PerformanceCounter simulateCounter;
+    simulate(0);
+    simulateCounter.StopCounter();
+    simulateTime += simulateCounter.GetElapsedTime();
+    render(meshes[0]);
+  }
+  sequentialCounter.StopCounter();
+  double sequentialTime = sequentialCounter.GetElapsedTime();
+  printf("%-12s %16.1f %16.3f %16.3f %16d\n", "sequential", numFrames / sequentialTime, 1e3 * simulateTime / numFrames,
+      1e3 * sequentialTime / numFrames, 0);
+
+  // pipelined: render frame N while frame N+1 is simulated
+  fk.resetToRestPose();
+  numSimulatedFrames = 0;
+  FramePipeline pipeline(simulate);
+  pipeline.start();
+  int numRenderedFrames = 0;
+  double renderTime = 0.0;
+  PerformanceCounter pipelineCounter;
+  while (numRenderedFrames < numFrames)
+  {
+    bool newFrame = false;
+    int buffer = pipeline.acquireFrame(&newFrame);
+    if (newFrame == false)
+    {
+      this_thread::yield();
+      continue;
+    }
+    PerformanceCounter renderCounter;
+    render(meshes[buffer]);
+    renderCounter.StopCounter();
+    renderTime += renderCounter.GetElapsedTime();
+    numRenderedFrames++;
+  }
+  pipelineCounter.StopCounter();
+  pipeline.stop();
+  FramePipeline::Statistics statistics = pipeline.getStatistics();
+  printf("%-12s %16.1f %16.3f %16.3f %16d\n", "pipelined", numFrames / pipelineCounter.GetElapsedTime(), 1e3 * statistics.averageStepTime,
+      1e3 * (statistics.averageLatency + renderTime / numFrames), statistics.numDroppedFrames);
+  fk.resetToRestPose();
+}
+
+// Fixed-rate IK: reach the IK targets during a quarter second of (simulated) time, with frame times of different machines,
+// running one IK step per frame, or IK steps at a fixed rate (FixedRateScheduler). The error is the total handle distance.
+// Then pace real frames to a frame rate limit (FramePacer).
+static void benchmarkFixedRateIK(FK & fk)
+{
+  const double duration = 0.25, IKStepRate = 60.0;
+  const int maxIKStepsPerFrame = 4;
+  const char * machineNames[4] = { "fast (2 ms)", "slow (33 ms)", "jittery", "hitch" };
+  printf("\nFixed-rate IK, %g s, %g steps/s, at most %d steps per frame:\n", duration, IKStepRate, maxIKStepsPerFrame);
+  printf("%-14s %8s %16s %16s %16s %16s\n", "frame times", "frames", "per-frame error", "fixed-rate steps", "fixed-rate error",
+      "dropped steps");
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+  for(int machine = 0; machine < 4; machine++)
+  {
+    vector<double> frameTimes;
+    srand(machine);
+    for(double time = 0.0; time < duration; time += frameTimes.back())
+    {
+      double frameTime = 0.016;
+      if (machine == 0)
+        frameTime = 0.002;
+      else if (machine == 1)
+        frameTime = 0.033;
+      else if (machine == 2)
+        frameTime = 0.005 + 0.045 * rand() / RAND_MAX;
+      else if (frameTimes.size() == 4)
+        frameTime = 0.1; // a pause
+      frameTimes.push_back(frameTime);
+    }
+    int numFrames = frameTimes.size();
+
+    fk.resetToRestPose();
+    for(int frame = 0; frame < numFrames; frame++)
+      ik.doIK(targetHandlePositions.data(), fk.getJointEulerAngles());
+    double perFrameError = computeIKError(fk, targetHandlePositions.data());
+
+    fk.resetToRestPose();
+    FixedRateScheduler scheduler(IKStepRate, maxIKStepsPerFrame, duration);
+    int numSteps = 0;
+    for(int frame = 0; frame < numFrames; frame++)
+    {
+      int numFrameSteps = scheduler.advance(frameTimes[frame]);
+      for(int step = 0; step < numFrameSteps; step++)
+        ik.doIK(targetHandlePositions.data(), fk.getJointEulerAngles());
+      numSteps += numFrameSteps;
+    }
+    double fixedRateError = computeIKError(fk, targetHandlePositions.data());
+    printf("%-14s %8d %16.6f %16d %16.6f %16d\n", machineNames[machine], numFrames, perFrameError, numSteps, fixedRateError,
+        scheduler.getStatistics().numDroppedSteps);
+  }
+  fk.resetToRestPose();
+
+  const double frameRateLimit = 120.0;
+  FramePacer pacer(frameRateLimit, 0.25);
+  for(int frame = 0; frame < 0.5 * frameRateLimit; frame++)
+    pacer.paceFrame();
+  printf("Frame pacing at %g frames/s: %.1f frames/s, %.0f%% of the time sleeping\n", frameRateLimit, pacer.getFrameRate(),
+      100.0 * pacer.getSleepFraction());
+}
+
+// A crowd: many characters of the rig, each with its own handle targets (circling around the rest positions, at
+// different phases), updated every frame with IK -> FK -> skinning -> normals per character, on a work-stealing
+// task graph executor with all the hardware threads, and with one thread. The results must be the same.
+static void benchmarkCrowd(FK & fk)
+{
+  const int numCrowdCharacters = 256, numFrames = 5;
+  ObjMesh mesh(meshFilename);
+  int numVertices = mesh.getNumVertices();
+  vector<double> restPositions = getRestPositions(mesh);
+  // the assets shared by all the characters
+  shared_ptr<const Skinning> skinning = make_shared<Skinning>(numVertices, restPositions.data(), jointWeightsFilename);
+  shared_ptr<const ObjMeshTopology> topology = make_shared<ObjMeshTopology>(mesh);
+  fk.resetToRestPose();
+  IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, IK::ANALYTIC);
+
+  TaskGraphExecutor parallelExecutor, serialExecutor(1);
+  TaskGraphExecutor * executors[2] = { &parallelExecutor, &serialExecutor };
+  vector<double> finalPositions[2];
+  printf("\nCrowd, %d characters of %d vertices, %d frames:\n", numCrowdCharacters, numVertices, numFrames);
+  printf("%-8s %12s %12s %12s %12s %14s %14s %14s %12s\n", "threads", "IK (ms)", "FK (ms)", "skin (ms)", "normals (ms)",
+      "frame (ms)", "characters/s", "max char (ms)", "stolen");
+  for(int e = 0; e < 2; e++)
+  {
+    CharacterScene scene(fk.getSkeleton(), &ik, numIKJoints, IKJointIDs.data(), skinning, topology);
+    for(int c = 0; c < numCrowdCharacters; c++)
+      scene.addCharacter();
+    double stageTimes[CharacterScene::NUM_STAGES] = { 0.0 };
+    double frameTime = 0.0, maxCharacterTime = 0.0;
+    int numStolenTasks = 0;
+    for(int frame = 0; frame < numFrames; frame++)
+    {
+      for(int c = 0; c < numCrowdCharacters; c++)
+      {
+        double phase = 2.0 * M_PI * (frame / 30.0 + (double)c / numCrowdCharacters);
+        for(int i = 0; i < numIKJoints; i++)
+          scene.getCharacterIKTargets(c)[i] = fk.getJointGlobalPosition(IKJointIDs[i]) +
+            0.02 * skeletonRadius * Vec3d(cos(phase), sin(phase), 0.0);
+      }
+      scene.update(*executors[e]);
+      for(int stage = 0; stage < CharacterScene::NUM_STAGES; stage++)
+        stageTimes[stage] += scene.getTotalStageTime((CharacterScene::Stage)stage);
+      frameTime += scene.getUpdateTime();
+      for(int c = 0; c < numCrowdCharacters; c++)
+        maxCharacterTime = max(maxCharacterTime, scene.getCharacterTime(c));
+      numStolenTasks += scene.getNumStolenTasks();
+    }
+    for(int c = 0; c < numCrowdCharacters; c++)
+      finalPositions[e].insert(finalPositions[e].end(), scene.getCharacterPositions(c), scene.getCharacterPositions(c) + 3 * numVertices);
+    printf("%-8d %12.3f %12.3f %12.3f %12.3f %14.3f %14.1f %14.3f %12d\n", executors[e]->getNumThreads(),
+        1e3 * stageTimes[0] / numFrames, 1e3 * stageTimes[1] / numFrames, 1e3 * stageTimes[2] / numFrames, 1e3 * stageTimes[3] / numFrames,
+        1e3 * frameTime / numFrames, numCrowdCharacters * numFrames / frameTime, 1e3 * maxCharacterTime, numStolenTasks / numFrames);
+  }
+  double maxDifference = 0.0;
+  for(size_t i = 0; i < finalPositions[0].size(); i++)
+    maxDifference = max(maxDifference, fabs(finalPositions[0][i] - finalPositions[1][i]));
+  printf("Stage times are summed over the characters; max difference between the thread counts: %.3g\n", maxDifference);
+
+  // memory per additional character: only its pose and output buffers, as the assets are shared
+  CharacterScene scene(fk.getSkeleton(), &ik, numIKJoints, IKJointIDs.data(), skinning, topology);
+  scene.addCharacter();
+  double characterMemory = scene.getCharacterMemoryUsage(0) / 1024.0, sharedMemory = scene.getSharedMemoryUsage() / 1024.0;
+  printf("Memory: %.1f KB per character, %.1f KB of shared assets (skeleton %.1f KB, skinning %.1f KB, faces %.1f KB); "
+      "%.1f KB per character without sharing\n", characterMemory, sharedMemory, fk.getSkeleton()->getMemoryUsage() / 1024.0,
+      skinning->getMemoryUsage() / 1024.0, topology->getMemoryUsage() / 1024.0, characterMemory + sharedMemory);
+}
+
+// Centers of rotation: the precomputation, serial and on the worker pool, and loaded from its cache file; then the skinning methods
+// on a bent pose (every joint rotated by up to 30 degrees): the time per frame, and how the mesh deforms around the joints.
+// A vertex influenced by several joints bends around the nearest of them, so a rigid bend would keep its distance to that joint:
+// the ratio of the posed to the rest distance is below 1 where the mesh collapses, and above 1 where it bulges.
+static void benchmarkCentersOfRotation(FK & fk, WorkerPool & workerPool)
+{
+  const int numRepetitions = 100;
+  const char * cacheFilename = "centersOfRotation.tmp";
+  ObjMesh mesh(meshFilename);
+  int numVertices = mesh.getNumVertices();
+  vector<double> restPositions = getRestPositions(mesh);
+  vector<int> triangles;
+  int numTriangles = ObjMeshTopology(mesh).getFanTriangles(triangles);
+  Skinning skinning(numVertices, restPositions.data(), jointWeightsFilename);
+
+  PerformanceCounter serialCounter;
+  skinning.computeCentersOfRotation(numTriangles, triangles.data());
+  serialCounter.StopCounter();
+  vector<double> serialCenters(3 * numVertices);
+  for(int v = 0; v < numVertices; v++)
+    for(int d = 0; d < 3; d++)
+      serialCenters[3 * v + d] = skinning.getCenterOfRotation(v)[d];
+  remove(cacheFilename);
+  PerformanceCounter parallelCounter;
+  skinning.computeCentersOfRotation(numTriangles, triangles.data(), &workerPool, cacheFilename);
+  parallelCounter.StopCounter();
+  PerformanceCounter cacheCounter;
+  bool loaded = false;
+  skinning.computeCentersOfRotation(numTriangles, triangles.data(), &workerPool, cacheFilename, &loaded);
+  cacheCounter.StopCounter();
+  remove(cacheFilename);
+  double maxDifference = 0.0;
+  for(int v = 0; v < numVertices; v++)
+    for(int d = 0; d < 3; d++)
+      maxDifference = max(maxDifference, fabs(skinning.getCenterOfRotation(v)[d] - serialCenters[3 * v + d]));
+  printf("\nCenters of rotation, %d vertices (%d with a center), %d triangles: serial %.1f ms, %d threads %.1f ms, "
+      "from the cache %.3f ms%s, max difference %.3g\n", numVertices, skinning.getNumCentersOfRotation(), numTriangles,
+      1e3 * serialCounter.GetElapsedTime(), workerPool.getNumThreads(), 1e3 * parallelCounter.GetElapsedTime(),
+      1e3 * cacheCounter.GetElapsedTime(), loaded ? "" : " (not loaded)", maxDifference);
+
+  FK restFK(fk.getSkeleton()), poseFK(fk.getSkeleton());
+  restFK.computeJointTransforms();
+  for(int i = 0; i < numJoints; i++)
+    poseFK.jointEulerAngle(i) += 30.0 * Vec3d(sin(i), cos(2 * i), sin(3 * i));
+  poseFK.computeJointTransforms();
+
+  // the joint each vertex bends around: the nearest (in the rest pose) of the joints that influence it, or -1 if only one joint does
+  vector<int> vertexJoints(numVertices, -1);
+  {
+    vector<vector<int>> influences(numVertices);
+    ifstream weightsIn(jointWeightsFilename.c_str());
+    int numRows = 0, numColumns = 0, row = 0, column = 0;
+    double weight = 0.0;
+    weightsIn >> numRows >> numColumns;
+    while (weightsIn >> row >> column >> weight)
+      if ((row >= 0) && (row < numVertices) && (weight > 0.0))
+        influences[row].push_back(column);
+    for(int v = 0; v < numVertices; v++)
+    {
+      if (influences[v].size() < 2)
+        continue;
+      double minDistance = DBL_MAX;
+      for(int jointID : influences[v])
+      {
+        double distance = len(Vec3d(&restPositions[3 * v]) - restFK.getJointGlobalPosition(jointID));
+        if (distance < minDistance)
+        {
+          minDistance = distance;
+          vertexJoints[v] = jointID;
+        }
+      }
+    }
+  }
+  // the mean and the extremes, over the vertices near a joint, of the posed / rest distance to the joint
+  auto measureJointDistances = [&](const double * positions, double & mean, double & minimum, double & maximum)
+  {
+    int numBlendedVertices = 0;
+    mean = 0.0;
+    minimum = DBL_MAX;
+    maximum = 0.0;
+    for(int v = 0; v < numVertices; v++)
+    {
+      int jointID = vertexJoints[v];
+      if (jointID < 0)
+        continue;
+      double restDistance = len(Vec3d(&restPositions[3 * v]) - restFK.getJointGlobalPosition(jointID));
+      if (restDistance == 0.0)
+        continue;
+      double ratio = len(Vec3d(&positions[3 * v]) - poseFK.getJointGlobalPosition(jointID)) / restDistance;
+      mean += ratio;
+      minimum = min(minimum, ratio);
+      maximum = max(maximum, ratio);
+      numBlendedVertices++;
+    }
+    mean /= max(numBlendedVertices, 1);
+  };
+
+  printf("%-18s %16s %24s %24s %24s\n", "method", "skin (ms)", "joint distance (mean)", "joint distance (min)", "joint distance (max)");
+  vector<double> skinnedPositions(3 * numVertices);
+  for(int method = 0; method < Skinning::NUM_METHODS; method++)
+  {
+    skinning.setMethod((Skinning::Method)method);
+    PerformanceCounter skinCounter;
+    for(int rep = 0; rep < numRepetitions; rep++)
+      skinning.applySkinning(poseFK.getJointSkinTransforms(), skinnedPositions.data());
+    skinCounter.StopCounter();
+    double mean = 0.0, minimum = 0.0, maximum = 0.0;
+    measureJointDistances(skinnedPositions.data(), mean, minimum, maximum);
+    printf("%-18s %16.3f %24.4f %24.4f %24.4f\n", Skinning::getMethodName((Skinning::Method)method),
+        1e3 * skinCounter.GetElapsedTime() / numRepetitions, mean, minimum, maximum);
+  }
+}
+
+// Solve many independent characters (sharing the rig) in parallel; one IK step per character.
+static void benchmarkIKBatch(FK & fk, WorkerPool & workerPool)
+{
+  const int numCharacters = 256;
+  printf("\n%d characters, one IK step each, on %d threads:\n", numCharacters, workerPool.getNumThreads());
+  printf("%-14s %16s %16s\n", "backend", "batch (ms)", "serial (ms)");
+  vector<vector<Vec3d>> characterEulerAngles(numCharacters);
+  vector<Vec3d*> characterEulerAnglePtrs(numCharacters);
+  vector<const Vec3d*> characterTargetPtrs(numCharacters, targetHandlePositions.data());
+  for(int b = 0; b < 3; b++)
+  {
+    IK ik(numIKJoints, IKJointIDs.data(), &fk, -1, backends[b]);
+    vector<IK*> IKs(numCharacters, &ik);
+    double times[2];
+    for(int serial = 0; serial < 2; serial++)
+    {
+      for(int c = 0; c < numCharacters; c++)
+      {
+        characterEulerAngles[c].assign(fk.getJointEulerAngles(), fk.getJointEulerAngles() + numJoints);
+        characterEulerAnglePtrs[c] = characterEulerAngles[c].data();
+      }
+      PerformanceCounter batchCounter;
+      if (serial)
+      {
+        for(int c = 0; c < numCharacters; c++)
+          ik.doIK(characterTargetPtrs[c], characterEulerAnglePtrs[c]);
+      }
+      else
+        IK::doIKBatch(numCharacters, IKs.data(), characterTargetPtrs.data(), characterEulerAnglePtrs.data(), &workerPool);
+      batchCounter.StopCounter();
+      times[serial] = 1e3 * batchCounter.GetElapsedTime();
+    }
+    printf("%-14s %16.3f %16.3f\n", backendNames[b], times[0], times[1]);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    cout << "Benchmarks the IK Jacobian backends on a rig." << endl;
+    cout << "Usage: " << argv[0] << " configFilename [numIterations]" << endl;
+    return 0;
+  }
+  initConfigurations(argv[1]);
+  int numIterations = (argc >= 3) ? atoi(argv[2]) : 1000;
+
+  FK fk(jointHierarchyFilename, jointRestTransformsFilename, jointLimitsFilename);
+  initRig(fk);
+  WorkerPool workerPool;
+
+  benchmarkJacobianBackends(fk, numIterations);
+  benchmarkIKMethods(fk);
+  benchmarkOrientedHandles(fk);
+  benchmarkDecompositions(fk);
+  benchmarkJointLimits(fk);
+  benchmarkPoseCache(fk);
+  benchmarkAnimationClip(fk, workerPool);
+  benchmarkSpatialQueries();
+  benchmarkMeshTopology();
+  benchmarkMeshOrder(fk);
+  if (hasSkinningWeights())
+  {
+    benchmarkInfluenceClusters(fk);
+    benchmarkPartialSkinning(fk);
+    benchmarkVertexCache(fk);
+    benchmarkPipelining(fk);
+  }
+  benchmarkFixedRateIK(fk);
+  if (hasSkinningWeights())
+  {
+    benchmarkCrowd(fk);
+    benchmarkCentersOfRotation(fk, workerPool);
+  }
+  benchmarkIKBatch(fk, workerPool);
+
+  return 0;
+}
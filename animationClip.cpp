@@ -0,0 +1,347 @@
+#include "animationClip.h"
+#include "workerPool.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#if defined(_WIN32) || defined(WIN32)
+  #ifndef _USE_MATH_DEFINES
+    #define _USE_MATH_DEFINES
+  #endif
+#endif
+#include <math.h>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+namespace
+{
+
+const char clipMagic[8] = { 'I', 'K', 'C', 'L', 'I', 'P', 0, 0 };
+const uint32_t clipVersion = 1;
+const size_t clipAlignment = 64;
+const double quaternionScale = 32767.0;
+static_assert(sizeof(AnimationClip::Header) == 64, "the clip header must be 64 bytes");
+
+size_t alignUp(size_t offset) { return (offset + clipAlignment - 1) / clipAlignment * clipAlignment; }
+
+// the unit quaternion (w, x, y, z) of the row-major rotation matrix R (Shepperd's method)
+void rotationToQuaternion(const double R[9], double q[4])
+{
+  double trace = R[0] + R[4] + R[8];
+  if (trace > 0.0)
+  {
+    double s = 2.0 * sqrt(1.0 + trace);
+    q[0] = 0.25 * s;
+    q[1] = (R[7] - R[5]) / s;
+    q[2] = (R[2] - R[6]) / s;
+    q[3] = (R[3] - R[1]) / s;
+  }
+  else if ((R[0] > R[4]) && (R[0] > R[8]))
+  {
+    double s = 2.0 * sqrt(1.0 + R[0] - R[4] - R[8]);
+    q[0] = (R[7] - R[5]) / s;
+    q[1] = 0.25 * s;
+    q[2] = (R[1] + R[3]) / s;
+    q[3] = (R[2] + R[6]) / s;
+  }
+  else if (R[4] > R[8])
+  {
+    double s = 2.0 * sqrt(1.0 + R[4] - R[0] - R[8]);
+    q[0] = (R[2] - R[6]) / s;
+    q[1] = (R[1] + R[3]) / s;
+    q[2] = 0.25 * s;
+    q[3] = (R[5] + R[7]) / s;
+  }
+  else
+  {
+    double s = 2.0 * sqrt(1.0 + R[8] - R[0] - R[4]);
+    q[0] = (R[3] - R[1]) / s;
+    q[1] = (R[2] + R[6]) / s;
+    q[2] = (R[5] + R[7]) / s;
+    q[3] = 0.25 * s;
+  }
+}
+
+// the row-major rotation matrix of the unit quaternion q = (w, x, y, z)
+void quaternionToRotation(const double q[4], double R[9])
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+  R[0] = 1.0 - 2.0 * (y * y + z * z); R[1] = 2.0 * (x * y - w * z);       R[2] = 2.0 * (x * z + w * y);
+  R[3] = 2.0 * (x * y + w * z);       R[4] = 1.0 - 2.0 * (x * x + z * z); R[5] = 2.0 * (y * z - w * x);
+  R[6] = 2.0 * (x * z - w * y);       R[7] = 2.0 * (y * z + w * x);       R[8] = 1.0 - 2.0 * (x * x + y * y);
+}
+
+// interpolates between unit quaternions q0 and q1 along the shorter arc; alpha in [0, 1]
+void interpolateQuaternions(AnimationClipPlayer::Interpolation interpolation, const double q0[4], const double q1[4], double alpha, double q[4])
+{
+  double d = q0[0] * q1[0] + q0[1] * q1[1] + q0[2] * q1[2] + q0[3] * q1[3];
+  double sign = (d < 0.0) ? -1.0 : 1.0;
+  d *= sign;
+
+  double w0 = 1.0 - alpha, w1 = alpha;
+  // nearly equal rotations: slerp degenerates to nlerp
+  if ((interpolation == AnimationClipPlayer::SLERP) && (d < 0.9995))
+  {
+    double theta = acos(d);
+    double invSinTheta = 1.0 / sin(theta);
+    w0 = sin(w0 * theta) * invSinTheta;
+    w1 = sin(w1 * theta) * invSinTheta;
+  }
+  w1 *= sign;
+  double norm2 = 0.0;
+  for(int i = 0; i < 4; i++)
+  {
+    q[i] = w0 * q0[i] + w1 * q1[i];
+    norm2 += q[i] * q[i];
+  }
+  double invNorm = 1.0 / sqrt(norm2);
+  for(int i = 0; i < 4; i++)
+    q[i] *= invNorm;
+}
+
+}
+
+AnimationClip::AnimationClip(const std::string & filename) : file(filename)
+{
+  if (file.isOpen() == false)
+  {
+    printf("Error: cannot open animation clip %s.\n", filename.c_str());
+    return;
+  }
+
+  const char * data = file.getData();
+  size_t dataSize = file.getSize();
+  const Header * h = (const Header *)data;
+  bool valid = (dataSize >= sizeof(Header));
+  size_t timesEnd = valid ? h->timesOffset + sizeof(double) * (size_t)h->numKeyframes : 0;
+  size_t rotateOrdersEnd = valid ? h->rotateOrdersOffset + sizeof(int32_t) * (size_t)h->numJoints : 0;
+  valid = valid && (memcmp(h->magic, clipMagic, sizeof(clipMagic)) == 0) && (h->version == clipVersion) &&
+    (h->numJoints > 0) && (h->numKeyframes > 0) && (h->keyframesPerBlock > 0) && (h->fileSize == dataSize) &&
+    (rotateOrdersEnd <= dataSize) && (timesEnd <= dataSize) && (h->timesOffset % sizeof(double) == 0) &&
+    (h->blockSize >= 4 * sizeof(int16_t) * (size_t)h->numJoints * h->keyframesPerBlock) &&
+    (h->blocksOffset + h->blockSize * ((h->numKeyframes + h->keyframesPerBlock - 1) / h->keyframesPerBlock) <= dataSize);
+  if (!valid)
+  {
+    printf("Error: %s is not a valid animation clip.\n", filename.c_str());
+    return;
+  }
+
+  const int32_t * orders = (const int32_t *)(data + h->rotateOrdersOffset);
+  for(uint32_t i = 0; i < h->numJoints; i++)
+    if ((orders[i] < XYZ) || (orders[i] > ZYX))
+    {
+      printf("Error: %s has an invalid rotate order.\n", filename.c_str());
+      return;
+    }
+
+  header = h;
+  rotateOrders = orders;
+  times = (const double *)(data + header->timesOffset);
+}
+
+int AnimationClip::save(const std::string & filename, const FK & fk, int numKeyframes, const double * keyframeTimes, const Vec3d * eulerAngles,
+    int keyframesPerBlock)
+{
+  int numJoints = fk.getNumJoints();
+  if ((numKeyframes <= 0) || (keyframesPerBlock <= 0))
+    return 1;
+  for(int k = 1; k < numKeyframes; k++)
+    if (keyframeTimes[k] <= keyframeTimes[k - 1])
+      return 1;
+
+  Header h;
+  memset(&h, 0, sizeof(Header));
+  memcpy(h.magic, clipMagic, sizeof(clipMagic));
+  h.version = clipVersion;
+  h.numJoints = numJoints;
+  h.numKeyframes = numKeyframes;
+  h.keyframesPerBlock = keyframesPerBlock;
+  int numBlocks = (numKeyframes + keyframesPerBlock - 1) / keyframesPerBlock;
+  h.rotateOrdersOffset = alignUp(sizeof(Header));
+  h.timesOffset = alignUp(h.rotateOrdersOffset + sizeof(int32_t) * numJoints);
+  h.blocksOffset = alignUp(h.timesOffset + sizeof(double) * numKeyframes);
+  h.blockSize = alignUp(4 * sizeof(int16_t) * numJoints * keyframesPerBlock);
+  h.fileSize = h.blocksOffset + h.blockSize * numBlocks;
+
+  vector<char> contents(h.fileSize, 0);
+  memcpy(contents.data(), &h, sizeof(Header));
+  int32_t * orders = (int32_t *)(contents.data() + h.rotateOrdersOffset);
+  vector<Euler2RotationFunction<double>> euler2RotationFunctions(numJoints);
+  for(int i = 0; i < numJoints; i++)
+  {
+    orders[i] = fk.getJointRotateOrder(i);
+    euler2RotationFunctions[i] = getEuler2RotationFunction<double>(fk.getJointRotateOrder(i));
+  }
+  memcpy(contents.data() + h.timesOffset, keyframeTimes, sizeof(double) * numKeyframes);
+
+  // Quaternions q and -q are the same rotation. Keep each joint's quaternions in one hemisphere from keyframe to keyframe,
+  // so that neighboring keyframes are close to each other also component-wise.
+  vector<double> previousQuaternions(4 * numJoints, 0.0);
+  for(int k = 0; k < numKeyframes; k++)
+  {
+    int16_t * stored = (int16_t *)(contents.data() + h.blocksOffset + h.blockSize * (k / keyframesPerBlock)) +
+      4 * numJoints * (k % keyframesPerBlock);
+    for(int i = 0; i < numJoints; i++)
+    {
+      double R[9], q[4];
+      euler2RotationFunctions[i](eulerAngles[k * numJoints + i].data(), R);
+      rotationToQuaternion(R, q);
+      double * previous = &previousQuaternions[4 * i];
+      if (q[0] * previous[0] + q[1] * previous[1] + q[2] * previous[2] + q[3] * previous[3] < 0.0)
+        for(int j = 0; j < 4; j++)
+          q[j] = -q[j];
+      for(int j = 0; j < 4; j++)
+      {
+        previous[j] = q[j];
+        stored[4 * i + j] = (int16_t)lround(quaternionScale * q[j]);
+      }
+    }
+  }
+
+  ofstream fout(filename.c_str(), ios::binary);
+  if (!fout)
+    return 1;
+  fout.write(contents.data(), contents.size());
+  return fout.good() ? 0 : 1;
+}
+
+void AnimationClip::decodeBlock(int block, double * quaternions) const
+{
+  int numJoints = header->numJoints;
+  int numKeyframesInBlock = min((int)header->keyframesPerBlock, (int)header->numKeyframes - block * (int)header->keyframesPerBlock);
+  const int16_t * stored = (const int16_t *)(file.getData() + header->blocksOffset + header->blockSize * block);
+  for(int q = 0; q < numKeyframesInBlock * numJoints; q++)
+  {
+    double norm2 = 0.0;
+    for(int j = 0; j < 4; j++)
+    {
+      quaternions[4 * q + j] = stored[4 * q + j];
+      norm2 += quaternions[4 * q + j] * quaternions[4 * q + j];
+    }
+    double invNorm = 1.0 / sqrt(norm2);
+    for(int j = 0; j < 4; j++)
+      quaternions[4 * q + j] *= invNorm;
+  }
+}
+
+void AnimationClip::prefetchBlock(int block) const
+{
+  if ((block >= 0) && (block < getNumBlocks()))
+    file.prefetch(header->blocksOffset + header->blockSize * block, header->blockSize);
+}
+
+AnimationClipPlayer::AnimationClipPlayer(const AnimationClip * clip_, Interpolation interpolation_) :
+  clip(clip_), interpolation(interpolation_)
+{
+  for(int slot = 0; slot < numSlots; slot++)
+    slotQuaternions[slot].resize(4 * clip->getNumJoints() * clip->getKeyframesPerBlock());
+  time = clip->getStartTime();
+}
+
+void AnimationClipPlayer::setTime(double newTime)
+{
+  double start = clip->getStartTime(), duration = clip->getEndTime() - start;
+  if (looping && (duration > 0.0))
+  {
+    newTime = fmod(newTime - start, duration);
+    if (newTime < 0.0)
+      newTime += duration;
+    newTime += start;
+  }
+  else
+    newTime = min(max(newTime, start), start + duration);
+  time = newTime;
+}
+
+int AnimationClipPlayer::decodeBlock(int block, int keepBlock)
+{
+  for(int slot = 0; slot < numSlots; slot++)
+    if (slotBlocks[slot] == block)
+      return slot;
+
+  int slot = (slotBlocks[0] == keepBlock) ? 1 : 0;
+  clip->decodeBlock(block, slotQuaternions[slot].data());
+  slotBlocks[slot] = block;
+  numDecodedBlocks++;
+  return slot;
+}
+
+const double * AnimationClipPlayer::getKeyframe(int keyframe, int keepBlock)
+{
+  int keyframesPerBlock = clip->getKeyframesPerBlock();
+  int slot = decodeBlock(keyframe / keyframesPerBlock, keepBlock);
+  return &slotQuaternions[slot][4 * clip->getNumJoints() * (keyframe % keyframesPerBlock)];
+}
+
+void AnimationClipPlayer::samplePose(Vec3d * eulerAngles)
+{
+  int numKeyframes = clip->getNumKeyframes();
+  int numJoints = clip->getNumJoints();
+  int keyframesPerBlock = clip->getKeyframesPerBlock();
+  const double * times = clip->getKeyframeTimes();
+
+  // find keyframe k with times[k] <= time < times[k+1]; when playing, it is the previous keyframe or the one after it
+  int k = min(keyframeHint, numKeyframes - 1);
+  if (times[k] > time)
+    k = 0;
+  if ((k + 1 < numKeyframes) && (times[k + 1] <= time))
+  {
+    k++;
+    if ((k + 1 < numKeyframes) && (times[k + 1] <= time))
+      k = max((int)(upper_bound(times, times + numKeyframes, time) - times) - 1, 0);
+  }
+  keyframeHint = k;
+  int k1 = min(k + 1, numKeyframes - 1);
+  double alpha = (k1 > k) ? (time - times[k]) / (times[k1] - times[k]) : 0.0;
+
+  int block0 = k / keyframesPerBlock, block1 = k1 / keyframesPerBlock;
+  const double * q0 = getKeyframe(k, block1);
+  const double * q1 = getKeyframe(k1, block0);
+  for(int i = 0; i < numJoints; i++)
+  {
+    double q[4], R[9];
+    interpolateQuaternions(interpolation, &q0[4 * i], &q1[4 * i], alpha, q);
+    quaternionToRotation(q, R);
+    rotation2Euler(clip->getJointRotateOrder(i), R, eulerAngles[i].data());
+  }
+
+  // decode the next block ahead of the playhead, and ask for the block after it to be read from the file
+  if (block0 == block1)
+  {
+    int numBlocks = clip->getNumBlocks();
+    int nextBlock = block0 + 1;
+    if (nextBlock >= numBlocks)
+      nextBlock = looping ? 0 : -1;
+    if ((nextBlock >= 0) && (nextBlock != block0))
+    {
+      int numDecoded = numDecodedBlocks;
+      decodeBlock(nextBlock, block0);
+      if (numDecodedBlocks > numDecoded)
+        clip->prefetchBlock((nextBlock + 1) % numBlocks);
+    }
+  }
+}
+
+void AnimationClipPlayer::samplePoseBatch(int numPlayers, AnimationClipPlayer * const * players, Vec3d * const * eulerAngles,
+    WorkerPool * workerPool)
+{
+  if (workerPool == nullptr)
+  {
+    for(int i = 0; i < numPlayers; i++)
+      players[i]->samplePose(eulerAngles[i]);
+    return;
+  }
+  // sample in chunks, so that the per-task overhead is small compared to one sample
+  const int chunkSize = 16;
+  int numChunks = (numPlayers + chunkSize - 1) / chunkSize;
+  workerPool->parallelFor(numChunks, [&](int chunk)
+  {
+    int end = min(numPlayers, (chunk + 1) * chunkSize);
+    for(int i = chunk * chunkSize; i < end; i++)
+      players[i]->samplePose(eulerAngles[i]);
+  });
+}
+
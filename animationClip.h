@@ -0,0 +1,131 @@
+#ifndef ANIMATIONCLIP_H
+#define ANIMATIONCLIP_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "FK.h"
+#include "mappedFile.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class WorkerPool;
+
+// A keyframed joint animation, stored in a binary file that is memory-mapped and read in place.
+// Each keyframe stores the rotation of every joint (the rotation given by FK::jointEulerAngle, without the joint orient)
+// as a unit quaternion, quantized to four 16-bit integers.
+// The keyframes are grouped into blocks of "keyframesPerBlock" consecutive keyframes;
+// a player decodes one block at a time (see AnimationClipPlayer).
+//
+// File layout (native endianness; every section starts at a multiple of 64 bytes):
+//   Header (64 bytes)
+//   joint rotate orders: int32 [numJoints]
+//   keyframe times, in seconds: double [numKeyframes], strictly increasing
+//   keyframe blocks: ceil(numKeyframes / keyframesPerBlock) blocks of "blockSize" bytes;
+//     block b holds keyframes b * keyframesPerBlock, ..., one after another, each numJoints quaternions (w, x, y, z) of 4 int16,
+//     where a component q is stored as round(32767 * q)
+class AnimationClip
+{
+public:
+  // Memory-maps the clip file. Check isLoaded() for success.
+  explicit AnimationClip(const std::string & filename);
+
+  // Writes a clip file. times: numKeyframes increasing times (seconds);
+  // eulerAngles: numKeyframes * numJoints Euler angles (in degrees), keyframe after keyframe, in the rotate orders of "fk".
+  // Returns 0 on success.
+  static int save(const std::string & filename, const FK & fk, int numKeyframes, const double * times, const Vec3d * eulerAngles,
+      int keyframesPerBlock = 16);
+
+  bool isLoaded() const { return header != nullptr; }
+  int getNumJoints() const { return header->numJoints; }
+  int getNumKeyframes() const { return header->numKeyframes; }
+  int getKeyframesPerBlock() const { return header->keyframesPerBlock; }
+  int getNumBlocks() const { return (header->numKeyframes + header->keyframesPerBlock - 1) / header->keyframesPerBlock; }
+  RotateOrder getJointRotateOrder(int jointID) const { return (RotateOrder)rotateOrders[jointID]; }
+  const double * getKeyframeTimes() const { return times; }
+  double getStartTime() const { return times[0]; }
+  double getEndTime() const { return times[header->numKeyframes - 1]; }
+
+  // Decodes the quaternions of block "block" into "quaternions" (4 * numJoints * keyframesPerBlock doubles, (w, x, y, z), normalized).
+  void decodeBlock(int block, double * quaternions) const;
+  // Asks the operating system to read the block's pages from the file ahead of time (does nothing if unsupported).
+  void prefetchBlock(int block) const;
+
+  struct Header
+  {
+    char magic[8]; // "IKCLIP\0\0"
+    uint32_t version;
+    uint32_t numJoints;
+    uint32_t numKeyframes;
+    uint32_t keyframesPerBlock;
+    uint64_t rotateOrdersOffset; // byte offsets from the start of the file
+    uint64_t timesOffset;
+    uint64_t blocksOffset;
+    uint64_t blockSize; // in bytes
+    uint64_t fileSize;
+  };
+
+protected:
+  MappedFile file;
+  const Header * header = nullptr;
+  const int32_t * rotateOrders = nullptr;
+  const double * times = nullptr;
+};
+
+// Samples the poses of an AnimationClip at a playhead.
+// Joint rotations are interpolated between the two keyframes around the playhead, as quaternions (slerp or nlerp),
+// and converted back to Euler angles in each joint's RotateOrder.
+// When the playhead enters a block of keyframes, the player decodes the next block ahead of the playhead
+// (and asks the operating system to read the one after it), so that playing forward decodes each block once.
+// A player owns two decoded blocks, allocated in the constructor; sampling does not allocate memory.
+// Many players can share one clip, and different players can be sampled concurrently.
+class AnimationClipPlayer
+{
+public:
+  enum Interpolation
+  {
+    SLERP = 0,
+    NLERP
+  };
+
+  AnimationClipPlayer(const AnimationClip * clip, Interpolation interpolation = SLERP);
+
+  void setInterpolation(Interpolation interpolation) { this->interpolation = interpolation; }
+  Interpolation getInterpolation() const { return interpolation; }
+  // when looping, the playhead wraps from the end time back to the start time
+  void setLooping(bool looping) { this->looping = looping; }
+  bool isLooping() const { return looping; }
+
+  void setTime(double time);
+  double getTime() const { return time; }
+  void advance(double timeStep) { setTime(time + timeStep); }
+
+  // Writes the pose at the playhead into eulerAngles (length: clip->getNumJoints()), e.g., FK::getJointEulerAngles().
+  void samplePose(Vec3d * eulerAngles);
+
+  // Samples the poses of many players, in parallel if a workerPool is given.
+  static void samplePoseBatch(int numPlayers, AnimationClipPlayer * const * players, Vec3d * const * eulerAngles,
+      WorkerPool * workerPool = nullptr);
+
+  int getNumDecodedBlocks() const { return numDecodedBlocks; } // statistics: how many blocks this player has decoded
+
+protected:
+  // returns the decoded quaternions of keyframe "keyframe"; decodes its block if needed, without evicting block "keepBlock"
+  const double * getKeyframe(int keyframe, int keepBlock);
+  int decodeBlock(int block, int keepBlock); // returns the slot
+
+  const AnimationClip * clip;
+  Interpolation interpolation;
+  bool looping = true;
+  double time = 0.0;
+  int keyframeHint = 0; // the keyframe at or before the playhead at the last sample
+
+  static const int numSlots = 2;
+  int slotBlocks[numSlots] = { -1, -1 };
+  std::vector<double> slotQuaternions[numSlots];
+  int numDecodedBlocks = 0;
+};
+
+#endif
+
@@ -0,0 +1,157 @@
+#include "characterScene.h"
+#include "objMeshTopology.h"
+#include "performanceCounter.h"
+#include <algorithm>
+#include <cassert>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+const char * CharacterScene::getStageName(Stage stage)
+{
+  const char * names[NUM_STAGES] = { "IK", "FK", "skinning", "normals" };
+  return names[stage];
+}
+
+CharacterScene::CharacterScene(shared_ptr<const FKSkeleton> skeleton_, IK * ik_, int numIKJoints, const int * IKJointIDs_,
+    shared_ptr<const Skinning> skinning_, shared_ptr<const ObjMeshTopology> topology_) : skeleton(move(skeleton_)), ik(ik_),
+    skinning(move(skinning_)), topology(move(topology_)), IKJointIDs(IKJointIDs_, IKJointIDs_ + numIKJoints),
+    numVertices(skinning->getNumMeshVertices())
+{
+}
+
+int CharacterScene::addCharacter()
+{
+  characters.emplace_back(new Character(skeleton));
+  Character & character = *characters.back();
+  for(int jointID : IKJointIDs)
+    character.IKTargets.push_back(character.fk.getJointGlobalPosition(jointID));
+  character.positions.resize(3 * numVertices);
+  character.normals.resize(3 * numVertices);
+  skinning->applySkinning(character.fk.getJointSkinTransforms(), character.positions.data());
+  computeNormals(character);
+  taskGraphIsValid = false;
+  return (int)characters.size() - 1;
+}
+
+void CharacterScene::computeNormals(Character & character) const
+{
+  const double * positions = character.positions.data();
+  double * normals = character.normals.data();
+  fill(character.normals.begin(), character.normals.end(), 0.0);
+  // the fan triangles of the faces, as in ObjMeshTopology::getFanTriangles
+  const int * positionIndices = topology->getPositionIndices();
+  for(int face = 0; face < topology->getNumFaces(); face++)
+  {
+    const int * corners = &positionIndices[topology->getFaceOffset(face)];
+    int numFaceVertices = topology->getFaceNumVertices(face);
+    for(int k = 2; k < numFaceVertices; k++)
+    {
+      int triangle[3] = { corners[0], corners[k - 1], corners[k] };
+      Vec3d p0(&positions[3 * triangle[0]]), p1(&positions[3 * triangle[1]]), p2(&positions[3 * triangle[2]]);
+      Vec3d normal = cross(p1 - p0, p2 - p0); // its length is twice the triangle area
+      for(int j = 0; j < 3; j++)
+        for(int d = 0; d < 3; d++)
+          normals[3 * triangle[j] + d] += normal[d];
+    }
+  }
+  for(int v = 0; v < numVertices; v++)
+  {
+    double length = sqrt(normals[3 * v + 0] * normals[3 * v + 0] + normals[3 * v + 1] * normals[3 * v + 1] + normals[3 * v + 2] * normals[3 * v + 2]);
+    if (length > 0.0)
+      for(int d = 0; d < 3; d++)
+        normals[3 * v + d] /= length;
+  }
+}
+
+void CharacterScene::runStage(int characterIndex, Stage stage)
+{
+  Character & character = *characters[characterIndex];
+  switch(stage)
+  {
+    case IK_STAGE:
+      for(int step = 0; step < numIKSteps; step++)
+        ik->doIK(character.IKTargets.data(), character.fk.getJointEulerAngles());
+    break;
+
+    case FK_STAGE:
+      character.fk.computeJointTransforms();
+    break;
+
+    case SKINNING_STAGE:
+      skinning->applySkinning(character.fk.getJointSkinTransforms(), character.positions.data());
+    break;
+
+    case NORMALS_STAGE:
+      computeNormals(character);
+    break;
+
+    default:
+    break;
+  }
+}
+
+void CharacterScene::buildTaskGraph()
+{
+  taskGraph.clear();
+  for(int c = 0; c < getNumCharacters(); c++)
+    for(int stage = 0; stage < NUM_STAGES; stage++)
+    {
+      int task = taskGraph.addTask([this, c, stage]() { runStage(c, (Stage)stage); });
+      if (stage > 0)
+        taskGraph.addDependency(task - 1, task);
+    }
+  taskGraphIsValid = true;
+}
+
+void CharacterScene::update(TaskGraphExecutor & executor)
+{
+  assert(ik->getMethod() != IK::LEVENBERG_MARQUARDT);
+  if (taskGraphIsValid == false)
+    buildTaskGraph();
+  PerformanceCounter updateCounter;
+  executor.run(taskGraph);
+  updateCounter.StopCounter();
+  updateTime = updateCounter.GetElapsedTime();
+  numStolenTasks = executor.getNumStolenTasks();
+}
+
+double CharacterScene::getStageTime(int character, Stage stage) const
+{
+  int task = NUM_STAGES * character + stage;
+  return taskGraph.getTaskFinishTime(task) - taskGraph.getTaskStartTime(task);
+}
+
+double CharacterScene::getCharacterTime(int character) const
+{
+  double time = 0.0;
+  for(int stage = 0; stage < NUM_STAGES; stage++)
+    time += getStageTime(character, (Stage)stage);
+  return time;
+}
+
+double CharacterScene::getTotalStageTime(Stage stage) const
+{
+  double time = 0.0;
+  for(int c = 0; c < getNumCharacters(); c++)
+    time += getStageTime(c, stage);
+  return time;
+}
+
+double CharacterScene::getCharacterLatency(int character) const
+{
+  return taskGraph.getTaskFinishTime(NUM_STAGES * character + NORMALS_STAGE);
+}
+
+size_t CharacterScene::getCharacterMemoryUsage(int characterIndex) const
+{
+  const Character & character = *characters[characterIndex];
+  return sizeof(Character) + character.fk.getPoseMemoryUsage() + character.IKTargets.capacity() * sizeof(Vec3d) +
+    (character.positions.capacity() + character.normals.capacity()) * sizeof(double);
+}
+
+size_t CharacterScene::getSharedMemoryUsage() const
+{
+  return skeleton->getMemoryUsage() + skinning->getMemoryUsage() + topology->getMemoryUsage();
+}
@@ -0,0 +1,99 @@
+#ifndef CHARACTERSCENE_H
+#define CHARACTERSCENE_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "FK.h"
+#include "IK.h"
+#include "skinning.h"
+#include "taskGraph.h"
+#include <vector>
+#include <memory>
+
+class ObjMeshTopology;
+
+// Many characters of one rig: they share the IK solver and the immutable assets of the rig (the skeleton, the skinning
+// weights and the mesh faces), and each has its own pose (an FK), IK handle targets, and skinned vertex positions and normals.
+// update() runs, for every character, the chain of stages IK -> FK -> skinning -> normals, as tasks of a TaskGraph
+// on a TaskGraphExecutor; the chains of different characters are independent, so they run in parallel.
+// FK follows IK, as skinning needs the joint transforms of the solved pose.
+class CharacterScene
+{
+public:
+  enum Stage
+  {
+    IK_STAGE = 0, // IK steps towards the character's handle targets
+    FK_STAGE, // joint transforms of the new pose
+    SKINNING_STAGE,
+    NORMALS_STAGE, // area-weighted vertex normals of the fan triangles of the faces
+    NUM_STAGES
+  };
+  static const char * getStageName(Stage stage);
+
+  // skeleton: the rig (e.g., fk.getSkeleton()); every character starts in its rest pose.
+  // ik: for the handles numIKJoints, IKJointIDs (as in the IK constructor); it is used by all the characters, concurrently,
+  // so its method must not keep state between doIK calls (i.e., not LEVENBERG_MARQUARDT), and the FORWARD_DUAL and
+  // ANALYTIC backends scale best. ik must outlive the scene.
+  // skinning, topology: the skinning weights and the faces of the mesh (e.g., std::make_shared<ObjMeshTopology>(mesh)).
+  CharacterScene(std::shared_ptr<const FKSkeleton> skeleton, IK * ik, int numIKJoints, const int * IKJointIDs,
+      std::shared_ptr<const Skinning> skinning, std::shared_ptr<const ObjMeshTopology> topology);
+
+  // Adds a character in the rest pose, with the IK targets at the rest positions of its handles. Returns its index.
+  int addCharacter();
+  int getNumCharacters() const { return (int)characters.size(); }
+
+  FK & getCharacterFK(int character) { return characters[character]->fk; }
+  Vec3d * getCharacterIKTargets(int character) { return characters[character]->IKTargets.data(); }
+  const double * getCharacterPositions(int character) const { return characters[character]->positions.data(); } // 3 * numVertices
+  const double * getCharacterNormals(int character) const { return characters[character]->normals.data(); } // 3 * numVertices
+  int getNumVertices() const { return numVertices; }
+
+  // IK steps per update for every character (default: 1)
+  void setNumIKSteps(int numIKSteps) { this->numIKSteps = numIKSteps; }
+
+  // Updates all the characters; returns after all the stages of all the characters have finished.
+  void update(TaskGraphExecutor & executor);
+
+  // Timings of the last update, in seconds.
+  double getStageTime(int character, Stage stage) const; // the time of one stage of one character
+  double getCharacterTime(int character) const; // all the stages of one character
+  double getTotalStageTime(Stage stage) const; // one stage, over all the characters
+  double getCharacterLatency(int character) const; // from the start of the update until the character is finished
+  double getUpdateTime() const { return updateTime; } // wall-clock time of the update
+  int getNumStolenTasks() const { return numStolenTasks; }
+
+  // memory, in bytes: of one character (its pose, targets, positions and normals), and of the assets shared by all the characters
+  size_t getCharacterMemoryUsage(int character) const;
+  size_t getSharedMemoryUsage() const;
+
+protected:
+  struct Character
+  {
+    explicit Character(const std::shared_ptr<const FKSkeleton> & skeleton) : fk(skeleton) {}
+    FK fk;
+    std::vector<Vec3d> IKTargets;
+    std::vector<double> positions, normals;
+  };
+
+  void buildTaskGraph();
+  void runStage(int character, Stage stage);
+  void computeNormals(Character & character) const;
+
+  std::shared_ptr<const FKSkeleton> skeleton;
+  IK * ik;
+  std::shared_ptr<const Skinning> skinning;
+  std::shared_ptr<const ObjMeshTopology> topology;
+  std::vector<int> IKJointIDs;
+  int numVertices;
+  int numIKSteps = 1;
+
+  std::vector<std::unique_ptr<Character>> characters;
+  TaskGraph taskGraph; // task NUM_STAGES * c + stage is stage "stage" of character c
+  bool taskGraphIsValid = false;
+  double updateTime = 0.0;
+  int numStolenTasks = 0;
+};
+
+#endif
+
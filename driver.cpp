@@ -9,6 +9,7 @@
 #include "openGL-headers.h"
 #include "camera.h"
 #include "objMesh.h"
+#include "objMeshTopology.h"
 #include "performanceCounter.h"
 #include "averagingBuffer.h"
 #include "inputDevice.h"
@@ -20,11 +21,19 @@
 #include "IK.h"
 #include "handleControl.h"
 #include "skeletonRenderer.h"
+#include "poseCache.h"
+#include "animationClip.h"
+#include "vertexCache.h"
+#include "framePipeline.h"
+#include "fixedRateScheduler.h"
+#include "workerPool.h"
 #ifdef WIN32
   #include <windows.h>
 #endif
 #include <vector>
 #include <set>
+#include <mutex>
+#include <algorithm>
 #include <stdlib.h>
 #include <stdio.h>
 #include <climits>
@@ -42,6 +51,11 @@ static string screenshotBaseName;
 static string jointHierarchyFilename;
 static string jointWeightsFilename;
 static string jointRestTransformsFilename;
+static string jointLimitsFilename;
+static bool optimizeMeshOrder = false;
+static double skinningWeightQuantum = 0.0;
+static string skinningMethod = Skinning::getMethodName(Skinning::DUAL_QUATERNION);
+static string centersOfRotationCacheFilename;
 
 static bool fullScreen = 0;
 static bool showAxes = false;
@@ -59,6 +73,7 @@ static FK * fk = nullptr;
 static IK * ik = nullptr;
 static Skinning * skinning = nullptr;
 static SkeletonRenderer * skeletonRenderer = nullptr;
+static PoseCache * poseCache = nullptr;
 
 static bool renderSkeleton = true;
 static int curJointID = -1;
@@ -67,6 +82,9 @@ static SphericalCamera * camera = nullptr;
 static int windowWidth = 800, windowHeight = 600;
 static double zNear = 0.001, zFar = 1000;
 static int selectedVertex = -1;
+// the view of the last rendered frame, for ray-cast picking
+static GLdouble pickModelview[16], pickProjection[16];
+static GLint pickViewport[4] = { 0, 0, 1, 1 };
 
 static int windowID = 0;
 static int graphicsFrameID = 0;
@@ -83,32 +101,238 @@ static int titleBarFrameCounter = 0;
 static AveragingBuffer fpsBuffer(5);
 
 static vector<int> IKJointIDs;
+static string IKMethod = IK::getMethodName(IK::DAMPED_LEAST_SQUARES);
 static vector<Vec3d> IKJointPos;
 
+// IK steps at a fixed rate (IKStepRate per second; 0, the default: one step per frame), at most maxIKStepsPerFrame per frame,
+// and frames limited to frameRateLimit per second (0: no limit)
+static double IKStepRate = 0.0;
+static int maxIKStepsPerFrame = 4;
+static double frameRateLimit = 0.0;
+static FixedRateScheduler * IKScheduler = nullptr;
+static FixedRateScheduler::Statistics IKStatistics; // of the shown frame
+static FramePacer framePacer;
+
+// pose cache; a memory budget of 0 (default) disables it
+static int poseCacheMegabytes = 0;
+static double poseCachePositionQuantum = 0.0; // 0: 1e-5 times the model radius
+static double poseCacheAngleQuantum = 1e-4; // degrees
+static bool poseCacheSkinnedVertices = true;
+static vector<Vec3d> skinnedVertexPositions;
+static vector<Vec3d> skinnedEulerAngles; // the joint angles that skinnedVertexPositions were skinned with
+static vector<char> changedJoints;
+static vector<int> dirtyVertices; // the vertices re-skinned by the last partial skinning
+static vector<Vec3d> seedEulerAngles;
+
+// keyframe animation playback ('p') and recording ('k')
+static string animationClipFilename;
+static string animationRecordFilename = "recording.clip";
+static AnimationClip * animationClip = nullptr;
+static AnimationClipPlayer * animationClipPlayer = nullptr;
+static bool playAnimation = false;
+static vector<double> recordedKeyframeTimes;
+static vector<Vec3d> recordedKeyframes;
+
+// baking of the skinned mesh positions ('b' starts and stops), resampled at vertexCacheFrameRate
+static string vertexCacheFilename = "skinned.vcache";
+static string vertexCacheEncoding = "float32"; // float64, float32, quantized16 or delta16
+static double vertexCacheFrameRate = 30.0;
+static VertexCacheWriter * vertexCacheWriter = nullptr;
+static double shownFrameTime = 0.0; // simulation time of the shown frame, in seconds
+static double vertexCacheStartTime = 0.0; // shownFrameTime when baking started
+
+// Simulation (IK, FK, skinning, normals) on a background thread, one frame ahead of rendering.
+// Without it, the simulation writes "mesh" and "fk" directly. With it, the simulation writes the three frames of the
+// pipeline in turn, with its own FK, and "mesh", "meshDeformable" and "fk" show the frame being rendered.
+static bool pipelineSimulation = false;
+static FramePipeline * framePipeline = nullptr;
+struct SimulationFrame
+{
+  ObjMesh * mesh = nullptr;
+  SceneObjectDeformable * meshDeformable = nullptr;
+  vector<Vec3d> eulerAngles; // the pose of the frame
+  vector<Vec3d> skinnedVertexPositions;
+  FixedRateScheduler::Statistics IKStatistics;
+  double time = 0.0; // simulation time of the frame, in seconds
+};
+static SimulationFrame simulationFrames[3];
+static ObjMesh * simulationMesh = nullptr;
+static SceneObjectDeformable * simulationMeshDeformable = nullptr;
+static FK * simulationFK = nullptr;
+static PerformanceCounter simulationCounter;
+static double simulationTime = 0.0;
+static vector<Vec3d> simulationIKJointPos; // the handle targets of the current step
+// the input of the simulation thread, written by the render thread under "simulationInputMutex"
+static mutex simulationInputMutex;
+static vector<Vec3d> simulationInputIKJointPos;
+static bool simulationInputPlayAnimation = false;
+static bool simulationInputResetToRest = false;
+
 //======================= Functions =============================
 
+// copies the skinned positions of movedVertices (by default, all the vertices) to the simulated mesh,
+// and updates its bounding volume hierarchies (for picking) and normals around them
+static void setSkinnedMeshPositions(const vector<int> * movedVertices = nullptr)
+{
+  // a pipeline frame holds an older pose than the previous step, so it needs all the vertices
+  if ((movedVertices == nullptr) || framePipeline)
+  {
+    for(int i = 0; i < (int)simulationMesh->getNumVertices(); i++)
+      simulationMesh->setPosition(i, skinnedVertexPositions[i]);
+    simulationMesh->refitVertexBVH();
+    simulationMesh->refitTriangleBVH();
+    simulationMeshDeformable->BuildNormals();
+    return;
+  }
+
+  if (movedVertices->size() == 0)
+    return;
+  for(int i : *movedVertices)
+    simulationMesh->setPosition(i, skinnedVertexPositions[i]);
+  simulationMesh->refitVertexBVH(*movedVertices);
+  simulationMesh->refitTriangleBVH(*movedVertices);
+  simulationMeshDeformable->UpdateNormals(*movedVertices);
+}
+
 static void updateSkinnedMesh()
 {
-  vector<Vec3d> newPos(meshDeformable->GetNumVertices());
-  double * newPosv = (double*)newPos.data();
+  skinnedVertexPositions.resize(simulationMesh->getNumVertices());
+  double * newPosv = (double*)skinnedVertexPositions.data();
+
+  simulationFK->computeJointTransforms();
+
+  // re-skin only the vertices influenced by the joints that moved since the last skinned pose
+  Vec3d * eulerAngles = simulationFK->getJointEulerAngles();
+  bool partial = ((int)skinnedEulerAngles.size() == simulationFK->getNumJoints());
+  if (partial)
+  {
+    changedJoints.resize(simulationFK->getNumJoints());
+    simulationFK->getChangedJoints(skinnedEulerAngles.data(), changedJoints.data());
+    skinning->applySkinning(simulationFK->getJointSkinTransforms(), changedJoints.data(), newPosv, &dirtyVertices);
+  }
+  else
+    skinning->applySkinning(simulationFK->getJointSkinTransforms(), newPosv);
+  skinnedEulerAngles.assign(eulerAngles, eulerAngles + simulationFK->getNumJoints());
+  setSkinnedMeshPositions(partial ? &dirtyVertices : nullptr);
+}
+
+// the number of IK steps to run in this frame
+static int getNumIKSteps()
+{
+  return IKScheduler ? IKScheduler->beginFrame() : 1;
+}
+
+// Runs numIKSteps IK steps towards the handle targets and skins the mesh; does nothing if numIKSteps is 0.
+// If the pose cache has the result of the last step for these targets and the pose before it, the step (and, if cached, skinning) is skipped.
+static void updatePose(const Vec3d * handleTargets, int numIKSteps = 1)
+{
+  if (numIKSteps <= 0)
+    return;
+  Vec3d * eulerAngles = simulationFK->getJointEulerAngles();
+  for(int step = 0; step < numIKSteps - 1; step++)
+    ik->doIK(handleTargets, eulerAngles);
+  if (poseCache == nullptr)
+  {
+    ik->doIK(handleTargets, eulerAngles);
+    updateSkinnedMesh();
+    return;
+  }
+
+  bool hasSkinnedVertices = false;
+  if (poseCache->find(handleTargets, eulerAngles, eulerAngles, (double*)skinnedVertexPositions.data(), &hasSkinnedVertices))
+  {
+    if (hasSkinnedVertices)
+    {
+      simulationFK->computeJointTransforms(); // for the skeleton renderer
+      skinnedEulerAngles.assign(eulerAngles, eulerAngles + simulationFK->getNumJoints());
+      setSkinnedMeshPositions();
+    }
+    else
+      updateSkinnedMesh();
+    return;
+  }
+
+  seedEulerAngles.assign(eulerAngles, eulerAngles + simulationFK->getNumJoints());
+  ik->doIK(handleTargets, eulerAngles);
+  updateSkinnedMesh();
+  poseCache->insert(handleTargets, seedEulerAngles.data(), eulerAngles,
+      poseCacheSkinnedVertices ? (const double*)skinnedVertexPositions.data() : nullptr);
+}
+
+// Render thread: hands the handle targets and the playback state to the simulation thread.
+static void publishSimulationInput(bool resetToRest = false)
+{
+  lock_guard<mutex> lock(simulationInputMutex);
+  simulationInputIKJointPos = IKJointPos;
+  simulationInputPlayAnimation = playAnimation;
+  if (resetToRest)
+    simulationInputResetToRest = true;
+}
 
-  fk->computeJointTransforms();
+// Simulation thread: simulates the next frame into pipeline buffer "buffer".
+static void simulateFrame(int buffer)
+{
+  bool playing = false, resetToRest = false;
+  {
+    lock_guard<mutex> lock(simulationInputMutex);
+    simulationIKJointPos = simulationInputIKJointPos;
+    playing = simulationInputPlayAnimation;
+    resetToRest = simulationInputResetToRest;
+    simulationInputResetToRest = false;
+  }
+  simulationCounter.StopCounter();
+  double dt = simulationCounter.GetElapsedTime();
+  simulationCounter.StartCounter();
+  simulationTime += dt;
+
+  SimulationFrame & frame = simulationFrames[buffer];
+  simulationMesh = frame.mesh;
+  simulationMeshDeformable = frame.meshDeformable;
+  if (resetToRest)
+    simulationFK->resetToRestPose();
+  if (playing)
+  {
+    animationClipPlayer->advance(dt);
+    animationClipPlayer->samplePose(simulationFK->getJointEulerAngles());
+    updateSkinnedMesh();
+  }
+  else
+  {
+    int numIKSteps = getNumIKSteps();
+    if (numIKSteps > 0)
+      updatePose(simulationIKJointPos.data(), numIKSteps);
+    else
+      updateSkinnedMesh(); // the pose did not change, but the mesh of this frame holds an older one
+  }
 
-  skinning->applySkinning(fk->getJointSkinTransforms(), newPosv);
-  for(size_t i = 0; i < mesh->getNumVertices(); i++)
-    mesh->setPosition(i, newPos[i]);
+  frame.eulerAngles.assign(simulationFK->getJointEulerAngles(), simulationFK->getJointEulerAngles() + simulationFK->getNumJoints());
+  frame.skinnedVertexPositions = skinnedVertexPositions;
+  if (IKScheduler)
+    frame.IKStatistics = IKScheduler->getStatistics();
+  frame.time = simulationTime;
+}
 
-  meshDeformable->BuildNormals();
+// Writes the shown frame to the vertex cache as the frames of the cache's clock (vertexCacheFrameRate) that
+// it covers: frame k of the cache is the mesh shown at vertexCacheStartTime + k / vertexCacheFrameRate.
+// A frame that lasts several cache frames is repeated, and a frame that lasts less than one may be skipped.
+static void bakeShownFrame(const Vec3d * vertexPositions)
+{
+  double bakeTime = shownFrameTime - vertexCacheStartTime;
+  while (vertexCacheWriter->isOpen() && (vertexCacheWriter->getNumFrames() <= bakeTime * vertexCacheFrameRate))
+    vertexCacheWriter->writeFrame((const double*)vertexPositions);
 }
 
 static void resetSkinningToRest()
 {
   fk->resetToRestPose();
-  updateSkinnedMesh();
+  if (framePipeline == nullptr)
+    updateSkinnedMesh();
   for(size_t i = 0; i < IKJointIDs.size(); i++)
   {
     IKJointPos[i] = fk->getJointGlobalPosition(IKJointIDs[i]);
   }
+  if (framePipeline)
+    publishSimulationInput(true);
   handleControl.clearHandleSelection();
   curJointID = -1;
 
@@ -119,9 +343,40 @@ static void idleFunction()
 {
   glutSetWindow(windowID);
   counter.StopCounter();
-  // double dt = counter.GetElapsedTime();
+  double dt = counter.GetElapsedTime();
   counter.StartCounter();
 
+  if (framePipeline)
+  {
+    // show the newest simulated frame
+    bool newFrame = false;
+    int buffer = framePipeline->acquireFrame(&newFrame);
+    if (newFrame)
+    {
+      const SimulationFrame & frame = simulationFrames[buffer];
+      mesh = frame.mesh;
+      meshDeformable = frame.meshDeformable;
+      copy(frame.eulerAngles.begin(), frame.eulerAngles.end(), fk->getJointEulerAngles());
+      fk->computeJointTransforms();
+      if (playAnimation)
+        for(size_t i = 0; i < IKJointIDs.size(); i++)
+          IKJointPos[i] = fk->getJointGlobalPosition(IKJointIDs[i]);
+      shownFrameTime = frame.time;
+      if (vertexCacheWriter)
+        bakeShownFrame(frame.skinnedVertexPositions.data());
+      IKStatistics = frame.IKStatistics;
+    }
+  }
+  else if (playAnimation)
+  {
+    // the clip drives the pose, and the IK handles follow it
+    animationClipPlayer->advance(dt);
+    animationClipPlayer->samplePose(fk->getJointEulerAngles());
+    updateSkinnedMesh();
+    for(size_t i = 0; i < IKJointIDs.size(); i++)
+      IKJointPos[i] = fk->getJointGlobalPosition(IKJointIDs[i]);
+  }
+
   // Take appropriate action in case the user is dragging a vertex.
   auto processDrag = [&](int vertex, Vec3d posDiff)
   {
@@ -135,9 +390,18 @@ static void idleFunction()
   const int maxIKIters = 10;
   const double maxOneStepDistance = modelRadius / 1000;
 
-  ik->doIK(IKJointPos.data(), fk->getJointEulerAngles());
-
-  updateSkinnedMesh();
+  if (framePipeline)
+    publishSimulationInput();
+  else
+  {
+    if (playAnimation == false)
+      updatePose(IKJointPos.data(), getNumIKSteps());
+    shownFrameTime += dt;
+    if (vertexCacheWriter)
+      bakeShownFrame(skinnedVertexPositions.data());
+    if (IKScheduler)
+      IKStatistics = IKScheduler->getStatistics();
+  }
 
   titleBarFrameCounter++;
   // update title bar at 4 Hz
@@ -151,12 +415,23 @@ static void idleFunction()
 
     // update menu bar
     char windowTitle[4096];
-    sprintf(windowTitle, "Vertices: %d | %.1f FPS | graphicsFrame %d ", meshDeformable->Getn(), fpsBuffer.getAverage(), graphicsFrameID);
+    int length = sprintf(windowTitle, "Vertices: %d | %.1f FPS | graphicsFrame %d ", meshDeformable->Getn(), fpsBuffer.getAverage(), graphicsFrameID);
+    if (framePipeline)
+    {
+      FramePipeline::Statistics statistics = framePipeline->getStatistics();
+      framePipeline->resetStatistics();
+      length += sprintf(windowTitle + length, "| simulation %.1f FPS, latency %.1f ms ", statistics.simulationRate, 1e3 * statistics.averageLatency);
+    }
+    else if (poseCache)
+      length += sprintf(windowTitle + length, "| pose cache %d entries, %.0f%% hits ", poseCache->getNumEntries(), 100.0 * poseCache->getHitRate());
+    if (IKScheduler)
+      sprintf(windowTitle + length, "| IK %.0f steps/s (%d dropped) ", IKStatistics.stepRate, IKStatistics.numDroppedSteps);
     glutSetWindowTitle(windowTitle);
     titleBarFrameCounter = 0;
   }
   graphicsFrameID++;
   glutPostRedisplay();
+  framePacer.paceFrame();
 }
 
 static void reshape(int x, int y)
@@ -181,6 +456,10 @@ static void displayFunction()
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
   camera->Look(); // calls gluLookAt
+  // querying the matrices does not wait for the GPU, unlike reading back pixels
+  glGetDoublev(GL_MODELVIEW_MATRIX, pickModelview);
+  glGetDoublev(GL_PROJECTION_MATRIX, pickProjection);
+  glGetIntegerv(GL_VIEWPORT, pickViewport);
 
   glDisable(GL_LIGHTING);
 
@@ -279,6 +558,10 @@ static void keyboardFunc(unsigned char key, int x, int y)
   switch (key)
   {
     case 27:
+      if (framePipeline)
+        framePipeline->stop();
+      if (vertexCacheWriter)
+        vertexCacheWriter->close();
       exit(0);
     break;
 
@@ -322,6 +605,65 @@ static void keyboardFunc(unsigned char key, int x, int y)
       renderSkeleton = !renderSkeleton;
       break;
 
+    case 'p':
+      if (animationClipPlayer)
+        playAnimation = !playAnimation;
+      else
+        cout << "No animation clip loaded (set animationClipFilename)." << endl;
+      break;
+
+    case 'b':
+      if (vertexCacheWriter == nullptr)
+      {
+        if (vertexCacheFrameRate <= 0.0)
+        {
+          cout << "Error: vertexCacheFrameRate must be positive." << endl;
+          break;
+        }
+        const char * encodingNames[NUM_VERTEX_CACHE_ENCODINGS] = { "float64", "float32", "quantized16", "delta16" };
+        int encoding = 0;
+        while ((encoding < NUM_VERTEX_CACHE_ENCODINGS) && (vertexCacheEncoding != encodingNames[encoding]))
+          encoding++;
+        if (encoding == NUM_VERTEX_CACHE_ENCODINGS)
+        {
+          cout << "Error: unknown vertexCacheEncoding " << vertexCacheEncoding << "." << endl;
+          break;
+        }
+        vertexCacheWriter = new VertexCacheWriter(vertexCacheFilename, meshDeformable->GetNumVertices(), vertexCacheFrameRate,
+            (VertexCacheEncoding)encoding, meshDeformable->GetVertexRestPositions());
+        vertexCacheStartTime = shownFrameTime;
+        if (vertexCacheWriter->isOpen())
+          cout << "Baking the skinned mesh to " << vertexCacheFilename << " at " << vertexCacheFrameRate << " frames per second." << endl;
+        else
+        {
+          delete vertexCacheWriter;
+          vertexCacheWriter = nullptr;
+        }
+      }
+      else
+      {
+        int numFrames = vertexCacheWriter->getNumFrames();
+        if (vertexCacheWriter->close() == 0)
+          cout << "Baked " << numFrames << " frames to " << vertexCacheFilename << "." << endl;
+        else
+          cout << "Error: cannot write " << vertexCacheFilename << "." << endl;
+        delete vertexCacheWriter;
+        vertexCacheWriter = nullptr;
+      }
+      break;
+
+    case 'k':
+    {
+      // record the current pose as a keyframe, one second after the previous one, and save the recording
+      recordedKeyframeTimes.push_back(recordedKeyframeTimes.size());
+      recordedKeyframes.insert(recordedKeyframes.end(), fk->getJointEulerAngles(), fk->getJointEulerAngles() + fk->getNumJoints());
+      if (AnimationClip::save(animationRecordFilename, *fk, recordedKeyframeTimes.size(), recordedKeyframeTimes.data(), recordedKeyframes.data()) == 0)
+        cout << "Saved " << recordedKeyframeTimes.size() << " keyframes to " << animationRecordFilename << "." << endl;
+      else
+        cout << "Error: cannot save " << animationRecordFilename << "." << endl;
+      break;
+    }
+
     default:
       break;
   }
@@ -349,17 +691,37 @@ static void specialKeysFunc(int key, int x, int y)
   }
 }
 
+// Casts the ray under the mouse position (x,y) against the skinned mesh, on the CPU, with the view of the last rendered frame.
+// Unlike unprojectPointFromScreen, it does not read back the depth and stencil buffers, which would wait for the GPU to finish rendering.
+// Returns true if the mesh is hit, and outputs the hit position and its depth value (as in the depth buffer).
+static bool pickMesh(int x, int y, Vec3d * worldPos, float * zValue)
+{
+  int winX = x;
+  int winY = pickViewport[1] + pickViewport[3] - 1 - y;
+  Vec3d nearPos, farPos;
+  gluUnProject(winX, winY, 0.0, pickModelview, pickProjection, pickViewport, &nearPos[0], &nearPos[1], &nearPos[2]);
+  gluUnProject(winX, winY, 1.0, pickModelview, pickProjection, pickViewport, &farPos[0], &farPos[1], &farPos[2]);
+  if ((showObject == false && showWireframe == false) || mesh->intersectRay(nearPos, farPos - nearPos, worldPos) == false)
+  {
+    *worldPos = farPos;
+    *zValue = 1.0f;
+    return false;
+  }
+
+  GLdouble windowPos[3];
+  gluProject((*worldPos)[0], (*worldPos)[1], (*worldPos)[2], pickModelview, pickProjection, pickViewport, &windowPos[0], &windowPos[1], &windowPos[2]);
+  *zValue = windowPos[2];
+  return true;
+}
+
 static void mouseNoDrag(int x, int y)
 {
   id.setMousePos(x,y);
   if (handleControl.isHandleSelected())
   {
     Vec3d worldPos(0.0);
-    GLubyte stencilValue;
     float zValue;
-    unprojectPointFromScreen(x,y, &worldPos[0], &stencilValue, &zValue);
-
-    if (stencilValue == 1)
+    if (pickMesh(x, y, &worldPos, &zValue))
     {
       handleControl.setMousePosition(worldPos);
     }
@@ -400,25 +762,19 @@ static void mouseButtonActivity(int button, int state, int x, int y)
     case GLUT_LEFT_BUTTON:
     {
       Vec3d clickedPosition(0.0);
-      GLubyte stencilValue;
       float zValue = 0.0f;
-      unprojectPointFromScreen(x,y, &clickedPosition[0], &stencilValue, &zValue);
+      bool clickedOnMesh = pickMesh(x, y, &clickedPosition, &zValue);
 
       if (id.leftMouseButtonDown())
       {
-        if (stencilValue == 0)
+        if (clickedOnMesh == false)
         {
           cout << "Clicked on empty space." << endl;
           selectedVertex = -1;
           return;
         }
-        MinValueIndex vi;
-        for(size_t i = 0; i < mesh->getNumVertices(); i++)
-        {
-          vi.update(len2(clickedPosition - mesh->getPosition(i)), i);
-        }
-        selectedVertex = vi.index;
-        cout << "Clicked on vertex " << vi.index << endl;
+        selectedVertex = mesh->getClosestVertex(clickedPosition);
+        cout << "Clicked on vertex " << selectedVertex << endl;
 
         if (fk->getNumJoints() > 0)
         {
@@ -450,7 +806,7 @@ static void mouseButtonActivity(int button, int state, int x, int y)
       {
         return make_pair(-1, false);
       };
-      handleControl.setMouseButtonActivity(id.leftMouseButtonDown(), stencilValue == 1, false,
+      handleControl.setMouseButtonActivity(id.leftMouseButtonDown(), clickedOnMesh, false,
           clickedPosition, zValue, getClosestHandle, addOrRemoveHandle);
 
       break;
@@ -464,6 +820,22 @@ static void mouseButtonActivity(int button, int state, int x, int y)
   }
 }
 
+// a renderable object for "objMesh", which it does not own; if restShape is given, the object shares its rest positions
+static SceneObjectDeformable * createMeshDeformable(ObjMesh * objMesh, const SceneObjectDeformable * restShape = nullptr)
+{
+  SceneObjectDeformable * objMeshDeformable = restShape ? new SceneObjectDeformable(objMesh, *restShape, false) :
+    new SceneObjectDeformable(objMesh, false);
+  if (objMeshDeformable->HasTextures())
+  {
+    objMeshDeformable->EnableTextures();
+    objMeshDeformable->SetUpTextures(SceneObject::MODULATE, SceneObject::NOMIPMAP);
+  }
+  objMeshDeformable->BuildNeighboringStructure();
+  objMeshDeformable->BuildNormals();
+  //  objMeshDeformable->BuildDisplayList();
+  return objMeshDeformable;
+}
+
 static void initialize()
 {
   // initialize random number generator
@@ -475,16 +847,18 @@ static void initialize()
   printf("GL_VERSION: %s\n",glGetString(GL_VERSION));
 
   mesh = new ObjMesh(meshFilename);
-  meshDeformable = new SceneObjectDeformable(mesh, false);
-
-  if (meshDeformable->HasTextures())
+  vector<int> vertexPermutation; // old -> new vertex indices, if the mesh is reordered
+  if (optimizeMeshOrder)
   {
-    meshDeformable->EnableTextures();
-    meshDeformable->SetUpTextures(SceneObject::MODULATE, SceneObject::NOMIPMAP);
+    printf("Mesh ACMR: %.3f", mesh->computeAverageCacheMissRatio());
+    mesh->reorderFacesForVertexCache();
+    mesh->computeFirstUseVertexOrder(vertexPermutation);
+    mesh->renumberVertices(vertexPermutation);
+    printf(" -> %.3f after reordering.\n", mesh->computeAverageCacheMissRatio());
   }
-  meshDeformable->BuildNeighboringStructure();
-  meshDeformable->BuildNormals();
-  //  meshDeformable->BuildDisplayList();
+  mesh->buildVertexBVH();
+  mesh->buildTriangleBVH();
+  meshDeformable = createMeshDeformable(mesh);
 
   // ---------------------------------------------------
   // joint initialization
@@ -498,12 +872,64 @@ static void initialize()
 
   assert(jointRestTransformsFilename.size() > 0 && jointWeightsFilename.size() > 0);
   skinning = new Skinning(meshDeformable->Getn(), meshDeformable->GetVertexRestPositions(), jointWeightsFilename);
-  fk = new FK(jointHierarchyFilename, jointRestTransformsFilename);
+  if (vertexPermutation.size() > 0)
+    skinning->renumberVertices(vertexPermutation);
+  if (skinningWeightQuantum != 0.0)
+    skinning->setWeightQuantum(skinningWeightQuantum);
+  printf("Skinning: %d influence clusters for %d vertices (%d vertices share a cluster).\n", skinning->getNumClusters(),
+      meshDeformable->Getn(), skinning->getNumClusteredVertices());
+  Skinning::Method skinningMethodID;
+  if (Skinning::getMethodFromName(skinningMethod.c_str(), &skinningMethodID) != 0)
+  {
+    printf("Error: unknown skinningMethod %s.\n", skinningMethod.c_str());
+    exit(1);
+  }
+  skinning->setMethod(skinningMethodID);
+  if (skinningMethodID == Skinning::CENTER_OF_ROTATION)
+  {
+    if (centersOfRotationCacheFilename.size() == 0)
+      centersOfRotationCacheFilename = jointWeightsFilename + (optimizeMeshOrder ? ".reordered.cor" : ".cor");
+    vector<int> triangles;
+    int numTriangles = ObjMeshTopology(*mesh).getFanTriangles(triangles);
+    WorkerPool precomputationWorkerPool;
+    PerformanceCounter centersCounter;
+    bool loaded = false;
+    int code = skinning->computeCentersOfRotation(numTriangles, triangles.data(), &precomputationWorkerPool, centersOfRotationCacheFilename, &loaded);
+    centersCounter.StopCounter();
+    if (loaded || (code == 0))
+      printf("Skinning: %d centers of rotation %s %s in %.3f s.\n", skinning->getNumCentersOfRotation(), loaded ? "loaded from" : "computed, cached in",
+          centersOfRotationCacheFilename.c_str(), centersCounter.GetElapsedTime());
+    else
+      printf("Skinning: %d centers of rotation computed in %.3f s.\n", skinning->getNumCentersOfRotation(), centersCounter.GetElapsedTime());
+  }
+  fk = new FK(jointHierarchyFilename, jointRestTransformsFilename, jointLimitsFilename);
+
+  simulationFK = fk;
+  simulationMesh = mesh;
+  simulationMeshDeformable = meshDeformable;
+  if (pipelineSimulation)
+  {
+    // the simulation thread gets its own pose (sharing the skeleton) and three copies of the mesh (sharing the rest positions);
+    // "mesh" is shown until the first frame is simulated
+    simulationFK = new FK(fk->getSkeleton());
+    for(SimulationFrame & frame : simulationFrames)
+    {
+      frame.mesh = new ObjMesh(*mesh);
+      frame.meshDeformable = createMeshDeformable(frame.mesh, meshDeformable);
+    }
+  }
 
   // ---------------------------------------------------
   // Setting up Adol-c
   // ---------------------------------------------------
-  ik = new IK(IKJointIDs.size(), IKJointIDs.data(), fk);
+  ik = new IK(IKJointIDs.size(), IKJointIDs.data(), simulationFK);
+  IK::Method method;
+  if (IK::getMethodFromName(IKMethod.c_str(), &method) != 0)
+  {
+    printf("Error: unknown IKMethod %s.\n", IKMethod.c_str());
+    exit(1);
+  }
+  ik->setMethod(method);
   IKJointPos.resize(IKJointIDs.size());
   for(size_t i = 0; i < IKJointIDs.size(); i++)
   {
@@ -528,6 +954,26 @@ static void initialize()
   skeletonRenderer = new SkeletonRenderer(fk, localAxisLength);
   cout << "Finished joint initialization" << endl;
 
+  skinnedVertexPositions.resize(meshDeformable->GetNumVertices());
+  if (poseCacheMegabytes > 0)
+  {
+    if (poseCachePositionQuantum <= 0.0)
+      poseCachePositionQuantum = 1e-5 * modelRadius;
+    poseCache = new PoseCache(IKJointIDs.size(), fk->getNumJoints(), poseCacheSkinnedVertices ? meshDeformable->GetNumVertices() : 0,
+        (size_t)poseCacheMegabytes << 20, poseCachePositionQuantum, poseCacheAngleQuantum);
+  }
+
+  if (animationClipFilename.size() > 0)
+  {
+    animationClip = new AnimationClip(animationClipFilename);
+    if (animationClip->isLoaded() == false || animationClip->getNumJoints() != fk->getNumJoints())
+    {
+      printf("Error: cannot play animation clip %s on this skeleton.\n", animationClipFilename.c_str());
+      exit(1);
+    }
+    animationClipPlayer = new AnimationClipPlayer(animationClip);
+  }
+
   double cameraRadius = 0;
   cameraFocus = modelCenter;
   cameraRadius = modelRadius * 2.5;
@@ -561,6 +1007,18 @@ static void initialize()
   glShadeModel(GL_SMOOTH);
   glEnable(GL_POLYGON_SMOOTH);
   glEnable(GL_LINE_SMOOTH);
+  if (IKStepRate > 0.0)
+    IKScheduler = new FixedRateScheduler(IKStepRate, maxIKStepsPerFrame);
+  framePacer.setFrameRateLimit(frameRateLimit);
+
+  if (pipelineSimulation)
+  {
+    framePipeline = new FramePipeline(simulateFrame);
+    publishSimulationInput();
+    simulationCounter.StartCounter();
+    framePipeline->start();
+  }
+
   printf ("Initialization complete.\n");
   return;
 }
@@ -573,12 +1031,42 @@ static void initConfigurations()
   ADD_CONFIG(allLightsIntensity);
   ADD_CONFIG(screenshotBaseName);
   ADD_CONFIG(meshFilename);
+  // reorder the mesh faces and vertices at load, for vertex cache efficiency and memory locality (vertex indices then differ from the file)
+  ADD_CONFIG(optimizeMeshOrder);
 
   // Maya data needs jointHierarchyFilename, jointRestTransformsFilename and jointWeightsFilename
   ADD_CONFIG(jointHierarchyFilename);
   ADD_CONFIG(jointRestTransformsFilename);
   ADD_CONFIG(jointWeightsFilename);
+  // vertices with the same skinning joints and weights (rounded to multiples of skinningWeightQuantum, if > 0) share a blended transform
+  ADD_CONFIG(skinningWeightQuantum);
+  // dualQuaternion (default), linearBlend or centerOfRotation; the centers of rotation are computed at load, and cached in
+  // centersOfRotationCacheFilename (default: the weights file name + ".cor")
+  ADD_CONFIG(skinningMethod);
+  ADD_CONFIG(centersOfRotationCacheFilename);
+  // optional Euler angle limits, respected by IK
+  ADD_CONFIG(jointLimitsFilename);
   ADD_CONFIG(IKJointIDs);
+  // dampedLeastSquares (default), levenbergMarquardt, pseudoInverse, jacobianTranspose, cyclicCoordinateDescent or fabrik
+  ADD_CONFIG(IKMethod);
+  // IK steps per second (0: one step per frame), the catch-up limit after slow frames, and the frame rate limit (0: none)
+  ADD_CONFIG(IKStepRate);
+  ADD_CONFIG(maxIKStepsPerFrame);
+  ADD_CONFIG(frameRateLimit);
+  // LRU cache of IK (and skinning) results, for recurring handle targets
+  ADD_CONFIG(poseCacheMegabytes);
+  ADD_CONFIG(poseCachePositionQuantum);
+  ADD_CONFIG(poseCacheAngleQuantum);
+  ADD_CONFIG(poseCacheSkinnedVertices);
+  // keyframe animation clip, played with 'p'; 'k' records keyframes into animationRecordFilename
+  ADD_CONFIG(animationClipFilename);
+  ADD_CONFIG(animationRecordFilename);
+  // vertex cache of the skinned mesh, baked with 'b' at vertexCacheFrameRate frames per second of simulation time
+  ADD_CONFIG(vertexCacheFilename);
+  ADD_CONFIG(vertexCacheEncoding);
+  ADD_CONFIG(vertexCacheFrameRate);
+  // simulate the next frame on a background thread while the current frame is rendered
+  ADD_CONFIG(pipelineSimulation);
 
   // parse the configuration file
   if (configFile.parseOptions(configFilename.c_str()) != 0)
@@ -0,0 +1,86 @@
+#ifndef DUALNUMBER_H
+#define DUALNUMBER_H
+
+#include <math.h>
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+// A dual number with a fixed-size gradient lane, for forward-mode automatic differentiation.
+// A DualNumber<N> carries a value and the derivatives of that value with respect to N seeded inputs.
+// Evaluating a function with DualNumber<N> arguments computes, in one forward sweep, the function value
+// and N columns of its Jacobian matrix. Unlike adouble in Adol-C, no tape is recorded and there is no global state.
+// It can be used as the "real" type in minivectorTemplate.h and in FK::computeLocalAndGlobalTransforms.
+template <int N>
+class DualNumber
+{
+public:
+  inline DualNumber() {}
+  // a constant (all derivatives are zero)
+  DualNumber(double value) : v(value) { for(int i = 0; i < N; i++) d[i] = 0.0; }
+  // an input variable, seeded on gradient lane "lane" (0 <= lane < N)
+  DualNumber(double value, int lane) : DualNumber(value) { d[lane] = 1.0; }
+
+  double value() const { return v; }
+  double derivative(int lane) const { return d[lane]; }
+  const double * derivatives() const { return d; }
+
+  DualNumber & operator+= (const DualNumber & w) { v += w.v; for(int i = 0; i < N; i++) d[i] += w.d[i]; return *this; }
+  DualNumber & operator-= (const DualNumber & w) { v -= w.v; for(int i = 0; i < N; i++) d[i] -= w.d[i]; return *this; }
+  DualNumber & operator*= (const DualNumber & w) { for(int i = 0; i < N; i++) d[i] = d[i] * w.v + v * w.d[i]; v *= w.v; return *this; }
+  DualNumber & operator/= (const DualNumber & w) { return (*this = *this / w); }
+  DualNumber & operator*= (double s) { v *= s; for(int i = 0; i < N; i++) d[i] *= s; return *this; }
+  DualNumber & operator/= (double s) { return (*this *= (1.0 / s)); }
+
+  inline friend DualNumber operator+ (const DualNumber & a, const DualNumber & b) { DualNumber r(a); return r += b; }
+  inline friend DualNumber operator- (const DualNumber & a, const DualNumber & b) { DualNumber r(a); return r -= b; }
+  inline friend DualNumber operator* (const DualNumber & a, const DualNumber & b)
+  {
+    DualNumber r;
+    r.v = a.v * b.v;
+    for(int i = 0; i < N; i++)
+      r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+    return r;
+  }
+  inline friend DualNumber operator/ (const DualNumber & a, const DualNumber & b)
+  {
+    DualNumber r;
+    double invB = 1.0 / b.v;
+    r.v = a.v * invB;
+    for(int i = 0; i < N; i++)
+      r.d[i] = (a.d[i] - r.v * b.d[i]) * invB;
+    return r;
+  }
+
+  // mixed operations with plain doubles (constants); cheaper than promoting the double to a DualNumber
+  inline friend DualNumber operator+ (const DualNumber & a, double s) { DualNumber r(a); r.v += s; return r; }
+  inline friend DualNumber operator+ (double s, const DualNumber & a) { return a + s; }
+  inline friend DualNumber operator- (const DualNumber & a, double s) { DualNumber r(a); r.v -= s; return r; }
+  inline friend DualNumber operator- (double s, const DualNumber & a) { DualNumber r(-a); r.v += s; return r; }
+  inline friend DualNumber operator* (const DualNumber & a, double s) { DualNumber r(a); return r *= s; }
+  inline friend DualNumber operator* (double s, const DualNumber & a) { DualNumber r(a); return r *= s; }
+  inline friend DualNumber operator/ (const DualNumber & a, double s) { DualNumber r(a); return r *= (1.0 / s); }
+
+  inline friend DualNumber operator- (const DualNumber & a) { DualNumber r; r.v = -a.v; for(int i = 0; i < N; i++) r.d[i] = -a.d[i]; return r; }
+
+  // elementary functions, via the chain rule: f(a)' = f'(a.v) * a'
+  inline friend DualNumber sin(const DualNumber & a) { return chain(a, ::sin(a.v), ::cos(a.v)); }
+  inline friend DualNumber cos(const DualNumber & a) { return chain(a, ::cos(a.v), -::sin(a.v)); }
+  inline friend DualNumber sqrt(const DualNumber & a) { double s = ::sqrt(a.v); return chain(a, s, 0.5 / s); }
+
+protected:
+  // returns the DualNumber with value "fValue" and derivatives "fDerivative" * a.d
+  static DualNumber chain(const DualNumber & a, double fValue, double fDerivative)
+  {
+    DualNumber r;
+    r.v = fValue;
+    for(int i = 0; i < N; i++)
+      r.d[i] = fDerivative * a.d[i];
+    return r;
+  }
+
+  double v; // value
+  double d[N]; // derivatives with respect to the N seeded inputs
+};
+
+#endif
@@ -0,0 +1,98 @@
+#include "fixedRateScheduler.h"
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+FixedRateScheduler::FixedRateScheduler(double stepRate_, int maxStepsPerFrame_, double statisticsInterval_) :
+  stepRate(stepRate_), maxStepsPerFrame(maxStepsPerFrame_), statisticsInterval(statisticsInterval_)
+{
+  statistics.stepRate = statistics.frameRate = statistics.averageStepsPerFrame = 0.0;
+  statistics.maxStepsPerFrame = statistics.numDroppedSteps = 0;
+  frameCounter.StartCounter();
+}
+
+int FixedRateScheduler::beginFrame()
+{
+  frameCounter.StopCounter();
+  double elapsedTime = frameCounter.GetElapsedTime();
+  frameCounter.StartCounter();
+  return advance(elapsedTime);
+}
+
+int FixedRateScheduler::advance(double elapsedTime)
+{
+  double stepTime = 1.0 / stepRate;
+  accumulatedTime += max(elapsedTime, 0.0);
+  int numSteps = (int)(accumulatedTime * stepRate);
+  if (numSteps > maxStepsPerFrame)
+  {
+    windowDroppedTime += (numSteps - maxStepsPerFrame) * stepTime;
+    numSteps = maxStepsPerFrame;
+    accumulatedTime = fmod(accumulatedTime, stepTime);
+  }
+  else
+    accumulatedTime = max(accumulatedTime - numSteps * stepTime, 0.0);
+
+  windowTime += elapsedTime;
+  windowFrames++;
+  windowSteps += numSteps;
+  windowMaxSteps = max(windowMaxSteps, numSteps);
+  if (windowTime >= statisticsInterval)
+  {
+    statistics.stepRate = windowSteps / windowTime;
+    statistics.frameRate = windowFrames / windowTime;
+    statistics.averageStepsPerFrame = (double)windowSteps / windowFrames;
+    statistics.maxStepsPerFrame = windowMaxSteps;
+    statistics.numDroppedSteps = (int)(windowDroppedTime * stepRate + 0.5);
+    windowTime = windowDroppedTime = 0.0;
+    windowFrames = windowSteps = windowMaxSteps = 0;
+  }
+  return numSteps;
+}
+
+FramePacer::FramePacer(double frameRateLimit_, double statisticsInterval_) : frameRateLimit(frameRateLimit_), statisticsInterval(statisticsInterval_)
+{
+  clock.StartCounter();
+}
+
+double FramePacer::getTime() const
+{
+  PerformanceCounter counter = clock;
+  counter.StopCounter();
+  return counter.GetElapsedTime();
+}
+
+void FramePacer::paceFrame()
+{
+  double time = getTime();
+  if (frameRateLimit > 0.0)
+  {
+    double frameTime = 1.0 / frameRateLimit;
+    nextFrameTime += frameTime;
+    if (time < nextFrameTime)
+    {
+      this_thread::sleep_for(chrono::microseconds((long long)(1e6 * (nextFrameTime - time))));
+      double wakeTime = getTime();
+      windowSleepTime += wakeTime - time;
+      time = wakeTime;
+    }
+    else if (time > nextFrameTime + frameTime)
+      nextFrameTime = time; // late by more than a frame: start over from now
+  }
+
+  windowFrames++;
+  double windowTime = time - windowStartTime;
+  if (windowTime >= statisticsInterval)
+  {
+    frameRate = windowFrames / windowTime;
+    sleepFraction = windowSleepTime / windowTime;
+    windowStartTime = time;
+    windowSleepTime = 0.0;
+    windowFrames = 0;
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef FIXEDRATESCHEDULER_H
+#define FIXEDRATESCHEDULER_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "performanceCounter.h"
+
+// Decides how many simulation steps (e.g., IK steps) to run in each frame, so that the steps run at a fixed rate
+// in real time, independently of the frame rate. Slow frames run several steps; fast frames may run none.
+// After a very slow frame (e.g., a pause), at most maxStepsPerFrame steps are run and the rest of the elapsed time is
+// dropped, so that the simulation slows down instead of falling further and further behind.
+// The statistics are measured over windows of statisticsInterval seconds; getStatistics returns the last complete window.
+// A scheduler is used by one thread.
+class FixedRateScheduler
+{
+public:
+  // stepRate: steps per second (> 0)
+  FixedRateScheduler(double stepRate = 60.0, int maxStepsPerFrame = 4, double statisticsInterval = 1.0);
+
+  void setStepRate(double stepRate) { this->stepRate = stepRate; }
+  double getStepRate() const { return stepRate; }
+  void setMaxStepsPerFrame(int maxStepsPerFrame) { this->maxStepsPerFrame = maxStepsPerFrame; }
+  int getMaxStepsPerFrame() const { return maxStepsPerFrame; }
+
+  // Call once per frame: measures the real time since the previous call (or the construction), and returns the number
+  // of steps to run in this frame.
+  int beginFrame();
+  // As beginFrame, for a given elapsed time (seconds), e.g., for reproducible runs.
+  int advance(double elapsedTime);
+
+  // the elapsed time not yet covered by steps, as a fraction of a step, in [0, 1); e.g., to interpolate poses
+  double getStepFraction() const { return accumulatedTime * stepRate; }
+
+  struct Statistics
+  {
+    double stepRate; // achieved steps per second
+    double frameRate; // frames (beginFrame or advance calls) per second
+    double averageStepsPerFrame;
+    int maxStepsPerFrame; // the most steps run in a frame
+    int numDroppedSteps; // steps dropped by the catch-up limit
+  };
+  const Statistics & getStatistics() const { return statistics; }
+
+protected:
+  double stepRate;
+  int maxStepsPerFrame;
+  double accumulatedTime = 0.0; // seconds
+  PerformanceCounter frameCounter;
+
+  double statisticsInterval;
+  Statistics statistics;
+  // the current statistics window
+  double windowTime = 0.0;
+  int windowFrames = 0, windowSteps = 0, windowMaxSteps = 0;
+  double windowDroppedTime = 0.0;
+};
+
+// Limits the frame rate: paceFrame sleeps until 1 / frameRateLimit seconds have passed since the previous frame's deadline.
+// Frames that are late do not make later frames shorter. A frame rate limit of 0 does not limit the frame rate.
+class FramePacer
+{
+public:
+  explicit FramePacer(double frameRateLimit = 0.0, double statisticsInterval = 1.0);
+
+  void setFrameRateLimit(double frameRateLimit) { this->frameRateLimit = frameRateLimit; }
+  double getFrameRateLimit() const { return frameRateLimit; }
+
+  // call once per frame
+  void paceFrame();
+
+  // over the last complete window of statisticsInterval seconds
+  double getFrameRate() const { return frameRate; }
+  double getSleepFraction() const { return sleepFraction; } // the fraction of the time spent sleeping
+
+protected:
+  double getTime() const; // seconds since the construction
+
+  double frameRateLimit;
+  PerformanceCounter clock; // not modified after the construction
+  double nextFrameTime = 0.0;
+
+  double statisticsInterval;
+  double frameRate = 0.0, sleepFraction = 0.0;
+  double windowStartTime = 0.0, windowSleepTime = 0.0;
+  int windowFrames = 0;
+};
+
+#endif
+
@@ -0,0 +1,129 @@
+#include "framePipeline.h"
+#include <algorithm>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+FramePipeline::FramePipeline(const StepFunction & step_, bool runAhead_) : step(step_), runAhead(runAhead_), readyBuffer(1), stopping(false)
+{
+  clock.StartCounter();
+  resetStatistics();
+}
+
+FramePipeline::~FramePipeline()
+{
+  stop();
+}
+
+double FramePipeline::getTime() const
+{
+  PerformanceCounter counter = clock;
+  counter.StopCounter();
+  return counter.GetElapsedTime();
+}
+
+void FramePipeline::start()
+{
+  if (isRunning())
+    return;
+  stopping = false;
+  simulationThread = thread(&FramePipeline::simulationLoop, this);
+}
+
+void FramePipeline::stop()
+{
+  if (isRunning() == false)
+    return;
+  stopping = true;
+  {
+    lock_guard<mutex> lock(sleepMutex);
+  }
+  frameTaken.notify_one();
+  simulationThread.join();
+}
+
+void FramePipeline::simulationLoop()
+{
+  while (true)
+  {
+    if (runAhead == false)
+    {
+      // wait until the render thread takes the previous frame
+      unique_lock<mutex> lock(sleepMutex);
+      frameTaken.wait(lock, [&]() { return (readyBuffer.load() & newFrameBit) == 0 || stopping; });
+    }
+    if (stopping)
+      return;
+
+    FrameInfo & info = frameInfos[simulationBuffer];
+    info.startTime = getTime();
+    step(simulationBuffer);
+    info.finishTime = getTime();
+    info.frameID = numSteps++;
+    totalStepTime += info.finishTime - info.startTime;
+    info.totalStepTime = totalStepTime;
+
+    // publish the frame, and continue with the buffer that held the previous ready frame (taken or not)
+    simulationBuffer = readyBuffer.exchange(simulationBuffer | newFrameBit) & ~newFrameBit;
+  }
+}
+
+int FramePipeline::acquireFrame(bool * newFrame)
+{
+  bool isNew = (readyBuffer.load() & newFrameBit) != 0;
+  if (isNew)
+  {
+    renderBuffer = readyBuffer.exchange(renderBuffer) & ~newFrameBit;
+    hasFrame = true;
+    if (runAhead == false)
+    {
+      // taking the (empty) lock orders the wake-up after the simulation thread has started waiting, if it has
+      {
+        lock_guard<mutex> lock(sleepMutex);
+      }
+      frameTaken.notify_one();
+    }
+
+    const FrameInfo & info = frameInfos[renderBuffer];
+    if (hasFirstFrameInfo == false)
+    {
+      firstFrameInfo = info;
+      hasFirstFrameInfo = true;
+    }
+    lastFrameInfo = info;
+    numDisplayedFrames++;
+    double latency = getTime() - info.startTime;
+    totalLatency += latency;
+    maxLatency = max(maxLatency, latency);
+  }
+  if (newFrame)
+    *newFrame = isNew;
+  return hasFrame ? renderBuffer : -1;
+}
+
+FramePipeline::Statistics FramePipeline::getStatistics()
+{
+  Statistics statistics;
+  // frames after the first one taken since resetStatistics
+  int numSimulatedFrames = hasFirstFrameInfo ? (int)(lastFrameInfo.frameID - firstFrameInfo.frameID) : 0;
+  statistics.numSimulatedFrames = numSimulatedFrames;
+  statistics.numDisplayedFrames = numDisplayedFrames;
+  statistics.numDroppedFrames = max(numSimulatedFrames - (numDisplayedFrames - 1), 0);
+  statistics.averageStepTime = (numSimulatedFrames > 0) ? (lastFrameInfo.totalStepTime - firstFrameInfo.totalStepTime) / numSimulatedFrames : 0.0;
+  statistics.averageLatency = (numDisplayedFrames > 0) ? totalLatency / numDisplayedFrames : 0.0;
+  statistics.maxLatency = maxLatency;
+  double simulationTime = lastFrameInfo.finishTime - firstFrameInfo.finishTime;
+  statistics.simulationRate = (numSimulatedFrames > 0 && simulationTime > 0.0) ? numSimulatedFrames / simulationTime : 0.0;
+  double elapsedTime = getTime() - statisticsStartTime;
+  statistics.displayRate = (elapsedTime > 0.0) ? numDisplayedFrames / elapsedTime : 0.0;
+  return statistics;
+}
+
+void FramePipeline::resetStatistics()
+{
+  statisticsStartTime = getTime();
+  hasFirstFrameInfo = false;
+  numDisplayedFrames = 0;
+  totalLatency = maxLatency = 0.0;
+}
@@ -0,0 +1,97 @@
+#ifndef FRAMEPIPELINE_H
+#define FRAMEPIPELINE_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "performanceCounter.h"
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Simulates frames on a background thread while the calling (render) thread draws the previous frame.
+// The frames are stored in three buffers that the caller owns, indexed 0, 1 and 2 (e.g., three copies of the skinned mesh).
+// At any time, the simulation thread writes one buffer, the render thread reads one buffer, and the third buffer holds
+// the newest finished frame. The threads hand the buffers over by atomically exchanging their indices (a triple buffer),
+// so that neither thread waits for the other to get a buffer.
+// By default, the simulation runs one frame ahead: after finishing frame N+1, it sleeps until the render thread takes it.
+class FramePipeline
+{
+public:
+  // step(buffer): simulates the next frame into buffer "buffer"; called on the simulation thread
+  typedef std::function<void(int buffer)> StepFunction;
+
+  // If runAhead is true, the simulation thread does not wait for the render thread;
+  // a finished frame that is not taken before the next frame is finished is dropped.
+  explicit FramePipeline(const StepFunction & step, bool runAhead = false);
+  virtual ~FramePipeline(); // calls stop()
+
+  void start(); // starts the simulation thread
+  void stop(); // lets the current step finish, and stops the simulation thread
+  bool isRunning() const { return simulationThread.joinable(); }
+
+  // Render thread: takes the newest finished frame, if it was not taken yet, and returns its buffer.
+  // Otherwise, returns the buffer of the previously taken frame, or -1 if no frame was finished yet.
+  // The simulation thread does not write the returned buffer until the next call. newFrame (if given) tells if the frame is new.
+  int acquireFrame(bool * newFrame = nullptr);
+
+  // Statistics of the frames since the last resetStatistics() (render thread).
+  struct Statistics
+  {
+    int numSimulatedFrames;
+    int numDisplayedFrames; // taken by acquireFrame
+    int numDroppedFrames; // simulated, but never taken
+    double averageStepTime; // seconds
+    double averageLatency, maxLatency; // seconds, from the start of the step of a frame until acquireFrame takes it
+    double simulationRate, displayRate; // frames per second
+  };
+  Statistics getStatistics();
+  void resetStatistics();
+
+protected:
+  FramePipeline(const FramePipeline &) = delete;
+  FramePipeline & operator=(const FramePipeline &) = delete;
+
+  void simulationLoop();
+  double getTime() const; // seconds since the construction; thread-safe
+
+  StepFunction step;
+  bool runAhead;
+  PerformanceCounter clock; // not modified after the construction
+
+  // The buffer indices. "readyBuffer" is shared; its newFrameBit is set when it holds a frame that was not taken.
+  static const int newFrameBit = 4;
+  std::atomic<int> readyBuffer;
+  int simulationBuffer = 0; // used only by the simulation thread
+  int renderBuffer = 2; // used only by the render thread
+  bool hasFrame = false;
+
+  // written by the simulation thread into the buffer's entry before the buffer is handed over
+  struct FrameInfo
+  {
+    long long frameID = -1;
+    double startTime = 0.0, finishTime = 0.0;
+    double totalStepTime = 0.0; // of all frames up to and including this one
+  };
+  FrameInfo frameInfos[3];
+  long long numSteps = 0;
+  double totalStepTime = 0.0;
+
+  // the simulation thread sleeps on "frameTaken" when it is a frame ahead; the mutex is used only for the sleeping
+  std::atomic<bool> stopping;
+  std::mutex sleepMutex;
+  std::condition_variable frameTaken;
+  std::thread simulationThread;
+
+  // statistics (render thread)
+  double statisticsStartTime = 0.0;
+  bool hasFirstFrameInfo = false;
+  FrameInfo firstFrameInfo, lastFrameInfo; // the first frame taken since resetStatistics is the baseline
+  int numDisplayedFrames = 0;
+  double totalLatency = 0.0, maxLatency = 0.0;
+};
+
+#endif
+
@@ -0,0 +1,69 @@
+#include "mappedFile.h"
+#include <fstream>
+#include <iterator>
+#if !defined(_WIN32) && !defined(WIN32)
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+MappedFile::MappedFile(const std::string & filename)
+{
+#if !defined(_WIN32) && !defined(WIN32)
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat fileStat;
+  if ((fstat(fd, &fileStat) == 0) && (fileStat.st_size > 0))
+  {
+    void * address = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED)
+    {
+      data = (const char *)address;
+      size = fileStat.st_size;
+      mapped = true;
+    }
+  }
+  close(fd); // the mapping stays valid
+  if (mapped)
+    return;
+#endif
+
+  ifstream fin(filename.c_str(), ios::binary);
+  if (!fin)
+    return;
+  contents.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+  if (contents.size() > 0)
+  {
+    data = contents.data();
+    size = contents.size();
+  }
+}
+
+MappedFile::~MappedFile()
+{
+#if !defined(_WIN32) && !defined(WIN32)
+  if (mapped)
+    munmap((void*)data, size);
+#endif
+}
+
+void MappedFile::prefetch(size_t offset, size_t numBytes) const
+{
+#if !defined(_WIN32) && !defined(WIN32)
+  if ((mapped == false) || (offset >= size))
+    return;
+  if (numBytes > size - offset)
+    numBytes = size - offset;
+  // madvise needs a page-aligned address
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t alignedOffset = offset / pageSize * pageSize;
+  madvise((void*)(data + alignedOffset), offset + numBytes - alignedOffset, MADV_WILLNEED);
+#endif
+}
+
@@ -0,0 +1,38 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// A read-only view of a whole file. The file is memory-mapped where supported,
+// so that only the pages that are accessed are read from the disk; otherwise it is read into memory.
+class MappedFile
+{
+public:
+  // Check isOpen() for success.
+  explicit MappedFile(const std::string & filename);
+  virtual ~MappedFile();
+
+  bool isOpen() const { return data != nullptr; }
+  const char * getData() const { return data; }
+  size_t getSize() const { return size; }
+
+  // Asks the operating system to read the bytes [offset, offset + numBytes) ahead of time (does nothing if unsupported).
+  void prefetch(size_t offset, size_t numBytes) const;
+
+protected:
+  MappedFile(const MappedFile &) = delete;
+  MappedFile & operator=(const MappedFile &) = delete;
+
+  const char * data = nullptr;
+  size_t size = 0;
+  bool mapped = false;
+  std::vector<char> contents; // the file, if it is not memory-mapped
+};
+
+#endif
+
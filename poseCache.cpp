@@ -0,0 +1,133 @@
+#include "poseCache.h"
+#include <math.h>
+#include <algorithm>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+PoseCache::PoseCache(int numIKHandles_, int numJoints_, int numVertices_, size_t memoryBudget_, double positionQuantum, double angleQuantum) :
+  numIKHandles(numIKHandles_), numJoints(numJoints_), numVertices(max(numVertices_, 0)), memoryBudget(memoryBudget_)
+{
+  inversePositionQuantum = (positionQuantum > 0.0) ? 1.0 / positionQuantum : 1.0;
+  inverseAngleQuantum = (angleQuantum > 0.0) ? 1.0 / angleQuantum : 1.0;
+  queryKey.resize(3 * (numIKHandles + numJoints));
+}
+
+size_t PoseCache::KeyHash::operator()(const Key & key) const
+{
+  // FNV-1a over the quantized values
+  unsigned long long h = 14695981039346656037ULL;
+  for(long long v : key)
+  {
+    h ^= (unsigned long long)v;
+    h *= 1099511628211ULL;
+  }
+  return (size_t)h;
+}
+
+void PoseCache::buildKey(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles)
+{
+  long long * k = queryKey.data();
+  for(int i = 0; i < numIKHandles; i++)
+    for(int d = 0; d < 3; d++)
+      *(k++) = llround(targetHandlePositions[i][d] * inversePositionQuantum);
+  for(int i = 0; i < numJoints; i++)
+    for(int d = 0; d < 3; d++)
+      *(k++) = llround(seedEulerAngles[i][d] * inverseAngleQuantum);
+}
+
+size_t PoseCache::getEntrySize(bool withSkinnedVertices) const
+{
+  // the key is stored twice (in the list entry and in the hash map); the constant approximates the list node, hash node and vector headers
+  size_t size = 2 * queryKey.size() * sizeof(long long) + numJoints * sizeof(Vec3d) + 128;
+  if (withSkinnedVertices)
+    size += 3 * numVertices * sizeof(double);
+  return size;
+}
+
+void PoseCache::evictUntil(size_t targetUsage)
+{
+  while ((memoryUsage > targetUsage) && (entries.size() > 0))
+  {
+    Entry & entry = entries.back();
+    memoryUsage -= getEntrySize(entry.skinnedVertices.size() > 0);
+    entryMap.erase(entry.key);
+    entries.pop_back();
+    numEvictions++;
+  }
+}
+
+bool PoseCache::find(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles, Vec3d * solvedEulerAngles,
+    double * skinnedVertices, bool * hasSkinnedVertices)
+{
+  if (hasSkinnedVertices)
+    *hasSkinnedVertices = false;
+
+  buildKey(targetHandlePositions, seedEulerAngles);
+  auto it = entryMap.find(queryKey);
+  if (it == entryMap.end())
+  {
+    numMisses++;
+    return false;
+  }
+  numHits++;
+
+  // move to the front of the LRU list
+  EntryList::iterator entry = it->second;
+  entries.splice(entries.begin(), entries, entry);
+
+  copy(entry->eulerAngles.begin(), entry->eulerAngles.end(), solvedEulerAngles);
+  if (skinnedVertices && (entry->skinnedVertices.size() > 0))
+  {
+    copy(entry->skinnedVertices.begin(), entry->skinnedVertices.end(), skinnedVertices);
+    if (hasSkinnedVertices)
+      *hasSkinnedVertices = true;
+  }
+  return true;
+}
+
+void PoseCache::insert(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles, const Vec3d * solvedEulerAngles,
+    const double * skinnedVertices)
+{
+  bool withSkinnedVertices = (skinnedVertices != nullptr) && (numVertices > 0);
+  size_t entrySize = getEntrySize(withSkinnedVertices);
+  if (entrySize > memoryBudget)
+    return;
+
+  buildKey(targetHandlePositions, seedEulerAngles);
+  auto it = entryMap.find(queryKey);
+  if (it != entryMap.end())
+  {
+    // replace the existing entry
+    EntryList::iterator entry = it->second;
+    memoryUsage -= getEntrySize(entry->skinnedVertices.size() > 0);
+    entries.erase(entry);
+    entryMap.erase(it);
+  }
+
+  evictUntil(memoryBudget - entrySize);
+
+  entries.emplace_front();
+  Entry & entry = entries.front();
+  entry.key = queryKey;
+  entry.eulerAngles.assign(solvedEulerAngles, solvedEulerAngles + numJoints);
+  if (withSkinnedVertices)
+    entry.skinnedVertices.assign(skinnedVertices, skinnedVertices + 3 * numVertices);
+  entryMap.emplace(queryKey, entries.begin());
+  memoryUsage += entrySize;
+}
+
+void PoseCache::clear()
+{
+  entries.clear();
+  entryMap.clear();
+  memoryUsage = 0;
+}
+
+void PoseCache::setMemoryBudget(size_t memoryBudget)
+{
+  this->memoryBudget = memoryBudget;
+  evictUntil(memoryBudget);
+}
+
@@ -0,0 +1,93 @@
+#ifndef POSECACHE_H
+#define POSECACHE_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "vec3d.h"
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstddef>
+
+// A least-recently-used cache of IK results.
+// An entry maps the IK handle targets and the seed pose (the Euler angles before the IK solve) to the solved Euler angles,
+// and optionally to the skinned mesh vertex positions of the solved pose.
+// When handles are driven from recorded input or snapped in the UI, the same (targets, seed) pairs recur,
+// and a cache hit replaces the IK solve and the skinning.
+// Targets are quantized to a grid of spacing "positionQuantum", and the seed Euler angles to multiples of "angleQuantum" (degrees);
+// two queries whose quantized values are equal hit the same entry.
+// The cache is not thread-safe.
+class PoseCache
+{
+public:
+  // numIKHandles: number of IK handles (targets) per query
+  // numJoints: number of joints in the Euler angle arrays
+  // numVertices: number of mesh vertices stored with each entry; use 0 to only cache the Euler angles
+  // memoryBudget: maximum number of bytes used by the entries; the least recently used entries are evicted to stay within it
+  PoseCache(int numIKHandles, int numJoints, int numVertices, size_t memoryBudget, double positionQuantum, double angleQuantum = 1e-4);
+
+  // Looks up the entry for the given targets and seed Euler angles (length numJoints).
+  // On a hit, copies the solved Euler angles to "solvedEulerAngles" (may be the same array as "seedEulerAngles"),
+  // and, if the entry has them and "skinnedVertices" is not nullptr, the 3*numVertices skinned vertex positions to "skinnedVertices".
+  // Returns true on a hit. "hasSkinnedVertices" (optional) is set to whether the vertex positions were copied.
+  bool find(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles, Vec3d * solvedEulerAngles,
+      double * skinnedVertices = nullptr, bool * hasSkinnedVertices = nullptr);
+
+  // Stores the result of solving IK from "seedEulerAngles" towards "targetHandlePositions".
+  // skinnedVertices: 3*numVertices positions, or nullptr to store only the Euler angles.
+  // Replaces an existing entry with the same key. Does nothing if a single entry does not fit into the memory budget.
+  void insert(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles, const Vec3d * solvedEulerAngles,
+      const double * skinnedVertices = nullptr);
+
+  // Removes all entries. The counters are kept.
+  void clear();
+
+  void setMemoryBudget(size_t memoryBudget); // evicts entries if needed
+  size_t getMemoryBudget() const { return memoryBudget; }
+  size_t getMemoryUsage() const { return memoryUsage; }
+  int getNumEntries() const { return (int)entries.size(); }
+
+  // statistics
+  long long getNumHits() const { return numHits; }
+  long long getNumMisses() const { return numMisses; }
+  long long getNumEvictions() const { return numEvictions; }
+  double getHitRate() const { return (numHits + numMisses > 0) ? (double)numHits / (numHits + numMisses) : 0.0; }
+  void resetCounters() { numHits = numMisses = numEvictions = 0; }
+
+protected:
+  typedef std::vector<long long> Key;
+  struct KeyHash
+  {
+    size_t operator()(const Key & key) const;
+  };
+  struct Entry
+  {
+    Key key;
+    std::vector<Vec3d> eulerAngles;
+    std::vector<double> skinnedVertices; // empty if not stored
+  };
+  typedef std::list<Entry> EntryList;
+
+  // computes the quantized key of (targets, seed) into "queryKey"
+  void buildKey(const Vec3d * targetHandlePositions, const Vec3d * seedEulerAngles);
+  size_t getEntrySize(bool withSkinnedVertices) const;
+  void evictUntil(size_t targetUsage);
+
+  int numIKHandles = 0;
+  int numJoints = 0;
+  int numVertices = 0;
+  size_t memoryBudget = 0;
+  size_t memoryUsage = 0;
+  double inversePositionQuantum = 1.0;
+  double inverseAngleQuantum = 1.0;
+
+  EntryList entries; // most recently used first
+  std::unordered_map<Key, EntryList::iterator, KeyHash> entryMap;
+  Key queryKey; // reused between queries, to avoid allocations
+
+  long long numHits = 0, numMisses = 0, numEvictions = 0;
+};
+
+#endif
+
@@ -1,9 +1,16 @@
 #include "skinning.h"
 #include "vec3d.h"
+#include "workerPool.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <bitset>
 #include <Eigen/Dense>
 #include <Eigen/Geometry>
 using namespace std;
@@ -12,11 +19,43 @@ using namespace Eigen;
 // CSCI 520 Computer Animation and Simulation
 // Jernej Barbic and Yijing Li
 
+namespace
+{
+
+const char * const methodNames[Skinning::NUM_METHODS] = { "dualQuaternion", "linearBlend", "centerOfRotation" };
+
+const char centersOfRotationMagic[8] = { 'I', 'K', 'C', 'O', 'R', 0, 0, 0 };
+const uint32_t centersOfRotationVersion = 1;
+// the cache file: the header, then numVertices chars (whether the vertex has a center), then 3 * numVertices doubles (the centers)
+struct CentersOfRotationHeader
+{
+  char magic[8]; // "IKCOR\0\0\0"
+  uint32_t version;
+  uint32_t numVertices;
+  uint64_t hash; // of the rest positions, triangles and weights
+};
+
+// 64-bit FNV-1a
+const uint64_t fnvOffsetBasis = 14695981039346656037ULL;
+void hashBytes(uint64_t & hash, const void * data, size_t size)
+{
+  const unsigned char * bytes = (const unsigned char *)data;
+  for(size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+}
+
+}
+
+const double Skinning::centerOfRotationSigma = 0.1;
+
 Skinning::Skinning(int numMeshVertices, const double * restMeshVertexPositions,
     const std::string & meshSkinningWeightsFilename)
 {
   this->numMeshVertices = numMeshVertices;
-  this->restMeshVertexPositions = restMeshVertexPositions;
+  this->restMeshVertexPositions.assign(restMeshVertexPositions, restMeshVertexPositions + 3 * numMeshVertices);
 
   cout << "Loading skinning weights..." << endl;
   ifstream fin(meshSkinningWeightsFilename.c_str());
@@ -25,7 +64,7 @@ Skinning::Skinning(int numMeshVertices, const double * restMeshVertexPositions,
   fin >> numWeightMatrixRows >> numWeightMatrixCols;
   assert(fin.fail() == false);
   assert(numWeightMatrixRows == numMeshVertices);
-  int numJoints = numWeightMatrixCols;
+  numJoints = numWeightMatrixCols;
 
   vector<vector<int>> weightMatrixColumnIndices(numWeightMatrixRows);
   vector<vector<double>> weightMatrixEntries(numWeightMatrixRows);
@@ -72,6 +111,134 @@ Skinning::Skinning(int numMeshVertices, const double * restMeshVertexPositions,
     // Note: When the number of joints used on this vertex is smaller than numJointsInfluencingEachVertex,
     // the remaining empty entries are initialized to zero due to vector::assign(XX, 0.0) .
   }
+
+  buildClusters();
+}
+
+void Skinning::renumberVertices(const vector<int> & permutation)
+{
+  assert((int)permutation.size() == numMeshVertices);
+  vector<int> renumberedJoints(meshSkinningJoints.size());
+  vector<double> renumberedWeights(meshSkinningWeights.size());
+  for (int vtxID = 0; vtxID < numMeshVertices; vtxID++)
+    for(int j = 0; j < numJointsInfluencingEachVertex; j++)
+    {
+      renumberedJoints[permutation[vtxID] * numJointsInfluencingEachVertex + j] = meshSkinningJoints[vtxID * numJointsInfluencingEachVertex + j];
+      renumberedWeights[permutation[vtxID] * numJointsInfluencingEachVertex + j] = meshSkinningWeights[vtxID * numJointsInfluencingEachVertex + j];
+    }
+  meshSkinningJoints.swap(renumberedJoints);
+  meshSkinningWeights.swap(renumberedWeights);
+  if (hasCentersOfRotation())
+  {
+    vector<double> renumberedCenters(centersOfRotation.size());
+    vector<char> renumberedHasCenter(vertexHasCenterOfRotation.size());
+    for (int vtxID = 0; vtxID < numMeshVertices; vtxID++)
+    {
+      for(int d = 0; d < 3; d++)
+        renumberedCenters[3 * permutation[vtxID] + d] = centersOfRotation[3 * vtxID + d];
+      renumberedHasCenter[permutation[vtxID]] = vertexHasCenterOfRotation[vtxID];
+    }
+    centersOfRotation.swap(renumberedCenters);
+    vertexHasCenterOfRotation.swap(renumberedHasCenter);
+  }
+  buildClusters();
+}
+
+void Skinning::setWeightQuantum(double weightQuantum)
+{
+  this->weightQuantum = weightQuantum;
+  buildClusters();
+}
+
+size_t Skinning::getMemoryUsage() const
+{
+  return sizeof(double) * (restMeshVertexPositions.capacity() + meshSkinningWeights.capacity() + clusterWeights.capacity() +
+    centersOfRotation.capacity() + clusterRestPositions.capacity() + clusterCentersOfRotation.capacity()) + sizeof(int) * (meshSkinningJoints.capacity() + clusterJoints.capacity() + clusterVertexStarts.capacity() +
+    clusterVertices.capacity() + jointClusterStarts.capacity() + jointClusters.capacity()) + vertexHasCenterOfRotation.capacity();
+}
+
+void Skinning::buildClusters()
+{
+  int numInfluences = numJointsInfluencingEachVertex;
+  clusterJoints.clear();
+  clusterWeights.clear();
+
+  // assign each vertex to the cluster of its (joints, weights) signature, numbering the clusters by their first vertex
+  vector<int> vertexClusters(numMeshVertices);
+  int numClusters = 0;
+  map<vector<double>, int> signatureClusters;
+  vector<double> signature(2 * numInfluences);
+  for (int vtxID = 0; vtxID < numMeshVertices; vtxID++)
+  {
+    double weightSum = 0.0;
+    for(int j = 0; j < numInfluences; j++)
+    {
+      double weight = meshSkinningWeights[vtxID * numInfluences + j];
+      if (weightQuantum > 0.0)
+        weight = weightQuantum * round(weight / weightQuantum);
+      // a joint with zero weight has no influence
+      signature[j] = (weight == 0.0) ? 0 : meshSkinningJoints[vtxID * numInfluences + j];
+      signature[numInfluences + j] = weight;
+      weightSum += weight;
+    }
+    // the rounded weights no longer sum to one, which would scale the vertex under LINEAR_BLEND and CENTER_OF_ROTATION
+    if ((weightQuantum > 0.0) && (weightSum > 0.0))
+      for(int j = 0; j < numInfluences; j++)
+        signature[numInfluences + j] /= weightSum;
+    int cluster = numClusters;
+    if (weightQuantum >= 0.0)
+      cluster = signatureClusters.emplace(signature, numClusters).first->second;
+    if (cluster == numClusters)
+    {
+      clusterJoints.insert(clusterJoints.end(), signature.begin(), signature.begin() + numInfluences);
+      clusterWeights.insert(clusterWeights.end(), signature.begin() + numInfluences, signature.end());
+      numClusters++;
+    }
+    vertexClusters[vtxID] = cluster;
+  }
+
+  // list the vertices of each cluster
+  clusterVertexStarts.assign(numClusters + 1, 0);
+  for (int vtxID = 0; vtxID < numMeshVertices; vtxID++)
+    clusterVertexStarts[vertexClusters[vtxID] + 1]++;
+  numClusteredVertices = 0;
+  for(int cluster = 0; cluster < numClusters; cluster++)
+  {
+    int clusterSize = clusterVertexStarts[cluster + 1];
+    if (clusterSize > 1)
+      numClusteredVertices += clusterSize;
+    clusterVertexStarts[cluster + 1] += clusterVertexStarts[cluster];
+  }
+  clusterVertices.resize(numMeshVertices);
+  vector<int> clusterEnds(clusterVertexStarts.begin(), clusterVertexStarts.end() - 1);
+  for (int vtxID = 0; vtxID < numMeshVertices; vtxID++)
+    clusterVertices[clusterEnds[vertexClusters[vtxID]]++] = vtxID;
+  buildClusterVertexPositions();
+
+  // the inverse influence index: the clusters of each joint
+  jointClusterStarts.assign(numJoints + 1, 0);
+  for(size_t i = 0; i < clusterJoints.size(); i++)
+    if (clusterWeights[i] != 0.0)
+      jointClusterStarts[clusterJoints[i] + 1]++;
+  for(int jointID = 0; jointID < numJoints; jointID++)
+    jointClusterStarts[jointID + 1] += jointClusterStarts[jointID];
+  jointClusters.resize(jointClusterStarts[numJoints]);
+  vector<int> jointClusterEnds(jointClusterStarts.begin(), jointClusterStarts.end() - 1);
+  for(size_t i = 0; i < clusterJoints.size(); i++)
+    if (clusterWeights[i] != 0.0)
+      jointClusters[jointClusterEnds[clusterJoints[i]]++] = i / numInfluences;
+}
+
+void Skinning::buildClusterVertexPositions()
+{
+  clusterRestPositions.resize(3 * numMeshVertices);
+  for(int k = 0; k < numMeshVertices; k++)
+    for(int d = 0; d < 3; d++)
+      clusterRestPositions[3 * k + d] = restMeshVertexPositions[3 * clusterVertices[k] + d];
+  clusterCentersOfRotation.resize(centersOfRotation.size());
+  for(size_t k = 0; 3 * k < centersOfRotation.size(); k++)
+    for(int d = 0; d < 3; d++)
+      clusterCentersOfRotation[3 * k + d] = centersOfRotation[3 * clusterVertices[k] + d];
 }
 
 /**********************************************************************************/
@@ -110,66 +277,130 @@ Skinning::Skinning(int numMeshVertices, const double * restMeshVertexPositions,
 //   }
 // }
 
+void Skinning::computeJointMatrices(const RigidTransform4d * jointSkinTransforms, vector<double> & jointMatrices) const
+{
+  jointMatrices.resize(12 * numJoints);
+  for(int jointID = 0; jointID < numJoints; jointID++)
+  {
+    Mat3d rotation = jointSkinTransforms[jointID].getLinearTrans();
+    Vec3d translation = jointSkinTransforms[jointID].getTranslation();
+    double * matrix = &jointMatrices[12 * jointID];
+    for(int rowID = 0; rowID < 3; rowID++)
+    {
+      for(int colID = 0; colID < 3; colID++)
+        matrix[4 * rowID + colID] = rotation[rowID][colID];
+      matrix[4 * rowID + 3] = translation[rowID];
+    }
+  }
+}
+
+void Skinning::skinClusterLinearBlend(int cluster, const double * jointMatrices, double * newMeshVertexPositions) const
+{
+  // the weighted sum of the joint matrices
+  double blended[12] = { 0.0 };
+  for(int j = 0; j < numJointsInfluencingEachVertex; j++)
+  {
+    int currInd = numJointsInfluencingEachVertex * cluster + j;
+    double weight = clusterWeights[currInd];
+    const double * matrix = &jointMatrices[12 * clusterJoints[currInd]];
+    for(int k = 0; k < 12; k++)
+      blended[k] += weight * matrix[k];
+  }
+
+  for(int k = clusterVertexStarts[cluster]; k < clusterVertexStarts[cluster + 1]; k++)
+  {
+    int i = clusterVertices[k];
+    const double * restPosition = &clusterRestPositions[3 * k];
+    for(int d = 0; d < 3; d++)
+      newMeshVertexPositions[3 * i + d] = blended[4 * d + 0] * restPosition[0] + blended[4 * d + 1] * restPosition[1] +
+        blended[4 * d + 2] * restPosition[2] + blended[4 * d + 3];
+  }
+}
+
 /**********************************************************************************/
 /*                    Dual Quaternion Skinning Implementation                     */
 /**********************************************************************************/
-void Skinning::applySkinning(const RigidTransform4d * jointSkinTransforms, double * newMeshVertexPositions) const
+void Skinning::computeJointDualQuaternions(const RigidTransform4d * jointSkinTransforms, vector<double> & jointDualQuaternions) const
 {
-  // Students should implement this
-  // Formula: currNewVertPosVec = sum_overRelaventJoints(jointWight_j * dual_quaternion(q0,q1))
-
-  int currInd;
-  Mat3d currRotation;
-  Vec3d currTranslation;
-  for(int i=0; i<numMeshVertices; i++)
+  jointDualQuaternions.resize(8 * numJoints);
+  for(int jointID = 0; jointID < numJoints; jointID++)
   {
-    // get restMeshVertPos (x)
-    Vector3d currRestMeshVertPosVec = {restMeshVertexPositions[3 * i + 0],
-                                       restMeshVertexPositions[3 * i + 1],
-                                       restMeshVertexPositions[3 * i + 2]};
+    // extract rotation and translation
+    Mat3d currRotation = jointSkinTransforms[jointID].getLinearTrans();
+    Vec3d currTranslation = jointSkinTransforms[jointID].getTranslation();
 
-    Quaterniond currNewQ0(0,0,0,0), currNewQ1(0,0,0,0);
-    // calculate current joint position based on the formula
-    for(int j=0; j<numJointsInfluencingEachVertex; j++)
-    {
-      currInd = numJointsInfluencingEachVertex * i + j;
-
-      // extract rotation and translation
-      currRotation = jointSkinTransforms[meshSkinningJoints[currInd]].getLinearTrans();
-      currTranslation = jointSkinTransforms[meshSkinningJoints[currInd]].getTranslation();
-
-      // form q0
-      // convert rotation to eigen matrix for quaternion calculation
-      Matrix3d currRotationEigenMat(3,3);
-      for(int rowID = 0; rowID < 3; rowID++)
-        for(int colID = 0; colID < 3; colID++)
-          currRotationEigenMat(rowID,colID) = currRotation[rowID][colID];
-      Quaterniond q0 = Quaterniond(currRotationEigenMat);
-
-      // check if angle < 0
-      if(q0.dot(currNewQ0) < 0) {
-        q0 = q0.coeffs() * -1;
-      }
+    // form q0
+    // convert rotation to eigen matrix for quaternion calculation
+    Matrix3d currRotationEigenMat(3,3);
+    for(int rowID = 0; rowID < 3; rowID++)
+      for(int colID = 0; colID < 3; colID++)
+        currRotationEigenMat(rowID,colID) = currRotation[rowID][colID];
+    Quaterniond q0 = Quaterniond(currRotationEigenMat);
 
-      // form q1
-      Quaterniond t = Quaterniond(0, currTranslation[0], currTranslation[1], currTranslation[2]);
-      t = t.coeffs() * 0.5;
-      Quaterniond q1 = t * q0;
+    // form q1
+    Quaterniond t = Quaterniond(0, currTranslation[0], currTranslation[1], currTranslation[2]);
+    t = t.coeffs() * 0.5;
+    Quaterniond q1 = t * q0;
 
-      // summing up dual quaternion
-      currNewQ0.coeffs() += meshSkinningWeights[currInd] * q0.coeffs();
-      currNewQ1.coeffs() += meshSkinningWeights[currInd] * q1.coeffs();
+    Map<Vector4d> q0Coefficients(&jointDualQuaternions[8 * jointID + 0]), q1Coefficients(&jointDualQuaternions[8 * jointID + 4]);
+    q0Coefficients = q0.coeffs();
+    q1Coefficients = q1.coeffs();
+  }
+}
+
+void Skinning::computeJointQuaternions(const RigidTransform4d * jointSkinTransforms, vector<double> & jointQuaternions) const
+{
+  jointQuaternions.resize(4 * numJoints);
+  for(int jointID = 0; jointID < numJoints; jointID++)
+  {
+    Mat3d rotation = jointSkinTransforms[jointID].getLinearTrans();
+    Matrix3d rotationEigenMat;
+    for(int rowID = 0; rowID < 3; rowID++)
+      for(int colID = 0; colID < 3; colID++)
+        rotationEigenMat(rowID, colID) = rotation[rowID][colID];
+    Map<Vector4d> q0Coefficients(&jointQuaternions[4 * jointID]);
+    q0Coefficients = Quaterniond(rotationEigenMat).coeffs();
+  }
+}
+
+void Skinning::skinClusterDualQuaternion(int cluster, const double * jointDualQuaternions, double * newMeshVertexPositions) const
+{
+  Quaterniond currNewQ0(0,0,0,0), currNewQ1(0,0,0,0);
+  // calculate current joint position based on the formula
+  for(int j=0; j<numJointsInfluencingEachVertex; j++)
+  {
+    int currInd = numJointsInfluencingEachVertex * cluster + j;
+    Quaterniond q0(Map<const Vector4d>(&jointDualQuaternions[8 * clusterJoints[currInd] + 0]));
+    Quaterniond q1(Map<const Vector4d>(&jointDualQuaternions[8 * clusterJoints[currInd] + 4]));
+
+    // check if angle < 0
+    if(q0.dot(currNewQ0) < 0) {
+      q0 = q0.coeffs() * -1;
+      q1 = q1.coeffs() * -1;
     }
 
-    Quaterniond c0, c_eps;
-    c0 = currNewQ0.coeffs() / currNewQ0.norm();
-    c_eps = currNewQ1.coeffs() / currNewQ0.norm();
+    // summing up dual quaternion
+    currNewQ0.coeffs() += clusterWeights[currInd] * q0.coeffs();
+    currNewQ1.coeffs() += clusterWeights[currInd] * q1.coeffs();
+  }
+
+  Quaterniond c0, c_eps;
+  c0 = currNewQ0.coeffs() / currNewQ0.norm();
+  c_eps = currNewQ1.coeffs() / currNewQ0.norm();
+
+  // calculate final rotation and translation
+  Matrix3d currFinalRotation = c0.toRotationMatrix();
+  Vector3d currFinalTranslation = {2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[1] + c_eps.coeffs()[1]*c_eps.coeffs()[0] - c_eps.coeffs()[2]*c_eps.coeffs()[3] + c_eps.coeffs()[3]*c_eps.coeffs()[2]),
+                                   2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[2] + c_eps.coeffs()[1]*c_eps.coeffs()[3] + c_eps.coeffs()[2]*c_eps.coeffs()[0] - c_eps.coeffs()[3]*c_eps.coeffs()[1]),
+                                   2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[3] - c_eps.coeffs()[1]*c_eps.coeffs()[2] + c_eps.coeffs()[2]*c_eps.coeffs()[1] + c_eps.coeffs()[3]*c_eps.coeffs()[0])};
 
-    // calculate final rotation and translation
-    Matrix3d currFinalRotation = c0.toRotationMatrix();
-    Vector3d currFinalTranslation = {2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[1] + c_eps.coeffs()[1]*c_eps.coeffs()[0] - c_eps.coeffs()[2]*c_eps.coeffs()[3] + c_eps.coeffs()[3]*c_eps.coeffs()[2]),
-                                     2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[2] + c_eps.coeffs()[1]*c_eps.coeffs()[3] + c_eps.coeffs()[2]*c_eps.coeffs()[0] - c_eps.coeffs()[3]*c_eps.coeffs()[1]),
-                                     2 * (-c_eps.coeffs()[0]*c_eps.coeffs()[3] - c_eps.coeffs()[1]*c_eps.coeffs()[2] + c_eps.coeffs()[2]*c_eps.coeffs()[1] + c_eps.coeffs()[3]*c_eps.coeffs()[0])};
+  for(int k = clusterVertexStarts[cluster]; k < clusterVertexStarts[cluster + 1]; k++)
+  {
+    int i = clusterVertices[k];
+    // get restMeshVertPos (x)
+    Vector3d currRestMeshVertPosVec = {clusterRestPositions[3 * k + 0],
+                                       clusterRestPositions[3 * k + 1],
+                                       clusterRestPositions[3 * k + 2]};
 
     // calculate new vertex position
     Vector3d currNewVertPosVec = currFinalTranslation + currFinalRotation * currRestMeshVertPosVec;
@@ -178,4 +409,319 @@ void Skinning::applySkinning(const RigidTransform4d * jointSkinTransforms, doubl
     newMeshVertexPositions[3 * i + 1] = currNewVertPosVec[1];
     newMeshVertexPositions[3 * i + 2] = currNewVertPosVec[2];
   }
-}
\ No newline at end of file
+}
+
+void Skinning::computeJointBlendData(const RigidTransform4d * jointSkinTransforms, JointBlendData & jointBlendData) const
+{
+  if (method == DUAL_QUATERNION)
+    computeJointDualQuaternions(jointSkinTransforms, jointBlendData.dualQuaternions);
+  else if (method == CENTER_OF_ROTATION) // only the rotations; the translations come from the matrices
+    computeJointQuaternions(jointSkinTransforms, jointBlendData.quaternions);
+  if (method != DUAL_QUATERNION)
+    computeJointMatrices(jointSkinTransforms, jointBlendData.matrices);
+}
+
+void Skinning::skinCluster(int cluster, const JointBlendData & jointBlendData, double * newMeshVertexPositions) const
+{
+  switch(method)
+  {
+    case LINEAR_BLEND:
+      skinClusterLinearBlend(cluster, jointBlendData.matrices.data(), newMeshVertexPositions);
+    break;
+
+    case CENTER_OF_ROTATION:
+      skinClusterCenterOfRotation(cluster, jointBlendData.quaternions.data(), jointBlendData.matrices.data(), newMeshVertexPositions);
+    break;
+
+    default:
+      skinClusterDualQuaternion(cluster, jointBlendData.dualQuaternions.data(), newMeshVertexPositions);
+    break;
+  }
+}
+
+const char * Skinning::getMethodName(Method method)
+{
+  assert(method >= 0 && method < NUM_METHODS);
+  return methodNames[method];
+}
+
+int Skinning::getMethodFromName(const char * name, Method * method)
+{
+  for(int i = 0; i < NUM_METHODS; i++)
+  {
+    if (strcmp(name, methodNames[i]) == 0)
+    {
+      *method = (Method)i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void Skinning::applySkinning(const RigidTransform4d * jointSkinTransforms, double * newMeshVertexPositions) const
+{
+  // Students should implement this
+  // Formula: currNewVertPosVec = sum_overRelaventJoints(jointWight_j * dual_quaternion(q0,q1))
+
+  // the dual quaternions are computed once per joint, and blended once per influence cluster
+  JointBlendData jointBlendData;
+  computeJointBlendData(jointSkinTransforms, jointBlendData);
+  for(int cluster = 0; cluster < getNumClusters(); cluster++)
+    skinCluster(cluster, jointBlendData, newMeshVertexPositions);
+}
+
+int Skinning::applySkinning(const RigidTransform4d * jointSkinTransforms, const char * changedJoints, double * newMeshVertexPositions,
+    vector<int> * dirtyVertices) const
+{
+  // the clusters influenced by the changed joints, from the inverse influence index
+  vector<int> dirtyClusters;
+  for(int jointID = 0; jointID < numJoints; jointID++)
+    if (changedJoints[jointID])
+      dirtyClusters.insert(dirtyClusters.end(), jointClusters.begin() + jointClusterStarts[jointID], jointClusters.begin() + jointClusterStarts[jointID + 1]);
+  sort(dirtyClusters.begin(), dirtyClusters.end());
+  dirtyClusters.erase(unique(dirtyClusters.begin(), dirtyClusters.end()), dirtyClusters.end());
+
+  JointBlendData jointBlendData;
+  if (dirtyClusters.size() > 0)
+    computeJointBlendData(jointSkinTransforms, jointBlendData);
+  if (dirtyVertices)
+    dirtyVertices->clear();
+  int numDirtyVertices = 0;
+  for(int cluster : dirtyClusters)
+  {
+    skinCluster(cluster, jointBlendData, newMeshVertexPositions);
+    numDirtyVertices += clusterVertexStarts[cluster + 1] - clusterVertexStarts[cluster];
+    if (dirtyVertices)
+      dirtyVertices->insert(dirtyVertices->end(), clusterVertices.begin() + clusterVertexStarts[cluster],
+          clusterVertices.begin() + clusterVertexStarts[cluster + 1]);
+  }
+  return numDirtyVertices;
+}
+
+/**********************************************************************************/
+/*               Optimized Centers of Rotation Skinning Implementation            */
+/**********************************************************************************/
+void Skinning::skinClusterCenterOfRotation(int cluster, const double * jointQuaternions, const double * jointMatrices,
+    double * newMeshVertexPositions) const
+{
+  // the blend of the joint rotation quaternions (in one hemisphere), and the linear blend L of the joint matrices
+  double blendedQ[4] = { 0.0, 0.0, 0.0, 0.0 };
+  double blended[12] = { 0.0 };
+  for(int j = 0; j < numJointsInfluencingEachVertex; j++)
+  {
+    int currInd = numJointsInfluencingEachVertex * cluster + j;
+    double weight = clusterWeights[currInd];
+    const double * q = &jointQuaternions[4 * clusterJoints[currInd]];
+    double quaternionWeight = (q[0] * blendedQ[0] + q[1] * blendedQ[1] + q[2] * blendedQ[2] + q[3] * blendedQ[3] < 0.0) ? -weight : weight;
+    for(int k = 0; k < 4; k++)
+      blendedQ[k] += quaternionWeight * q[k];
+    const double * matrix = &jointMatrices[12 * clusterJoints[currInd]];
+    for(int k = 0; k < 12; k++)
+      blended[k] += weight * matrix[k];
+  }
+
+  // the rotation matrix R of the normalized blended quaternion (x, y, z, w)
+  double x = blendedQ[0], y = blendedQ[1], z = blendedQ[2], w = blendedQ[3];
+  double s = 2.0 / (x * x + y * y + z * z + w * w);
+  double R[9] = { 1.0 - s * (y * y + z * z), s * (x * y - w * z), s * (x * z + w * y),
+                  s * (x * y + w * z), 1.0 - s * (x * x + z * z), s * (y * z - w * x),
+                  s * (x * z - w * y), s * (y * z + w * x), 1.0 - s * (x * x + y * y) };
+
+  // v' = R (v - p) + L p: the vertex is rotated by R around its center of rotation p, which is moved by linear blend skinning.
+  // The center of a vertex without one is the vertex itself, so that v' = L v.
+  const double * centers = hasCentersOfRotation() ? clusterCentersOfRotation.data() : clusterRestPositions.data();
+  for(int k = clusterVertexStarts[cluster]; k < clusterVertexStarts[cluster + 1]; k++)
+  {
+    int i = clusterVertices[k];
+    const double * restPosition = &clusterRestPositions[3 * k];
+    const double * center = &centers[3 * k];
+    double offset[3] = { restPosition[0] - center[0], restPosition[1] - center[1], restPosition[2] - center[2] };
+    for(int d = 0; d < 3; d++)
+      newMeshVertexPositions[3 * i + d] = R[3 * d + 0] * offset[0] + R[3 * d + 1] * offset[1] + R[3 * d + 2] * offset[2] +
+        blended[4 * d + 0] * center[0] + blended[4 * d + 1] * center[1] + blended[4 * d + 2] * center[2] + blended[4 * d + 3];
+  }
+}
+
+int Skinning::getNumCentersOfRotation() const
+{
+  return (int)count(vertexHasCenterOfRotation.begin(), vertexHasCenterOfRotation.end(), 1);
+}
+
+unsigned long long Skinning::computeCentersOfRotationHash(int numTriangles, const int * triangles) const
+{
+  uint64_t hash = fnvOffsetBasis;
+  hashBytes(hash, &numMeshVertices, sizeof(int));
+  hashBytes(hash, restMeshVertexPositions.data(), sizeof(double) * restMeshVertexPositions.size());
+  hashBytes(hash, &numTriangles, sizeof(int));
+  hashBytes(hash, triangles, sizeof(int) * 3 * numTriangles);
+  hashBytes(hash, &numJointsInfluencingEachVertex, sizeof(int));
+  hashBytes(hash, meshSkinningJoints.data(), sizeof(int) * meshSkinningJoints.size());
+  hashBytes(hash, meshSkinningWeights.data(), sizeof(double) * meshSkinningWeights.size());
+  hashBytes(hash, &centerOfRotationSigma, sizeof(double));
+  return hash;
+}
+
+int Skinning::loadCentersOfRotation(const string & filename, unsigned long long hash)
+{
+  ifstream fin(filename.c_str(), ios::binary);
+  if (!fin)
+    return 1;
+  CentersOfRotationHeader h;
+  fin.read((char *)&h, sizeof(h));
+  if (!fin || (memcmp(h.magic, centersOfRotationMagic, sizeof(centersOfRotationMagic)) != 0) || (h.version != centersOfRotationVersion) ||
+      ((int)h.numVertices != numMeshVertices) || (h.hash != hash))
+    return 1;
+
+  vector<char> hasCenter(numMeshVertices);
+  vector<double> centers(3 * numMeshVertices);
+  fin.read(hasCenter.data(), numMeshVertices);
+  fin.read((char *)centers.data(), sizeof(double) * centers.size());
+  if (!fin)
+    return 1;
+  vertexHasCenterOfRotation.swap(hasCenter);
+  centersOfRotation.swap(centers);
+  buildClusterVertexPositions();
+  return 0;
+}
+
+int Skinning::saveCentersOfRotation(const string & filename, unsigned long long hash) const
+{
+  CentersOfRotationHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, centersOfRotationMagic, sizeof(centersOfRotationMagic));
+  h.version = centersOfRotationVersion;
+  h.numVertices = numMeshVertices;
+  h.hash = hash;
+
+  ofstream fout(filename.c_str(), ios::binary);
+  fout.write((const char *)&h, sizeof(h));
+  fout.write(vertexHasCenterOfRotation.data(), numMeshVertices);
+  fout.write((const char *)centersOfRotation.data(), sizeof(double) * centersOfRotation.size());
+  return fout ? 0 : 1;
+}
+
+int Skinning::computeCentersOfRotation(int numTriangles, const int * triangles, WorkerPool * workerPool, const string & cacheFilename,
+    bool * loadedFromCache)
+{
+  uint64_t hash = computeCentersOfRotationHash(numTriangles, triangles);
+  bool loaded = (cacheFilename.size() > 0) && (loadCentersOfRotation(cacheFilename, hash) == 0);
+  if (loadedFromCache)
+    *loadedFromCache = loaded;
+  if (loaded)
+    return 0;
+
+  // Per triangle: the area, the centroid, the average of the weights of its vertices (over all the joints),
+  // and the joints with a nonzero average weight, as a bit mask.
+  int numInfluences = numJointsInfluencingEachVertex;
+  int numMaskWords = (numJoints + 63) / 64;
+  vector<double> triangleAreas(numTriangles), triangleCentroids(3 * numTriangles);
+  vector<double> triangleWeights((size_t)numJoints * numTriangles, 0.0);
+  vector<uint64_t> triangleJointMasks((size_t)numMaskWords * numTriangles, 0);
+  for(int tri = 0; tri < numTriangles; tri++)
+  {
+    Vec3d p0(&restMeshVertexPositions[3 * triangles[3 * tri + 0]]);
+    Vec3d p1(&restMeshVertexPositions[3 * triangles[3 * tri + 1]]);
+    Vec3d p2(&restMeshVertexPositions[3 * triangles[3 * tri + 2]]);
+    triangleAreas[tri] = 0.5 * len(cross(p1 - p0, p2 - p0));
+    Vec3d centroid = (p0 + p1 + p2) / 3.0;
+    centroid.convertToArray(&triangleCentroids[3 * tri]);
+    for(int corner = 0; corner < 3; corner++)
+    {
+      int vtxID = triangles[3 * tri + corner];
+      for(int j = 0; j < numInfluences; j++)
+      {
+        double weight = meshSkinningWeights[numInfluences * vtxID + j];
+        if (weight == 0.0)
+          continue;
+        int jointID = meshSkinningJoints[numInfluences * vtxID + j];
+        triangleWeights[(size_t)numJoints * tri + jointID] += weight / 3.0;
+        triangleJointMasks[(size_t)numMaskWords * tri + jointID / 64] |= 1ULL << (jointID % 64);
+      }
+    }
+  }
+
+  // The center of rotation of vertex i is sum_t s(w_i, w_t) a_t c_t / sum_t s(w_i, w_t) a_t, over the triangles t with area a_t,
+  // centroid c_t and average weights w_t, where the similarity of the weights is
+  // s(w_i, w_t) = sum_{j < k} w_ij w_ik w_tj w_tk exp(-(w_ij w_tk - w_ik w_tj)^2 / sigma^2).
+  // It is nonzero only if two joints influence both the vertex and the triangle; the masks skip the other triangles.
+  vector<double> centers(3 * numMeshVertices, 0.0);
+  vector<char> hasCenter(numMeshVertices, 0);
+  double invSigma2 = 1.0 / (centerOfRotationSigma * centerOfRotationSigma);
+  const double maxExponent = 40.0; // exp(-40) < 1e-17
+  const int verticesPerBlock = 64;
+  int numBlocks = (numMeshVertices + verticesPerBlock - 1) / verticesPerBlock;
+  auto computeBlock = [&](int block)
+  {
+    vector<int> joints(numInfluences);
+    vector<double> weights(numInfluences);
+    vector<uint64_t> vertexMask(numMaskWords);
+    int blockEnd = min((block + 1) * verticesPerBlock, numMeshVertices);
+    for(int vtxID = block * verticesPerBlock; vtxID < blockEnd; vtxID++)
+    {
+      int numVertexJoints = 0;
+      fill(vertexMask.begin(), vertexMask.end(), 0);
+      for(int j = 0; j < numInfluences; j++)
+      {
+        double weight = meshSkinningWeights[numInfluences * vtxID + j];
+        if (weight == 0.0)
+          continue;
+        joints[numVertexJoints] = meshSkinningJoints[numInfluences * vtxID + j];
+        weights[numVertexJoints] = weight;
+        vertexMask[joints[numVertexJoints] / 64] |= 1ULL << (joints[numVertexJoints] % 64);
+        numVertexJoints++;
+      }
+      for(int d = 0; d < 3; d++) // a vertex without a center of rotation is its own center
+        centers[3 * vtxID + d] = restMeshVertexPositions[3 * vtxID + d];
+      if (numVertexJoints < 2) // rigidly attached to one joint: linear blend skinning is exact
+        continue;
+
+      double numerator[3] = { 0.0, 0.0, 0.0 }, denominator = 0.0;
+      for(int tri = 0; tri < numTriangles; tri++)
+      {
+        int numSharedJoints = 0;
+        for(int word = 0; word < numMaskWords; word++)
+          numSharedJoints += bitset<64>(vertexMask[word] & triangleJointMasks[(size_t)numMaskWords * tri + word]).count();
+        if (numSharedJoints < 2)
+          continue;
+
+        const double * triangleWeight = &triangleWeights[(size_t)numJoints * tri];
+        double similarity = 0.0;
+        for(int j = 0; j < numVertexJoints; j++)
+          for(int k = j + 1; k < numVertexJoints; k++)
+          {
+            double wtj = triangleWeight[joints[j]], wtk = triangleWeight[joints[k]];
+            if ((wtj == 0.0) || (wtk == 0.0))
+              continue;
+            double exponent = (weights[j] * wtk - weights[k] * wtj) * (weights[j] * wtk - weights[k] * wtj) * invSigma2;
+            if (exponent < maxExponent) // otherwise, the term is negligible
+              similarity += weights[j] * weights[k] * wtj * wtk * exp(-exponent);
+          }
+        double weight = similarity * triangleAreas[tri];
+        for(int d = 0; d < 3; d++)
+          numerator[d] += weight * triangleCentroids[3 * tri + d];
+        denominator += weight;
+      }
+      if (denominator > 0.0)
+      {
+        for(int d = 0; d < 3; d++)
+          centers[3 * vtxID + d] = numerator[d] / denominator;
+        hasCenter[vtxID] = 1;
+      }
+    }
+  };
+  if (workerPool)
+    workerPool->parallelFor(numBlocks, computeBlock);
+  else
+    for(int block = 0; block < numBlocks; block++)
+      computeBlock(block);
+  centersOfRotation.swap(centers);
+  vertexHasCenterOfRotation.swap(hasCenter);
+  buildClusterVertexPositions();
+
+  if ((cacheFilename.size() > 0) && (saveCentersOfRotation(cacheFilename, hash) != 0))
+  {
+    printf("Warning: cannot write the centers of rotation to %s.\n", cacheFilename.c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -5,7 +5,12 @@
 #include <vector>
 #include <string>
 
-// A class to perform linear blend skinning on a triangle mesh.
+class WorkerPool;
+
+// A class to perform skinning on a triangle mesh: dual quaternion (default), linear blend, or optimized centers of rotation.
+// After the setup (constructor, renumberVertices, setWeightQuantum), a Skinning holds only the rest shape and the weights,
+// and applySkinning does not modify it; so one instance (e.g., held in a std::shared_ptr<const Skinning>) serves all the
+// instances of a mesh, each with its own joint transforms and output positions.
 
 // CSCI 520 Computer Animation and Simulation
 // Jernej Barbic and Yijing Li
@@ -15,10 +20,40 @@ class Skinning
 public:
   // Load skinning data from a file.
   // numMeshVertices, restMeshVertexPositions: specifies the mesh vertices to be skinned
-  // restMeshVertexPositions must be an array of length 3*numMeshVertices .
+  // restMeshVertexPositions must be an array of length 3*numMeshVertices ; it is copied.
   // meshSkinningWeightsFilename: ASCII file in SparseMatrix format, giving the skinning weights.
   Skinning(int numMeshVertices, const double * restMeshVertexPositions, const std::string & meshSkinningWeightsFilename);
 
+  enum Method
+  {
+    DUAL_QUATERNION = 0, // blends the joint dual quaternions; bulges at bent joints
+    LINEAR_BLEND, // blends the joint matrices; the mesh collapses at bent and twisted joints
+    // optimized centers of rotation [Le and Hodgins 2016]: the rotation is a blend of the joint quaternions, applied around the vertex's
+    // center of rotation, which is moved by linear blend skinning; needs computeCentersOfRotation
+    // (until then, and for the vertices without a center: linear blend)
+    CENTER_OF_ROTATION,
+    NUM_METHODS
+  };
+  static const char * getMethodName(Method method); // "dualQuaternion", "linearBlend", "centerOfRotation"
+  static int getMethodFromName(const char * name, Method * method); // returns 0 on success, 1 if the name is unknown
+  void setMethod(Method method) { this->method = method; }
+  Method getMethod() const { return method; }
+
+  // Computes the center of rotation of each vertex: the average of the centroids of the mesh triangles, weighted by area and by
+  // the similarity of the triangle's (averaged) skinning weights to the vertex's weights; the vertices whose weights are similar to
+  // no triangle get none. This is O(numMeshVertices * numTriangles); the vertices are distributed over the threads of workerPool
+  // (if not nullptr). triangles: 3 * numTriangles vertex indices of the rest mesh (e.g., from ObjMeshTopology::getFanTriangles).
+  // cacheFilename (if not empty): the centers are loaded from this file if it was computed for the same rest positions, triangles and
+  // weights (as identified by a hash of them), and otherwise computed and saved to it.
+  // loadedFromCache (if not nullptr): set to whether the centers were loaded from the cache.
+  // Returns 0 on success, and 1 if the centers were computed but could not be saved to cacheFilename.
+  int computeCentersOfRotation(int numTriangles, const int * triangles, WorkerPool * workerPool = nullptr, const std::string & cacheFilename = "",
+      bool * loadedFromCache = nullptr);
+  bool hasCentersOfRotation() const { return centersOfRotation.size() > 0; }
+  int getNumCentersOfRotation() const; // the number of vertices that have a center of rotation
+  const double * getCenterOfRotation(int vertex) const { return &centersOfRotation[3 * vertex]; }
+  static const double centerOfRotationSigma; // the width of the weight similarity kernel
+
   // Main routine: Apply skinning to produce the new positions of the mesh vertices.
   // jointSkinTransforms is an array of transformations, one per joint. For each joint, we have: 
   // jointSkinTransform = globalTransform * globalRestTransform^{-1}
@@ -26,9 +61,36 @@ public:
   // output: newMeshVertexPositions (length is 3*numMeshVertices)
   void applySkinning(const RigidTransform4d * jointSkinTransforms, double * newMeshVertexPositions) const;
 
+  // Partial skinning: recomputes only the vertices influenced by the joints with changedJoints[jointID] != 0
+  // (e.g., from FK::getChangedJoints); the other vertices of newMeshVertexPositions are not written, so it must hold
+  // the result of skinning the previous pose. The cost is proportional to the number of influenced vertices.
+  // Outputs the recomputed vertices to dirtyVertices (if not nullptr; each vertex once, in no particular order), e.g., for updating
+  // normals and bounding volumes (ObjMesh::updateNormals, refitTriangleBVH) or uploading to the GPU. Returns the number of recomputed vertices.
+  int applySkinning(const RigidTransform4d * jointSkinTransforms, const char * changedJoints, double * newMeshVertexPositions,
+      std::vector<int> * dirtyVertices = nullptr) const;
+
+  // Reorders the skinning weights (and the centers of rotation) after the mesh vertices were renumbered
+  // (e.g., by ObjMesh::renumberVertices), with the same permutation (old vertex index -> new vertex index).
+  // The weights file is in the old vertex order; restMeshVertexPositions (given to the constructor) must be in the new order.
+  void renumberVertices(const std::vector<int> & permutation);
+
+  // Vertices with the same influences (joints and weights) form a cluster; applySkinning blends the joint transforms
+  // once per cluster and applies the blended transform to all its vertices.
+  // weightQuantum > 0: weights are rounded to multiples of weightQuantum before clustering (approximate, fewer clusters),
+  //   and then divided by their sum, so that they still sum to one;
+  // weightQuantum = 0 (default): only identical weights are clustered (exact);
+  // weightQuantum < 0: no clustering (every vertex is a cluster).
+  void setWeightQuantum(double weightQuantum);
+  double getWeightQuantum() const { return weightQuantum; }
+  int getNumClusters() const { return (int)clusterVertexStarts.size() - 1; }
+  int getNumClusteredVertices() const { return numClusteredVertices; } // vertices in clusters of more than one vertex
+
+  int getNumMeshVertices() const { return numMeshVertices; }
+  size_t getMemoryUsage() const; // bytes used by the arrays
+
 protected:
   int numMeshVertices = 0;
-  const double * restMeshVertexPositions = nullptr; // length of array is 3 x numMeshVertices
+  std::vector<double> restMeshVertexPositions; // length of array is 3 x numMeshVertices
 
   // Number of joints that influence each vertex. This is constant for all vertices.
   int numJointsInfluencingEachVertex = 0; 
@@ -38,6 +100,55 @@ protected:
   // The skinning weights for each mesh vertex.
   // Length is numJointsInfluencingEachVertex * numMeshVertices.
   std::vector<double> meshSkinningWeights; 
+
+  int numJoints = 0;
+  Method method = DUAL_QUATERNION;
+  double weightQuantum = 0.0;
+  // 3 doubles per vertex (empty if not computed; a vertex without a center of rotation has its rest position), and whether
+  // the vertex has a center of rotation
+  std::vector<double> centersOfRotation;
+  std::vector<char> vertexHasCenterOfRotation;
+  // Influence clusters: cluster c has the joints and weights clusterJoints/clusterWeights[numJointsInfluencingEachVertex * c + j],
+  // and the vertices clusterVertices[clusterVertexStarts[c]], ..., clusterVertices[clusterVertexStarts[c+1] - 1], in increasing order.
+  // The output keeps the mesh vertex order, but the per-vertex inputs of the kernels are stored in the cluster order
+  // (slot k holds vertex clusterVertices[k]), so that a cluster, and a run of consecutive clusters, reads contiguous memory.
+  std::vector<int> clusterJoints;
+  std::vector<double> clusterWeights;
+  std::vector<int> clusterVertexStarts;
+  std::vector<int> clusterVertices;
+  std::vector<double> clusterRestPositions; // 3 doubles per slot
+  std::vector<double> clusterCentersOfRotation; // 3 doubles per slot (empty if the centers were not computed)
+  int numClusteredVertices = 0;
+  // inverse influence index: the clusters influenced (with a nonzero weight) by joint j are
+  // jointClusters[jointClusterStarts[j]], ..., jointClusters[jointClusterStarts[j+1] - 1]
+  std::vector<int> jointClusterStarts;
+  std::vector<int> jointClusters;
+  void buildClusters();
+  void buildClusterVertexPositions(); // clusterRestPositions and clusterCentersOfRotation, from clusterVertices
+
+  // the dual quaternion of each joint transform: 8 doubles per joint, the coefficients (x, y, z, w) of q0 and of q1
+  void computeJointDualQuaternions(const RigidTransform4d * jointSkinTransforms, std::vector<double> & jointDualQuaternions) const;
+  // the rotation quaternion q0 of each joint transform: 4 doubles per joint (for CENTER_OF_ROTATION)
+  void computeJointQuaternions(const RigidTransform4d * jointSkinTransforms, std::vector<double> & jointQuaternions) const;
+  // the joint transforms as 3x4 row-major matrices: 12 doubles per joint (for LINEAR_BLEND and CENTER_OF_ROTATION)
+  void computeJointMatrices(const RigidTransform4d * jointSkinTransforms, std::vector<double> & jointMatrices) const;
+  // what the method needs of the joint transforms of one pose, computed once per joint
+  struct JointBlendData
+  {
+    std::vector<double> dualQuaternions;
+    std::vector<double> quaternions;
+    std::vector<double> matrices;
+  };
+  void computeJointBlendData(const RigidTransform4d * jointSkinTransforms, JointBlendData & jointBlendData) const;
+  // blends the joint transforms of a cluster, and transforms its vertices
+  void skinCluster(int cluster, const JointBlendData & jointBlendData, double * newMeshVertexPositions) const;
+  void skinClusterDualQuaternion(int cluster, const double * jointDualQuaternions, double * newMeshVertexPositions) const;
+  void skinClusterLinearBlend(int cluster, const double * jointMatrices, double * newMeshVertexPositions) const;
+  void skinClusterCenterOfRotation(int cluster, const double * jointQuaternions, const double * jointMatrices, double * newMeshVertexPositions) const;
+
+  unsigned long long computeCentersOfRotationHash(int numTriangles, const int * triangles) const;
+  int loadCentersOfRotation(const std::string & filename, unsigned long long hash);
+  int saveCentersOfRotation(const std::string & filename, unsigned long long hash) const;
 };
 
 #endif
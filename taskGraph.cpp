@@ -0,0 +1,191 @@
+#include "taskGraph.h"
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+int TaskGraph::addTask(const function<void()> & task)
+{
+  tasks.emplace_back();
+  tasks.back().function = task;
+  return (int)tasks.size() - 1;
+}
+
+void TaskGraph::addDependency(int before, int after)
+{
+  tasks[before].successors.push_back(after);
+  tasks[after].numPredecessors++;
+}
+
+TaskGraphExecutor::TaskGraphExecutor(int numThreads) : numUnfinishedTasks(0), numQueuedTasks(0), numStolenTasks(0)
+{
+  if (numThreads <= 0)
+    numThreads = thread::hardware_concurrency();
+  if (numThreads <= 0)
+    numThreads = 1;
+  for(int i = 0; i < numThreads; i++)
+    queues.emplace_back(new TaskQueue);
+  for(int i = 1; i < numThreads; i++)
+    workers.emplace_back(&TaskGraphExecutor::workerLoop, this, i);
+}
+
+TaskGraphExecutor::~TaskGraphExecutor()
+{
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    shuttingDown = true;
+  }
+  runStarted.notify_all();
+  for(thread & worker : workers)
+    worker.join();
+}
+
+double TaskGraphExecutor::getTime() const
+{
+  PerformanceCounter counter = runClock;
+  counter.StopCounter();
+  return counter.GetElapsedTime();
+}
+
+void TaskGraphExecutor::pushTask(int thread, int task)
+{
+  {
+    lock_guard<std::mutex> lock(queues[thread]->mutex);
+    queues[thread]->tasks.push_back(task);
+  }
+  {
+    // a thread that is about to sleep either sees the task, or is already waiting and gets notified
+    lock_guard<std::mutex> lock(idleMutex);
+    numQueuedTasks++;
+  }
+  taskQueued.notify_one();
+}
+
+bool TaskGraphExecutor::popTask(int thread, int * task)
+{
+  {
+    TaskQueue & queue = *queues[thread];
+    lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.size() > 0)
+    {
+      *task = queue.tasks.back();
+      queue.tasks.pop_back();
+      numQueuedTasks--;
+      return true;
+    }
+  }
+
+  int numThreads = (int)queues.size();
+  for(int i = 1; i < numThreads; i++)
+  {
+    TaskQueue & victim = *queues[(thread + i) % numThreads];
+    lock_guard<std::mutex> lock(victim.mutex);
+    if (victim.tasks.size() > 0)
+    {
+      *task = victim.tasks.front();
+      victim.tasks.pop_front();
+      numQueuedTasks--;
+      numStolenTasks++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskGraphExecutor::runTasks(int thread)
+{
+  while (numUnfinishedTasks > 0)
+  {
+    int taskID = -1;
+    if (popTask(thread, &taskID) == false)
+    {
+      // the remaining tasks are running, or wait for running tasks: sleep until one is queued
+      unique_lock<std::mutex> lock(idleMutex);
+      taskQueued.wait(lock, [&]() { return (numQueuedTasks > 0) || (numUnfinishedTasks == 0); });
+      continue;
+    }
+
+    TaskGraph::Task & task = graph->tasks[taskID];
+    task.thread = thread;
+    task.startTime = getTime();
+    task.function();
+    task.finishTime = getTime();
+    for(int successor : task.successors)
+      if (--numPendingPredecessors[successor] == 0)
+        pushTask(thread, successor);
+    bool lastTask = false;
+    {
+      lock_guard<std::mutex> lock(idleMutex);
+      lastTask = (--numUnfinishedTasks == 0);
+    }
+    if (lastTask) // wake up the sleeping threads, so that they return
+      taskQueued.notify_all();
+  }
+}
+
+void TaskGraphExecutor::workerLoop(int thread)
+{
+  unsigned long long lastRunID = 0;
+  while(true)
+  {
+    {
+      unique_lock<std::mutex> lock(stateMutex);
+      runStarted.wait(lock, [&]() { return shuttingDown || runID != lastRunID; });
+      if (shuttingDown)
+        return;
+      lastRunID = runID;
+      numBusyWorkers++;
+    }
+
+    runTasks(thread);
+
+    {
+      lock_guard<std::mutex> lock(stateMutex);
+      numBusyWorkers--;
+    }
+    runFinished.notify_all();
+  }
+}
+
+void TaskGraphExecutor::run(TaskGraph & graph)
+{
+  int numTasks = graph.getNumTasks();
+  if (numTasks == 0)
+    return;
+
+  lock_guard<std::mutex> runLock(runMutex);
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    this->graph = &graph;
+  }
+  runClock.StartCounter();
+  if (numPendingPredecessorsSize < numTasks)
+  {
+    numPendingPredecessors.reset(new atomic<int>[numTasks]);
+    numPendingPredecessorsSize = numTasks;
+  }
+  // deal the tasks without predecessors out to the threads
+  int numThreads = getNumThreads();
+  int numRootTasks = 0;
+  for(int i = 0; i < numTasks; i++)
+  {
+    numPendingPredecessors[i] = graph.tasks[i].numPredecessors;
+    if (graph.tasks[i].numPredecessors == 0)
+      pushTask(numRootTasks++ % numThreads, i);
+  }
+  numStolenTasks = 0;
+  numUnfinishedTasks = numTasks; // last: a worker may start as soon as this is set
+
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    runID++;
+  }
+  if (workers.size() > 0)
+    runStarted.notify_all();
+
+  runTasks(0);
+
+  // wait until every worker that joined this run is done
+  unique_lock<std::mutex> lock(stateMutex);
+  runFinished.wait(lock, [&]() { return numBusyWorkers == 0; });
+}
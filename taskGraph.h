@@ -0,0 +1,109 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "performanceCounter.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Tasks and the dependencies between them, to be run by a TaskGraphExecutor.
+// A graph is built once and can be run many times (e.g., once per frame). After a run, the graph holds the
+// start and finish time of each task, and the thread that ran it.
+class TaskGraph
+{
+public:
+  // Adds a task and returns its ID (0, 1, 2, ...).
+  int addTask(const std::function<void()> & task);
+  // Task "after" starts only after task "before" has finished.
+  void addDependency(int before, int after);
+  void clear() { tasks.clear(); }
+
+  int getNumTasks() const { return (int)tasks.size(); }
+  // timings of the last run, in seconds since the start of the run
+  double getTaskStartTime(int task) const { return tasks[task].startTime; }
+  double getTaskFinishTime(int task) const { return tasks[task].finishTime; }
+  int getTaskThread(int task) const { return tasks[task].thread; }
+
+protected:
+  friend class TaskGraphExecutor;
+
+  struct Task
+  {
+    std::function<void()> function;
+    std::vector<int> successors;
+    int numPredecessors = 0;
+    double startTime = 0.0, finishTime = 0.0;
+    int thread = -1;
+  };
+  std::vector<Task> tasks;
+};
+
+// Runs TaskGraphs on a fixed set of threads, with work stealing.
+// Every thread has its own queue of ready tasks. When a task finishes, the thread that ran it queues the successors
+// that became ready, and runs the newest task of its queue next, so that a chain of dependent tasks tends to stay on one
+// thread (with its data in that thread's cache). A thread whose queue is empty steals the oldest task of another thread;
+// if no thread has a queued task, it sleeps until a task is queued or the run finishes.
+// As in WorkerPool, the threads are created once, in the constructor, and sleep between runs.
+class TaskGraphExecutor
+{
+public:
+  // numThreads: total number of threads that run tasks, including the calling thread.
+  // If numThreads <= 0, std::thread::hardware_concurrency() is used.
+  explicit TaskGraphExecutor(int numThreads = 0);
+  virtual ~TaskGraphExecutor();
+
+  int getNumThreads() const { return (int)workers.size() + 1; }
+
+  // Runs all the tasks of the graph, each after all its predecessors have finished. The calling thread participates
+  // (as thread 0). Returns after all the tasks have finished. Only one graph runs at a time; calls from different threads
+  // are serialized. Do not call run from inside a task. The graph must not have cycles.
+  void run(TaskGraph & graph);
+
+  // statistics of the last run
+  int getNumStolenTasks() const { return numStolenTasks; }
+
+protected:
+  struct TaskQueue
+  {
+    std::mutex mutex;
+    std::deque<int> tasks;
+  };
+
+  void workerLoop(int thread);
+  void runTasks(int thread);
+  bool popTask(int thread, int * task); // from the back of the thread's own queue, or stolen from the front of another queue
+  void pushTask(int thread, int task);
+  double getTime() const; // seconds since the start of the run
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<TaskQueue>> queues; // one per thread
+
+  std::mutex runMutex; // serializes run calls
+  std::mutex stateMutex;
+  std::condition_variable runStarted, runFinished;
+  unsigned long long runID = 0; // incremented for each run, so that the workers can detect a new run
+  int numBusyWorkers = 0;
+  bool shuttingDown = false;
+
+  // the current run
+  TaskGraph * graph = nullptr;
+  std::unique_ptr<std::atomic<int>[]> numPendingPredecessors;
+  int numPendingPredecessorsSize = 0;
+  std::atomic<int> numUnfinishedTasks;
+  std::atomic<int> numQueuedTasks; // over all the queues
+  std::mutex idleMutex;
+  std::condition_variable taskQueued; // notified when a task is queued, and when the last task finishes
+  std::atomic<int> numStolenTasks;
+  PerformanceCounter runClock; // started at the beginning of each run, and then only read
+};
+
+#endif
+
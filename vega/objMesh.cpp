@@ -37,6 +37,7 @@
   #pragma warning(disable : 4244)
 #endif
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 #include <vector>
@@ -53,6 +54,7 @@
 #include <cassert>
 #include "macros.h"
 #include "objMesh.h"
+#include "objMeshTopology.h"
 using namespace std;
 
 namespace // anonymous namespace
@@ -1850,6 +1852,12 @@ void ObjMesh::setNormalsToAverageFaceNormals()
 
 unsigned int ObjMesh::getClosestVertex(const Vec3d & queryPos, double * distance) const
 {
+  if (hasVertexBVH())
+  {
+    int indexClosest = vertexBVH.getClosestPoint(vertexPositions.data(), queryPos, distance);
+    return (indexClosest >= 0) ? indexClosest : 0;
+  }
+
   double closestDist2 = DBL_MAX;
   double candidateDist2;
   unsigned int indexClosest = 0;
@@ -1868,6 +1876,117 @@ unsigned int ObjMesh::getClosestVertex(const Vec3d & queryPos, double * distance
   return indexClosest;
 }
 
+void ObjMesh::buildVertexBVH()
+{
+  vertexBVH.build(vertexPositions.size(), vertexPositions.data());
+}
+
+void ObjMesh::refitVertexBVH()
+{
+  if (hasVertexBVH())
+    vertexBVH.refit(vertexPositions.data());
+}
+
+void ObjMesh::refitVertexBVH(const vector<int> & movedVertices)
+{
+  if (hasVertexBVH())
+    vertexBVH.refit(vertexPositions.data(), movedVertices.size(), movedVertices.data());
+}
+
+void ObjMesh::buildTriangleBVH()
+{
+  ObjMeshTopology topology(*this);
+  vector<int> fanTriangles, triangleFaces;
+  int numTriangles = topology.getFanTriangles(fanTriangles, &triangleFaces);
+  triangleBVHFaces.resize(numTriangles);
+  int group = 0;
+  for(int i = 0; i < numTriangles; i++)
+  {
+    while (triangleFaces[i] >= topology.getGroupFirstFace(group + 1))
+      group++;
+    triangleBVHFaces[i] = make_pair(group, triangleFaces[i] - topology.getGroupFirstFace(group));
+  }
+  triangleBVH.build(numTriangles, fanTriangles.data(), vertexPositions.data());
+}
+
+void ObjMesh::refitTriangleBVH()
+{
+  if (hasTriangleBVH())
+    triangleBVH.refit(vertexPositions.data());
+}
+
+void ObjMesh::refitTriangleBVH(const vector<int> & movedVertices)
+{
+  if (hasTriangleBVH())
+    triangleBVH.refit(vertexPositions.data(), movedVertices.size(), movedVertices.data());
+}
+
+bool ObjMesh::intersectRay(const Vec3d & origin, const Vec3d & direction, Vec3d * hitPosition, int * groupIndex, int * faceIndex,
+    int triangleVertices[3], double barycentrics[3]) const
+{
+  int hitGroup = -1, hitFace = -1, hitTriangle[3];
+  double hitBarycentrics[3];
+  if (hasTriangleBVH())
+  {
+    TriangleBVH::RayHit hit;
+    if (triangleBVH.intersectRay(vertexPositions.data(), origin, direction, &hit) == false)
+      return false;
+    hitGroup = triangleBVHFaces[hit.triangle].first;
+    hitFace = triangleBVHFaces[hit.triangle].second;
+    for(int j = 0; j < 3; j++)
+    {
+      hitTriangle[j] = triangleBVH.getTriangle(hit.triangle)[j];
+      hitBarycentrics[j] = hit.barycentrics[j];
+    }
+  }
+  else
+  {
+    double closestT = DBL_MAX;
+    for(unsigned int i = 0; i < groups.size(); i++)
+      for(unsigned int iFace = 0; iFace < groups[i].getNumFaces(); iFace++)
+      {
+        const Face & face = groups[i].getFace(iFace);
+        for(unsigned int k = 2; k < face.getNumVertices(); k++)
+        {
+          int v[3] = { (int)face.getVertexPositionIndex(0), (int)face.getVertexPositionIndex(k - 1), (int)face.getVertexPositionIndex(k) };
+          double t, u, w;
+          if (TriangleBVH::intersectTriangle(origin, direction, vertexPositions[v[0]], vertexPositions[v[1]], vertexPositions[v[2]], closestT, &t, &u, &w))
+          {
+            closestT = t;
+            hitGroup = i;
+            hitFace = iFace;
+            for(int j = 0; j < 3; j++)
+              hitTriangle[j] = v[j];
+            hitBarycentrics[0] = 1.0 - u - w;
+            hitBarycentrics[1] = u;
+            hitBarycentrics[2] = w;
+          }
+        }
+      }
+    if (hitGroup < 0)
+      return false;
+  }
+
+  if (hitPosition != NULL)
+  {
+    *hitPosition = Vec3d(0.0);
+    for(int j = 0; j < 3; j++)
+      *hitPosition += hitBarycentrics[j] * vertexPositions[hitTriangle[j]];
+  }
+  if (groupIndex != NULL)
+    *groupIndex = hitGroup;
+  if (faceIndex != NULL)
+    *faceIndex = hitFace;
+  for(int j = 0; j < 3; j++)
+  {
+    if (triangleVertices != NULL)
+      triangleVertices[j] = hitTriangle[j];
+    if (barycentrics != NULL)
+      barycentrics[j] = hitBarycentrics[j];
+  }
+  return true;
+}
+
 double ObjMesh::computeMinEdgeLength() const
 {
   double minLength = -1;
@@ -2161,6 +2280,75 @@ void ObjMesh::buildVertexNormals(double angle)
   }
 }
 
+int ObjMesh::updateNormals(const vector<int> & movedVertices, double angle)
+{
+  if ((vertexFaceNeighbors.size() == 0) || (normals.size() == 0))
+  {
+    buildFaceNormals();
+    buildVertexNormals(angle);
+    return 1;
+  }
+
+  // the faces at the moved vertices get new face normals, and their vertices new vertex normals
+  vector<int> groupFirstFaces(groups.size() + 1, 0);
+  for(size_t i = 0; i < groups.size(); i++)
+    groupFirstFaces[i + 1] = groupFirstFaces[i] + groups[i].getNumFaces();
+  vector<char> faceFound(groupFirstFaces.back(), 0), vertexFound(vertexPositions.size(), 0);
+  vector<int> vertices;
+  for(int vtx : movedVertices)
+    for(const auto & faceNeighbor : vertexFaceNeighbors[vtx])
+    {
+      int globalFace = groupFirstFaces[faceNeighbor.groupIndex] + faceNeighbor.faceIndex;
+      if (faceFound[globalFace])
+        continue;
+      faceFound[globalFace] = 1;
+      Face & face = groups[faceNeighbor.groupIndex].getFace(faceNeighbor.faceIndex);
+      face.setFaceNormal(computeFaceNormal(face));
+      for(unsigned int k = 0; k < face.getNumVertices(); k++)
+      {
+        int faceVtx = face.getVertexPositionIndex(k);
+        if (vertexFound[faceVtx] == 0)
+        {
+          vertexFound[faceVtx] = 1;
+          vertices.push_back(faceVtx);
+        }
+      }
+    }
+
+  // the same averaging as buildVertexNormals; the normal indices stay valid as long as the same faces are averaged
+  double cosang = cos(angle * M_PI / 180.0);
+  for(int vtx : vertices)
+  {
+    if (vertexFaceNeighbors[vtx].size() == 0)
+      continue;
+    const auto & firstFaceNeighbor = vertexFaceNeighbors[vtx][0];
+    Vec3d firstNorm = getGroupHandle(firstFaceNeighbor.groupIndex)->getFaceHandle(firstFaceNeighbor.faceIndex)->getFaceNormal();
+    Vec3d average(0.0);
+    for(const auto & faceNeighbor : vertexFaceNeighbors[vtx])
+    {
+      const Face * currentFace = getGroupHandle(faceNeighbor.groupIndex)->getFaceHandle(faceNeighbor.faceIndex);
+      bool averaged = dot(firstNorm, currentFace->getFaceNormal()) > cosang;
+      if (averaged != faceNeighbor.averaged) // a hard edge appeared or disappeared: the number of normals changes
+      {
+        buildVertexNormals(angle);
+        return 1;
+      }
+      if (averaged)
+        average += currentFace->getFaceNormal();
+      else
+        normals[currentFace->getVertexHandle(faceNeighbor.faceVertexIndex)->getNormalIndex()] = currentFace->getFaceNormal();
+    }
+    for(const auto & faceNeighbor : vertexFaceNeighbors[vtx])
+      if (faceNeighbor.averaged)
+      {
+        const Face * currentFace = getGroupHandle(faceNeighbor.groupIndex)->getFaceHandle(faceNeighbor.faceIndex);
+        normals[currentFace->getVertexHandle(faceNeighbor.faceVertexIndex)->getNormalIndex()] = norm(average);
+        break; // the averaged faces share one normal
+      }
+  }
+  return 0;
+}
+
 void ObjMesh::buildVertexNormalsFancy(double angle)
 {
   if (vertexFaceNeighbors.size() == 0)
@@ -3015,6 +3203,56 @@ void ObjMesh::clearVertexFaceNeighbors()
   vertexFaceNeighbors.clear();
 }
 
+void ObjMesh::getFacesOfVertices(const vector<int> & vertices, vector<int> & faces) const
+{
+  vector<int> groupFirstFaces(groups.size() + 1, 0);
+  for(size_t i = 0; i < groups.size(); i++)
+    groupFirstFaces[i + 1] = groupFirstFaces[i] + groups[i].getNumFaces();
+
+  vector<char> faceFound(groupFirstFaces.back(), 0);
+  faces.clear();
+  for(int vtx : vertices)
+    for(const auto & faceNeighbor : vertexFaceNeighbors[vtx])
+    {
+      int face = groupFirstFaces[faceNeighbor.groupIndex] + faceNeighbor.faceIndex;
+      if (faceFound[face] == 0)
+      {
+        faceFound[face] = 1;
+        faces.push_back(face);
+      }
+    }
+  sort(faces.begin(), faces.end());
+}
+
+void ObjMesh::Face::addVertex(const Vertex & v)
+{
+  if (numVertices < numInlineVertices)
+    inlineVertices[numVertices] = v;
+  else
+  {
+    if (numVertices == numInlineVertices) // move to the heap
+      overflowVertices.assign(inlineVertices, inlineVertices + numInlineVertices);
+    overflowVertices.push_back(v);
+  }
+  numVertices++;
+}
+
+void ObjMesh::Face::removeVertex(unsigned int i)
+{
+  if (numVertices <= numInlineVertices)
+    copy(inlineVertices + i + 1, inlineVertices + numVertices, inlineVertices + i);
+  else
+  {
+    overflowVertices.erase(overflowVertices.begin() + i);
+    if (numVertices - 1 == numInlineVertices) // fits inside the face again
+    {
+      copy(overflowVertices.begin(), overflowVertices.end(), inlineVertices);
+      overflowVertices.clear();
+    }
+  }
+  numVertices--;
+}
+
 void ObjMesh::Group::removeFace(unsigned int i)
 {
   faces.erase(faces.begin() + i);
@@ -3373,6 +3611,194 @@ void ObjMesh::renumberVertices(const vector<int> & permutation)
         vtx->setPositionIndex(permutation[vtx->getPositionIndex()]);
       }
     }
+
+  // these refer to the old vertex indices
+  vertexBVH.clear();
+  triangleBVH.clear();
+  triangleBVHFaces.clear();
+  vertexFaceNeighbors.clear();
+}
+
+namespace
+{
+// the score of a vertex in Forsyth's vertex cache optimization: vertices in the cache score higher (those of the last face a bit less,
+// to avoid strips that turn back), and vertices with few remaining faces are boosted, so that no lonely faces are left behind
+double computeVertexCacheScore(int cachePosition, int numRemainingFaces, int cacheSize)
+{
+  if (numRemainingFaces == 0)
+    return -1.0;
+  double score = 0.0;
+  if (cachePosition >= 0)
+  {
+    if (cachePosition < 3)
+      score = 0.75;
+    else
+      score = pow(1.0 - (double)(cachePosition - 3) / (cacheSize - 3), 1.5);
+  }
+  return score + 2.0 / sqrt((double)numRemainingFaces);
+}
+}
+
+void ObjMesh::reorderFacesForVertexCache(int cacheSize)
+{
+  cacheSize = max(cacheSize, 4);
+  vector<int> localIndex(getNumVertices(), -1); // global vtxID -> index among the vertices of the current group
+  for(unsigned int g = 0; g < groups.size(); g++)
+  {
+    vector<Face> & faces = groups[g].faces;
+    int numFaces = faces.size();
+
+    // faces adjacent to each vertex of the group
+    vector<int> groupVertices;
+    for(int f = 0; f < numFaces; f++)
+      for(unsigned int k = 0; k < faces[f].getNumVertices(); k++)
+      {
+        int vtx = faces[f].getVertexPositionIndex(k);
+        if (localIndex[vtx] < 0)
+        {
+          localIndex[vtx] = groupVertices.size();
+          groupVertices.push_back(vtx);
+        }
+      }
+    int numGroupVertices = groupVertices.size();
+    vector<int> adjacencyStart(numGroupVertices + 1, 0);
+    for(int f = 0; f < numFaces; f++)
+      for(unsigned int k = 0; k < faces[f].getNumVertices(); k++)
+        adjacencyStart[localIndex[faces[f].getVertexPositionIndex(k)] + 1]++;
+    for(int v = 0; v < numGroupVertices; v++)
+      adjacencyStart[v + 1] += adjacencyStart[v];
+    vector<int> adjacentFaces(adjacencyStart[numGroupVertices]);
+    vector<int> adjacencyEnd(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for(int f = 0; f < numFaces; f++)
+      for(unsigned int k = 0; k < faces[f].getNumVertices(); k++)
+        adjacentFaces[adjacencyEnd[localIndex[faces[f].getVertexPositionIndex(k)]]++] = f;
+
+    vector<int> numRemainingFaces(numGroupVertices), cachePosition(numGroupVertices, -1);
+    vector<double> vertexScore(numGroupVertices);
+    for(int v = 0; v < numGroupVertices; v++)
+    {
+      numRemainingFaces[v] = adjacencyStart[v + 1] - adjacencyStart[v];
+      vertexScore[v] = computeVertexCacheScore(-1, numRemainingFaces[v], cacheSize);
+    }
+    vector<double> faceScore(numFaces, 0.0);
+    int bestFace = -1;
+    for(int f = 0; f < numFaces; f++)
+    {
+      for(unsigned int k = 0; k < faces[f].getNumVertices(); k++)
+        faceScore[f] += vertexScore[localIndex[faces[f].getVertexPositionIndex(k)]];
+      if ((bestFace < 0) || (faceScore[f] > faceScore[bestFace]))
+        bestFace = f;
+    }
+
+    // greedily emit the face with the highest score among the faces of the cached vertices
+    vector<bool> emitted(numFaces, false);
+    vector<int> order;
+    order.reserve(numFaces);
+    vector<int> cache, newCache;
+    int nextUnemittedFace = 0;
+    while ((int)order.size() < numFaces)
+    {
+      if (bestFace < 0) // no face around the cached vertices is left
+      {
+        while (emitted[nextUnemittedFace])
+          nextUnemittedFace++;
+        bestFace = nextUnemittedFace;
+      }
+      emitted[bestFace] = true;
+      order.push_back(bestFace);
+
+      // the face's vertices move to the front of the cache
+      const Face & face = faces[bestFace];
+      newCache.clear();
+      for(unsigned int k = 0; k < face.getNumVertices(); k++)
+      {
+        int v = localIndex[face.getVertexPositionIndex(k)];
+        numRemainingFaces[v]--;
+        if (find(newCache.begin(), newCache.end(), v) == newCache.end())
+          newCache.push_back(v);
+      }
+      size_t numFaceVertices = newCache.size();
+      for(int v : cache)
+        if (find(newCache.begin(), newCache.begin() + numFaceVertices, v) == newCache.begin() + numFaceVertices)
+          newCache.push_back(v);
+      for(size_t i = 0; i < newCache.size(); i++)
+        cachePosition[newCache[i]] = (i < (size_t)cacheSize) ? i : -1;
+
+      // update the scores of the vertices that were in the cache or entered it, and of their faces
+      for(int v : newCache)
+      {
+        double score = computeVertexCacheScore(cachePosition[v], numRemainingFaces[v], cacheSize);
+        double change = score - vertexScore[v];
+        vertexScore[v] = score;
+        for(int j = adjacencyStart[v]; j < adjacencyStart[v + 1]; j++)
+          faceScore[adjacentFaces[j]] += change;
+      }
+
+      if (newCache.size() > (size_t)cacheSize)
+        newCache.resize(cacheSize);
+      cache.swap(newCache);
+      bestFace = -1;
+      for(int v : cache)
+        for(int j = adjacencyStart[v]; j < adjacencyStart[v + 1]; j++)
+        {
+          int f = adjacentFaces[j];
+          if (!emitted[f] && ((bestFace < 0) || (faceScore[f] > faceScore[bestFace])))
+            bestFace = f;
+        }
+    }
+
+    vector<Face> reorderedFaces;
+    reorderedFaces.reserve(numFaces);
+    for(int f : order)
+      reorderedFaces.push_back(std::move(faces[f]));
+    faces.swap(reorderedFaces);
+
+    for(int vtx : groupVertices)
+      localIndex[vtx] = -1;
+  }
+
+  // these refer to the old face indices
+  triangleBVH.clear();
+  triangleBVHFaces.clear();
+  vertexFaceNeighbors.clear();
+}
+
+void ObjMesh::computeFirstUseVertexOrder(vector<int> & permutation) const
+{
+  permutation.assign(getNumVertices(), -1);
+  int numNumbered = 0;
+  for(unsigned int i = 0; i < groups.size(); i++)
+    for(unsigned int j = 0; j < groups[i].getNumFaces(); j++)
+    {
+      const Face & face = groups[i].getFace(j);
+      for(unsigned int k = 0; k < face.getNumVertices(); k++)
+        if (permutation[face.getVertexPositionIndex(k)] < 0)
+          permutation[face.getVertexPositionIndex(k)] = numNumbered++;
+    }
+  for(size_t vtx = 0; vtx < permutation.size(); vtx++)
+    if (permutation[vtx] < 0)
+      permutation[vtx] = numNumbered++;
+}
+
+double ObjMesh::computeAverageCacheMissRatio(int cacheSize) const
+{
+  // a vertex is in the FIFO cache if fewer than cacheSize vertices were loaded after it
+  vector<int> loadTime(getNumVertices(), -1);
+  int numMisses = 0, numTriangles = 0;
+  for(unsigned int i = 0; i < groups.size(); i++)
+    for(unsigned int j = 0; j < groups[i].getNumFaces(); j++)
+    {
+      const Face & face = groups[i].getFace(j);
+      for(unsigned int k = 2; k < face.getNumVertices(); k++)
+      {
+        int triangle[3] = { (int)face.getVertexPositionIndex(0), (int)face.getVertexPositionIndex(k - 1), (int)face.getVertexPositionIndex(k) };
+        for(int vtx : triangle)
+          if ((loadTime[vtx] < 0) || (numMisses - loadTime[vtx] >= cacheSize))
+            loadTime[vtx] = numMisses++;
+        numTriangles++;
+      }
+    }
+  return (numTriangles > 0) ? (double)numMisses / numTriangles : 0.0;
 }
 
 int ObjMesh::computeNumIsolatedVertices() const
@@ -46,6 +46,8 @@
 #include <memory>
 #include <functional>
 #include "vec3d.h"
+#include "pointBVH.h"
+#include "triangleBVH.h"
 
 /*
    This class stores a 3D surface mesh, loaded from an .obj file.
@@ -72,6 +74,7 @@
          using the member functions of the Vertex class.
      6.  Look these up in the .obj file global namspace using the "getPosition",
          "getTextureCoordinate", and "getNormal" member functions of the ObjMesh class.
+   For fast read-only traversals of the faces, build an ObjMeshTopology (flat index arrays) from the mesh.
 
    Code authors: Jernej Barbic, Christopher Twigg, Daniel Schroeder,
                  CMU, 2001-2007, MIT 2007-2009, USC 2009-2011
@@ -215,6 +218,10 @@ public:
   // neighborID < getVertexNumNeighborFaces(vtxID)
   // return <groupID, faceID>
   std::pair<int,int> getVertexNeighborFace(int vtxID, int neighborID) const { return std::make_pair(vertexFaceNeighbors[vtxID][neighborID].groupIndex, vertexFaceNeighbors[vtxID][neighborID].faceIndex); }
+  // must call buildVertexFaceNeighbors before
+  // finds the faces adjacent to the given vertices (e.g., the faces to update after these vertices moved), as global face indices
+  // (faces numbered over all groups, in order), in increasing order and without duplicates
+  void getFacesOfVertices(const std::vector<int> & vertices, std::vector<int> & faces) const;
 
   // ===== vtx/face/edge normals =====
 
@@ -246,6 +253,11 @@ public:
   // input angle is in degrees, if faces around a vertex have angles >= input angle, they are considered as having hard edges and those faces have separated normals on the vertex,
   // otherwise, those faces are joined by soft edges and they share the same vertex normal as averages of the face normals for the soft edge
   void buildVertexNormals(double angle);
+  // after the vertices movedVertices moved, updates the face normals of their faces, and the vertex normals of the vertices of these faces,
+  // in place; assumes the normals were built by buildVertexNormals with the same angle
+  // if the hard edges (faces whose normals are not averaged at a vertex) changed, rebuilds all the vertex normals with buildVertexNormals
+  // returns 0 if the normals were updated in place, and 1 if they were rebuilt
+  int updateNormals(const std::vector<int> & movedVertices, double angle);
   // another version of buildVertexNormals: assumes no hard edges, assigns vertex normals as average face normals, prints errors when hard edges that form angles >= input angles
   void buildVertexNormalsFancy(double angle);
 
@@ -328,9 +340,33 @@ public:
   // computes masses "belonging" to each vertex, given the surface mass densities
   void computeMassPerVertex(const std::vector<double> & groupSurfaceMassDensities, std::vector<double> & masses) const;
 
-  // finds the closest mesh vertex to the query position queryPos (using exhaustive search); also outputs distance to such a vertex (if distance is not NULL)
+  // finds the closest mesh vertex to the query position queryPos; also outputs distance to such a vertex (if distance is not NULL)
+  // uses the vertex BVH if it was built (see buildVertexBVH), otherwise exhaustive search
   unsigned int getClosestVertex(const Vec3d & queryPos, double * distance=NULL) const;
 
+  // builds a bounding volume hierarchy over the vertex positions, for fast getClosestVertex queries
+  void buildVertexBVH();
+  // after the vertex positions change (e.g., the mesh is deformed), updates the hierarchy in O(#vertices) time
+  void refitVertexBVH();
+  // the same, when only the vertices movedVertices moved; updates only the boxes that contain them
+  void refitVertexBVH(const std::vector<int> & movedVertices);
+  bool hasVertexBVH() const { return vertexBVH.isBuilt() && (vertexBVH.getNumPoints() == (int)vertexPositions.size()); }
+
+  // builds a bounding volume hierarchy over the faces (each face triangulated as a fan), for fast intersectRay queries
+  void buildTriangleBVH();
+  // after the vertex positions change, updates the hierarchy in O(#triangles) time; call buildTriangleBVH if the faces change
+  void refitTriangleBVH();
+  // the same, when only the vertices movedVertices moved; updates only the boxes of the triangles at these vertices
+  void refitTriangleBVH(const std::vector<int> & movedVertices);
+  bool hasTriangleBVH() const { return triangleBVH.isBuilt(); }
+
+  // casts the ray origin + t * direction (t >= 0) against the faces (both sides) and finds the closest hit; returns true on a hit
+  // outputs the hit position, the hit face (group and face index), the position indices of the hit triangle of the face (a fan triangle),
+  // and the barycentric weights of the hit position with respect to these three vertices (all outputs are optional)
+  // uses the triangle BVH if it was built (see buildTriangleBVH), otherwise tests every face
+  bool intersectRay(const Vec3d & origin, const Vec3d & direction, Vec3d * hitPosition, int * groupIndex = NULL, int * faceIndex = NULL,
+      int triangleVertices[3] = NULL, double barycentrics[3] = NULL) const;
+
   void computeCentroids(std::vector<Vec3d> & centroids) const; // centroids of all the faces
   void interpolateToCentroids(const std::vector<double> & nodalData, std::vector<double> & centroidData) const; // interpolates vertex data to centroids
   void interpolateToCentroids(const std::vector<Vec3d> & nodalData, std::vector<Vec3d> & centroidData) const; // interpolates vertex data to centroids
@@ -363,6 +399,17 @@ public:
   // this method can also be used to merge vertices
   void renumberVertices(const std::vector<int> & permutation);
 
+  // reorders the faces within each group for the post-transform vertex cache of the GPU
+  // (Forsyth's linear-speed vertex cache optimization, with an LRU cache of "cacheSize" vertices);
+  // the groups and the vertices of each face do not change
+  void reorderFacesForVertexCache(int cacheSize = 32);
+  // computes the permutation (old vtxID -> new vtxID) that numbers the vertices in the order in which the faces first use them
+  // (isolated vertices go last), so that consecutive faces read nearby vertex data; pass it to renumberVertices
+  void computeFirstUseVertexOrder(std::vector<int> & permutation) const;
+  // the average number of vertex cache misses per triangle (ACMR) when rendering the faces (as triangle fans) in their order,
+  // for a FIFO cache of "cacheSize" vertices; between 0.5 (ideal, for large meshes) and 3
+  double computeAverageCacheMissRatio(int cacheSize = 32) const;
+
   // merges all the specified groups into a single group
   // groupIndices need not be sorted
   // the index of the merged group is set to the smallest index among "groupIndices"
@@ -415,39 +462,43 @@ public:
   class Vertex
   {
     public:
+      Vertex() : positionIndex(0), textureIndex(noIndex), normalIndex(noIndex) {}
+
       explicit Vertex(const unsigned int & positionIndex_)
-        : positionIndex(positionIndex_), textureIndex(std::make_pair(false, 0)), normalIndex(std::make_pair(false, 0)) {}
+        : positionIndex(positionIndex_), textureIndex(noIndex), normalIndex(noIndex) {}
 
       explicit Vertex(const unsigned int & positionIndex_, const unsigned int & textureIndex_)
-        : positionIndex(positionIndex_), textureIndex(std::make_pair(true, textureIndex_)), normalIndex(std::make_pair(false, 0)) {}
+        : positionIndex(positionIndex_), textureIndex(textureIndex_), normalIndex(noIndex) {}
 
       explicit Vertex(const unsigned int & positionIndex_, const unsigned int & textureIndex_, const unsigned int & normalIndex_)
-        : positionIndex(positionIndex_), textureIndex(std::make_pair(true, textureIndex_)), normalIndex(std::make_pair(true, normalIndex_)) {}
+        : positionIndex(positionIndex_), textureIndex(textureIndex_), normalIndex(normalIndex_) {}
 
       explicit Vertex(const unsigned int & positionIndex_, const std::pair<bool, unsigned int> textureIndex_, const std::pair<bool, unsigned int> normalIndex_)
-        : positionIndex(positionIndex_), textureIndex(textureIndex_), normalIndex(normalIndex_) {}
+        : positionIndex(positionIndex_), textureIndex(textureIndex_.first ? textureIndex_.second : noIndex), normalIndex(normalIndex_.first ? normalIndex_.second : noIndex) {}
 
       inline unsigned int getPositionIndex() const { return positionIndex; }
-      inline unsigned int getNormalIndex() const { assert(normalIndex.first); return normalIndex.second; }
-      inline unsigned int getTextureCoordinateIndex() const { assert(textureIndex.first); return textureIndex.second; }
-      inline std::pair< bool, unsigned int > getTextureIndexPair() const { return textureIndex; }
-      inline std::pair< bool, unsigned int > getNormalIndexPair() const { return normalIndex; }
+      inline unsigned int getNormalIndex() const { assert(hasNormalIndex()); return normalIndex; }
+      inline unsigned int getTextureCoordinateIndex() const { assert(hasTextureCoordinateIndex()); return textureIndex; }
+      inline std::pair< bool, unsigned int > getTextureIndexPair() const { return hasTextureCoordinateIndex() ? std::make_pair(true, textureIndex) : std::make_pair(false, 0u); }
+      inline std::pair< bool, unsigned int > getNormalIndexPair() const { return hasNormalIndex() ? std::make_pair(true, normalIndex) : std::make_pair(false, 0u); }
 
       // Normals and texture coordinates are not considered "required" in the
       // obj file format standard.  Check these before retrieving them.
-      inline bool hasNormalIndex() const { return normalIndex.first; }
-      inline bool hasTextureCoordinateIndex() const { return textureIndex.first; }
+      inline bool hasNormalIndex() const { return normalIndex != noIndex; }
+      inline bool hasTextureCoordinateIndex() const { return textureIndex != noIndex; }
 
       inline void setPositionIndex(unsigned int positionIndex_) { positionIndex = positionIndex_; }
-      inline void setNormalIndex(unsigned int normalIndex_) { normalIndex = std::pair<bool,unsigned int>(true, normalIndex_); }
-      inline void setTextureCoordinateIndex(unsigned int textureCoordinate_) { textureIndex = std::pair<bool,unsigned int>(true, textureCoordinate_); }
-      inline void removeNormalIndex() { normalIndex.first = false; }
-      inline void removeTextureCoordinateIndex() { textureIndex.first = false; }
+      inline void setNormalIndex(unsigned int normalIndex_) { normalIndex = normalIndex_; }
+      inline void setTextureCoordinateIndex(unsigned int textureCoordinate_) { textureIndex = textureCoordinate_; }
+      inline void removeNormalIndex() { normalIndex = noIndex; }
+      inline void removeTextureCoordinateIndex() { textureIndex = noIndex; }
 
     protected:
+      // a missing texture coordinate or normal index is stored as noIndex, so that a vertex takes 12 bytes
+      static const unsigned int noIndex = 0xFFFFFFFFu;
       unsigned int positionIndex;
-      std::pair< bool, unsigned int > textureIndex;
-      std::pair< bool, unsigned int > normalIndex;
+      unsigned int textureIndex;
+      unsigned int normalIndex;
   };
 
   class Material
@@ -488,36 +539,44 @@ public:
   class Face
   {
     public:
-      explicit Face() : faceNormal(std::make_pair(false, Vec3d())) { vertices.reserve(3); }
+      explicit Face() : faceNormal(std::make_pair(false, Vec3d())) {}
       explicit Face(const Vertex & v1, const Vertex & v2, const Vertex & v3) :
-          vertices{{v1,v2,v3}} , faceNormal(std::make_pair(false, Vec3d())) {}
+          numVertices(3), inlineVertices{v1, v2, v3}, faceNormal(std::make_pair(false, Vec3d())) {}
       explicit Face(unsigned int posIndex1, unsigned int posIndex2, unsigned int posIndex3) :
-          vertices{{Vertex(posIndex1), Vertex(posIndex2), Vertex(posIndex3)}}, faceNormal(std::make_pair(false, Vec3d())) {}
+          numVertices(3), inlineVertices{Vertex(posIndex1), Vertex(posIndex2), Vertex(posIndex3)}, faceNormal(std::make_pair(false, Vec3d())) {}
       explicit Face(unsigned int posIndex1, unsigned int posIndex2, unsigned int posIndex3, unsigned int posIndex4) :
-          vertices{{Vertex(posIndex1), Vertex(posIndex2), Vertex(posIndex3), Vertex(posIndex4)}}, faceNormal(std::make_pair(false, Vec3d())) {}
-
-      inline size_t getNumVertices() const { return vertices.size(); }
-      // get vertex pointer. Warning: This pointer will be invalided if vertices are modified by Face::removeVertex(), Face::reverseVertices() or Face::addVertex() due to vector reallocation
-      inline Vertex & getVertex(unsigned int vertex) { return vertices[vertex]; }
-      inline const Vertex & getVertex(unsigned int vertex) const { return vertices[vertex]; }
-      inline Vertex * getVertexHandle(unsigned int vertex) { return &(vertices[vertex]); }
-      inline const Vertex * getVertexHandle(unsigned int vertex) const { return &(vertices[vertex]); }
-      inline unsigned int getVertexPositionIndex(unsigned int vertex) const { return vertices[vertex].getPositionIndex(); }
+          numVertices(4), inlineVertices{Vertex(posIndex1), Vertex(posIndex2), Vertex(posIndex3), Vertex(posIndex4)}, faceNormal(std::make_pair(false, Vec3d())) {}
+
+      inline size_t getNumVertices() const { return numVertices; }
+      // get vertex pointer. Warning: This pointer will be invalided if vertices are modified by Face::removeVertex(), Face::reverseVertices() or Face::addVertex()
+      inline Vertex & getVertex(unsigned int vertex) { return getVertices()[vertex]; }
+      inline const Vertex & getVertex(unsigned int vertex) const { return getVertices()[vertex]; }
+      inline Vertex * getVertexHandle(unsigned int vertex) { return &(getVertices()[vertex]); }
+      inline const Vertex * getVertexHandle(unsigned int vertex) const { return &(getVertices()[vertex]); }
+      inline unsigned int getVertexPositionIndex(unsigned int vertex) const { return getVertices()[vertex].getPositionIndex(); }
       // get #triangles if triangulated
-      int getNumTriangles() const { return vertices.size() < 2 ? 0 : vertices.size() - 2; }
+      int getNumTriangles() const { return numVertices < 2 ? 0 : numVertices - 2; }
 
       inline void setFaceNormal(const Vec3d & normal) { faceNormal = std::pair<bool, Vec3d>(true, normal); }
       inline bool hasFaceNormal() const { return faceNormal.first; };
       inline const Vec3d & getFaceNormal() const { assert(faceNormal.first); return faceNormal.second; }
       inline void removeFaceNormal() { faceNormal.first = false; }
 
-      inline void addVertex(const Vertex & v) { vertices.push_back(v); }
-      inline void removeVertex(unsigned int i) { vertices.erase(vertices.begin() + i); }
-      inline void reverseVertices() { reverse(vertices.begin(), vertices.end()); }
-      inline void printVertices() const { for(unsigned int i=0; i<vertices.size(); i++) std::cout << vertices[i].getPositionIndex() << " "; }
+      void addVertex(const Vertex & v);
+      void removeVertex(unsigned int i);
+      inline void reverseVertices() { std::reverse(getVertices(), getVertices() + numVertices); }
+      inline void printVertices() const { for(unsigned int i=0; i<numVertices; i++) std::cout << getVertexPositionIndex(i) << " "; }
 
     protected:
-      std::vector< Vertex > vertices;
+      // Faces with up to numInlineVertices vertices (triangles and quads) store them inside the Face, without a heap allocation;
+      // larger faces store all their vertices in overflowVertices.
+      static const unsigned int numInlineVertices = 4;
+      inline Vertex * getVertices() { return (numVertices <= numInlineVertices) ? inlineVertices : overflowVertices.data(); }
+      inline const Vertex * getVertices() const { return (numVertices <= numInlineVertices) ? inlineVertices : overflowVertices.data(); }
+
+      unsigned int numVertices = 0;
+      Vertex inlineVertices[numInlineVertices];
+      std::vector< Vertex > overflowVertices;
       std::pair< bool, Vec3d > faceNormal;
   };
 
@@ -575,6 +634,10 @@ protected:
 
   std::vector<int> triangles; // for triangle vertex lookup
 
+  PointBVH vertexBVH; // over vertexPositions; must be refit when they change
+  TriangleBVH triangleBVH; // over the fan triangles of the faces; must be refit when vertexPositions change
+  std::vector<std::pair<int,int> > triangleBVHFaces; // group and face index of each triangle in triangleBVH
+
   // index assumes that the first int is smaller than the second
   std::map< std::pair<unsigned int,unsigned int>, Vec3d > edgePseudoNormals;
 
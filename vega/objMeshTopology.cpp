@@ -0,0 +1,116 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+
+#include "objMeshTopology.h"
+#include "objMesh.h"
+using namespace std;
+
+void ObjMeshTopology::clear()
+{
+  numFaces = 0;
+  triangleMesh = true;
+  faceOffsets.clear();
+  positionIndices.clear();
+  textureCoordinateIndices.clear();
+  normalIndices.clear();
+  groupFaceOffsets.assign(1, 0);
+  groupMaterialIndices.clear();
+}
+
+void ObjMeshTopology::build(const ObjMesh & mesh)
+{
+  clear();
+
+  // first pass: sizes
+  size_t numCorners = 0;
+  bool hasTextureCoordinates = false, hasNormals = false;
+  for(size_t i = 0; i < mesh.getNumGroups(); i++)
+  {
+    const ObjMesh::Group & group = mesh.getGroup(i);
+    for(size_t iFace = 0; iFace < group.getNumFaces(); iFace++)
+    {
+      const ObjMesh::Face & face = group.getFace(iFace);
+      numCorners += face.getNumVertices();
+      triangleMesh = triangleMesh && (face.getNumVertices() == 3);
+      for(size_t j = 0; j < face.getNumVertices(); j++)
+      {
+        hasTextureCoordinates = hasTextureCoordinates || face.getVertex(j).hasTextureCoordinateIndex();
+        hasNormals = hasNormals || face.getVertex(j).hasNormalIndex();
+      }
+    }
+    numFaces += group.getNumFaces();
+  }
+
+  positionIndices.reserve(numCorners);
+  if (hasTextureCoordinates)
+    textureCoordinateIndices.reserve(numCorners);
+  if (hasNormals)
+    normalIndices.reserve(numCorners);
+  if (triangleMesh == false)
+  {
+    faceOffsets.reserve(numFaces + 1);
+    faceOffsets.push_back(0);
+  }
+  groupFaceOffsets.reserve(mesh.getNumGroups() + 1);
+  groupMaterialIndices.reserve(mesh.getNumGroups());
+
+  // second pass: copy the indices
+  for(size_t i = 0; i < mesh.getNumGroups(); i++)
+  {
+    const ObjMesh::Group & group = mesh.getGroup(i);
+    for(size_t iFace = 0; iFace < group.getNumFaces(); iFace++)
+    {
+      const ObjMesh::Face & face = group.getFace(iFace);
+      for(size_t j = 0; j < face.getNumVertices(); j++)
+      {
+        const ObjMesh::Vertex & vertex = face.getVertex(j);
+        positionIndices.push_back(vertex.getPositionIndex());
+        if (hasTextureCoordinates)
+          textureCoordinateIndices.push_back(vertex.hasTextureCoordinateIndex() ? (int)vertex.getTextureCoordinateIndex() : -1);
+        if (hasNormals)
+          normalIndices.push_back(vertex.hasNormalIndex() ? (int)vertex.getNormalIndex() : -1);
+      }
+      if (triangleMesh == false)
+        faceOffsets.push_back(positionIndices.size());
+    }
+    groupFaceOffsets.push_back(groupFaceOffsets.back() + group.getNumFaces());
+    groupMaterialIndices.push_back(group.getMaterialIndex());
+  }
+}
+
+int ObjMeshTopology::getFanTriangles(vector<int> & triangles, vector<int> * triangleFaces) const
+{
+  if (triangleMesh)
+  {
+    // fast path: the corners are the triangles
+    triangles.insert(triangles.end(), positionIndices.begin(), positionIndices.end());
+    if (triangleFaces != NULL)
+      for(int face = 0; face < numFaces; face++)
+        triangleFaces->push_back(face);
+    return numFaces;
+  }
+
+  int numTriangles = 0;
+  for(int face = 0; face < numFaces; face++)
+  {
+    const int * corners = &positionIndices[faceOffsets[face]];
+    int numVertices = faceOffsets[face + 1] - faceOffsets[face];
+    for(int k = 2; k < numVertices; k++)
+    {
+      triangles.push_back(corners[0]);
+      triangles.push_back(corners[k - 1]);
+      triangles.push_back(corners[k]);
+      if (triangleFaces != NULL)
+        triangleFaces->push_back(face);
+      numTriangles++;
+    }
+  }
+  return numTriangles;
+}
+
+size_t ObjMeshTopology::getMemoryUsage() const
+{
+  return sizeof(int) * (faceOffsets.capacity() + positionIndices.capacity() + textureCoordinateIndices.capacity() +
+      normalIndices.capacity() + groupFaceOffsets.capacity() + groupMaterialIndices.capacity());
+}
@@ -0,0 +1,111 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+
+#ifndef _OBJMESH_TOPOLOGY_H_
+#define _OBJMESH_TOPOLOGY_H_
+
+#include <vector>
+#include <cstddef>
+
+class ObjMesh;
+
+/*
+  A compact, read-only copy of the faces of an ObjMesh, in flat arrays:
+  the position, texture coordinate and normal indices of all the face corners (face after face, group after group),
+  and the offset of each face's first corner. If every face is a triangle, the offsets are not stored
+  (face f has corners 3f, 3f+1, 3f+2), and getTriangles() gives the triangle index array directly.
+
+  Traversals read contiguous integer arrays, instead of one ObjMesh::Face object per face.
+  FaceView and GroupView offer the read-only part of the ObjMesh::Face and ObjMesh::Group interface over these arrays,
+  so traversal code can be written for either.
+  The topology is a snapshot: build it again after the faces of the mesh change (the vertex positions can change freely).
+*/
+
+class ObjMeshTopology
+{
+public:
+  ObjMeshTopology() {}
+  explicit ObjMeshTopology(const ObjMesh & mesh) { build(mesh); }
+
+  void build(const ObjMesh & mesh);
+  void clear();
+
+  int getNumFaces() const { return numFaces; }
+  int getNumGroups() const { return (int)groupFaceOffsets.size() - 1; }
+  int getNumCorners() const { return (int)positionIndices.size(); } // total number of face vertices
+
+  // true if every face is a triangle
+  bool isTriangleMesh() const { return triangleMesh; }
+  // only for triangle meshes: 3 * getNumFaces() position indices
+  const int * getTriangles() const { return positionIndices.data(); }
+
+  int getFaceOffset(int face) const { return triangleMesh ? 3 * face : faceOffsets[face]; } // index of the face's first corner
+  int getFaceNumVertices(int face) const { return triangleMesh ? 3 : faceOffsets[face + 1] - faceOffsets[face]; }
+
+  // corner arrays, of length getNumCorners(); a missing texture coordinate or normal index is -1
+  // the texture coordinate (normal) array is empty if no corner has a texture coordinate (normal)
+  const int * getPositionIndices() const { return positionIndices.data(); }
+  bool hasTextureCoordinateIndices() const { return textureCoordinateIndices.size() > 0; }
+  const int * getTextureCoordinateIndices() const { return textureCoordinateIndices.data(); }
+  bool hasNormalIndices() const { return normalIndices.size() > 0; }
+  const int * getNormalIndices() const { return normalIndices.data(); }
+
+  // faces of group g are getGroupFirstFace(g), ..., getGroupFirstFace(g+1) - 1
+  int getGroupFirstFace(int group) const { return groupFaceOffsets[group]; }
+  int getGroupMaterialIndex(int group) const { return groupMaterialIndices[group]; }
+
+  // appends the fan triangulation of all the faces (3 position indices per triangle) to "triangles",
+  // and, if triangleFaces is not NULL, the face of each triangle; returns the number of triangles
+  int getFanTriangles(std::vector<int> & triangles, std::vector<int> * triangleFaces = NULL) const;
+
+  size_t getMemoryUsage() const; // bytes used by the arrays
+
+  class FaceView
+  {
+  public:
+    int getNumVertices() const { return numVertices; }
+    int getVertexPositionIndex(int vertex) const { return topology->positionIndices[offset + vertex]; }
+    bool hasTextureCoordinateIndex(int vertex) const { return topology->hasTextureCoordinateIndices() && (topology->textureCoordinateIndices[offset + vertex] >= 0); }
+    int getTextureCoordinateIndex(int vertex) const { return topology->textureCoordinateIndices[offset + vertex]; }
+    bool hasNormalIndex(int vertex) const { return topology->hasNormalIndices() && (topology->normalIndices[offset + vertex] >= 0); }
+    int getNormalIndex(int vertex) const { return topology->normalIndices[offset + vertex]; }
+    int getNumTriangles() const { return numVertices < 2 ? 0 : numVertices - 2; }
+
+  protected:
+    friend class ObjMeshTopology;
+    FaceView(const ObjMeshTopology * topology_, int offset_, int numVertices_) : topology(topology_), offset(offset_), numVertices(numVertices_) {}
+    const ObjMeshTopology * topology;
+    int offset, numVertices;
+  };
+
+  class GroupView
+  {
+  public:
+    int getNumFaces() const { return topology->groupFaceOffsets[group + 1] - topology->groupFaceOffsets[group]; }
+    FaceView getFace(int face) const { return topology->getFace(topology->groupFaceOffsets[group] + face); }
+    int getMaterialIndex() const { return topology->groupMaterialIndices[group]; }
+
+  protected:
+    friend class ObjMeshTopology;
+    GroupView(const ObjMeshTopology * topology_, int group_) : topology(topology_), group(group_) {}
+    const ObjMeshTopology * topology;
+    int group;
+  };
+
+  // face: a global face index (0 <= face < getNumFaces(), over all groups)
+  FaceView getFace(int face) const { return FaceView(this, getFaceOffset(face), getFaceNumVertices(face)); }
+  GroupView getGroup(int group) const { return GroupView(this, group); }
+
+protected:
+  int numFaces = 0;
+  bool triangleMesh = true;
+  std::vector<int> faceOffsets; // numFaces + 1 entries; empty for triangle meshes
+  std::vector<int> positionIndices;
+  std::vector<int> textureCoordinateIndices;
+  std::vector<int> normalIndices;
+  std::vector<int> groupFaceOffsets { 0 }; // numGroups + 1 entries
+  std::vector<int> groupMaterialIndices;
+};
+
+#endif
@@ -0,0 +1,187 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "pointBVH.h"
+#include <algorithm>
+#include <cfloat>
+using namespace std;
+
+void PointBVH::build(int numPoints, const Vec3d * points, int leafSize)
+{
+  clear();
+  if (numPoints <= 0)
+    return;
+  pointOrder.resize(numPoints);
+  for(int i = 0; i < numPoints; i++)
+    pointOrder[i] = i;
+  nodes.reserve(2 * (numPoints / max(leafSize, 1) + 1));
+  buildNode(points, 0, numPoints, max(leafSize, 1));
+
+  nodeParents.assign(nodes.size(), -1);
+  pointLeaves.resize(numPoints);
+  for(int nodeIndex = 0; nodeIndex < (int)nodes.size(); nodeIndex++)
+  {
+    const Node & node = nodes[nodeIndex];
+    if (node.right < 0)
+    {
+      for(int i = node.begin; i < node.end; i++)
+        pointLeaves[pointOrder[i]] = nodeIndex;
+    }
+    else
+      nodeParents[nodeIndex + 1] = nodeParents[node.right] = nodeIndex;
+  }
+}
+
+int PointBVH::buildNode(const Vec3d * points, int begin, int end, int leafSize)
+{
+  int nodeIndex = nodes.size();
+  nodes.emplace_back();
+  Vec3d bmin(DBL_MAX), bmax(-DBL_MAX);
+  for(int i = begin; i < end; i++)
+  {
+    const Vec3d & p = points[pointOrder[i]];
+    for(int d = 0; d < 3; d++)
+    {
+      bmin[d] = min(bmin[d], p[d]);
+      bmax[d] = max(bmax[d], p[d]);
+    }
+  }
+  nodes[nodeIndex].bmin = bmin;
+  nodes[nodeIndex].bmax = bmax;
+  nodes[nodeIndex].begin = begin;
+  nodes[nodeIndex].end = end;
+  nodes[nodeIndex].right = -1;
+  if (end - begin <= leafSize)
+    return nodeIndex;
+
+  // split at the median along the longest side
+  Vec3d side = bmax - bmin;
+  int axis = (side[0] >= side[1]) ? ((side[0] >= side[2]) ? 0 : 2) : ((side[1] >= side[2]) ? 1 : 2);
+  int middle = (begin + end) / 2;
+  nth_element(pointOrder.begin() + begin, pointOrder.begin() + middle, pointOrder.begin() + end,
+      [&](int a, int b) { return points[a][axis] < points[b][axis]; });
+
+  buildNode(points, begin, middle, leafSize);
+  int right = buildNode(points, middle, end, leafSize);
+  nodes[nodeIndex].right = right; // "nodes" may have been reallocated
+  return nodeIndex;
+}
+
+void PointBVH::refitNode(const Vec3d * points, int nodeIndex)
+{
+  Node & node = nodes[nodeIndex];
+  if (node.right < 0)
+  {
+    Vec3d bmin(DBL_MAX), bmax(-DBL_MAX);
+    for(int i = node.begin; i < node.end; i++)
+    {
+      const Vec3d & p = points[pointOrder[i]];
+      for(int d = 0; d < 3; d++)
+      {
+        bmin[d] = min(bmin[d], p[d]);
+        bmax[d] = max(bmax[d], p[d]);
+      }
+    }
+    node.bmin = bmin;
+    node.bmax = bmax;
+  }
+  else
+  {
+    const Node & left = nodes[nodeIndex + 1], & right = nodes[node.right];
+    for(int d = 0; d < 3; d++)
+    {
+      node.bmin[d] = min(left.bmin[d], right.bmin[d]);
+      node.bmax[d] = max(left.bmax[d], right.bmax[d]);
+    }
+  }
+}
+
+void PointBVH::refit(const Vec3d * points)
+{
+  // children come after their parents, so a reverse sweep visits the children first
+  for(int nodeIndex = (int)nodes.size() - 1; nodeIndex >= 0; nodeIndex--)
+    refitNode(points, nodeIndex);
+}
+
+void PointBVH::refit(const Vec3d * points, int numMovedPoints, const int * movedPoints)
+{
+  // mark the leaves of the moved points and their ancestors (stopping at an already marked node), and refit the marked nodes
+  vector<char> nodeMoved(nodes.size(), 0);
+  for(int i = 0; i < numMovedPoints; i++)
+    for(int nodeIndex = pointLeaves[movedPoints[i]]; (nodeIndex >= 0) && (nodeMoved[nodeIndex] == 0); nodeIndex = nodeParents[nodeIndex])
+      nodeMoved[nodeIndex] = 1;
+  for(int nodeIndex = (int)nodes.size() - 1; nodeIndex >= 0; nodeIndex--)
+    if (nodeMoved[nodeIndex])
+      refitNode(points, nodeIndex);
+}
+
+void PointBVH::clear()
+{
+  nodes.clear();
+  pointOrder.clear();
+  nodeParents.clear();
+  pointLeaves.clear();
+}
+
+double PointBVH::boxDistance2(const Node & node, const Vec3d & pos)
+{
+  double dist2 = 0.0;
+  for(int d = 0; d < 3; d++)
+  {
+    double outside = max(max(node.bmin[d] - pos[d], pos[d] - node.bmax[d]), 0.0);
+    dist2 += outside * outside;
+  }
+  return dist2;
+}
+
+int PointBVH::getClosestPoint(const Vec3d * points, const Vec3d & queryPos, double * distance) const
+{
+  double closestDist2 = DBL_MAX;
+  int indexClosest = -1;
+  if (nodes.size() > 0)
+  {
+    // depth-first, nearer child first; the depth of a median-split tree is logarithmic
+    int stack[128];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+      const Node & node = nodes[stack[--stackSize]];
+      if (boxDistance2(node, queryPos) >= closestDist2)
+        continue;
+
+      if (node.right < 0)
+      {
+        for(int i = node.begin; i < node.end; i++)
+        {
+          double dist2 = len2(points[pointOrder[i]] - queryPos);
+          if (dist2 < closestDist2)
+          {
+            closestDist2 = dist2;
+            indexClosest = pointOrder[i];
+          }
+        }
+        continue;
+      }
+
+      int leftIndex = &node - nodes.data() + 1;
+      double leftDist2 = boxDistance2(nodes[leftIndex], queryPos), rightDist2 = boxDistance2(nodes[node.right], queryPos);
+      // push the farther child first, so that the nearer one is visited first
+      if (leftDist2 < rightDist2)
+      {
+        stack[stackSize++] = node.right;
+        stack[stackSize++] = leftIndex;
+      }
+      else
+      {
+        stack[stackSize++] = leftIndex;
+        stack[stackSize++] = node.right;
+      }
+    }
+  }
+
+  if (distance != NULL)
+    *distance = (indexClosest >= 0) ? sqrt(closestDist2) : DBL_MAX;
+  return indexClosest;
+}
+
@@ -0,0 +1,57 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#ifndef _POINT_BVH_H_
+#define _POINT_BVH_H_
+
+#include "vec3d.h"
+#include <vector>
+
+/*
+  A bounding volume hierarchy (axis-aligned boxes) over a set of points, for nearest-point queries.
+  The tree is built once, by median splits along the longest box side. When the points move
+  (e.g., a deforming mesh), refit() recomputes the boxes bottom-up in linear time and keeps the tree;
+  queries remain exact, and are fast as long as the deformation does not scramble the point neighborhoods.
+  The points are not stored: pass the same point array (with the current positions) to refit and the queries.
+*/
+
+class PointBVH
+{
+public:
+  PointBVH() {}
+
+  // builds the hierarchy over points[0], ..., points[numPoints-1]; leaves hold at most "leafSize" points
+  void build(int numPoints, const Vec3d * points, int leafSize = 8);
+  // recomputes the bounding boxes for the current point positions
+  void refit(const Vec3d * points);
+  // the same, when only the points movedPoints[0], ..., movedPoints[numMovedPoints-1] moved: recomputes only
+  // the boxes of their leaves and of the ancestors of these leaves
+  void refit(const Vec3d * points, int numMovedPoints, const int * movedPoints);
+  void clear();
+
+  int getNumPoints() const { return (int)pointOrder.size(); }
+  bool isBuilt() const { return nodes.size() > 0; }
+
+  // returns the index of the point closest to queryPos (-1 if there are no points); also outputs the distance (if distance is not NULL)
+  int getClosestPoint(const Vec3d * points, const Vec3d & queryPos, double * distance = NULL) const;
+
+protected:
+  struct Node
+  {
+    Vec3d bmin, bmax;
+    int begin, end; // range in pointOrder
+    int right; // index of the right child; the left child is the next node; -1 for a leaf
+  };
+
+  int buildNode(const Vec3d * points, int begin, int end, int leafSize);
+  void refitNode(const Vec3d * points, int nodeIndex);
+  static double boxDistance2(const Node & node, const Vec3d & pos);
+
+  std::vector<Node> nodes; // in depth-first order: every child comes after its parent
+  std::vector<int> pointOrder; // point indices, grouped by leaf
+  std::vector<int> nodeParents; // -1 for the root
+  std::vector<int> pointLeaves; // the leaf of each point
+};
+
+#endif
+
@@ -148,6 +148,11 @@ void SceneObject::BuildNormals(double thresholdAngle)
   BuildVertexNormals(thresholdAngle);
 }
 
+int SceneObject::UpdateNormals(const std::vector<int> & movedVertices, double thresholdAngle)
+{
+  return mesh->updateNormals(movedVertices, thresholdAngle);
+}
+
 void SceneObject::SetNormalsToFaceNormals()
 {
   mesh->setNormalsToFaceNormals();
@@ -136,6 +136,9 @@ public:
   // if the normals of two nearby faces form an angle that's larger than thresholdAngle, it's considered as a hard edge
   void BuildVertexNormals(double thresholdAngle=85.0); // assumes pre-existing face normals
   void BuildNormals(double thresholdAngle=85.0); // builds both face and vertex normals
+  // after the vertices movedVertices moved, updates the normals of their faces and of the vertices of these faces (see ObjMesh::updateNormals);
+  // the normals must have been built by BuildNormals with the same thresholdAngle; returns 1 if all the vertex normals had to be rebuilt
+  int UpdateNormals(const std::vector<int> & movedVertices, double thresholdAngle=85.0);
   void BuildNormalsFancy(double thresholdAngle=85.0);  // rebuilds facet normals + calls vertex-per-triangle normal update
 
   void SetNormalsToFaceNormals();
@@ -46,6 +46,11 @@ SceneObjectDeformable::SceneObjectDeformable(ObjMesh * objMesh, bool deepCopy):
 {
 }
 
+SceneObjectDeformable::SceneObjectDeformable(ObjMesh * objMesh, const SceneObjectDeformable & restShape, bool deepCopy):
+   SceneObjectWithRestPosition(objMesh, restShape, deepCopy) 
+{
+}
+
 SceneObjectDeformable::~SceneObjectDeformable()
 {
 }
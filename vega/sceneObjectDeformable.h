@@ -46,6 +46,8 @@ class SceneObjectDeformable : public virtual SceneObjectWithRestPosition
 public:
   SceneObjectDeformable(const char * filenameOBJ);
   SceneObjectDeformable(ObjMesh * objMesh, bool deepCopy = true);
+  // shares the rest positions of restShape; see SceneObjectWithRestPosition
+  SceneObjectDeformable(ObjMesh * objMesh, const SceneObjectDeformable & restShape, bool deepCopy = true);
   virtual ~SceneObjectDeformable();
 
   // sets the current dynamic vertex positions to the rest position + specified deformation
@@ -78,6 +80,11 @@ inline void SceneObjectDeformable::GetSingleVertexRestPosition(int vertex, doubl
 
 inline void SceneObjectDeformable::SetSingleVertexRestPosition(int vertex, double x, double y, double z)
 {
+  if (restPositions.use_count() > 1) // shared with other objects: copy before changing
+  {
+    restPositions = std::make_shared<std::vector<double>>(*restPositions);
+    restPosition = restPositions->data();
+  }
   restPosition[3*vertex+0] = x;
   restPosition[3*vertex+1] = y;
   restPosition[3*vertex+2] = z;
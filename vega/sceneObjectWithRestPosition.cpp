@@ -32,6 +32,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <assert.h>
 #include "sceneObjectWithRestPosition.h"
 
 SceneObjectWithRestPosition::SceneObjectWithRestPosition(const char * filename): SceneObject(filename) 
@@ -44,9 +45,17 @@ SceneObjectWithRestPosition::SceneObjectWithRestPosition(ObjMesh * objMesh, bool
   Construct();
 }
 
+SceneObjectWithRestPosition::SceneObjectWithRestPosition(ObjMesh * objMesh, const SceneObjectWithRestPosition & restShape, bool deepCopy):
+  SceneObject(objMesh, deepCopy), restPositions(restShape.restPositions)
+{
+  assert(n == restShape.n);
+  restPosition = restPositions->data();
+}
+
 void SceneObjectWithRestPosition::Construct()
 {
-  restPosition = (double*) malloc (sizeof(double) * 3 * n);
+  restPositions = std::make_shared<std::vector<double>>(3 * n);
+  restPosition = restPositions->data();
   for(int i = 0; i < n; i++)
   {
     Vec3d pos = mesh->getPosition(i);
@@ -58,7 +67,6 @@ void SceneObjectWithRestPosition::Construct()
 
 SceneObjectWithRestPosition::~SceneObjectWithRestPosition()
 {
-  free(restPosition);
 }
 
 void SceneObjectWithRestPosition::GetVertexRestPositions(double * buffer)
@@ -34,21 +34,27 @@
 #define _SCENEOBJECTWITHRESTPOSITION_H_
 
 #include "sceneObject.h"
+#include <vector>
+#include <memory>
 
 class SceneObjectWithRestPosition: public SceneObject
 {
 public:
   SceneObjectWithRestPosition(const char * filename);
   SceneObjectWithRestPosition(ObjMesh * objMesh, bool deepCopy = true);
+  // shares the rest positions of restShape (which must have the same number of vertices), instead of copying them from objMesh;
+  // the shared positions are copied only if one of the objects changes them
+  SceneObjectWithRestPosition(ObjMesh * objMesh, const SceneObjectWithRestPosition & restShape, bool deepCopy = true);
   virtual ~SceneObjectWithRestPosition();
 
   void GetVertexRestPositions(float * buffer);
   void GetVertexRestPositions(double * buffer);
-  double * GetVertexRestPositions() { return restPosition; }
+  const double * GetVertexRestPositions() const { return restPosition; }
 
 protected:
   void Construct();
-  double * restPosition;
+  std::shared_ptr<std::vector<double>> restPositions; // possibly shared with other objects
+  double * restPosition; // restPositions->data()
 };
 
 #endif
@@ -0,0 +1,279 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "triangleBVH.h"
+#include <algorithm>
+#include <cfloat>
+using namespace std;
+
+void TriangleBVH::build(int numTriangles, const int * triangles_, const Vec3d * positions, int leafSize)
+{
+  clear();
+  if (numTriangles <= 0)
+    return;
+  triangles.assign(triangles_, triangles_ + 3 * numTriangles);
+  triangleOrder.resize(numTriangles);
+  vector<Vec3d> centroids(numTriangles);
+  for(int i = 0; i < numTriangles; i++)
+  {
+    triangleOrder[i] = i;
+    centroids[i] = (positions[triangles[3 * i + 0]] + positions[triangles[3 * i + 1]] + positions[triangles[3 * i + 2]]) / 3.0;
+  }
+  nodes.reserve(2 * (numTriangles / max(leafSize, 1) + 1));
+  buildNode(centroids, 0, numTriangles, max(leafSize, 1));
+
+  // the parents, and the (vertex, leaf) incidences, sorted by vertex, without duplicates
+  nodeParents.assign(nodes.size(), -1);
+  vector<pair<int, int>> incidences;
+  incidences.reserve(triangles.size());
+  for(int nodeIndex = 0; nodeIndex < (int)nodes.size(); nodeIndex++)
+  {
+    const Node & node = nodes[nodeIndex];
+    if (node.right < 0)
+    {
+      for(int i = node.begin; i < node.end; i++)
+        for(int j = 0; j < 3; j++)
+          incidences.push_back(make_pair(triangles[3 * triangleOrder[i] + j], nodeIndex));
+    }
+    else
+      nodeParents[nodeIndex + 1] = nodeParents[node.right] = nodeIndex;
+  }
+  sort(incidences.begin(), incidences.end());
+  incidences.erase(unique(incidences.begin(), incidences.end()), incidences.end());
+  int numVertices = *max_element(triangles.begin(), triangles.end()) + 1;
+  vertexLeafStarts.assign(numVertices + 1, 0);
+  vertexLeaves.resize(incidences.size());
+  for(size_t i = 0; i < incidences.size(); i++)
+  {
+    vertexLeafStarts[incidences[i].first + 1]++;
+    vertexLeaves[i] = incidences[i].second;
+  }
+  for(int v = 0; v < numVertices; v++)
+    vertexLeafStarts[v + 1] += vertexLeafStarts[v];
+
+  refit(positions);
+}
+
+int TriangleBVH::buildNode(const vector<Vec3d> & centroids, int begin, int end, int leafSize)
+{
+  int nodeIndex = nodes.size();
+  nodes.emplace_back();
+  nodes[nodeIndex].begin = begin;
+  nodes[nodeIndex].end = end;
+  nodes[nodeIndex].right = -1;
+  if (end - begin <= leafSize)
+    return nodeIndex;
+
+  // split at the median centroid along the longest side of the centroids' box
+  Vec3d cmin(DBL_MAX), cmax(-DBL_MAX);
+  for(int i = begin; i < end; i++)
+  {
+    const Vec3d & c = centroids[triangleOrder[i]];
+    for(int d = 0; d < 3; d++)
+    {
+      cmin[d] = min(cmin[d], c[d]);
+      cmax[d] = max(cmax[d], c[d]);
+    }
+  }
+  Vec3d side = cmax - cmin;
+  int axis = (side[0] >= side[1]) ? ((side[0] >= side[2]) ? 0 : 2) : ((side[1] >= side[2]) ? 1 : 2);
+  int middle = (begin + end) / 2;
+  nth_element(triangleOrder.begin() + begin, triangleOrder.begin() + middle, triangleOrder.begin() + end,
+      [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+  buildNode(centroids, begin, middle, leafSize);
+  int right = buildNode(centroids, middle, end, leafSize);
+  nodes[nodeIndex].right = right; // "nodes" may have been reallocated
+  return nodeIndex;
+}
+
+void TriangleBVH::computeLeafBox(const Vec3d * positions, Node & node) const
+{
+  Vec3d bmin(DBL_MAX), bmax(-DBL_MAX);
+  for(int i = node.begin; i < node.end; i++)
+  {
+    const int * triangle = &triangles[3 * triangleOrder[i]];
+    for(int j = 0; j < 3; j++)
+    {
+      const Vec3d & p = positions[triangle[j]];
+      for(int d = 0; d < 3; d++)
+      {
+        bmin[d] = min(bmin[d], p[d]);
+        bmax[d] = max(bmax[d], p[d]);
+      }
+    }
+  }
+  node.bmin = bmin;
+  node.bmax = bmax;
+}
+
+void TriangleBVH::refitNode(const Vec3d * positions, int nodeIndex)
+{
+  Node & node = nodes[nodeIndex];
+  if (node.right < 0)
+    computeLeafBox(positions, node);
+  else
+  {
+    const Node & left = nodes[nodeIndex + 1], & right = nodes[node.right];
+    for(int d = 0; d < 3; d++)
+    {
+      node.bmin[d] = min(left.bmin[d], right.bmin[d]);
+      node.bmax[d] = max(left.bmax[d], right.bmax[d]);
+    }
+  }
+}
+
+void TriangleBVH::refit(const Vec3d * positions)
+{
+  // children come after their parents, so a reverse sweep visits the children first
+  for(int nodeIndex = (int)nodes.size() - 1; nodeIndex >= 0; nodeIndex--)
+    refitNode(positions, nodeIndex);
+}
+
+void TriangleBVH::refit(const Vec3d * positions, int numMovedVertices, const int * movedVertices)
+{
+  // mark the leaves of the moved vertices and their ancestors (stopping at an already marked node), and refit the marked nodes
+  vector<char> nodeMoved(nodes.size(), 0);
+  int numVertices = (int)vertexLeafStarts.size() - 1;
+  for(int i = 0; i < numMovedVertices; i++)
+  {
+    int vertex = movedVertices[i];
+    if (vertex >= numVertices) // in no triangle
+      continue;
+    for(int k = vertexLeafStarts[vertex]; k < vertexLeafStarts[vertex + 1]; k++)
+      for(int nodeIndex = vertexLeaves[k]; (nodeIndex >= 0) && (nodeMoved[nodeIndex] == 0); nodeIndex = nodeParents[nodeIndex])
+        nodeMoved[nodeIndex] = 1;
+  }
+  for(int nodeIndex = (int)nodes.size() - 1; nodeIndex >= 0; nodeIndex--)
+    if (nodeMoved[nodeIndex])
+      refitNode(positions, nodeIndex);
+}
+
+void TriangleBVH::clear()
+{
+  nodes.clear();
+  triangles.clear();
+  triangleOrder.clear();
+  nodeParents.clear();
+  vertexLeafStarts.clear();
+  vertexLeaves.clear();
+}
+
+double TriangleBVH::intersectBox(const Node & node, const Vec3d & origin, const Vec3d & inverseDirection, double maxT)
+{
+  double tEnter = 0.0, tExit = maxT;
+  for(int d = 0; d < 3; d++)
+  {
+    if (inverseDirection[d] == DBL_MAX) // the ray is parallel to the slab
+    {
+      if ((origin[d] < node.bmin[d]) || (origin[d] > node.bmax[d]))
+        return -1.0;
+      continue;
+    }
+    double t0 = (node.bmin[d] - origin[d]) * inverseDirection[d];
+    double t1 = (node.bmax[d] - origin[d]) * inverseDirection[d];
+    if (t0 > t1)
+      swap(t0, t1);
+    tEnter = max(tEnter, t0);
+    tExit = min(tExit, t1);
+    if (tEnter > tExit)
+      return -1.0;
+  }
+  return tEnter;
+}
+
+bool TriangleBVH::intersectTriangle(const Vec3d & origin, const Vec3d & direction, const Vec3d & p0, const Vec3d & p1, const Vec3d & p2,
+    double maxT, double * t, double * u, double * v)
+{
+  Vec3d e1 = p1 - p0, e2 = p2 - p0;
+  Vec3d pv = cross(direction, e2);
+  double det = dot(e1, pv);
+  if (fabs(det) < 1e-300)
+    return false;
+  double invDet = 1.0 / det;
+  Vec3d tv = origin - p0;
+  double uu = dot(tv, pv) * invDet;
+  if ((uu < 0.0) || (uu > 1.0))
+    return false;
+  Vec3d qv = cross(tv, e1);
+  double vv = dot(direction, qv) * invDet;
+  if ((vv < 0.0) || (uu + vv > 1.0))
+    return false;
+  double tt = dot(e2, qv) * invDet;
+  if ((tt < 0.0) || (tt > maxT))
+    return false;
+  *t = tt;
+  *u = uu;
+  *v = vv;
+  return true;
+}
+
+bool TriangleBVH::intersectRay(const Vec3d * positions, const Vec3d & origin, const Vec3d & direction, RayHit * hit, double maxT) const
+{
+  if (nodes.size() == 0)
+    return false;
+
+  Vec3d inverseDirection;
+  for(int d = 0; d < 3; d++)
+    inverseDirection[d] = (direction[d] != 0.0) ? 1.0 / direction[d] : DBL_MAX;
+
+  bool found = false;
+  double closestT = maxT;
+  // depth-first, nearer child first; the depth of a median-split tree is logarithmic
+  int stack[128];
+  int stackSize = 0;
+  if (intersectBox(nodes[0], origin, inverseDirection, closestT) >= 0.0)
+    stack[stackSize++] = 0;
+  while (stackSize > 0)
+  {
+    int nodeIndex = stack[--stackSize];
+    const Node & node = nodes[nodeIndex];
+    if (intersectBox(node, origin, inverseDirection, closestT) < 0.0) // a closer hit was found since this node was pushed
+      continue;
+
+    if (node.right < 0)
+    {
+      for(int i = node.begin; i < node.end; i++)
+      {
+        int triangle = triangleOrder[i];
+        const int * v = &triangles[3 * triangle];
+        double t, bu, bv;
+        if (intersectTriangle(origin, direction, positions[v[0]], positions[v[1]], positions[v[2]], closestT, &t, &bu, &bv))
+        {
+          found = true;
+          closestT = t;
+          hit->triangle = triangle;
+          hit->t = t;
+          hit->barycentrics[0] = 1.0 - bu - bv;
+          hit->barycentrics[1] = bu;
+          hit->barycentrics[2] = bv;
+        }
+      }
+      continue;
+    }
+
+    int leftIndex = nodeIndex + 1;
+    double leftT = intersectBox(nodes[leftIndex], origin, inverseDirection, closestT);
+    double rightT = intersectBox(nodes[node.right], origin, inverseDirection, closestT);
+    // push the farther child first, so that the nearer one is visited first
+    if ((leftT >= 0.0) && (rightT >= 0.0))
+    {
+      if (leftT < rightT)
+      {
+        stack[stackSize++] = node.right;
+        stack[stackSize++] = leftIndex;
+      }
+      else
+      {
+        stack[stackSize++] = leftIndex;
+        stack[stackSize++] = node.right;
+      }
+    }
+    else if (leftT >= 0.0)
+      stack[stackSize++] = leftIndex;
+    else if (rightT >= 0.0)
+      stack[stackSize++] = node.right;
+  }
+  return found;
+}
+
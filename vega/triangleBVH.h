@@ -0,0 +1,74 @@
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#ifndef _TRIANGLE_BVH_H_
+#define _TRIANGLE_BVH_H_
+
+#include "vec3d.h"
+#include <vector>
+
+/*
+  A bounding volume hierarchy (axis-aligned boxes) over a triangle mesh, for ray casting.
+  The tree is built once, by median splits of the triangle centroids along the longest box side.
+  When the vertices move (e.g., a skinned mesh), refit() recomputes the boxes bottom-up in linear time and keeps the tree.
+  The vertex positions are not stored: pass the current positions to build, refit and the queries.
+*/
+
+class TriangleBVH
+{
+public:
+  TriangleBVH() {}
+
+  // triangles: 3 * numTriangles vertex indices into "positions"; leaves hold at most "leafSize" triangles
+  void build(int numTriangles, const int * triangles, const Vec3d * positions, int leafSize = 4);
+  // recomputes the bounding boxes for the current vertex positions
+  void refit(const Vec3d * positions);
+  // the same, when only the vertices movedVertices[0], ..., movedVertices[numMovedVertices-1] moved: recomputes only
+  // the boxes of the leaves with a triangle at one of these vertices, and of the ancestors of these leaves
+  void refit(const Vec3d * positions, int numMovedVertices, const int * movedVertices);
+  void clear();
+
+  int getNumTriangles() const { return (int)triangles.size() / 3; }
+  bool isBuilt() const { return nodes.size() > 0; }
+  const int * getTriangle(int triangle) const { return &triangles[3 * triangle]; }
+
+  struct RayHit
+  {
+    int triangle; // index of the hit triangle, as given to build
+    double t; // the hit point is origin + t * direction
+    double barycentrics[3]; // weights of the triangle's three vertices at the hit point
+  };
+
+  // finds the closest intersection of the ray origin + t * direction, t in [0, maxT], with the triangles (both sides)
+  // returns true if the ray hits a triangle
+  bool intersectRay(const Vec3d * positions, const Vec3d & origin, const Vec3d & direction, RayHit * hit, double maxT = 1e300) const;
+
+  // ray-triangle intersection (Moller-Trumbore); returns true and t, u, v (hit = (1-u-v) * p0 + u * p1 + v * p2) on a hit with t in [0, maxT]
+  static bool intersectTriangle(const Vec3d & origin, const Vec3d & direction, const Vec3d & p0, const Vec3d & p1, const Vec3d & p2,
+      double maxT, double * t, double * u, double * v);
+
+protected:
+  struct Node
+  {
+    Vec3d bmin, bmax;
+    int begin, end; // range in triangleOrder
+    int right; // index of the right child; the left child is the next node; -1 for a leaf
+  };
+
+  int buildNode(const std::vector<Vec3d> & centroids, int begin, int end, int leafSize);
+  void computeLeafBox(const Vec3d * positions, Node & node) const;
+  void refitNode(const Vec3d * positions, int nodeIndex);
+  // returns the ray parameter at which the ray enters the box, or a negative value if it misses the box within [0, maxT]
+  static double intersectBox(const Node & node, const Vec3d & origin, const Vec3d & inverseDirection, double maxT);
+
+  std::vector<Node> nodes; // in depth-first order: every child comes after its parent
+  std::vector<int> triangles; // 3 vertex indices per triangle
+  std::vector<int> triangleOrder; // triangle indices, grouped by leaf
+  std::vector<int> nodeParents; // -1 for the root
+  // the leaves with a triangle at vertex v: vertexLeaves[vertexLeafStarts[v]], ..., vertexLeaves[vertexLeafStarts[v+1] - 1]
+  std::vector<int> vertexLeafStarts;
+  std::vector<int> vertexLeaves;
+};
+
+#endif
+
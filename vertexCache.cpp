@@ -0,0 +1,279 @@
+#include "vertexCache.h"
+#include "performanceCounter.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+namespace
+{
+
+const char vertexCacheMagic[8] = { 'I', 'K', 'V', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t vertexCacheVersion = 1;
+static_assert(sizeof(VertexCacheHeader) == 64, "the vertex cache header must be 64 bytes");
+
+size_t alignUp(size_t offset, size_t alignment) { return (offset + alignment - 1) / alignment * alignment; }
+
+size_t getFrameSize(VertexCacheEncoding encoding, int numVertices)
+{
+  size_t numValues = 3 * (size_t)numVertices;
+  switch(encoding)
+  {
+    case VERTEX_CACHE_FLOAT64:
+      return numValues * sizeof(double);
+    case VERTEX_CACHE_FLOAT32:
+      return alignUp(numValues * sizeof(float), 8);
+    default:
+      return 6 * sizeof(double) + alignUp(numValues * sizeof(uint16_t), 8);
+  }
+}
+
+}
+
+VertexCacheWriter::VertexCacheWriter(const std::string & filename, int numVertices_, double frameRate,
+    VertexCacheEncoding encoding, const double * referencePositions_) : numVertices(numVertices_)
+{
+  memset(&header, 0, sizeof(VertexCacheHeader));
+  memcpy(header.magic, vertexCacheMagic, sizeof(vertexCacheMagic));
+  header.version = vertexCacheVersion;
+  header.encoding = encoding;
+  header.numVertices = numVertices;
+  header.frameRate = frameRate;
+  header.referenceOffset = alignUp(sizeof(VertexCacheHeader), 64);
+  size_t referenceSize = (encoding == VERTEX_CACHE_DELTA16) ? 3 * sizeof(double) * numVertices : 0;
+  header.framesOffset = alignUp(header.referenceOffset + referenceSize, 64);
+  header.frameSize = getFrameSize(encoding, numVertices);
+
+  if (encoding == VERTEX_CACHE_DELTA16)
+  {
+    if (referencePositions_)
+      referencePositions.assign(referencePositions_, referencePositions_ + 3 * numVertices);
+    else
+    {
+      referencePositions.assign(3 * numVertices, 0.0);
+      writeReference = true;
+    }
+  }
+
+  file = fopen(filename.c_str(), "wb");
+  if (file == nullptr)
+  {
+    printf("Error: cannot open vertex cache %s for writing.\n", filename.c_str());
+    return;
+  }
+  // the header is written again by close(), with the number of frames
+  vector<char> start(header.framesOffset, 0);
+  memcpy(start.data(), &header, sizeof(VertexCacheHeader));
+  if (referencePositions.size() > 0)
+    memcpy(start.data() + header.referenceOffset, referencePositions.data(), referenceSize);
+  if (fwrite(start.data(), 1, start.size(), file) != start.size())
+    writeError = true;
+
+  encodedFrame.resize(header.frameSize, 0);
+  for(int b = 0; b < 2; b++)
+    buffers[b].resize(3 * numVertices);
+  writerThread = thread(&VertexCacheWriter::writerLoop, this);
+}
+
+VertexCacheWriter::~VertexCacheWriter()
+{
+  close();
+}
+
+void VertexCacheWriter::writeFrame(const double * positions)
+{
+  if (file == nullptr)
+    return;
+
+  unique_lock<std::mutex> lock(mutex);
+  if (bufferFull[fillBuffer])
+  {
+    PerformanceCounter stallCounter;
+    bufferEmptied.wait(lock, [&]() { return !bufferFull[fillBuffer]; });
+    stallCounter.StopCounter();
+    stallTime += stallCounter.GetElapsedTime();
+  }
+  lock.unlock();
+
+  // the background thread does not access an empty buffer
+  memcpy(buffers[fillBuffer].data(), positions, sizeof(double) * 3 * numVertices);
+
+  lock.lock();
+  bufferFull[fillBuffer] = true;
+  lock.unlock();
+  bufferFilled.notify_one();
+  fillBuffer = 1 - fillBuffer;
+  numFramesSubmitted++;
+}
+
+void VertexCacheWriter::encodeFrame(const double * positions)
+{
+  int numValues = 3 * numVertices;
+  switch(header.encoding)
+  {
+    case VERTEX_CACHE_FLOAT64:
+      memcpy(encodedFrame.data(), positions, sizeof(double) * numValues);
+    break;
+
+    case VERTEX_CACHE_FLOAT32:
+    {
+      float * values = (float *)encodedFrame.data();
+      for(int i = 0; i < numValues; i++)
+        values[i] = (float)positions[i];
+    }
+    break;
+
+    default:
+    {
+      // QUANTIZED16 and DELTA16: 16 bits per coordinate, over the range of each coordinate in this frame
+      const double * reference = (header.encoding == VERTEX_CACHE_DELTA16) ? referencePositions.data() : nullptr;
+      double minimum[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL }, maximum[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+      for(int i = 0; i < numValues; i++)
+      {
+        double value = reference ? positions[i] - reference[i] : positions[i];
+        minimum[i % 3] = min(minimum[i % 3], value);
+        maximum[i % 3] = max(maximum[i % 3], value);
+      }
+      double * range = (double *)encodedFrame.data();
+      uint16_t * values = (uint16_t *)(range + 6);
+      double inverseStep[3];
+      for(int d = 0; d < 3; d++)
+      {
+        if (numVertices == 0)
+          minimum[d] = maximum[d] = 0.0;
+        range[d] = minimum[d];
+        range[3 + d] = (maximum[d] - minimum[d]) / 65535.0;
+        inverseStep[d] = (range[3 + d] > 0.0) ? 1.0 / range[3 + d] : 0.0;
+      }
+      for(int i = 0; i < numValues; i++)
+      {
+        double value = reference ? positions[i] - reference[i] : positions[i];
+        values[i] = (uint16_t)min(lround((value - minimum[i % 3]) * inverseStep[i % 3]), 65535L);
+      }
+    }
+    break;
+  }
+}
+
+void VertexCacheWriter::writerLoop()
+{
+  int buffer = 0;
+  while (true)
+  {
+    unique_lock<std::mutex> lock(mutex);
+    bufferFilled.wait(lock, [&]() { return bufferFull[buffer] || closing; });
+    if (bufferFull[buffer] == false) // closing, and every frame is written
+      return;
+    lock.unlock();
+
+    bool error = false;
+    if (writeReference)
+    {
+      // DELTA16 without given reference positions: the first frame is the reference
+      referencePositions = buffers[buffer];
+      long position = ftell(file);
+      error = (fseek(file, header.referenceOffset, SEEK_SET) != 0) ||
+        (fwrite(referencePositions.data(), sizeof(double), referencePositions.size(), file) != referencePositions.size()) ||
+        (fseek(file, position, SEEK_SET) != 0);
+      writeReference = false;
+    }
+    encodeFrame(buffers[buffer].data());
+    error = error || (fwrite(encodedFrame.data(), 1, encodedFrame.size(), file) != encodedFrame.size());
+
+    lock.lock();
+    writeError = writeError || error;
+    bufferFull[buffer] = false;
+    lock.unlock();
+    bufferEmptied.notify_one();
+    buffer = 1 - buffer;
+  }
+}
+
+int VertexCacheWriter::close()
+{
+  if (file == nullptr)
+    return 1;
+
+  {
+    lock_guard<std::mutex> lock(mutex);
+    closing = true;
+  }
+  bufferFilled.notify_one();
+  writerThread.join();
+
+  header.numFrames = numFramesSubmitted;
+  bool error = writeError || (fseek(file, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(VertexCacheHeader), 1, file) != 1);
+  error = (fclose(file) != 0) || error;
+  file = nullptr;
+  return error ? 1 : 0;
+}
+
+VertexCacheReader::VertexCacheReader(const std::string & filename) : file(filename)
+{
+  if (file.isOpen() == false)
+  {
+    printf("Error: cannot open vertex cache %s.\n", filename.c_str());
+    return;
+  }
+
+  const VertexCacheHeader * h = (const VertexCacheHeader *)file.getData();
+  size_t size = file.getSize();
+  bool valid = (size >= sizeof(VertexCacheHeader)) && (memcmp(h->magic, vertexCacheMagic, sizeof(vertexCacheMagic)) == 0) &&
+    (h->version == vertexCacheVersion) && (h->encoding < NUM_VERTEX_CACHE_ENCODINGS) &&
+    (h->frameSize == getFrameSize((VertexCacheEncoding)h->encoding, h->numVertices)) && (h->framesOffset <= size) &&
+    (h->referenceOffset + ((h->encoding == VERTEX_CACHE_DELTA16) ? 3 * sizeof(double) * h->numVertices : 0) <= h->framesOffset);
+  if (!valid)
+  {
+    printf("Error: %s is not a valid vertex cache.\n", filename.c_str());
+    return;
+  }
+
+  header = h;
+  // If the writer did not finish (numFrames is 0 in the header), use the frames that were completely written.
+  int numFramesInFile = (header->frameSize > 0) ? (int)((size - header->framesOffset) / header->frameSize) : 0;
+  numFrames = (header->numFrames > 0) ? min((int)header->numFrames, numFramesInFile) : numFramesInFile;
+}
+
+void VertexCacheReader::readFrame(int frame, double * positions) const
+{
+  int numValues = 3 * header->numVertices;
+  const char * data = file.getData() + header->framesOffset + header->frameSize * frame;
+  switch(header->encoding)
+  {
+    case VERTEX_CACHE_FLOAT64:
+      memcpy(positions, data, sizeof(double) * numValues);
+    break;
+
+    case VERTEX_CACHE_FLOAT32:
+    {
+      const float * values = (const float *)data;
+      for(int i = 0; i < numValues; i++)
+        positions[i] = values[i];
+    }
+    break;
+
+    default:
+    {
+      const double * range = (const double *)data;
+      const uint16_t * values = (const uint16_t *)(range + 6);
+      const double * reference = (header->encoding == VERTEX_CACHE_DELTA16) ? (const double *)(file.getData() + header->referenceOffset) : nullptr;
+      for(int i = 0; i < numValues; i++)
+      {
+        positions[i] = range[i % 3] + range[3 + i % 3] * values[i];
+        if (reference)
+          positions[i] += reference[i];
+      }
+    }
+    break;
+  }
+}
+
+void VertexCacheReader::prefetchFrame(int frame) const
+{
+  if ((frame >= 0) && (frame < numFrames))
+    file.prefetch(header->framesOffset + header->frameSize * frame, header->frameSize);
+}
+
@@ -0,0 +1,129 @@
+#ifndef VERTEXCACHE_H
+#define VERTEXCACHE_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include "mappedFile.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A baked sequence of mesh vertex positions (e.g., the output of Skinning::applySkinning for every frame of an animation),
+// for offline rendering. Every frame has the same size, so any frame can be read directly.
+//
+// File layout (native endianness; sections start at multiples of 64 bytes):
+//   Header (64 bytes)
+//   reference positions: double [3 * numVertices] (only for the DELTA16 encoding)
+//   frames: numFrames blocks of "frameSize" bytes, in the encoding of the file:
+//     FLOAT64:     double [3 * numVertices]
+//     FLOAT32:     float [3 * numVertices]
+//     QUANTIZED16: double minimum[3], double step[3], uint16 [3 * numVertices]; position = minimum + step * value (per coordinate)
+//     DELTA16:     as QUANTIZED16, but for the offsets from the reference positions
+enum VertexCacheEncoding
+{
+  VERTEX_CACHE_FLOAT64 = 0,
+  VERTEX_CACHE_FLOAT32,
+  VERTEX_CACHE_QUANTIZED16,
+  VERTEX_CACHE_DELTA16,
+  NUM_VERTEX_CACHE_ENCODINGS
+};
+
+struct VertexCacheHeader
+{
+  char magic[8]; // "IKVCACHE"
+  uint32_t version;
+  uint32_t encoding;
+  uint32_t numVertices;
+  uint32_t numFrames;
+  double frameRate;
+  uint64_t referenceOffset; // byte offsets from the start of the file
+  uint64_t framesOffset;
+  uint64_t frameSize; // in bytes
+  uint64_t reserved;
+};
+
+// Streams frames to a vertex cache file.
+// Frames are encoded and written by a background thread. writeFrame copies the positions into one of two buffers
+// and returns; it only waits if the thread is still busy with the frame before the previous one.
+class VertexCacheWriter
+{
+public:
+  // numVertices: number of mesh vertices in every frame
+  // referencePositions: for DELTA16, the positions that the frames are stored relative to (3 * numVertices, e.g., the rest positions);
+  //   if nullptr, the first frame is used
+  // Check isOpen() for success.
+  VertexCacheWriter(const std::string & filename, int numVertices, double frameRate,
+      VertexCacheEncoding encoding = VERTEX_CACHE_FLOAT32, const double * referencePositions = nullptr);
+  virtual ~VertexCacheWriter(); // calls close()
+
+  bool isOpen() const { return file != nullptr; }
+
+  // Appends a frame; positions has length 3 * numVertices.
+  void writeFrame(const double * positions);
+
+  // Waits until all frames are written, completes the header and closes the file. Returns 0 on success.
+  int close();
+
+  int getNumFrames() const { return numFramesSubmitted; }
+  double getStallTime() const { return stallTime; } // total time (seconds) that writeFrame waited for the background thread
+
+protected:
+  VertexCacheWriter(const VertexCacheWriter &) = delete;
+  VertexCacheWriter & operator=(const VertexCacheWriter &) = delete;
+
+  void writerLoop();
+  void encodeFrame(const double * positions);
+
+  FILE * file = nullptr;
+  VertexCacheHeader header;
+  int numVertices = 0;
+  std::vector<double> referencePositions;
+  bool writeReference = false; // DELTA16 without given reference positions: the first frame becomes the reference
+  std::vector<char> encodedFrame; // used only by the background thread
+
+  // double buffering; the fields below are written under "mutex"
+  std::vector<double> buffers[2];
+  bool bufferFull[2] = { false, false };
+  int fillBuffer = 0; // the buffer that writeFrame fills next
+  bool closing = false;
+  bool writeError = false;
+  std::mutex mutex;
+  std::condition_variable bufferFilled, bufferEmptied;
+  std::thread writerThread;
+
+  int numFramesSubmitted = 0;
+  double stallTime = 0.0;
+};
+
+// Reads a vertex cache file. The file is memory-mapped, so only the frames that are read are loaded from the disk.
+class VertexCacheReader
+{
+public:
+  // Check isLoaded() for success.
+  explicit VertexCacheReader(const std::string & filename);
+
+  bool isLoaded() const { return header != nullptr; }
+  int getNumVertices() const { return header->numVertices; }
+  int getNumFrames() const { return numFrames; }
+  double getFrameRate() const { return header->frameRate; }
+  VertexCacheEncoding getEncoding() const { return (VertexCacheEncoding)header->encoding; }
+  size_t getFileSize() const { return file.getSize(); }
+
+  // Decodes frame "frame" (0 <= frame < getNumFrames()) into positions (length 3 * numVertices).
+  void readFrame(int frame, double * positions) const;
+  // Asks the operating system to read frame "frame" from the disk ahead of time.
+  void prefetchFrame(int frame) const;
+
+protected:
+  MappedFile file;
+  const VertexCacheHeader * header = nullptr;
+  int numFrames = 0;
+};
+
+#endif
+
@@ -0,0 +1,92 @@
+#include "workerPool.h"
+using namespace std;
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+WorkerPool::WorkerPool(int numThreads) : nextTask(0)
+{
+  if (numThreads <= 0)
+    numThreads = thread::hardware_concurrency();
+  if (numThreads <= 0)
+    numThreads = 1;
+  for(int i = 1; i < numThreads; i++)
+    workers.emplace_back(&WorkerPool::workerLoop, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    shuttingDown = true;
+  }
+  loopStarted.notify_all();
+  for(thread & worker : workers)
+    worker.join();
+}
+
+void WorkerPool::runTasks(const function<void(int)> & task, int numTasks)
+{
+  for(int i = nextTask++; i < numTasks; i = nextTask++)
+    task(i);
+}
+
+void WorkerPool::workerLoop()
+{
+  unsigned long long lastLoopID = 0;
+  while(true)
+  {
+    const function<void(int)> * loopTask = nullptr;
+    int loopNumTasks = 0;
+    {
+      unique_lock<std::mutex> lock(stateMutex);
+      loopStarted.wait(lock, [&]() { return shuttingDown || (loopActive && loopID != lastLoopID); });
+      if (shuttingDown)
+        return;
+      lastLoopID = loopID;
+      loopTask = task;
+      loopNumTasks = numTasks;
+      numBusyWorkers++;
+    }
+
+    runTasks(*loopTask, loopNumTasks);
+
+    {
+      lock_guard<std::mutex> lock(stateMutex);
+      numBusyWorkers--;
+    }
+    loopFinished.notify_all();
+  }
+}
+
+void WorkerPool::parallelFor(int n, const function<void(int)> & task)
+{
+  if (n <= 0)
+    return;
+  if (workers.size() == 0 || n == 1)
+  {
+    for(int i = 0; i < n; i++)
+      task(i);
+    return;
+  }
+
+  lock_guard<std::mutex> loopLock(loopMutex);
+  {
+    lock_guard<std::mutex> lock(stateMutex);
+    this->task = &task;
+    numTasks = n;
+    nextTask = 0;
+    loopID++;
+    loopActive = true;
+  }
+  loopStarted.notify_all();
+
+  runTasks(task, n);
+
+  // wait until every task has been handed out and every worker that joined this loop is done;
+  // then close the loop, so that workers that wake up later wait for the next one
+  unique_lock<std::mutex> lock(stateMutex);
+  loopFinished.wait(lock, [&]() { return numBusyWorkers == 0; });
+  loopActive = false;
+  this->task = nullptr;
+}
@@ -0,0 +1,54 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+// CSCI 520 Computer Animation and Simulation
+// Jernej Barbic and Yijing Li
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// A fixed set of worker threads that execute parallel loops.
+// The threads are created once, in the constructor, and sleep between loops,
+// so that many small parallel loops per frame do not pay for thread creation.
+class WorkerPool
+{
+public:
+  // numThreads: total number of threads that execute a loop, including the calling thread.
+  // If numThreads <= 0, std::thread::hardware_concurrency() is used.
+  explicit WorkerPool(int numThreads = 0);
+  virtual ~WorkerPool();
+
+  int getNumThreads() const { return (int)workers.size() + 1; }
+
+  // Calls task(i) for i = 0, 1, ..., n-1, distributed dynamically over the threads.
+  // The calling thread participates. Returns after all calls have finished.
+  // Only one loop runs at a time; calls to parallelFor from different threads are serialized.
+  // Do not call parallelFor of the same pool from inside a task.
+  void parallelFor(int n, const std::function<void(int)> & task);
+
+protected:
+  void workerLoop();
+  void runTasks(const std::function<void(int)> & task, int numTasks);
+
+  std::vector<std::thread> workers;
+  std::mutex loopMutex; // serializes parallelFor calls
+  std::mutex stateMutex;
+  std::condition_variable loopStarted, loopFinished;
+
+  // the current loop; written under "stateMutex"
+  // workers join a loop only while "loopActive" is set, and copy "task" and "numTasks" when they join
+  const std::function<void(int)> * task = nullptr;
+  int numTasks = 0;
+  std::atomic<int> nextTask;
+  int numBusyWorkers = 0;
+  unsigned long long loopID = 0; // incremented for each loop, so that the workers can detect a new loop
+  bool loopActive = false; // cleared before parallelFor returns, so that a late worker cannot join a finished loop
+  bool shuttingDown = false;
+};
+
+#endif
+